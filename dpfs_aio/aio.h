@@ -28,6 +28,11 @@ io_getevents(aio_context_t ctx, long min_nr, long nr,
     return syscall(SYS_io_getevents, ctx, min_nr, nr, events, timeout);
 }
 
+static inline int
+io_cancel(aio_context_t ctx, struct iocb *iocb, struct io_event *result) {
+    return syscall(SYS_io_cancel, ctx, iocb, result);
+}
+
 static inline int
 io_destroy(aio_context_t ctx)
 {
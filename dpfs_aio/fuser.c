@@ -22,6 +22,7 @@
 #include "fuser.h"
 #include "mirror_impl.h"
 #include "aio.h"
+#include "placement.h"
 
 struct inode *inode_new(fuse_ino_t ino) {
     struct inode *i = calloc(1, sizeof(struct inode));
@@ -161,34 +162,51 @@ static void maximize_fd_limit() {
         warn("WARNING: setrlimit() failed with");
 }
 
+#define FUSER_AIO_EVENT_BATCH 64
+
 static void *fuser_io_poll_thread(struct fuser *f) {
     struct timespec ts = { 
         .tv_sec = 1,
         .tv_nsec = 0
     };
+    struct io_event events[FUSER_AIO_EVENT_BATCH];
+    void *completion_contexts[FUSER_AIO_EVENT_BATCH];
+
+    if (f->io_poll_thread_cpu >= 0) {
+        int ret = placement_pin(f->io_poll_thread_cpu);
+        if (ret) {
+            errno = -ret;
+            warn("Could not set the CPU affinity of the aio poll thread. It will continue not pinned.");
+        }
+    }
 
     while(!f->io_poll_thread_stop){
-        struct io_event e;
-        int ret = io_getevents(f->aio_ctx, 1, 1, &e, &ts);
+        int ret = io_getevents(f->aio_ctx, 1, FUSER_AIO_EVENT_BATCH, events, &ts);
         if(ret <= 0){
             continue; // No event to process or interrupted
-        } // else process the event
-        struct fuser_rw_cb_data *cb_data = (struct fuser_rw_cb_data *) e.data;
-        if (e.res == -1) {
-            cb_data->out_hdr->error = -errno;
-            dpfs_hal_async_complete(cb_data->completion_context, DPFS_HAL_COMPLETION_SUCCES);
-        }
+        } // else process the events
+
+        for (int i = 0; i < ret; i++) {
+            struct io_event *e = &events[i];
+            struct fuser_rw_cb_data *cb_data = (struct fuser_rw_cb_data *) e->data;
+            fuse_ll_inflight_remove(cb_data->se, cb_data->in_hdr->unique);
+
+            if (e->res == -ECANCELED) {
+                cb_data->out_hdr->error = -EINTR;
+            } else if (e->res < 0) {
+                // The kernel reports the negated errno in res
+                cb_data->out_hdr->error = e->res;
+            } else if (cb_data->op == FUSER_RW_CB_WRITE) {
+                cb_data->rw.write.out_write->size = e->res;
+                cb_data->out_hdr->len += sizeof(*cb_data->rw.write.out_write);
+            } else { // READ
+                cb_data->out_hdr->len += e->res;
+            }
 
-        if (cb_data->op == FUSER_RW_CB_WRITE) {
-            cb_data->rw.write.out_write->size = e.res;
-            cb_data->out_hdr->len += sizeof(*cb_data->rw.write.out_write);
-            dpfs_hal_async_complete(cb_data->completion_context, DPFS_HAL_COMPLETION_SUCCES);
-        } else { // READ
-            cb_data->out_hdr->len += e.res;
-            dpfs_hal_async_complete(cb_data->completion_context, DPFS_HAL_COMPLETION_SUCCES);
+            completion_contexts[i] = cb_data->completion_context;
+            mpool_free(f->cb_data_pool, cb_data);
         }
-
-        mpool_free(f->cb_data_pool, cb_data);
+        dpfs_hal_async_complete_batch(completion_contexts, NULL, ret);
     }
     return NULL;
 }
@@ -236,6 +254,14 @@ int fuser_main(bool debug, char *source, bool cached, const char *conf_path) {
     struct fuse_ll_operations ops;
     fuser_mirror_assign_ops(&ops);
 
+    // The poll thread runs on the first completion_threads CPU of [placement], and is not pinned by default
+    struct placement p;
+    if (placement_load(conf_path, &p))
+        errx(1, "ERROR: invalid [placement] in %s", conf_path);
+    f->io_poll_thread_cpu = placement_cpu(&p, PLACEMENT_COMPLETION_THREADS, 0);
+    if (f->io_poll_thread_cpu >= 0)
+        printf("dpfs_aio: the aio poll thread runs on CPU %d\n", f->io_poll_thread_cpu);
+
     mpool_init(&f->cb_data_pool, sizeof(struct fuser_rw_cb_data), 256);
     pthread_t poll_thread;
     pthread_create(&poll_thread, NULL, (void *(*)(void *))fuser_io_poll_thread, f);
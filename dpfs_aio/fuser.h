@@ -74,6 +74,8 @@ struct fuser {
     // bool nocache;
 
     volatile bool io_poll_thread_stop;
+    // -1 if the poll thread is not pinned
+    int io_poll_thread_cpu;
     aio_context_t aio_ctx; 
     struct mpool *cb_data_pool;
 };
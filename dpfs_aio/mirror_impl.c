@@ -20,8 +20,10 @@
 #include <unistd.h>
 #include <sys/statvfs.h>
 #include <sys/file.h>
+#include <sys/xattr.h>
 #include <string.h>
 #include "dpfs_fuse.h"
+#include "dpfs/stats.h"
 
 #include "fuser.h"
 #include "mirror_impl.h"
@@ -696,6 +698,93 @@ int fuser_mirror_rename(struct fuse_session *se, void *user_data,
     return 0;
 }
 
+#define FUSER_AIO_SUBMIT_BATCH 64
+
+// The iocbs that a DPFS thread deferred during a poll batch
+static __thread struct {
+    bool active;
+    int n;
+    struct iocb *iocbs[FUSER_AIO_SUBMIT_BATCH];
+} batch;
+
+// Submits all the deferred iocbs of this thread in as few io_submit calls as possible.
+// The requests that can't be submitted already returned EWOULDBLOCK, so they get completed here
+static void fuser_aio_flush(struct fuser *f)
+{
+    int done = 0;
+    while (done < batch.n) {
+        int res = io_submit(f->aio_ctx, batch.n - done, batch.iocbs + done);
+        if (res <= 0) {
+            int error = res == -1 ? -errno : -EAGAIN;
+            fprintf(stderr, "ERROR: aio submit of %d deferred iocbs failed: %s\n",
+                    batch.n - done, strerror(-error));
+            for (int i = done; i < batch.n; i++) {
+                struct fuser_rw_cb_data *cb_data = (struct fuser_rw_cb_data *) batch.iocbs[i]->aio_data;
+                void *completion_context = cb_data->completion_context;
+
+                cb_data->out_hdr->error = error;
+                fuse_ll_inflight_remove(cb_data->se, cb_data->in_hdr->unique);
+                mpool_free(f->cb_data_pool, cb_data);
+                dpfs_hal_async_complete(completion_context, DPFS_HAL_COMPLETION_SUCCES);
+            }
+            break;
+        }
+        done += res;
+    }
+    batch.n = 0;
+}
+
+// Returns 0 if the I/O has been submitted or deferred, otherwise the negated errno
+static int fuser_aio_submit(struct fuser *f, struct fuser_rw_cb_data *cb_data)
+{
+    if (batch.active) {
+        batch.iocbs[batch.n++] = &cb_data->iocb;
+        if (batch.n == FUSER_AIO_SUBMIT_BATCH)
+            fuser_aio_flush(f);
+        return 0;
+    }
+
+    struct iocb *iocb_ptrs[1] = { &cb_data->iocb };
+    int res = io_submit(f->aio_ctx, 1, iocb_ptrs);
+    if (res == -1) {
+        res = -errno;
+        fuse_ll_inflight_remove(cb_data->se, cb_data->in_hdr->unique);
+        mpool_free(f->cb_data_pool, cb_data);
+        return res;
+    }
+    return 0;
+}
+
+void fuser_mirror_poll_batch_begin(struct fuse_session *se, void *user_data, uint16_t device_id)
+{
+    batch.active = true;
+}
+
+void fuser_mirror_poll_batch_end(struct fuse_session *se, void *user_data, uint16_t device_id)
+{
+    struct fuser *f = user_data;
+
+    batch.active = false;
+    fuser_aio_flush(f);
+}
+
+// io_cancel can be called from any thread. Most file systems don't support cancelling aio, io_cancel then
+// fails and the request completes as usual. A cancelled iocb is still completed through the event ring
+// (io_cancel returns -EINPROGRESS), with -ECANCELED which is returned to the guest as -EINTR.
+// An iocb that is still deferred in the poll batch of its thread isn't known to the kernel yet and also fails
+void fuser_mirror_cancel(struct fuse_session *se, void *user_data, uint64_t unique, void *token, uint16_t device_id)
+{
+    struct fuser *f = user_data;
+    struct fuser_rw_cb_data *cb_data = token;
+
+    struct io_event result;
+    int res = io_cancel(f->aio_ctx, &cb_data->iocb, &result);
+#ifdef DEBUG_ENABLED
+    if (res == -1 && errno != EINPROGRESS)
+        fprintf(stderr, "%s: FUSE request %lu could not be cancelled: %s\n", __func__, unique, strerror(errno));
+#endif
+}
+
 int fuser_mirror_read(struct fuse_session *se, void *user_data,
                 struct fuse_in_header *in_hdr, struct fuse_read_in *in_read,
                 struct fuse_out_header *out_hdr, struct iovec *out_iov, int out_iovcnt,
@@ -704,24 +793,31 @@ int fuser_mirror_read(struct fuse_session *se, void *user_data,
     struct fuser *f = user_data;
         
     struct fuser_rw_cb_data *rw_cb_data = mpool_alloc(f->cb_data_pool);
+    if (!rw_cb_data) {
+        dpfs_stats_mpool_exhausted(dpfs_hal_stats(), dpfs_hal_thread_id());
+        out_hdr->error = -ENOMEM;
+        return 0;
+    }
     rw_cb_data->op = FUSER_RW_CB_READ;
     rw_cb_data->completion_context = completion_context;
+    rw_cb_data->se = se;
     rw_cb_data->in_hdr = in_hdr;
     rw_cb_data->out_hdr = out_hdr;
 
-    struct iocb iocb = {0};
-    iocb.aio_data = (__u64) rw_cb_data;
-    iocb.aio_fildes = in_read->fh;
-    iocb.aio_lio_opcode = IOCB_CMD_PREADV;
-    iocb.aio_reqprio = 0;
-    iocb.aio_buf = (__u64) out_iov;
-    iocb.aio_nbytes = out_iovcnt;
-    iocb.aio_offset = in_read->offset;
-
-    struct iocb *iocb_ptrs[1] = { &iocb };
-    int res = io_submit(f->aio_ctx, 1, iocb_ptrs);
-    if (res == -1) {
-        out_hdr->error = -errno;
+    struct iocb *iocb = &rw_cb_data->iocb;
+    memset(iocb, 0, sizeof(*iocb));
+    iocb->aio_data = (__u64) rw_cb_data;
+    iocb->aio_fildes = in_read->fh;
+    iocb->aio_lio_opcode = IOCB_CMD_PREADV;
+    iocb->aio_reqprio = 0;
+    iocb->aio_buf = (__u64) out_iov;
+    iocb->aio_nbytes = out_iovcnt;
+    iocb->aio_offset = in_read->offset;
+
+    fuse_ll_inflight_add(se, in_hdr->unique, rw_cb_data);
+    int res = fuser_aio_submit(f, rw_cb_data);
+    if (res < 0) {
+        out_hdr->error = res;
         return 0;
     }
     return EWOULDBLOCK; // We move async
@@ -736,25 +832,32 @@ int fuser_mirror_write(struct fuse_session *se, void *user_data,
     struct fuser *f = user_data;
 
     struct fuser_rw_cb_data *rw_cb_data = mpool_alloc(f->cb_data_pool);
+    if (!rw_cb_data) {
+        dpfs_stats_mpool_exhausted(dpfs_hal_stats(), dpfs_hal_thread_id());
+        out_hdr->error = -ENOMEM;
+        return 0;
+    }
     rw_cb_data->op = FUSER_RW_CB_WRITE;
     rw_cb_data->completion_context = completion_context;
+    rw_cb_data->se = se;
     rw_cb_data->in_hdr = in_hdr;
     rw_cb_data->out_hdr = out_hdr;
     rw_cb_data->rw.write.out_write = out_write;
 
-    struct iocb iocb = {0};
-    iocb.aio_data = (__u64) rw_cb_data;
-    iocb.aio_fildes = in_write->fh;
-    iocb.aio_lio_opcode = IOCB_CMD_PWRITEV;
-    iocb.aio_reqprio = 0;
-    iocb.aio_buf = (__u64) in_iov;
-    iocb.aio_nbytes = in_iovcnt;
-    iocb.aio_offset = in_write->offset;
-
-    struct iocb *iocb_ptrs[1] = { &iocb };
-    int res = io_submit(f->aio_ctx, 1, iocb_ptrs);
-    if (res == -1) {
-        out_hdr->error = -errno;
+    struct iocb *iocb = &rw_cb_data->iocb;
+    memset(iocb, 0, sizeof(*iocb));
+    iocb->aio_data = (__u64) rw_cb_data;
+    iocb->aio_fildes = in_write->fh;
+    iocb->aio_lio_opcode = IOCB_CMD_PWRITEV;
+    iocb->aio_reqprio = 0;
+    iocb->aio_buf = (__u64) in_iov;
+    iocb->aio_nbytes = in_iovcnt;
+    iocb->aio_offset = in_write->offset;
+
+    fuse_ll_inflight_add(se, in_hdr->unique, rw_cb_data);
+    int res = fuser_aio_submit(f, rw_cb_data);
+    if (res < 0) {
+        out_hdr->error = res;
         return 0;
     }
     return EWOULDBLOCK; // We move async
@@ -949,6 +1052,110 @@ int fuser_mirror_fallocate(struct fuse_session *se, void *user_data,
     return 0;
 }
 
+// The fd of an inode is O_PATH, which the f*xattr calls don't take
+int fuser_mirror_setxattr(struct fuse_session *se, void *user_data,
+                          struct fuse_in_header *in_hdr, const char *const in_name,
+                          const void *in_value, uint32_t in_size, uint32_t in_flags,
+                          struct fuse_out_header *out_hdr,
+                          void *completion_context, uint16_t device_id)
+{
+    struct fuser *f = user_data;
+    struct inode *i = ino_to_inodeptr(f, in_hdr->nodeid);
+    if (!i) {
+        out_hdr->error = -ENOENT;
+        return 0;
+    }
+
+    char procname[64];
+    sprintf(procname, "/proc/self/fd/%i", i->fd);
+    int res = setxattr(procname, in_name, in_value, in_size, in_flags);
+
+    if (res == -1)
+        out_hdr->error = -errno;
+    return 0;
+}
+
+int fuser_mirror_getxattr(struct fuse_session *se, void *user_data,
+                          struct fuse_in_header *in_hdr, const char *const in_name, uint32_t in_size,
+                          struct fuse_out_header *out_hdr, struct fuse_getxattr_out *out_getxattr, void *out_value,
+                          void *completion_context, uint16_t device_id)
+{
+    struct fuser *f = user_data;
+    struct inode *i = ino_to_inodeptr(f, in_hdr->nodeid);
+    if (!i) {
+        out_hdr->error = -ENOENT;
+        return 0;
+    }
+
+    char procname[64];
+    sprintf(procname, "/proc/self/fd/%i", i->fd);
+    ssize_t res = getxattr(procname, in_name, in_size ? out_value : NULL, in_size);
+    if (res == -1) {
+        out_hdr->error = -errno;
+        return 0;
+    }
+
+    if (in_size == 0) {
+        out_getxattr->size = res;
+        out_getxattr->padding = 0;
+        out_hdr->len += sizeof(*out_getxattr);
+    } else {
+        out_hdr->len += res;
+    }
+    return 0;
+}
+
+int fuser_mirror_listxattr(struct fuse_session *se, void *user_data,
+                           struct fuse_in_header *in_hdr, uint32_t in_size,
+                           struct fuse_out_header *out_hdr, struct fuse_getxattr_out *out_getxattr, void *out_value,
+                           void *completion_context, uint16_t device_id)
+{
+    struct fuser *f = user_data;
+    struct inode *i = ino_to_inodeptr(f, in_hdr->nodeid);
+    if (!i) {
+        out_hdr->error = -ENOENT;
+        return 0;
+    }
+
+    char procname[64];
+    sprintf(procname, "/proc/self/fd/%i", i->fd);
+    ssize_t res = listxattr(procname, in_size ? out_value : NULL, in_size);
+    if (res == -1) {
+        out_hdr->error = -errno;
+        return 0;
+    }
+
+    if (in_size == 0) {
+        out_getxattr->size = res;
+        out_getxattr->padding = 0;
+        out_hdr->len += sizeof(*out_getxattr);
+    } else {
+        out_hdr->len += res;
+    }
+    return 0;
+}
+
+int fuser_mirror_removexattr(struct fuse_session *se, void *user_data,
+                             struct fuse_in_header *in_hdr, const char *const in_name,
+                             struct fuse_out_header *out_hdr,
+                             void *completion_context, uint16_t device_id)
+{
+    struct fuser *f = user_data;
+    struct inode *i = ino_to_inodeptr(f, in_hdr->nodeid);
+    if (!i) {
+        out_hdr->error = -ENOENT;
+        return 0;
+    }
+
+    char procname[64];
+    sprintf(procname, "/proc/self/fd/%i", i->fd);
+    int res = removexattr(procname, in_name);
+
+    if (res == -1)
+        out_hdr->error = -errno;
+    return 0;
+}
+
 void fuser_mirror_assign_ops(struct fuse_ll_operations *ops) {
     memset(ops, 0, sizeof(*ops));
     ops->init = fuser_mirror_init;
@@ -978,5 +1185,12 @@ void fuser_mirror_assign_ops(struct fuse_ll_operations *ops) {
     //ops->flock = fuser_mirror_flock;
     //ops->flush = fuser_mirror_flush;
     //ops->fallocate = fuser_mirror_fallocate;
+    ops->setxattr = fuser_mirror_setxattr;
+    ops->getxattr = fuser_mirror_getxattr;
+    ops->listxattr = fuser_mirror_listxattr;
+    ops->removexattr = fuser_mirror_removexattr;
+    ops->poll_batch_begin = fuser_mirror_poll_batch_begin;
+    ops->poll_batch_end = fuser_mirror_poll_batch_end;
+    ops->cancel = fuser_mirror_cancel;
 }
 
@@ -8,6 +8,7 @@
 #ifndef VIRTIOFUSER_MIRROR_IMPL_H
 #define VIRTIOFUSER_MIRROR_IMPL_H
 
+#include <linux/aio_abi.h>
 #include "dpfs_fuse.h"
 
 enum fuser_rw_cb_op {
@@ -19,6 +20,7 @@ struct fuser_rw_cb_data {
     enum fuser_rw_cb_op op;
     void *completion_context;
     uint16_t device_id;
+    struct fuse_session *se;
     struct fuse_in_header *in_hdr;
     struct fuse_out_header *out_hdr;
     union {
@@ -26,6 +28,8 @@ struct fuser_rw_cb_data {
             struct fuse_write_out *out_write;
         } write;
     } rw;
+    // Lives here because the submission can be deferred to the end of the poll batch
+    struct iocb iocb;
 };
 
 void fuser_mirror_assign_ops(struct fuse_ll_operations *);
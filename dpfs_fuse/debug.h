@@ -13,9 +13,9 @@
 extern "C" {
 #endif
 
-inline void fuse_ll_debug_print_in_hdr(struct fuse_in_header *in) {
+inline const char *fuse_ll_opcode_name(uint32_t opcode) {
 	const char *op_name;
-	switch (in->opcode) {
+	switch (opcode) {
 	case 1:
 	      op_name = "FUSE_LOOKUP";
 	      break;
@@ -164,8 +164,12 @@ inline void fuse_ll_debug_print_in_hdr(struct fuse_in_header *in) {
 	      op_name = "UNKNOWN FUSE operation!";
 	      break;
 	}
+	return op_name;
+}
+
+inline void fuse_ll_debug_print_in_hdr(struct fuse_in_header *in) {
 	uint16_t thread_id = dpfs_hal_thread_id();
-	printf("-- %s:%lu:%u --\n", op_name, in->unique, thread_id);
+	printf("-- %s:%lu:%u --\n", fuse_ll_opcode_name(in->opcode), in->unique, thread_id);
 	printf("* nodeid: %lu\n", in->nodeid);
 	printf("* uid, gid, pid: %u, %u, %u\n", in->uid, in->gid, in->pid);
 }
@@ -28,7 +28,11 @@
 #include <sys/uio.h>
 #include <sys/fcntl.h>
 #include <stddef.h>
-#include <unordered_map>
+#include <array>
+#include <map>
+#include <mutex>
+#include <iterator>
+#include <new>
 #include <linux/fuse.h>
 #include <string.h>
 
@@ -36,7 +40,10 @@
 #include "common.h"
 #include "debug.h"
 #include "dpfs/hal.h"
+#include "dpfs/stats.h"
 #include "dpfs_fuse.h"
+#include "latency.h"
+#include "xattr_cache.h"
 
 #define MIN(x, y) x < y ? x : y
 #define MAX(x, y) x > y ? x : y
@@ -53,9 +60,15 @@ typedef int (*fuse_handler_t) (struct dpfs_fuse *,
 
 struct dpfs_fuse {
     struct dpfs_hal *hal;
+    // NULL if the statistics are disabled
+    struct dpfs_stats *stats;
+    // NULL until the HAL is up
+    struct fuse_lat *lat;
 
     fuse_handler_t fuse_handlers[DPFS_FUSE_HANDLERS_LEN];
-    std::unordered_map<uint16_t, fuse_session*> se;
+    // Indexed by device_id. Devices can be (un)registered at runtime while the other devices are
+    // being polled, so this is never resized. Zeroed by the calloc in dpfs_fuse_new
+    std::array<fuse_session*, UINT16_MAX + 1> se;
 
     void *user_data;
     struct fuse_ll_operations ops;
@@ -367,6 +380,182 @@ size_t fuse_add_direntry_plus(struct iov *read_iov,
     return iov_write_buf(read_iov, buf, entlen_padded);
 }
 
+// The guest decides what goes where in the DAX window and evicts ranges itself (FUSE_REMOVEMAPPING,
+// or a FUSE_SETUPMAPPING over a range that is still mapped when the window is full).
+// dpfs_fuse keeps track of the mapped ranges so that it can validate the requests,
+// split the mappings that a request only partially covers and unmap everything on FUSE_DESTROY
+struct dax_mapping {
+    uint64_t len;
+    fuse_ino_t nodeid;
+    uint64_t foffset;
+    uint64_t flags;
+};
+
+struct dpfs_fuse_dax {
+    uint8_t *addr;
+    uint64_t len;
+    // The requests of a device are handled by multiple threads
+    std::mutex lock;
+    // Keyed by the offset in the window, the ranges never overlap
+    std::map<uint64_t, struct dax_mapping> mappings;
+};
+
+// Drops [moffset, moffset + len) from the mapping table, the mappings that stick out of it are trimmed
+static void dax_forget_range(struct dpfs_fuse_dax *dax, uint64_t moffset, uint64_t len)
+{
+    uint64_t end = moffset + len;
+    auto it = dax->mappings.lower_bound(moffset);
+    if (it != dax->mappings.begin()) {
+        auto prev = std::prev(it);
+        if (prev->first + prev->second.len > moffset)
+            it = prev;
+    }
+
+    while (it != dax->mappings.end() && it->first < end) {
+        uint64_t m_start = it->first;
+        struct dax_mapping m = it->second;
+        uint64_t m_end = m_start + m.len;
+        it = dax->mappings.erase(it);
+        if (m_start < moffset)
+            dax->mappings[m_start] = {moffset - m_start, m.nodeid, m.foffset, m.flags};
+        if (m_end > end) {
+            dax->mappings[end] = {m_end - end, m.nodeid, m.foffset + (end - m_start), m.flags};
+            break;
+        }
+    }
+}
+
+// Returns false if [moffset, moffset + len) isn't a page aligned range within the window
+static bool dax_range_valid(struct dpfs_fuse_dax *dax, uint64_t moffset, uint64_t len)
+{
+    uint64_t page = getpagesize();
+    return len > 0 && moffset % page == 0 && moffset <= dax->len && len <= dax->len - moffset;
+}
+
+// Sets up se->dax if the device has a window and the backend can map files into it
+static bool dax_init(struct dpfs_fuse *f_ll, struct fuse_session *se, uint16_t device_id)
+{
+    if (se->dax)
+        return true;
+    if (!f_ll->ops.setupmapping || !f_ll->ops.removemapping)
+        return false;
+
+    void *addr;
+    uint64_t len;
+    if (dpfs_hal_dax_window(f_ll->hal, device_id, &addr, &len))
+        return false;
+
+    struct dpfs_fuse_dax *dax = new struct dpfs_fuse_dax();
+    dax->addr = (uint8_t *) addr;
+    dax->len = len;
+    se->dax = dax;
+    printf("dpfs_fuse: device %u has a DAX window of %lu bytes\n", device_id, len);
+    return true;
+}
+
+// Unmaps every mapping of the window
+static void dax_remove_all(struct dpfs_fuse *f_ll, struct fuse_session *se, uint16_t device_id)
+{
+    struct dpfs_fuse_dax *dax = se->dax;
+    if (!dax)
+        return;
+
+    std::lock_guard<std::mutex> lock(dax->lock);
+    for (auto it = dax->mappings.begin(); it != dax->mappings.end(); it++) {
+        int ret = f_ll->ops.removemapping(se, f_ll->user_data, dax->addr + it->first, it->second.len, device_id);
+        if (ret)
+            fprintf(stderr, "%s: couldn't unmap %lu bytes at offset %lu of the DAX window of device %u, err=%d\n",
+                    __func__, it->second.len, it->first, device_id, ret);
+    }
+    dax->mappings.clear();
+}
+
+// The requests that are registered with fuse_ll_inflight_add, spread over buckets by their unique.
+// A bucket is a small array that is searched linearly, with room for twice the maximum of outstanding requests
+#define FUSE_INFLIGHT_BUCKETS 256
+#define FUSE_INFLIGHT_BUCKET_SIZE (2 * DPFS_HAL_MAX_BACKGROUND / FUSE_INFLIGHT_BUCKETS)
+
+struct fuse_inflight_entry {
+    // 0 if the entry is free, the guest never uses 0
+    uint64_t unique;
+    void *token;
+};
+
+struct fuse_inflight_bucket {
+    std::mutex lock;
+    struct fuse_inflight_entry entries[FUSE_INFLIGHT_BUCKET_SIZE];
+};
+
+struct dpfs_fuse_inflight {
+    struct fuse_inflight_bucket buckets[FUSE_INFLIGHT_BUCKETS];
+};
+
+static inline struct fuse_inflight_bucket *inflight_bucket(struct dpfs_fuse_inflight *inflight, uint64_t unique)
+{
+    // The guest increments unique in steps of 2
+    return &inflight->buckets[(unique >> 1) % FUSE_INFLIGHT_BUCKETS];
+}
+
+bool fuse_ll_inflight_add(struct fuse_session *se, uint64_t unique, void *token)
+{
+    if (!se->inflight)
+        return false;
+
+    struct fuse_inflight_bucket *b = inflight_bucket(se->inflight, unique);
+    std::lock_guard<std::mutex> lock(b->lock);
+    for (size_t i = 0; i < FUSE_INFLIGHT_BUCKET_SIZE; i++) {
+        if (b->entries[i].unique == 0) {
+            b->entries[i].unique = unique;
+            b->entries[i].token = token;
+            return true;
+        }
+    }
+    return false;
+}
+
+void fuse_ll_inflight_remove(struct fuse_session *se, uint64_t unique)
+{
+    if (!se->inflight)
+        return;
+
+    struct fuse_inflight_bucket *b = inflight_bucket(se->inflight, unique);
+    std::lock_guard<std::mutex> lock(b->lock);
+    for (size_t i = 0; i < FUSE_INFLIGHT_BUCKET_SIZE; i++) {
+        if (b->entries[i].unique == unique) {
+            b->entries[i].unique = 0;
+            return;
+        }
+    }
+}
+
+// Returns false if the request isn't registered (anymore)
+static bool inflight_cancel(struct dpfs_fuse *f_ll, struct fuse_session *se, uint64_t unique, uint16_t device_id)
+{
+    struct fuse_inflight_bucket *b = inflight_bucket(se->inflight, unique);
+    std::lock_guard<std::mutex> lock(b->lock);
+    for (size_t i = 0; i < FUSE_INFLIGHT_BUCKET_SIZE; i++) {
+        if (b->entries[i].unique == unique) {
+            f_ll->ops.cancel(se, f_ll->user_data, unique, b->entries[i].token, device_id);
+            return true;
+        }
+    }
+    return false;
+}
+
+// The xattrs of nodeid may have changed
+static void xattr_cache_drop(struct fuse_session *se, uint64_t nodeid)
+{
+    if (se->xattr_cache)
+        fuse_xattr_cache_invalidate(se->xattr_cache, nodeid);
+}
+
+// The file system of the backend can remove security.capability when the file is modified
+static void xattr_cache_drop_positive(struct fuse_session *se, uint64_t nodeid)
+{
+    if (se->xattr_cache)
+        fuse_xattr_cache_invalidate_positive(se->xattr_cache, nodeid);
+}
+
 static int fuse_ll_init(struct dpfs_fuse *f_ll,
                struct iovec *fuse_in_iov, int in_iovcnt,
                struct iovec *fuse_out_iov, int out_iovcnt,
@@ -401,6 +590,8 @@ static int fuse_ll_init(struct dpfs_fuse *f_ll,
 #endif
     se->conn.proto_major = inarg->major;
     se->conn.proto_minor = inarg->minor;
+    if (se->xattr_cache)
+        fuse_xattr_cache_clear(se->xattr_cache);
     se->conn.capable = 0;
     se->conn.want = 0;
     se->conn.max_background = DPFS_HAL_MAX_BACKGROUND;
@@ -582,6 +773,11 @@ static int fuse_ll_init(struct dpfs_fuse *f_ll,
         outarg->flags |= FUSE_CACHE_SYMLINKS;
     if (se->conn.want & FUSE_CAP_EXPLICIT_INVAL_DATA)
         outarg->flags |= FUSE_EXPLICIT_INVAL_DATA;
+    // The guest only asks for it if it has DAX enabled, the mappings are page aligned
+    if (inarg->flags & FUSE_MAP_ALIGNMENT && dax_init(f_ll, se, device_id)) {
+        outarg->flags |= FUSE_MAP_ALIGNMENT;
+        outarg->map_alignment = __builtin_ctz(getpagesize());
+    }
 
     //if (inarg->flags & FUSE_INIT_EXT) {
     //	outarg->flags |= FUSE_INIT_EXT;
@@ -640,6 +836,9 @@ static int fuse_ll_destroy(struct dpfs_fuse *f_ll,
     out_hdr->error = 0;
 
     f_ll->se.at(device_id)->got_destroy = 1;
+    dax_remove_all(f_ll, f_ll->se.at(device_id), device_id);
+    if (f_ll->se.at(device_id)->xattr_cache)
+        fuse_xattr_cache_clear(f_ll->se.at(device_id)->xattr_cache);
     if (f_ll->ops.destroy)
         return f_ll->ops.destroy(f_ll->se.at(device_id), f_ll->user_data, in_hdr, out_hdr, completion_context, device_id);
     else
@@ -709,6 +908,7 @@ static int fuse_ll_setattr(struct dpfs_fuse *f_ll,
         out_hdr->error = -EBUSY;
         return 0;
     }
+    xattr_cache_drop_positive(f_ll->se.at(device_id), in_hdr->nodeid);
 
     if (f_ll->ops.setattr) {
         struct fuse_file_info *fi = NULL;
@@ -1275,6 +1475,7 @@ static int fuse_ll_forget(struct dpfs_fuse *f_ll,
     fuse_ll_debug_print_in_hdr(in_hdr);
 #endif
 
+    xattr_cache_drop(f_ll->se.at(device_id), in_hdr->nodeid);
     if (f_ll->ops.forget)
         return f_ll->ops.forget(f_ll->se.at(device_id), f_ll->user_data, in_hdr, in_forget, completion_context, device_id);
     else
@@ -1300,6 +1501,8 @@ static int fuse_ll_batch_forget(struct dpfs_fuse *f_ll,
     fuse_ll_debug_print_in_hdr(in_hdr);
 #endif
 
+    for (uint32_t i = 0; i < in_batch_forget->count; i++)
+        xattr_cache_drop(f_ll->se.at(device_id), in_forget[i].nodeid);
     if (f_ll->ops.batch_forget)
         return f_ll->ops.batch_forget(f_ll->se.at(device_id), f_ll->user_data, in_hdr, in_batch_forget, in_forget, completion_context, device_id);
     else
@@ -1434,6 +1637,7 @@ static int fuse_ll_read(struct dpfs_fuse *f_ll,
         fprintf(stderr, "%s: iovecs not the same size as the amount of data requested to read!!!\n", __func__);
         return -EINVAL;
     }
+    dpfs_stats_io(f_ll->stats, dpfs_hal_thread_id(), device_id, in_read->size, 0);
 
     return f_ll->ops.read(se, f_ll->user_data, in_hdr, in_read, out_hdr,
             &fuse_out_iov[1], out_iovcnt-1, completion_context, device_id);
@@ -1486,6 +1690,8 @@ static int fuse_ll_write(struct dpfs_fuse *f_ll,
         fprintf(stderr, "%s: iovecs not the same size as the amount of data requested to write!!!\n", __func__);
         return -EINVAL;
     }
+    dpfs_stats_io(f_ll->stats, dpfs_hal_thread_id(), device_id, 0, in_write->size);
+    xattr_cache_drop_positive(se, in_hdr->nodeid);
 
     return f_ll->ops.write(se, f_ll->user_data, in_hdr, in_write,
             &fuse_in_iov[2], in_iovcnt-2, out_hdr, out_write, completion_context, device_id);
@@ -1747,9 +1953,427 @@ static int fuse_ll_fallocate(struct dpfs_fuse *f_ll,
         return 0;
     }
 
+    xattr_cache_drop_positive(se, in_hdr->nodeid);
     return f_ll->ops.fallocate(se, f_ll->user_data, in_hdr, in_fallocate, out_hdr, completion_context, device_id);
 }
 
+static int fuse_ll_copy_file_range(struct dpfs_fuse *f_ll,
+        struct iovec *fuse_in_iov, int in_iovcnt,
+        struct iovec *fuse_out_iov, int out_iovcnt,
+        void *completion_context, uint16_t device_id)
+{
+    if (in_iovcnt != 2 || out_iovcnt != 2) {
+        fprintf(stderr, "%s: invalid number of iovecs!\n", __func__);
+        return -EINVAL;
+    }
+    struct fuse_session *se = f_ll->se.at(device_id);
+
+    struct fuse_in_header *in_hdr = (struct fuse_in_header *) fuse_in_iov[0].iov_base;
+    struct fuse_out_header *out_hdr = (struct fuse_out_header *) fuse_out_iov[0].iov_base;
+    out_hdr->unique = in_hdr->unique;
+    out_hdr->len = sizeof(*out_hdr);
+    out_hdr->error = 0;
+
+    struct fuse_copy_file_range_in *in_copy = (struct fuse_copy_file_range_in *) fuse_in_iov[1].iov_base;
+    struct fuse_write_out *out_write = (struct fuse_write_out *) fuse_out_iov[1].iov_base;
+
+#ifdef DEBUG_ENABLED
+    fuse_ll_debug_print_in_hdr(in_hdr);
+    printf("* fh_in: %lu\n", in_copy->fh_in);
+    printf("* off_in: %lu\n", in_copy->off_in);
+    printf("* nodeid_out: %lu\n", in_copy->nodeid_out);
+    printf("* fh_out: %lu\n", in_copy->fh_out);
+    printf("* off_out: %lu\n", in_copy->off_out);
+    printf("* len: %lu\n", in_copy->len);
+    printf("* flags: 0x%lX\n", in_copy->flags);
+#endif
+
+    if (!se->init_done) {
+        out_hdr->error = -EBUSY;
+        return 0;
+    }
+    // The guest falls back to READ and WRITE after this
+    if (!f_ll->ops.copy_file_range) {
+        out_hdr->error = -ENOSYS;
+        return 0;
+    }
+
+    xattr_cache_drop_positive(se, in_copy->nodeid_out);
+    return f_ll->ops.copy_file_range(se, f_ll->user_data, in_hdr, in_copy, out_hdr, out_write,
+            completion_context, device_id);
+}
+
+static int fuse_ll_setxattr(struct dpfs_fuse *f_ll,
+        struct iovec *fuse_in_iov, int in_iovcnt,
+        struct iovec *fuse_out_iov, int out_iovcnt,
+        void *completion_context, uint16_t device_id)
+{
+    if (in_iovcnt != 2 || out_iovcnt != 1) {
+        fprintf(stderr, "%s: invalid number of iovecs!\n", __func__);
+        return -EINVAL;
+    }
+    struct fuse_session *se = f_ll->se.at(device_id);
+
+    struct fuse_in_header *in_hdr = (struct fuse_in_header *) fuse_in_iov[0].iov_base;
+    struct fuse_out_header *out_hdr = (struct fuse_out_header *) fuse_out_iov[0].iov_base;
+    out_hdr->unique = in_hdr->unique;
+    out_hdr->len = sizeof(*out_hdr);
+    out_hdr->error = 0;
+
+    // FUSE_SETXATTR_EXT isn't negotiated, so the guest sends the old, smaller fuse_setxattr_in
+    struct fuse_setxattr_in *in_setxattr = (struct fuse_setxattr_in *) fuse_in_iov[1].iov_base;
+    const char *in_name = ((char *) fuse_in_iov[1].iov_base) + FUSE_COMPAT_SETXATTR_IN_SIZE;
+    const void *in_value = in_name + strlen(in_name) + 1;
+
+#ifdef DEBUG_ENABLED
+    fuse_ll_debug_print_in_hdr(in_hdr);
+    printf("* name: %s\n", in_name);
+    printf("* size: %u\n", in_setxattr->size);
+    printf("* flags: 0x%X\n", in_setxattr->flags);
+#endif
+
+    if (!se->init_done) {
+        out_hdr->error = -EBUSY;
+        return 0;
+    }
+    if (!f_ll->ops.setxattr) {
+        out_hdr->error = -ENOSYS;
+        return 0;
+    }
+
+    xattr_cache_drop(se, in_hdr->nodeid);
+    int ret = f_ll->ops.setxattr(se, f_ll->user_data, in_hdr, in_name, in_value, in_setxattr->size,
+            in_setxattr->flags, out_hdr, completion_context, device_id);
+    // A GETXATTR on another thread could have cached the old value in the meantime
+    if (ret == 0)
+        xattr_cache_drop(se, in_hdr->nodeid);
+    return ret;
+}
+
+static int fuse_ll_getxattr(struct dpfs_fuse *f_ll,
+        struct iovec *fuse_in_iov, int in_iovcnt,
+        struct iovec *fuse_out_iov, int out_iovcnt,
+        void *completion_context, uint16_t device_id)
+{
+    if (in_iovcnt != 2 || out_iovcnt != 2) {
+        fprintf(stderr, "%s: invalid number of iovecs!\n", __func__);
+        return -EINVAL;
+    }
+    struct fuse_session *se = f_ll->se.at(device_id);
+
+    struct fuse_in_header *in_hdr = (struct fuse_in_header *) fuse_in_iov[0].iov_base;
+    struct fuse_out_header *out_hdr = (struct fuse_out_header *) fuse_out_iov[0].iov_base;
+    out_hdr->unique = in_hdr->unique;
+    out_hdr->len = sizeof(*out_hdr);
+    out_hdr->error = 0;
+
+    struct fuse_getxattr_in *in_getxattr = (struct fuse_getxattr_in *) fuse_in_iov[1].iov_base;
+    const char *in_name = ((char *) fuse_in_iov[1].iov_base) + sizeof(*in_getxattr);
+    struct fuse_getxattr_out *out_getxattr = (struct fuse_getxattr_out *) fuse_out_iov[1].iov_base;
+    void *out_value = fuse_out_iov[1].iov_base;
+
+#ifdef DEBUG_ENABLED
+    fuse_ll_debug_print_in_hdr(in_hdr);
+    printf("* name: %s\n", in_name);
+    printf("* size: %u\n", in_getxattr->size);
+#endif
+
+    if (!se->init_done) {
+        out_hdr->error = -EBUSY;
+        return 0;
+    }
+    if (!f_ll->ops.getxattr) {
+        out_hdr->error = -ENOSYS;
+        return 0;
+    }
+    uint32_t size = in_getxattr->size;
+    if ((size == 0 && fuse_out_iov[1].iov_len < sizeof(*out_getxattr)) || fuse_out_iov[1].iov_len < size) {
+        fprintf(stderr, "%s: the out iovec is too small for the requested xattr size!\n", __func__);
+        return -EINVAL;
+    }
+
+    int error;
+    uint32_t len;
+    if (se->xattr_cache && fuse_xattr_cache_get(se->xattr_cache, in_hdr->nodeid, in_name,
+                &error, out_value, size, &len)) {
+        if (error) {
+            out_hdr->error = error;
+        } else if (size == 0) {
+            out_getxattr->size = len;
+            out_getxattr->padding = 0;
+            out_hdr->len += sizeof(*out_getxattr);
+        } else if (size < len) {
+            out_hdr->error = -ERANGE;
+        } else {
+            out_hdr->len += len;
+        }
+        return 0;
+    }
+
+    // A SETXATTR on another thread may change the xattr while the backend reads it
+    uint64_t gen = se->xattr_cache ? fuse_xattr_cache_generation(se->xattr_cache, in_hdr->nodeid) : 0;
+    int ret = f_ll->ops.getxattr(se, f_ll->user_data, in_hdr, in_name, size, out_hdr, out_getxattr, out_value,
+            completion_context, device_id);
+    // The reply can only be read here if the backend answered synchronously
+    if (ret == 0 && se->xattr_cache) {
+        if (out_hdr->error == -ENODATA)
+            fuse_xattr_cache_put(se->xattr_cache, in_hdr->nodeid, gen, in_name, -ENODATA, NULL, 0);
+        else if (out_hdr->error == 0 && size == 0)
+            fuse_xattr_cache_put(se->xattr_cache, in_hdr->nodeid, gen, in_name, 0, NULL, out_getxattr->size);
+        else if (out_hdr->error == 0)
+            fuse_xattr_cache_put(se->xattr_cache, in_hdr->nodeid, gen, in_name, 0, out_value,
+                    out_hdr->len - sizeof(*out_hdr));
+    }
+    return ret;
+}
+
+static int fuse_ll_listxattr(struct dpfs_fuse *f_ll,
+        struct iovec *fuse_in_iov, int in_iovcnt,
+        struct iovec *fuse_out_iov, int out_iovcnt,
+        void *completion_context, uint16_t device_id)
+{
+    if (in_iovcnt != 2 || out_iovcnt != 2) {
+        fprintf(stderr, "%s: invalid number of iovecs!\n", __func__);
+        return -EINVAL;
+    }
+    struct fuse_session *se = f_ll->se.at(device_id);
+
+    struct fuse_in_header *in_hdr = (struct fuse_in_header *) fuse_in_iov[0].iov_base;
+    struct fuse_out_header *out_hdr = (struct fuse_out_header *) fuse_out_iov[0].iov_base;
+    out_hdr->unique = in_hdr->unique;
+    out_hdr->len = sizeof(*out_hdr);
+    out_hdr->error = 0;
+
+    struct fuse_getxattr_in *in_getxattr = (struct fuse_getxattr_in *) fuse_in_iov[1].iov_base;
+    struct fuse_getxattr_out *out_getxattr = (struct fuse_getxattr_out *) fuse_out_iov[1].iov_base;
+
+#ifdef DEBUG_ENABLED
+    fuse_ll_debug_print_in_hdr(in_hdr);
+    printf("* size: %u\n", in_getxattr->size);
+#endif
+
+    if (!se->init_done) {
+        out_hdr->error = -EBUSY;
+        return 0;
+    }
+    if (!f_ll->ops.listxattr) {
+        out_hdr->error = -ENOSYS;
+        return 0;
+    }
+    uint32_t size = in_getxattr->size;
+    if ((size == 0 && fuse_out_iov[1].iov_len < sizeof(*out_getxattr)) || fuse_out_iov[1].iov_len < size) {
+        fprintf(stderr, "%s: the out iovec is too small for the requested list size!\n", __func__);
+        return -EINVAL;
+    }
+
+    return f_ll->ops.listxattr(se, f_ll->user_data, in_hdr, size, out_hdr, out_getxattr,
+            fuse_out_iov[1].iov_base, completion_context, device_id);
+}
+
+static int fuse_ll_removexattr(struct dpfs_fuse *f_ll,
+        struct iovec *fuse_in_iov, int in_iovcnt,
+        struct iovec *fuse_out_iov, int out_iovcnt,
+        void *completion_context, uint16_t device_id)
+{
+    if (in_iovcnt != 2 || out_iovcnt != 1) {
+        fprintf(stderr, "%s: invalid number of iovecs!\n", __func__);
+        return -EINVAL;
+    }
+    struct fuse_session *se = f_ll->se.at(device_id);
+
+    struct fuse_in_header *in_hdr = (struct fuse_in_header *) fuse_in_iov[0].iov_base;
+    struct fuse_out_header *out_hdr = (struct fuse_out_header *) fuse_out_iov[0].iov_base;
+    out_hdr->unique = in_hdr->unique;
+    out_hdr->len = sizeof(*out_hdr);
+    out_hdr->error = 0;
+
+    const char *in_name = (const char *) fuse_in_iov[1].iov_base;
+
+#ifdef DEBUG_ENABLED
+    fuse_ll_debug_print_in_hdr(in_hdr);
+    printf("* name: %s\n", in_name);
+#endif
+
+    if (!se->init_done) {
+        out_hdr->error = -EBUSY;
+        return 0;
+    }
+    if (!f_ll->ops.removexattr) {
+        out_hdr->error = -ENOSYS;
+        return 0;
+    }
+
+    xattr_cache_drop(se, in_hdr->nodeid);
+    int ret = f_ll->ops.removexattr(se, f_ll->user_data, in_hdr, in_name, out_hdr, completion_context, device_id);
+    if (ret == 0)
+        xattr_cache_drop(se, in_hdr->nodeid);
+    return ret;
+}
+
+// The guest sends this when the process that waits on the request gets a signal, and expects the reply
+// of the request, with -EINTR if it was cancelled. -EAGAIN makes the guest send it again later,
+// the request might not have reached the backend yet
+static int fuse_ll_interrupt(struct dpfs_fuse *f_ll,
+        struct iovec *fuse_in_iov, int in_iovcnt,
+        struct iovec *fuse_out_iov, int out_iovcnt,
+        void *completion_context, uint16_t device_id)
+{
+    if (in_iovcnt < 1 || in_iovcnt > 2 || out_iovcnt > 1) {
+        fprintf(stderr, "%s: invalid number of iovecs!\n", __func__);
+        return -EINVAL;
+    }
+    struct fuse_session *se = f_ll->se.at(device_id);
+
+    struct fuse_in_header *in_hdr = (struct fuse_in_header *) fuse_in_iov[0].iov_base;
+    // Like FORGET it can arrive in a single buffer on the hiprio queue
+    struct fuse_interrupt_in *in_interrupt = in_iovcnt == 2
+        ? (struct fuse_interrupt_in *) fuse_in_iov[1].iov_base
+        : (struct fuse_interrupt_in *) (((char *) fuse_in_iov[0].iov_base) + sizeof(struct fuse_in_header));
+
+#ifdef DEBUG_ENABLED
+    fuse_ll_debug_print_in_hdr(in_hdr);
+    printf("* unique: %lu\n", in_interrupt->unique);
+#endif
+
+    // ENOSYS makes the guest stop sending interrupts, EAGAIN makes it resend this one, the request
+    // may not have reached the backend yet
+    int error;
+    if (!f_ll->ops.cancel || !se->inflight)
+        error = -ENOSYS;
+    else if (se->init_done && inflight_cancel(f_ll, se, in_interrupt->unique, device_id))
+        error = 0;
+    else
+        error = -EAGAIN;
+
+    if (out_iovcnt == 1) {
+        struct fuse_out_header *out_hdr = (struct fuse_out_header *) fuse_out_iov[0].iov_base;
+        out_hdr->unique = in_hdr->unique;
+        out_hdr->len = sizeof(*out_hdr);
+        out_hdr->error = error;
+    }
+    return 0;
+}
+
+static int fuse_ll_setupmapping(struct dpfs_fuse *f_ll,
+               struct iovec *fuse_in_iov, int in_iovcnt,
+               struct iovec *fuse_out_iov, int out_iovcnt,
+               void *completion_context, uint16_t device_id)
+{
+    if (in_iovcnt != 2 || out_iovcnt != 1) {
+        fprintf(stderr, "%s: invalid number of iovecs!\n", __func__);
+        return -EINVAL;
+    }
+    struct fuse_session *se = f_ll->se.at(device_id);
+
+    struct fuse_in_header *in_hdr = (struct fuse_in_header *) fuse_in_iov[0].iov_base;
+    struct fuse_out_header *out_hdr = (struct fuse_out_header *) fuse_out_iov[0].iov_base;
+    out_hdr->unique = in_hdr->unique;
+    out_hdr->len = sizeof(*out_hdr);
+    out_hdr->error = 0;
+
+    struct fuse_setupmapping_in *in_setupmapping = (struct fuse_setupmapping_in *) fuse_in_iov[1].iov_base;
+
+#ifdef DEBUG_ENABLED
+    fuse_ll_debug_print_in_hdr(in_hdr);
+    printf("* fh: %lu\n", in_setupmapping->fh);
+    printf("* foffset: %lu\n", in_setupmapping->foffset);
+    printf("* len: %lu\n", in_setupmapping->len);
+    printf("* flags: %lu\n", in_setupmapping->flags);
+    printf("* moffset: %lu\n", in_setupmapping->moffset);
+#endif
+
+    if (!se->init_done) {
+        out_hdr->error = -EBUSY;
+        return 0;
+    }
+    struct dpfs_fuse_dax *dax = se->dax;
+    if (!dax) {
+        out_hdr->error = -ENOSYS;
+        return 0;
+    }
+    uint64_t page = getpagesize();
+    // The tail of a file is mapped as a whole page
+    uint64_t len = (in_setupmapping->len + page - 1) & ~(page - 1);
+    if (!dax_range_valid(dax, in_setupmapping->moffset, len) || in_setupmapping->foffset % page) {
+        out_hdr->error = -EINVAL;
+        return 0;
+    }
+
+    std::lock_guard<std::mutex> lock(dax->lock);
+    int ret = f_ll->ops.setupmapping(se, f_ll->user_data, in_hdr, in_setupmapping,
+            dax->addr + in_setupmapping->moffset, out_hdr, device_id);
+    if (ret == 0 && out_hdr->error == 0) {
+        // The new mapping replaced whatever was mapped in its range
+        dax_forget_range(dax, in_setupmapping->moffset, len);
+        dax->mappings[in_setupmapping->moffset] = {len, in_hdr->nodeid, in_setupmapping->foffset, in_setupmapping->flags};
+    }
+    return ret;
+}
+
+static int fuse_ll_removemapping(struct dpfs_fuse *f_ll,
+               struct iovec *fuse_in_iov, int in_iovcnt,
+               struct iovec *fuse_out_iov, int out_iovcnt,
+               void *completion_context, uint16_t device_id)
+{
+    if (in_iovcnt != 2 || out_iovcnt != 1) {
+        fprintf(stderr, "%s: invalid number of iovecs!\n", __func__);
+        return -EINVAL;
+    }
+    if (fuse_in_iov[1].iov_len < sizeof(struct fuse_removemapping_in)) {
+        fprintf(stderr, "%s: the in args are too short!\n", __func__);
+        return -EINVAL;
+    }
+    struct fuse_session *se = f_ll->se.at(device_id);
+
+    struct fuse_in_header *in_hdr = (struct fuse_in_header *) fuse_in_iov[0].iov_base;
+    struct fuse_out_header *out_hdr = (struct fuse_out_header *) fuse_out_iov[0].iov_base;
+    out_hdr->unique = in_hdr->unique;
+    out_hdr->len = sizeof(*out_hdr);
+    out_hdr->error = 0;
+
+    // The array of ranges follows fuse_removemapping_in in the same descriptor
+    struct fuse_removemapping_in *in_removemapping = (struct fuse_removemapping_in *) fuse_in_iov[1].iov_base;
+    struct fuse_removemapping_one *in_one = (struct fuse_removemapping_one *)
+        ((char *) fuse_in_iov[1].iov_base + sizeof(*in_removemapping));
+    size_t max_count = (fuse_in_iov[1].iov_len - sizeof(*in_removemapping)) / sizeof(*in_one);
+
+#ifdef DEBUG_ENABLED
+    fuse_ll_debug_print_in_hdr(in_hdr);
+    printf("* count: %u\n", in_removemapping->count);
+#endif
+
+    if (!se->init_done) {
+        out_hdr->error = -EBUSY;
+        return 0;
+    }
+    struct dpfs_fuse_dax *dax = se->dax;
+    if (!dax) {
+        out_hdr->error = -ENOSYS;
+        return 0;
+    }
+    if (in_removemapping->count > max_count) {
+        out_hdr->error = -EINVAL;
+        return 0;
+    }
+
+    uint64_t page = getpagesize();
+    std::lock_guard<std::mutex> lock(dax->lock);
+    for (uint32_t i = 0; i < in_removemapping->count; i++) {
+        uint64_t len = (in_one[i].len + page - 1) & ~(page - 1);
+        if (!dax_range_valid(dax, in_one[i].moffset, len)) {
+            out_hdr->error = -EINVAL;
+            break;
+        }
+        int ret = f_ll->ops.removemapping(se, f_ll->user_data, dax->addr + in_one[i].moffset, len, device_id);
+        if (ret) {
+            out_hdr->error = ret;
+            break;
+        }
+        dax_forget_range(dax, in_one[i].moffset, len);
+    }
+    return 0;
+}
+
 static void fuse_ll_map(struct dpfs_fuse *fuse_ll) {
     // NULL maps to fuse_unknown
     memset(&fuse_ll->fuse_handlers, 0, sizeof(fuse_ll->fuse_handlers));
@@ -1787,6 +2411,14 @@ static void fuse_ll_map(struct dpfs_fuse *fuse_ll) {
     fuse_ll->fuse_handlers[FUSE_SETLKW] = fuse_ll_setlkw;
     fuse_ll->fuse_handlers[FUSE_SETLK] = fuse_ll_setlk;
     fuse_ll->fuse_handlers[FUSE_FALLOCATE] = fuse_ll_fallocate;
+    fuse_ll->fuse_handlers[FUSE_COPY_FILE_RANGE] = fuse_ll_copy_file_range;
+    fuse_ll->fuse_handlers[FUSE_INTERRUPT] = fuse_ll_interrupt;
+    fuse_ll->fuse_handlers[FUSE_SETXATTR] = fuse_ll_setxattr;
+    fuse_ll->fuse_handlers[FUSE_GETXATTR] = fuse_ll_getxattr;
+    fuse_ll->fuse_handlers[FUSE_LISTXATTR] = fuse_ll_listxattr;
+    fuse_ll->fuse_handlers[FUSE_REMOVEXATTR] = fuse_ll_removexattr;
+    fuse_ll->fuse_handlers[FUSE_SETUPMAPPING] = fuse_ll_setupmapping;
+    fuse_ll->fuse_handlers[FUSE_REMOVEMAPPING] = fuse_ll_removemapping;
 }
 
 static int fuse_unknown(struct dpfs_fuse *fuse_ll,
@@ -1822,11 +2454,23 @@ static int fuse_handle_req(void *u,
         fprintf(stderr, "Invalid FUSE opcode!\n");
         return -EINVAL;
     } else {
+        dpfs_stats_opcode(fuse_ll->stats, dpfs_hal_thread_id(), in_hdr->opcode);
         fuse_handler_t h = fuse_ll->fuse_handlers[in_hdr->opcode];
         if (h == NULL) {
             h = fuse_unknown;
         }
+        // The handler can free the request before it returns
+        uint32_t opcode = in_hdr->opcode;
+        struct fuse_lat *lat = __atomic_load_n(&fuse_ll->lat, __ATOMIC_ACQUIRE);
+        uint64_t start = 0;
+        int lat_idx = -1;
+        if (lat) {
+            start = fuse_lat_now();
+            lat_idx = fuse_lat_start(lat, completion_context, start, device_id, opcode);
+        }
         int ret = h(fuse_ll, in_iov, in_iovcnt, out_iov, out_iovcnt, completion_context, device_id);
+        if (lat && ret != EWOULDBLOCK)
+            fuse_lat_sync_done(lat, lat_idx, start, device_id, opcode);
         
 #ifdef DEBUG_ENABLED
         if (ret == 0 && out_iovcnt > 0 &&
@@ -1856,13 +2500,17 @@ void register_dpfs_device(void *user_data, uint16_t device_id)
         fprintf(stderr, "%s - ERROR: Could not allocate memory for fuse_session", __func__);
         return;
     }
-    f_ll->se.insert(std::make_pair(device_id, se));
+    f_ll->se.at(device_id) = se;
 
     se->conn.max_write = UINT_MAX;
     se->conn.max_readahead = UINT_MAX;
 
     se->bufsize = FUSE_MAX_MAX_PAGES * getpagesize() +
         FUSE_BUFFER_HEADER_SIZE;
+    // Without the cache every GETXATTR goes to the backend
+    se->xattr_cache = fuse_xattr_cache_new();
+    // Without it the requests can't be interrupted
+    se->inflight = new (std::nothrow) struct dpfs_fuse_inflight();
 
     if (f_ll->register_device_cb)
         f_ll->register_device_cb(f_ll->user_data, device_id);
@@ -1873,13 +2521,51 @@ void unregister_dpfs_device(void *user_data, uint16_t device_id)
     struct dpfs_fuse *f_ll = (struct dpfs_fuse *) user_data;
     struct fuse_session *se = f_ll->se.at(device_id);
 
+    dax_remove_all(f_ll, se, device_id);
+    delete se->dax;
+    if (se->xattr_cache)
+        fuse_xattr_cache_destroy(se->xattr_cache);
+    delete se->inflight;
+
     if (f_ll->unregister_device_cb)
         f_ll->unregister_device_cb(f_ll->user_data, device_id);
 
-    f_ll->se.erase(device_id);
+    f_ll->se.at(device_id) = NULL;
     free(se);
 }
 
+static void fuse_poll_batch_begin(void *user_data, uint16_t device_id)
+{
+    struct dpfs_fuse *f_ll = (struct dpfs_fuse *) user_data;
+    f_ll->ops.poll_batch_begin(f_ll->se.at(device_id), f_ll->user_data, device_id);
+}
+
+static void fuse_poll_batch_end(void *user_data, uint16_t device_id)
+{
+    struct dpfs_fuse *f_ll = (struct dpfs_fuse *) user_data;
+    f_ll->ops.poll_batch_end(f_ll->se.at(device_id), f_ll->user_data, device_id);
+}
+
+static void fuse_thread_park(void *user_data, uint16_t thread_id)
+{
+    struct dpfs_fuse *f_ll = (struct dpfs_fuse *) user_data;
+    f_ll->ops.thread_park(f_ll->user_data, thread_id);
+}
+
+static void fuse_thread_unpark(void *user_data, uint16_t thread_id)
+{
+    struct dpfs_fuse *f_ll = (struct dpfs_fuse *) user_data;
+    f_ll->ops.thread_unpark(f_ll->user_data, thread_id);
+}
+
+static void fuse_async_done(void *user_data, void *completion_context)
+{
+    struct dpfs_fuse *f_ll = (struct dpfs_fuse *) user_data;
+    struct fuse_lat *lat = __atomic_load_n(&f_ll->lat, __ATOMIC_ACQUIRE);
+    if (lat)
+        fuse_lat_async_done(lat, completion_context);
+}
+
 struct dpfs_fuse *dpfs_fuse_new(struct fuse_ll_operations *ops, const char *hal_conf_path, 
                    void *user_data, dpfs_hal_register_device_t register_device_cb,
                    dpfs_hal_unregister_device_t unregister_device_cb)
@@ -1889,7 +2575,6 @@ struct dpfs_fuse *dpfs_fuse_new(struct fuse_ll_operations *ops, const char *hal_
 #endif
 
     struct dpfs_fuse *f_ll = (struct dpfs_fuse *) calloc(1, sizeof(struct dpfs_fuse));
-    f_ll->se = std::unordered_map<uint16_t, struct fuse_session *>();
     f_ll->ops = *ops;
     f_ll->user_data = user_data;
     f_ll->register_device_cb = register_device_cb;
@@ -1902,6 +2587,15 @@ struct dpfs_fuse *dpfs_fuse_new(struct fuse_ll_operations *ops, const char *hal_
     hal_params.ops.request_handler = fuse_handle_req;
     hal_params.ops.register_device = register_dpfs_device;
     hal_params.ops.unregister_device = unregister_dpfs_device;
+    if (ops->poll_batch_begin)
+        hal_params.ops.poll_batch_begin = fuse_poll_batch_begin;
+    if (ops->poll_batch_end)
+        hal_params.ops.poll_batch_end = fuse_poll_batch_end;
+    if (ops->thread_park)
+        hal_params.ops.thread_park = fuse_thread_park;
+    if (ops->thread_unpark)
+        hal_params.ops.thread_unpark = fuse_thread_unpark;
+    hal_params.ops.async_done = fuse_async_done;
     hal_params.conf_path = hal_conf_path;
 
     struct dpfs_hal *hal = dpfs_hal_new(&hal_params, false);
@@ -1910,6 +2604,9 @@ struct dpfs_fuse *dpfs_fuse_new(struct fuse_ll_operations *ops, const char *hal_
         return NULL;
     }
     f_ll->hal = hal;
+    f_ll->stats = dpfs_hal_stats();
+    // Without the histograms the requests are only not measured
+    __atomic_store_n(&f_ll->lat, fuse_lat_new(dpfs_hal_max_inflight(hal)), __ATOMIC_RELEASE);
 
     return f_ll;
 }
@@ -1921,6 +2618,8 @@ void dpfs_fuse_loop(struct dpfs_fuse *f_ll)
 void dpfs_fuse_destroy(struct dpfs_fuse *f_ll)
 {
     dpfs_hal_destroy(f_ll->hal);
+    if (f_ll->lat)
+        fuse_lat_destroy(f_ll->lat);
 }
 
 int dpfs_fuse_main(struct fuse_ll_operations *ops, const char *hal_conf_path, 
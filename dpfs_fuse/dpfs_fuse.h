@@ -34,6 +34,9 @@ extern "C" {
 #endif
 
 struct dpfs_fuse;
+struct dpfs_fuse_dax;
+struct fuse_xattr_cache;
+struct dpfs_fuse_inflight;
 
 /** Inode number type */
 typedef uint64_t fuse_ino_t;
@@ -57,6 +60,12 @@ struct fuse_session {
     size_t bufsize;
     int error;
     bool init_done;
+    // The DAX window and its mappings, NULL if the device has no window or DAX wasn't negotiated
+    struct dpfs_fuse_dax *dax;
+    // NULL if it couldn't be allocated, see xattr_cache.h
+    struct fuse_xattr_cache *xattr_cache;
+    // The requests that can be interrupted, see fuse_ll_inflight_add. NULL if it couldn't be allocated
+    struct dpfs_fuse_inflight *inflight;
 };
 
 #define FUSE_MAX_MAX_PAGES 256
@@ -137,6 +146,13 @@ size_t iov_write_buf(struct iov*, void *, size_t);
 unsigned int calc_timeout_nsec(double);
 unsigned long calc_timeout_sec(double);
 
+// For the requests that the backend can cancel (see cancel in fuse_ll_operations).
+// Register the request before submitting it, with a token that identifies it to the backend,
+// and remove it before the token is freed. Returns false if the request can't be tracked,
+// a FUSE_INTERRUPT then doesn't reach the backend
+bool fuse_ll_inflight_add(struct fuse_session *, uint64_t unique, void *token);
+void fuse_ll_inflight_remove(struct fuse_session *, uint64_t unique);
+
 int fuse_ll_reply_attr(struct fuse_session *, struct fuse_out_header *, struct fuse_attr_out *, struct stat *, double attr_timeout);
 int fuse_ll_reply_attrx(struct fuse_session *, struct fuse_out_header *, struct fuse_attr_out *, struct statx *, double attr_timeout);
 int fuse_ll_reply_entry(struct fuse_session *se, struct fuse_out_header *, struct fuse_entry_out *, struct fuse_entry_param *);
@@ -271,6 +287,59 @@ struct fuse_ll_operations {
                       struct fuse_in_header *, struct fuse_fallocate_in *,
                       struct fuse_out_header *,
                       void *completion_context, uint16_t device_id);
+    // Optional, the guest stops sending the xattr requests after ENOSYS.
+    // getxattr and listxattr: if in_size is 0, fill out_getxattr with the size of the value (list),
+    // otherwise copy the value (list) of at most in_size bytes to out_value (-ERANGE if it's bigger)
+    // and add its length to out_hdr->len. out_getxattr and out_value point to the same buffer.
+    // dpfs_fuse caches the synchronous getxattr answers, see xattr_cache.h
+    int (*setxattr) (struct fuse_session *, void *user_data,
+                     struct fuse_in_header *, const char *const in_name,
+                     const void *in_value, uint32_t in_size, uint32_t in_flags,
+                     struct fuse_out_header *,
+                     void *completion_context, uint16_t device_id);
+    int (*getxattr) (struct fuse_session *, void *user_data,
+                     struct fuse_in_header *, const char *const in_name, uint32_t in_size,
+                     struct fuse_out_header *, struct fuse_getxattr_out *out_getxattr, void *out_value,
+                     void *completion_context, uint16_t device_id);
+    int (*listxattr) (struct fuse_session *, void *user_data,
+                      struct fuse_in_header *, uint32_t in_size,
+                      struct fuse_out_header *, struct fuse_getxattr_out *out_getxattr, void *out_value,
+                      void *completion_context, uint16_t device_id);
+    int (*removexattr) (struct fuse_session *, void *user_data,
+                        struct fuse_in_header *, const char *const in_name,
+                        struct fuse_out_header *,
+                        void *completion_context, uint16_t device_id);
+    // Optional. Copy in_copy->len bytes of the open file in_copy->fh_in (in_hdr->nodeid) to in_copy->fh_out
+    // (in_copy->nodeid_out) without moving the data through the host. out_write->size is the number of bytes
+    // copied, which can be less than len, the guest then continues with a new request
+    int (*copy_file_range) (struct fuse_session *, void *user_data,
+                            struct fuse_in_header *, struct fuse_copy_file_range_in *in_copy,
+                            struct fuse_out_header *, struct fuse_write_out *,
+                            void *completion_context, uint16_t device_id);
+    // Optional, DAX (see dpfs_hal_dax_window) is only offered to the guest if both are implemented.
+    // Both are synchronous and dpfs_fuse serializes them per device.
+    // Map in_setupmapping->len bytes at in_setupmapping->foffset of the open file in_setupmapping->fh
+    // at addr in the window, with the FUSE_SETUPMAPPING_FLAG_* access. This replaces whatever was
+    // mapped there. dpfs_fuse checked that the range is page aligned and within the window
+    int (*setupmapping) (struct fuse_session *, void *user_data,
+                         struct fuse_in_header *, struct fuse_setupmapping_in *in_setupmapping,
+                         void *addr, struct fuse_out_header *, uint16_t device_id);
+    // Unmap [addr, addr + len) of the window and leave it reserved. Also called for the remaining
+    // mappings on FUSE_DESTROY and when the device is unregistered. Returns 0 or a negative errno
+    int (*removemapping) (struct fuse_session *, void *user_data,
+                          void *addr, uint64_t len, uint16_t device_id);
+    // Optional. Cancel the request unique that the backend registered with fuse_ll_inflight_add,
+    // on FUSE_INTERRUPT. Called with the lock of the request held, so that token stays valid, but
+    // fuse_ll_inflight_remove of the request blocks until this returns, so this must not block.
+    // The request must still be completed, with -EINTR if it was cancelled
+    void (*cancel) (struct fuse_session *, void *user_data, uint64_t unique, void *token, uint16_t device_id);
+    // Optional, see poll_batch_begin/end in dpfs_hal_ops. All the requests in between are
+    // handled by the same thread, so submissions can be deferred to poll_batch_end
+    void (*poll_batch_begin) (struct fuse_session *, void *user_data, uint16_t device_id);
+    void (*poll_batch_end) (struct fuse_session *, void *user_data, uint16_t device_id);
+    // Optional, see thread_park/unpark in dpfs_hal_ops
+    void (*thread_park) (void *user_data, uint16_t thread_id);
+    void (*thread_unpark) (void *user_data, uint16_t thread_id);
 };
 
 uint16_t dpfs_fuse_nthreads(struct dpfs_fuse *);
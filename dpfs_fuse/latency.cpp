@@ -0,0 +1,282 @@
+/*
+#
+# Copyright 2023- IBM Inc. All rights reserved
+# SPDX-License-Identifier: LGPL-2.1-or-later
+#
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <time.h>
+#include <signal.h>
+#include <semaphore.h>
+#include <pthread.h>
+#include <new>
+#include <atomic>
+#include <map>
+#include <mutex>
+#include <vector>
+
+#include "lat_hist.h"
+#include "debug.h"
+#include "latency.h"
+
+// The (device, opcode) pairs that a single thread can record, the samples of any more are dropped
+#define FUSE_LAT_KEYS 4096
+// How far from its home entry a request can be in the table of in-flight requests
+#define FUSE_LAT_PROBES 32
+
+struct fuse_lat_req {
+    // NULL if the entry is free
+    std::atomic<void *> completion_context;
+    uint64_t start;
+    uint16_t device_id;
+    uint32_t opcode;
+};
+
+struct fuse_lat_thread {
+    struct fuse_lat *lat;
+    // (device_id << 32 | opcode) + 1, 0 if unused. Only the owner inserts, the dumps read them
+    std::atomic<uint64_t> keys[FUSE_LAT_KEYS];
+    struct lat_hist *hists[FUSE_LAT_KEYS];
+    std::atomic<uint64_t> dropped;
+};
+
+struct fuse_lat {
+    // Indexed by the hash of the completion context, twice the size of the maximum in flight
+    struct fuse_lat_req *reqs;
+    size_t mask;
+
+    // Every thread that ever recorded a request
+    std::mutex threads_lock;
+    std::vector<struct fuse_lat_thread *> threads;
+
+    pthread_t dump_thread;
+    std::atomic<bool> stop;
+};
+
+static thread_local struct fuse_lat_thread *lat_thread = nullptr;
+// Posted by SIGUSR1
+static sem_t dump_sem;
+
+static inline size_t fuse_lat_hash(uint64_t v)
+{
+    return (v * 0x9e3779b97f4a7c15ULL) >> 32;
+}
+
+uint64_t fuse_lat_now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static struct fuse_lat_thread *fuse_lat_thread_get(struct fuse_lat *lat)
+{
+    struct fuse_lat_thread *t = lat_thread;
+    if (t && t->lat == lat)
+        return t;
+
+    t = new (std::nothrow) fuse_lat_thread();
+    if (!t)
+        return nullptr;
+    t->lat = lat;
+    std::lock_guard<std::mutex> lock(lat->threads_lock);
+    lat->threads.push_back(t);
+    lat_thread = t;
+    return t;
+}
+
+static void fuse_lat_record(struct fuse_lat *lat, uint16_t device_id, uint32_t opcode, uint64_t ns)
+{
+    struct fuse_lat_thread *t = fuse_lat_thread_get(lat);
+    if (!t)
+        return;
+
+    uint64_t key = ((uint64_t) device_id << 32 | opcode) + 1;
+    size_t i = fuse_lat_hash(key) & (FUSE_LAT_KEYS - 1);
+    for (size_t n = 0; n < FUSE_LAT_KEYS; n++, i = (i + 1) & (FUSE_LAT_KEYS - 1)) {
+        uint64_t k = t->keys[i].load(std::memory_order_relaxed);
+        if (k == key) {
+            lat_hist_record(t->hists[i], ns);
+            return;
+        }
+        if (k == 0) {
+            struct lat_hist *h = (struct lat_hist *) malloc(sizeof(*h));
+            if (!h)
+                break;
+            lat_hist_init(h);
+            lat_hist_record(h, ns);
+            t->hists[i] = h;
+            t->keys[i].store(key, std::memory_order_release);
+            return;
+        }
+    }
+    t->dropped.store(t->dropped.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+}
+
+int fuse_lat_start(struct fuse_lat *lat, void *completion_context, uint64_t start,
+                   uint16_t device_id, uint32_t opcode)
+{
+    size_t home = fuse_lat_hash((uintptr_t) completion_context);
+    for (size_t n = 0; n < FUSE_LAT_PROBES; n++) {
+        size_t i = (home + n) & lat->mask;
+        struct fuse_lat_req *r = &lat->reqs[i];
+        void *expected = nullptr;
+        if (r->completion_context.load(std::memory_order_relaxed) == nullptr &&
+            r->completion_context.compare_exchange_strong(expected, completion_context,
+                std::memory_order_acquire, std::memory_order_relaxed)) {
+            // The backend hands the request to whichever thread completes it, which orders these
+            // writes before the reads in fuse_lat_async_done
+            r->start = start;
+            r->device_id = device_id;
+            r->opcode = opcode;
+            return i;
+        }
+    }
+    return -1;
+}
+
+void fuse_lat_sync_done(struct fuse_lat *lat, int idx, uint64_t start, uint16_t device_id, uint32_t opcode)
+{
+    uint64_t end = fuse_lat_now();
+    if (idx >= 0)
+        lat->reqs[idx].completion_context.store(nullptr, std::memory_order_release);
+    fuse_lat_record(lat, device_id, opcode, end - start);
+}
+
+void fuse_lat_async_done(struct fuse_lat *lat, void *completion_context)
+{
+    uint64_t end = fuse_lat_now();
+    size_t home = fuse_lat_hash((uintptr_t) completion_context);
+    for (size_t n = 0; n < FUSE_LAT_PROBES; n++) {
+        struct fuse_lat_req *r = &lat->reqs[(home + n) & lat->mask];
+        if (r->completion_context.load(std::memory_order_relaxed) != completion_context)
+            continue;
+        uint64_t start = r->start;
+        uint16_t device_id = r->device_id;
+        uint32_t opcode = r->opcode;
+        r->completion_context.store(nullptr, std::memory_order_release);
+        fuse_lat_record(lat, device_id, opcode, end - start);
+        return;
+    }
+    // Not tracked, the table was full around its home entry
+}
+
+void fuse_lat_dump(struct fuse_lat *lat)
+{
+    std::map<uint64_t, struct lat_hist *> merged;
+    uint64_t dropped = 0;
+    {
+        std::lock_guard<std::mutex> lock(lat->threads_lock);
+        for (struct fuse_lat_thread *t : lat->threads) {
+            dropped += t->dropped.load(std::memory_order_relaxed);
+            for (size_t i = 0; i < FUSE_LAT_KEYS; i++) {
+                uint64_t key = t->keys[i].load(std::memory_order_acquire);
+                if (key == 0)
+                    continue;
+                struct lat_hist *&h = merged[key];
+                if (!h) {
+                    h = (struct lat_hist *) malloc(sizeof(*h));
+                    if (!h)
+                        continue;
+                    lat_hist_init(h);
+                }
+                lat_hist_merge(h, t->hists[i]);
+            }
+        }
+    }
+
+    printf("dpfs_fuse: request latency per device and opcode\n");
+    printf("%-8s %-22s %12s %10s %10s %10s %10s\n", "device", "opcode", "count",
+            "p50(us)", "p99(us)", "p999(us)", "max(us)");
+    for (auto it = merged.begin(); it != merged.end(); it++) {
+        uint64_t key = it->first - 1;
+        struct lat_hist *h = it->second;
+        printf("%-8lu %-22s %12lu %10.2f %10.2f %10.2f %10.2f\n", key >> 32,
+                fuse_ll_opcode_name(key & UINT32_MAX), h->count,
+                lat_hist_percentile(h, 50.0) / 1e3,
+                lat_hist_percentile(h, 99.0) / 1e3,
+                lat_hist_percentile(h, 99.9) / 1e3,
+                h->max / 1e3);
+        free(h);
+    }
+    if (dropped)
+        printf("dpfs_fuse: %lu requests were not recorded, a thread saw too many devices and opcodes\n", dropped);
+    fflush(stdout);
+}
+
+static void fuse_lat_signal(int sig)
+{
+    sem_post(&dump_sem);
+}
+
+static void *fuse_lat_dump_thread(void *arg)
+{
+    struct fuse_lat *lat = (struct fuse_lat *) arg;
+    while (true) {
+        while (sem_wait(&dump_sem) && errno == EINTR);
+        if (lat->stop.load())
+            break;
+        fuse_lat_dump(lat);
+    }
+    return NULL;
+}
+
+struct fuse_lat *fuse_lat_new(size_t max_inflight)
+{
+    if (max_inflight == 0)
+        max_inflight = DPFS_HAL_MAX_BACKGROUND;
+    size_t size = 1;
+    while (size < 2 * max_inflight)
+        size <<= 1;
+
+    struct fuse_lat *lat = new (std::nothrow) fuse_lat();
+    if (!lat)
+        return NULL;
+    lat->reqs = new (std::nothrow) fuse_lat_req[size]();
+    if (!lat->reqs) {
+        delete lat;
+        return NULL;
+    }
+    lat->mask = size - 1;
+    lat->stop = false;
+
+    sem_init(&dump_sem, 0, 0);
+    int ret = pthread_create(&lat->dump_thread, NULL, fuse_lat_dump_thread, lat);
+    if (ret) {
+        fprintf(stderr, "%s: could not start the latency dump thread, err=%d\n", __func__, ret);
+        sem_destroy(&dump_sem);
+        delete[] lat->reqs;
+        delete lat;
+        return NULL;
+    }
+    struct sigaction sa = {};
+    sa.sa_handler = fuse_lat_signal;
+    sa.sa_flags = SA_RESTART;
+    sigemptyset(&sa.sa_mask);
+    sigaction(SIGUSR1, &sa, NULL);
+
+    return lat;
+}
+
+void fuse_lat_destroy(struct fuse_lat *lat)
+{
+    signal(SIGUSR1, SIG_DFL);
+    lat->stop = true;
+    sem_post(&dump_sem);
+    pthread_join(lat->dump_thread, NULL);
+    sem_destroy(&dump_sem);
+
+    fuse_lat_dump(lat);
+    for (struct fuse_lat_thread *t : lat->threads) {
+        for (size_t i = 0; i < FUSE_LAT_KEYS; i++) {
+            if (t->keys[i].load())
+                free(t->hists[i]);
+        }
+        delete t;
+    }
+    delete[] lat->reqs;
+    delete lat;
+}
@@ -0,0 +1,45 @@
+/*
+#
+# Copyright 2023- IBM Inc. All rights reserved
+# SPDX-License-Identifier: LGPL-2.1-or-later
+#
+*/
+
+#ifndef DPFS_FUSE_LATENCY_H
+#define DPFS_FUSE_LATENCY_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+    Always-on latency histograms of the FUSE requests, per device and opcode.
+    fuse_handle_req timestamps a request before handing it to the backend, the latency is recorded
+    when the handler returns for synchronous requests and in the async_done op of the HAL
+    (i.e. in dpfs_hal_async_complete) for asynchronous ones.
+    The start of the asynchronous requests is kept in a lock-free table indexed by their completion context.
+    Every thread that records (DPFS threads and the completion threads of the backends) has its own
+    lat_hist's, so recording takes no lock. SIGUSR1 prints p50/p99/p99.9/max of every device and opcode,
+    as does fuse_lat_destroy. The dumps read the histograms while they are being written,
+    so a dump can be off by the requests that complete during it.
+*/
+
+struct fuse_lat;
+
+// max_inflight is the number of requests that can be in flight at once, 0 if unknown
+struct fuse_lat *fuse_lat_new(size_t max_inflight);
+// Prints the histograms and frees everything, the HAL must not handle requests anymore
+void fuse_lat_destroy(struct fuse_lat *);
+
+uint64_t fuse_lat_now(void);
+// Called right before the request handler, so that a completion during the handler finds the request.
+// Returns the index of the request to pass to fuse_lat_sync_done, -1 if it isn't tracked
+int fuse_lat_start(struct fuse_lat *, void *completion_context, uint64_t start,
+                   uint16_t device_id, uint32_t opcode);
+// The request handler returned without EWOULDBLOCK
+void fuse_lat_sync_done(struct fuse_lat *, int idx, uint64_t start, uint16_t device_id, uint32_t opcode);
+// A request was completed with dpfs_hal_async_complete
+void fuse_lat_async_done(struct fuse_lat *, void *completion_context);
+// Prints the histograms to stdout
+void fuse_lat_dump(struct fuse_lat *);
+
+#endif // DPFS_FUSE_LATENCY_H
@@ -0,0 +1,175 @@
+/*
+#
+# Copyright 2023- IBM Inc. All rights reserved
+# SPDX-License-Identifier: LGPL-2.1-or-later
+#
+*/
+
+#include <errno.h>
+#include <string.h>
+#include <new>
+#include <atomic>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+
+#include "xattr_cache.h"
+
+#define FUSE_XATTR_CACHE_BUCKETS 64
+// The generations of the inodes, inodes that share one are both treated as changed.
+// A multiple of the buckets, so that the generation of an inode is protected by the lock of its bucket
+#define FUSE_XATTR_CACHE_GENS 4096
+
+struct fuse_xattr_entry {
+    // 0 or -ENODATA
+    int error;
+    uint32_t len;
+    bool has_value;
+    std::string value;
+};
+
+struct fuse_xattr_bucket {
+    std::mutex lock;
+    // nodeid -> name -> answer
+    std::unordered_map<uint64_t, std::unordered_map<std::string, struct fuse_xattr_entry>> inodes;
+};
+
+struct fuse_xattr_cache {
+    struct fuse_xattr_bucket buckets[FUSE_XATTR_CACHE_BUCKETS];
+    std::atomic<size_t> ninodes;
+    // Bumped with the bucket lock held by every drop of the inode
+    std::atomic<uint64_t> gens[FUSE_XATTR_CACHE_GENS];
+};
+
+static inline size_t fuse_xattr_hash(uint64_t nodeid)
+{
+    // The nodeids are often pointers
+    return (nodeid * 0x9e3779b97f4a7c15ULL) >> 32;
+}
+
+static inline struct fuse_xattr_bucket *fuse_xattr_bucket_get(struct fuse_xattr_cache *c, uint64_t nodeid)
+{
+    return &c->buckets[fuse_xattr_hash(nodeid) % FUSE_XATTR_CACHE_BUCKETS];
+}
+
+static inline std::atomic<uint64_t> *fuse_xattr_gen_get(struct fuse_xattr_cache *c, uint64_t nodeid)
+{
+    return &c->gens[fuse_xattr_hash(nodeid) % FUSE_XATTR_CACHE_GENS];
+}
+
+struct fuse_xattr_cache *fuse_xattr_cache_new(void)
+{
+    struct fuse_xattr_cache *c = new (std::nothrow) fuse_xattr_cache();
+    if (!c)
+        return NULL;
+    c->ninodes = 0;
+    for (size_t n = 0; n < FUSE_XATTR_CACHE_GENS; n++)
+        c->gens[n] = 0;
+    return c;
+}
+
+void fuse_xattr_cache_destroy(struct fuse_xattr_cache *c)
+{
+    delete c;
+}
+
+bool fuse_xattr_cache_get(struct fuse_xattr_cache *c, uint64_t nodeid, const char *name,
+                          int *error, void *value, uint32_t size, uint32_t *len)
+{
+    struct fuse_xattr_bucket *b = fuse_xattr_bucket_get(c, nodeid);
+    std::lock_guard<std::mutex> lock(b->lock);
+
+    auto i = b->inodes.find(nodeid);
+    if (i == b->inodes.end())
+        return false;
+    auto e = i->second.find(name);
+    if (e == i->second.end())
+        return false;
+
+    *error = e->second.error;
+    *len = e->second.len;
+    if (e->second.error || size == 0 || size < e->second.len)
+        return true;
+    if (!e->second.has_value)
+        return false;
+    memcpy(value, e->second.value.data(), e->second.len);
+    return true;
+}
+
+uint64_t fuse_xattr_cache_generation(struct fuse_xattr_cache *c, uint64_t nodeid)
+{
+    return fuse_xattr_gen_get(c, nodeid)->load(std::memory_order_acquire);
+}
+
+void fuse_xattr_cache_put(struct fuse_xattr_cache *c, uint64_t nodeid, uint64_t gen, const char *name,
+                          int error, const void *value, uint32_t len)
+{
+    if (error && error != -ENODATA)
+        return;
+
+    struct fuse_xattr_bucket *b = fuse_xattr_bucket_get(c, nodeid);
+    std::lock_guard<std::mutex> lock(b->lock);
+
+    // The answer may be older than a drop that happened while the backend handled it
+    if (fuse_xattr_gen_get(c, nodeid)->load(std::memory_order_relaxed) != gen)
+        return;
+
+    auto i = b->inodes.find(nodeid);
+    if (i == b->inodes.end()) {
+        if (c->ninodes.load(std::memory_order_relaxed) >= FUSE_XATTR_CACHE_MAX_INODES)
+            return;
+        i = b->inodes.emplace(nodeid, std::unordered_map<std::string, struct fuse_xattr_entry>()).first;
+        c->ninodes.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    struct fuse_xattr_entry &e = i->second[name];
+    e.error = error;
+    e.len = error ? 0 : len;
+    // Don't forget a cached value because of a request that only asked for the size
+    if (!error && value && len <= FUSE_XATTR_CACHE_MAX_VALUE) {
+        e.has_value = true;
+        e.value.assign((const char *) value, len);
+    } else if (error || value || e.value.size() != len) {
+        e.has_value = false;
+        e.value.clear();
+    }
+}
+
+void fuse_xattr_cache_invalidate(struct fuse_xattr_cache *c, uint64_t nodeid)
+{
+    struct fuse_xattr_bucket *b = fuse_xattr_bucket_get(c, nodeid);
+    std::lock_guard<std::mutex> lock(b->lock);
+
+    fuse_xattr_gen_get(c, nodeid)->fetch_add(1, std::memory_order_release);
+    if (b->inodes.erase(nodeid))
+        c->ninodes.fetch_sub(1, std::memory_order_relaxed);
+}
+
+void fuse_xattr_cache_invalidate_positive(struct fuse_xattr_cache *c, uint64_t nodeid)
+{
+    struct fuse_xattr_bucket *b = fuse_xattr_bucket_get(c, nodeid);
+    std::lock_guard<std::mutex> lock(b->lock);
+
+    fuse_xattr_gen_get(c, nodeid)->fetch_add(1, std::memory_order_release);
+    auto i = b->inodes.find(nodeid);
+    if (i == b->inodes.end())
+        return;
+    for (auto e = i->second.begin(); e != i->second.end();) {
+        if (e->second.error == 0)
+            e = i->second.erase(e);
+        else
+            e++;
+    }
+}
+
+void fuse_xattr_cache_clear(struct fuse_xattr_cache *c)
+{
+    for (size_t n = 0; n < FUSE_XATTR_CACHE_BUCKETS; n++) {
+        struct fuse_xattr_bucket *b = &c->buckets[n];
+        std::lock_guard<std::mutex> lock(b->lock);
+        for (size_t g = n; g < FUSE_XATTR_CACHE_GENS; g += FUSE_XATTR_CACHE_BUCKETS)
+            c->gens[g].fetch_add(1, std::memory_order_release);
+        c->ninodes.fetch_sub(b->inodes.size(), std::memory_order_relaxed);
+        b->inodes.clear();
+    }
+}
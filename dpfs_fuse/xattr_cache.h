@@ -0,0 +1,57 @@
+/*
+#
+# Copyright 2023- IBM Inc. All rights reserved
+# SPDX-License-Identifier: LGPL-2.1-or-later
+#
+*/
+
+#ifndef DPFS_FUSE_XATTR_CACHE_H
+#define DPFS_FUSE_XATTR_CACHE_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+/*
+    A per-device cache of the FUSE_GETXATTR answers of the backend, per inode and xattr name.
+    The guest asks for security.capability before every write of a file (to kill the privileges), which
+    nearly always doesn't exist. With this cache that answer (-ENODATA) only reaches the backend once per inode.
+    Positive answers are cached with their value if it is at most FUSE_XATTR_CACHE_MAX_VALUE bytes,
+    otherwise only their size is.
+    Only this DPFS instance may change the xattrs of the backend: the cache of an inode is dropped on
+    SETXATTR, REMOVEXATTR and FORGET, the positive answers also on WRITE, SETATTR, FALLOCATE and
+    COPY_FILE_RANGE, because the file system of the backend can remove security.capability on those.
+    Only the answers that the backend gives synchronously are cached, and only if the inode wasn't
+    dropped since the request sampled its generation (fuse_xattr_cache_generation) before going to the backend.
+    The inodes are spread over buckets that each have a lock, so the requests of a device can be
+    handled by multiple threads.
+*/
+
+#define FUSE_XATTR_CACHE_MAX_VALUE 256
+// The cache stops taking new inodes when it holds this many
+#define FUSE_XATTR_CACHE_MAX_INODES (1 << 16)
+
+struct fuse_xattr_cache;
+
+struct fuse_xattr_cache *fuse_xattr_cache_new(void);
+void fuse_xattr_cache_destroy(struct fuse_xattr_cache *);
+
+// Returns false if nodeid:name isn't cached. Otherwise *error is 0 or -ENODATA,
+// with 0 *len is the size of the value, which is copied to value if size >= *len and it is cached.
+// Returns false if the value is needed (size >= *len) but only its size is cached
+bool fuse_xattr_cache_get(struct fuse_xattr_cache *, uint64_t nodeid, const char *name,
+                          int *error, void *value, uint32_t size, uint32_t *len);
+// Sample this before asking the backend, every drop of the inode changes it
+uint64_t fuse_xattr_cache_generation(struct fuse_xattr_cache *, uint64_t nodeid);
+// error is 0 or -ENODATA, value is NULL if only the size is known.
+// Not cached if the generation of the inode isn't gen anymore
+void fuse_xattr_cache_put(struct fuse_xattr_cache *, uint64_t nodeid, uint64_t gen, const char *name,
+                          int error, const void *value, uint32_t len);
+// Drops all the names of the inode
+void fuse_xattr_cache_invalidate(struct fuse_xattr_cache *, uint64_t nodeid);
+// Drops the names of the inode that exist, keeps the -ENODATA ones
+void fuse_xattr_cache_invalidate_positive(struct fuse_xattr_cache *, uint64_t nodeid);
+// Drops everything, on FUSE_INIT and FUSE_DESTROY the nodeids start over
+void fuse_xattr_cache_clear(struct fuse_xattr_cache *);
+
+#endif // DPFS_FUSE_XATTR_CACHE_H
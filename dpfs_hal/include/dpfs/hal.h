@@ -33,12 +33,35 @@ typedef int (*dpfs_hal_handler_t) (void *user_data,
                                    void *completion_context, uint16_t device_id);
 typedef void (*dpfs_hal_register_device_t) (void *user_data, uint16_t device_id);
 typedef void (*dpfs_hal_unregister_device_t) (void *user_data, uint16_t device_id);
+// Called by the polling thread around every poll of a device
+typedef void (*dpfs_hal_poll_batch_t) (void *user_data, uint16_t device_id);
+// Called by a polling thread when it is parked or woken up again
+typedef void (*dpfs_hal_thread_state_t) (void *user_data, uint16_t thread_id);
+// Called for a request that the backend completes with dpfs_hal_async_complete(_batch)
+typedef void (*dpfs_hal_async_done_t) (void *user_data, void *completion_context);
 
 struct dpfs_hal_ops {
     dpfs_hal_handler_t request_handler;    
-    // These two callbacks are called during dpfs_hal_new
+    // These two callbacks are called during dpfs_hal_new and dpfs_hal_destroy. With SR-IOV (max_vfs)
+    // they are also called at runtime from a HAL thread, while the other devices are being polled,
+    // when the host enables or disables VFs. A device is registered before its first request
     dpfs_hal_register_device_t register_device;    
     dpfs_hal_unregister_device_t unregister_device;    
+    // Optional. All the requests that a single poll of a device yields are handed to the
+    // request_handler between poll_batch_begin and poll_batch_end, on the same thread.
+    // This allows the backend to defer its submissions (e.g. io_uring_submit) to poll_batch_end
+    dpfs_hal_poll_batch_t poll_batch_begin;
+    dpfs_hal_poll_batch_t poll_batch_end;
+    // Optional. With elastic pollers (min_threads) a polling thread is parked when the load drops,
+    // its devices are handed to the other threads. thread_park is called on the thread after it handled
+    // its last request, thread_unpark before it handles the first request after waking up.
+    // The thread ids stay in [0, dpfs_hal_nthreads), so per-thread state of the backend remains valid
+    dpfs_hal_thread_state_t thread_park;
+    dpfs_hal_thread_state_t thread_unpark;
+    // Optional. Called by dpfs_hal_async_complete(_batch) for every request it completes, on the completing
+    // thread (which can be any thread of the backend) and before the HAL can reuse the completion_context.
+    // Not called for the requests that the request_handler completed synchronously
+    dpfs_hal_async_done_t async_done;
 };
 
 struct dpfs_hal_params {
@@ -57,13 +80,18 @@ struct dpfs_hal;
 
 // Returns the current thread id
 // This should only be called from within the request handler context!!
+// A device with multiple request queues has its requests handled by multiple threads concurrently
 uint16_t dpfs_hal_thread_id(void);
 // Returns the total number of DPFS threads for request handling
 uint16_t dpfs_hal_nthreads(struct dpfs_hal *);
+// Returns how many requests can be in flight at once over all the devices (the queue depth times
+// the number of queues), so that the backend can size its pools. 0 if the HAL doesn't bound it
+size_t dpfs_hal_max_inflight(struct dpfs_hal *);
 
 // Optionally starts a background thread that handles the mock virtio-fs devices,
-// which only get polled once a second. This should be set to true when not using
-// `dpfs_hal_loop`!
+// which only get polled once a second. When not using `dpfs_hal_loop`, either set this
+// to true or poll the mock devices with `dpfs_hal_poll_io` yourself. The mock thread calls
+// the request handler concurrently with the thread of the backend!
 struct dpfs_hal *dpfs_hal_new(struct dpfs_hal_params *params, bool start_mock_thread);
 // DPFS will handle the polling for you (including mock devices), using the supplied interval in the params
 void dpfs_hal_loop(struct dpfs_hal *hal);
@@ -72,8 +100,25 @@ void dpfs_hal_loop(struct dpfs_hal *hal);
 int dpfs_hal_poll_io(struct dpfs_hal *hal, uint16_t device);
 // Poll on the management IO
 void dpfs_hal_poll_mmio(struct dpfs_hal *hal, uint16_t device);
+// Poll on the management IO only if the mmio period of the device (mmio_period_usec in the config)
+// has elapsed. Cheap enough to call on every iteration of a polling loop
+void dpfs_hal_poll_mmio_timed(struct dpfs_hal *hal, uint16_t device);
 void dpfs_hal_destroy(struct dpfs_hal *hal);
 int dpfs_hal_async_complete(void *completion_context, enum dpfs_hal_completion_status);
+// Completes n requests at once, statuses can be NULL if all the requests were succesful
+int dpfs_hal_async_complete_batch(void **completion_contexts,
+                                  enum dpfs_hal_completion_status *statuses, int n);
+
+struct dpfs_stats;
+// Returns the runtime statistics segment of this process (see stats.h), NULL if disabled
+struct dpfs_stats *dpfs_hal_stats(void);
+
+// The DAX window of a device (the virtio-fs shared memory region 0, the "cache"), memory that the guest
+// maps directly. On FUSE_SETUPMAPPING the backend maps file data into the window, so that the guest
+// reads and writes it in place without a request per page. The window stays at the same address for
+// the lifetime of the device and it is reserved, but nothing is mapped in it until the backend does so.
+// Returns 0 with the window in addr and len, or -ENOTSUP if the device has no window
+int dpfs_hal_dax_window(struct dpfs_hal *, uint16_t device_id, void **addr, uint64_t *len);
 
 #ifdef __cplusplus
 }
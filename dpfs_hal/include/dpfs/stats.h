@@ -0,0 +1,194 @@
+/*
+#
+# Copyright 2023- IBM Inc. All rights reserved
+# SPDX-License-Identifier: LGPL-2.1-or-later
+#
+*/
+
+#ifndef DPFS_STATS_H
+#define DPFS_STATS_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <errno.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+    The runtime statistics of a DPFS process. The HAL publishes them in a POSIX shared memory
+    segment (see stats_shm_name in the [snap_hal] config) that dpfs_stat samples from another process.
+    Every counter only increases. The thread counters have a single writer (their DPFS thread),
+    the device and external counters are updated with relaxed atomics.
+    Readers never take a lock and never write to the segment, so they don't perturb the pollers.
+*/
+
+#define DPFS_STATS_MAGIC 0x5441545353465044ULL // "DPFSSTAT" in little-endian
+#define DPFS_STATS_VERSION 2
+#define DPFS_STATS_MAX_THREADS 64
+#define DPFS_STATS_MAX_DEVICES 64
+// FUSE opcodes that don't fit (CUSE_INIT) are counted as opcode 0
+#define DPFS_STATS_NOPCODES 64
+
+struct dpfs_stats_thread {
+    // Passes over the queues of the thread and the passes that found requests
+    uint64_t polls;
+    uint64_t useful_polls;
+    // Requests handed to the request handler, split by what the handler returned
+    uint64_t requests;
+    uint64_t sync_completions;
+    uint64_t async_requests; // EWOULDBLOCK
+    uint64_t errors;
+    // dpfs_hal_async_complete calls made on this thread
+    uint64_t async_completions;
+    // Requests that failed because the backend ran out of memory pool entries
+    uint64_t mpool_exhausted;
+    // The requested bytes of FUSE_READ and FUSE_WRITE
+    uint64_t read_bytes;
+    uint64_t write_bytes;
+    // Nanoseconds that the thread waited for requests without polling: in a low-power wait
+    // (WFE/UMWAIT) or yielding the CPU, and sleeping or parked
+    uint64_t wait_ns;
+    uint64_t sleep_ns;
+    uint64_t opcodes[DPFS_STATS_NOPCODES];
+} __attribute__((aligned(64)));
+
+struct dpfs_stats_device {
+    uint64_t requests;
+    uint64_t async_requests;
+    uint64_t errors;
+    uint64_t read_bytes;
+    uint64_t write_bytes;
+} __attribute__((aligned(64)));
+
+struct dpfs_stats {
+    // Written last by the HAL, the segment is only valid when this is DPFS_STATS_MAGIC
+    uint64_t magic;
+    uint32_t version;
+    int32_t pid;
+    // CLOCK_REALTIME seconds
+    uint64_t start_time;
+    uint16_t nthreads;
+    uint16_t ndevices;
+    char hal[16];
+
+    // dpfs_hal_async_complete calls made on threads that are not DPFS threads (e.g. io_uring cq threads)
+    uint64_t external_async_completions __attribute__((aligned(64)));
+    struct dpfs_stats_thread threads[DPFS_STATS_MAX_THREADS];
+    struct dpfs_stats_device devices[DPFS_STATS_MAX_DEVICES];
+};
+
+// For counters with a single writer, the reader never sees a torn value
+static inline void dpfs_stats_add(uint64_t *c, uint64_t v)
+{
+    __atomic_store_n(c, *c + v, __ATOMIC_RELAXED);
+}
+
+// For counters that are written by multiple threads
+static inline void dpfs_stats_add_shared(uint64_t *c, uint64_t v)
+{
+    __atomic_fetch_add(c, v, __ATOMIC_RELAXED);
+}
+
+static inline uint64_t dpfs_stats_read(const uint64_t *c)
+{
+    return __atomic_load_n(c, __ATOMIC_RELAXED);
+}
+
+// All the functions below accept s == NULL, which means that the statistics are disabled
+
+static inline struct dpfs_stats_thread *dpfs_stats_thread(struct dpfs_stats *s, uint16_t thread_id)
+{
+    if (!s || thread_id >= DPFS_STATS_MAX_THREADS)
+        return NULL;
+    return &s->threads[thread_id];
+}
+
+static inline struct dpfs_stats_device *dpfs_stats_device(struct dpfs_stats *s, uint16_t device_id)
+{
+    if (!s || device_id >= DPFS_STATS_MAX_DEVICES)
+        return NULL;
+    return &s->devices[device_id];
+}
+
+// Accounts a pass over the queues of a thread that found n requests
+static inline void dpfs_stats_poll(struct dpfs_stats *s, uint16_t thread_id, int n)
+{
+    struct dpfs_stats_thread *t = dpfs_stats_thread(s, thread_id);
+    if (!t)
+        return;
+    dpfs_stats_add(&t->polls, 1);
+    if (n > 0)
+        dpfs_stats_add(&t->useful_polls, 1);
+}
+
+// Accounts a request that the request handler returned ret for. Anything other than 0 (completed)
+// and EWOULDBLOCK (asynchronous) is an error, at both levels
+static inline void dpfs_stats_request(struct dpfs_stats *s, uint16_t thread_id, uint16_t device_id, int ret)
+{
+    bool error = ret != 0 && ret != EWOULDBLOCK;
+    struct dpfs_stats_thread *t = dpfs_stats_thread(s, thread_id);
+    if (t) {
+        dpfs_stats_add(&t->requests, 1);
+        if (ret == 0)
+            dpfs_stats_add(&t->sync_completions, 1);
+        else if (ret == EWOULDBLOCK)
+            dpfs_stats_add(&t->async_requests, 1);
+        if (error)
+            dpfs_stats_add(&t->errors, 1);
+    }
+    struct dpfs_stats_device *d = dpfs_stats_device(s, device_id);
+    if (d) {
+        dpfs_stats_add_shared(&d->requests, 1);
+        if (ret == EWOULDBLOCK)
+            dpfs_stats_add_shared(&d->async_requests, 1);
+        if (error)
+            dpfs_stats_add_shared(&d->errors, 1);
+    }
+}
+
+static inline void dpfs_stats_opcode(struct dpfs_stats *s, uint16_t thread_id, uint32_t opcode)
+{
+    struct dpfs_stats_thread *t = dpfs_stats_thread(s, thread_id);
+    if (t)
+        dpfs_stats_add(&t->opcodes[opcode < DPFS_STATS_NOPCODES ? opcode : 0], 1);
+}
+
+static inline void dpfs_stats_io(struct dpfs_stats *s, uint16_t thread_id, uint16_t device_id,
+                                 uint64_t read_bytes, uint64_t write_bytes)
+{
+    struct dpfs_stats_thread *t = dpfs_stats_thread(s, thread_id);
+    if (t) {
+        dpfs_stats_add(&t->read_bytes, read_bytes);
+        dpfs_stats_add(&t->write_bytes, write_bytes);
+    }
+    struct dpfs_stats_device *d = dpfs_stats_device(s, device_id);
+    if (d) {
+        dpfs_stats_add_shared(&d->read_bytes, read_bytes);
+        dpfs_stats_add_shared(&d->write_bytes, write_bytes);
+    }
+}
+
+static inline void dpfs_stats_idle(struct dpfs_stats *s, uint16_t thread_id, uint64_t wait_ns, uint64_t sleep_ns)
+{
+    struct dpfs_stats_thread *t = dpfs_stats_thread(s, thread_id);
+    if (t) {
+        dpfs_stats_add(&t->wait_ns, wait_ns);
+        dpfs_stats_add(&t->sleep_ns, sleep_ns);
+    }
+}
+
+// Called by the backends when a request fails because their memory pool is empty
+static inline void dpfs_stats_mpool_exhausted(struct dpfs_stats *s, uint16_t thread_id)
+{
+    struct dpfs_stats_thread *t = dpfs_stats_thread(s, thread_id);
+    if (t)
+        dpfs_stats_add(&t->mpool_exhausted, 1);
+}
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // DPFS_STATS_H
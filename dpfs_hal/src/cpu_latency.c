@@ -6,6 +6,7 @@
 */
 
 #include <stdint.h>
+#include <stdbool.h>
 #include <stdio.h>
 #include <fcntl.h>
 #include <errno.h>
@@ -39,6 +40,21 @@ int start_low_latency(void)
     return 0;
 }
 
+// Holds (low == true) or relaxes the request of start_low_latency without closing the fd,
+// so that idle pollers let the CPUs enter the deeper C-states
+int set_low_latency(bool low)
+{
+    // The PM QoS framework treats anything above PM_QOS_CPU_LATENCY_DEFAULT_VALUE as the default
+    int32_t latency = low ? 0 : 2000000000;
+
+    if (pm_qos_fd < 0)
+        return -EBADF;
+
+    if (write(pm_qos_fd, &latency, sizeof(latency)) != sizeof(latency))
+        return -errno;
+    return 0;
+}
+
 void stop_low_latency(void)  
 {  
     if (pm_qos_fd >= 0)  
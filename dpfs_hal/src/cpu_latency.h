@@ -8,7 +8,10 @@
 #ifndef CPU_LATENCY_H
 #define CPU_LATENCY_H
 
+#include <stdbool.h>
+
 int start_low_latency(void);
+int set_low_latency(bool low);
 void stop_low_latency(void);
 
 #endif // CPU_LATENCY_H
@@ -0,0 +1,127 @@
+/*
+#
+# Copyright 2023- IBM Inc. All rights reserved
+# SPDX-License-Identifier: LGPL-2.1-or-later
+#
+*/
+
+#include <unistd.h>
+#include <stdbool.h>
+#if defined(__x86_64__)
+#include <cpuid.h>
+#endif
+
+#include "cycles.h"
+
+static uint64_t clock_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+uint64_t cycles_per_usec(void)
+{
+    static uint64_t per_usec;
+    uint64_t v = __atomic_load_n(&per_usec, __ATOMIC_RELAXED);
+    if (v)
+        return v;
+
+#if defined(__aarch64__)
+    // The generic timer reports its own frequency
+    uint64_t freq;
+    asm volatile("mrs %0, cntfrq_el0" : "=r"(freq));
+    v = freq / 1000000;
+#else
+    // Measure the counter against the monotonic clock over 10ms
+    uint64_t c0 = cycles_now(), t0 = clock_ns();
+    usleep(10000);
+    uint64_t c1 = cycles_now(), t1 = clock_ns();
+    v = t1 > t0 ? (c1 - c0) * 1000 / (t1 - t0) : 0;
+#endif
+    if (v == 0)
+        v = 1;
+    __atomic_store_n(&per_usec, v, __ATOMIC_RELAXED);
+    return v;
+}
+
+#if defined(__x86_64__)
+// The WAITPKG instructions are emitted as bytes, so that no -mwaitpkg is needed to build
+static bool has_waitpkg(void)
+{
+    // 0 = unknown, 1 = no, 2 = yes
+    static int waitpkg;
+    if (waitpkg == 0) {
+        unsigned int a, b, c, d;
+        waitpkg = __get_cpuid_count(7, 0, &a, &b, &c, &d) && (c & (1 << 5)) ? 2 : 1;
+    }
+    return waitpkg == 2;
+}
+
+// Control 0 selects C0.2, the state that saves the most power
+static inline void tpause(uint64_t deadline)
+{
+    asm volatile(".byte 0x66, 0x0f, 0xae, 0xf7" /* tpause %edi */
+            :: "D"(0), "a"((uint32_t) deadline), "d"((uint32_t) (deadline >> 32)) : "cc", "memory");
+}
+
+static inline void umonitor(const void *addr)
+{
+    asm volatile(".byte 0xf3, 0x0f, 0xae, 0xf0" /* umonitor %rax */ :: "a"(addr) : "memory");
+}
+
+static inline void umwait(uint64_t deadline)
+{
+    asm volatile(".byte 0xf2, 0x0f, 0xae, 0xf7" /* umwait %edi */
+            :: "D"(0), "a"((uint32_t) deadline), "d"((uint32_t) (deadline >> 32)) : "cc", "memory");
+}
+#endif
+
+void cycles_wait(uint64_t deadline)
+{
+#if defined(__aarch64__)
+    while (cycles_now() < deadline)
+        asm volatile("wfe" ::: "memory");
+#elif defined(__x86_64__)
+    bool waitpkg = has_waitpkg();
+    // TPAUSE returns early when the OS limit (IA32_UMWAIT_CONTROL) is reached
+    while (cycles_now() < deadline) {
+        if (waitpkg)
+            tpause(deadline);
+        else
+            __builtin_ia32_pause();
+    }
+#else
+    while (cycles_now() < deadline)
+        ;
+#endif
+}
+
+void cycles_monitor_wait(const uint32_t *addr, uint32_t old, uint64_t deadline)
+{
+#if defined(__aarch64__)
+    while (cycles_now() < deadline) {
+        uint32_t v;
+        // Arms the exclusive monitor, a write to the cacheline by another CPU sends us an event
+        asm volatile("ldaxr %w0, [%1]" : "=&r"(v) : "r"(addr) : "memory");
+        if (v != old)
+            return;
+        asm volatile("wfe" ::: "memory");
+    }
+#elif defined(__x86_64__)
+    bool waitpkg = has_waitpkg();
+    while (cycles_now() < deadline) {
+        if (waitpkg)
+            umonitor(addr);
+        if (__atomic_load_n(addr, __ATOMIC_ACQUIRE) != old)
+            return;
+        if (waitpkg)
+            umwait(deadline);
+        else
+            __builtin_ia32_pause();
+    }
+#else
+    while (cycles_now() < deadline && __atomic_load_n(addr, __ATOMIC_ACQUIRE) == old)
+        ;
+#endif
+}
@@ -0,0 +1,43 @@
+/*
+#
+# Copyright 2023- IBM Inc. All rights reserved
+# SPDX-License-Identifier: LGPL-2.1-or-later
+#
+*/
+
+#ifndef CYCLES_H
+#define CYCLES_H
+
+#include <stdint.h>
+#include <time.h>
+
+// A cheap monotonic cycle counter for deadlines on the polling path, reading it doesn't enter
+// the kernel or the vDSO. Its frequency is fixed but unknown, convert with cycles_per_usec()
+static inline uint64_t cycles_now(void)
+{
+#if defined(__aarch64__)
+    uint64_t v;
+    asm volatile("isb; mrs %0, cntvct_el0" : "=r"(v) :: "memory");
+    return v;
+#elif defined(__x86_64__)
+    return __builtin_ia32_rdtsc();
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+#endif
+}
+
+// The number of cycles_now() ticks per microsecond, at least 1.
+// Calibrated on the first call, which can take a few milliseconds
+uint64_t cycles_per_usec(void);
+
+// Waits in a low-power state until cycles_now() reaches deadline. Uses WFE on aarch64, which is
+// woken up by the event stream of the generic timer, so the wait can overshoot by up to ~100us.
+// Uses TPAUSE on x86 CPUs with WAITPKG, other CPUs spin with pause
+void cycles_wait(uint64_t deadline);
+// Like cycles_wait, but also returns as soon as the value at addr differs from old. Another
+// thread writing addr wakes us up: a load-exclusive arms WFE on aarch64, UMONITOR/UMWAIT on x86
+void cycles_monitor_wait(const uint32_t *addr, uint32_t old, uint64_t deadline);
+
+#endif // CYCLES_H
@@ -0,0 +1,1150 @@
+/*
+#
+# Copyright 2023- IBM Inc. All rights reserved
+# SPDX-License-Identifier: LGPL-2.1-or-later
+#
+*/
+
+// Software loopback implementation of the DPFS HAL.
+// Instead of a virtio-fs device on the DPU, every device is an in-process virtqueue that
+// is filled by a load-generator thread (the "host"). The requests are handled by the exact same
+// request_handler/dpfs_hal_async_complete path as with SNAP, so dpfs_fuse and the file system
+// backends can be benchmarked on any Linux machine.
+
+#include "config.h"
+#if defined(DPFS_LOOPBACK)
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sched.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <err.h>
+#include <string.h>
+#include <time.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/errno.h>
+#include <linux/fuse.h>
+
+#include "hal.h"
+#include "cpu_latency.h"
+#include "stats_shm.h"
+#include "placement.h"
+#include "cycles.h"
+#include "toml.h"
+#include "lat_hist.h"
+
+#define LB_MAX_OPCODE FUSE_REMOVEMAPPING
+#define LB_MAX_NAME 256
+#define LB_DATA_ALIGN 4096
+
+enum lb_workload {
+    LB_WORKLOAD_GETATTR,
+    LB_WORKLOAD_STATFS,
+    LB_WORKLOAD_LOOKUP,
+    LB_WORKLOAD_READ,
+    LB_WORKLOAD_WRITE,
+    LB_WORKLOAD_RW,
+};
+
+// The largest argument structs we send and receive
+union lb_in_arg {
+    struct fuse_init_in init;
+    struct fuse_getattr_in getattr;
+    struct fuse_open_in open;
+    struct fuse_read_in read;
+    struct fuse_write_in write;
+    char name[LB_MAX_NAME];
+};
+
+union lb_out_arg {
+    struct fuse_init_out init;
+    struct fuse_entry_out entry;
+    struct fuse_attr_out attr;
+    struct fuse_open_out open;
+    struct fuse_write_out write;
+    struct fuse_statfs_out statfs;
+};
+
+// A single request slot of the software virtqueue, the slot is the completion_context
+struct lb_slot {
+    struct lb_device *dev;
+    uint16_t idx;
+
+    struct fuse_in_header in_hdr;
+    union lb_in_arg in_arg;
+    struct fuse_out_header out_hdr;
+    union lb_out_arg out_arg;
+    // Read or write payload of block_size
+    void *data;
+
+    struct iovec in_iov[3];
+    int in_iovcnt;
+    struct iovec out_iov[2];
+    int out_iovcnt;
+
+    struct timespec start;
+    // Only touched by the generator
+    bool posted;
+    // Written by whichever thread completes the request, read by the generator
+    bool done;
+    bool error;
+};
+
+struct lb_device {
+    uint16_t device_id;
+    uint32_t qd;
+    struct lb_slot *slots;
+
+    // The avail ring, produced by the generator and consumed by the owning poller.
+    // Can never overflow because every slot is in the ring at most once.
+    uint16_t *avail;
+    uint32_t avail_prod;
+    uint32_t avail_cons;
+
+    // Set by the generator once it has stopped and drained all the requests
+    bool suspended;
+    uint64_t unique;
+    uint64_t nodeid;
+    uint64_t fh;
+    // NULL without dax_window_size
+    void *dax_window;
+
+    struct dpfs_hal *hal;
+};
+
+struct lb_generator {
+    pthread_t thread;
+    uint16_t id;
+    int cpu;
+    bool running;
+    bool failed;
+    struct dpfs_hal *hal;
+
+    size_t devices_start;
+    size_t devices_end;
+    uint64_t rng;
+
+    // Only written by the generator itself, read by generator 0 for the interval reports
+    uint64_t completions;
+    uint64_t errors;
+    struct timespec begin;
+    struct timespec end;
+    struct lat_hist *hist[LB_MAX_OPCODE + 1];
+    uint64_t op_errors[LB_MAX_OPCODE + 1];
+};
+
+struct dpfs_hal {
+    int ndevices;
+    struct lb_device *devices;
+
+    struct dpfs_hal_ops ops;
+    void *user_data;
+    useconds_t polling_interval_usec;
+    // If not 0, a poller waits in a low-power state for up to this long (in cycles) after a pass
+    // that found no requests. With a single device it is woken up by the generator
+    uint64_t idle_wait;
+    uint16_t nthreads;
+    uint32_t queue_depth;
+
+    enum lb_workload workload;
+    char *workload_name;
+    char *file;
+    uint32_t block_size;
+    uint64_t file_size;
+    uint64_t duration_sec;
+    uint64_t report_interval_sec;
+    // The size of the DAX window of every device, 0 for none
+    uint64_t dax_window_size;
+
+    struct lb_generator *generators;
+    bool generators_joined;
+    bool summary_printed;
+    // NULL if the statistics are disabled
+    char *stats_shm_name;
+    // The CPU of every polling thread
+    int *thread_cpus;
+};
+
+static volatile int keep_running = 1;
+
+pthread_key_t dpfs_hal_thread_id_key;
+__attribute__((visibility("default")))
+uint16_t dpfs_hal_thread_id(void) {
+    return (uint16_t) (size_t) pthread_getspecific(dpfs_hal_thread_id_key);
+}
+__attribute__((visibility("default")))
+uint16_t dpfs_hal_nthreads(struct dpfs_hal *hal)
+{
+    return hal->nthreads;
+}
+__attribute__((visibility("default")))
+size_t dpfs_hal_max_inflight(struct dpfs_hal *hal)
+{
+    return (size_t) hal->ndevices * hal->queue_depth;
+}
+
+// The window is plain memory of this process, so the mappings of a backend can be tested without a guest
+__attribute__((visibility("default")))
+int dpfs_hal_dax_window(struct dpfs_hal *hal, uint16_t device_id, void **addr, uint64_t *len)
+{
+    if (device_id >= hal->ndevices || !hal->devices[device_id].dax_window)
+        return -ENOTSUP;
+    *addr = hal->devices[device_id].dax_window;
+    *len = hal->dax_window_size;
+    return 0;
+}
+
+static void signal_handler(int dummy)
+{
+    keep_running = 0;
+    printf("DPFS-HAL loopback: the HAL will exit when all the in-flight requests have completed\n");
+}
+
+static inline uint64_t lb_ts_diff_ns(struct timespec *a, struct timespec *b)
+{
+    return (b->tv_sec - a->tv_sec) * 1000000000ULL + b->tv_nsec - a->tv_nsec;
+}
+
+static inline uint64_t lb_rand(uint64_t *state)
+{
+    // xorshift64
+    uint64_t x = *state;
+    x ^= x << 13;
+    x ^= x >> 7;
+    x ^= x << 17;
+    return *state = x;
+}
+
+// The same device window rules as the SNAP static scheduler, thread 0 takes the remainder
+static void lb_device_window(struct dpfs_hal *hal, size_t thread_id, size_t *start, size_t *end)
+{
+    size_t ndevices = hal->ndevices / hal->nthreads;
+    size_t remainder = hal->ndevices % hal->nthreads;
+    size_t devices_start = ndevices * thread_id;
+    size_t devices_end = devices_start + ndevices;
+    if (thread_id == 0 && remainder != 0) {
+        devices_end += remainder;
+    } else if (remainder != 0) {
+        devices_start += remainder;
+        devices_end += remainder;
+    }
+    *start = devices_start;
+    *end = devices_end;
+}
+
+static void lb_complete(struct lb_slot *s, bool error)
+{
+    s->error = error;
+    __atomic_store_n(&s->done, true, __ATOMIC_RELEASE);
+}
+
+static int lb_progress_device(struct lb_device *dev)
+{
+    struct dpfs_hal *hal = dev->hal;
+    uint32_t prod = __atomic_load_n(&dev->avail_prod, __ATOMIC_ACQUIRE);
+    int n = 0;
+
+    if (dev->avail_cons == prod)
+        return 0;
+
+    if (hal->ops.poll_batch_begin)
+        hal->ops.poll_batch_begin(hal->user_data, dev->device_id);
+    while (dev->avail_cons != prod) {
+        struct lb_slot *s = &dev->slots[dev->avail[dev->avail_cons & (dev->qd - 1)]];
+        dev->avail_cons++;
+
+        int ret = hal->ops.request_handler(hal->user_data, s->in_iov, s->in_iovcnt,
+                s->out_iov, s->out_iovcnt, s, dev->device_id);
+        dpfs_stats_request(stats_shm, dpfs_hal_thread_id(), dev->device_id, ret);
+        if (ret != EWOULDBLOCK)
+            lb_complete(s, ret != 0);
+        n++;
+    }
+    if (hal->ops.poll_batch_end)
+        hal->ops.poll_batch_end(hal->user_data, dev->device_id);
+
+    return n;
+}
+
+__attribute__((visibility("default")))
+int dpfs_hal_poll_io(struct dpfs_hal *hal, uint16_t device_id)
+{
+    if (device_id < hal->ndevices)
+        return lb_progress_device(&hal->devices[device_id]);
+    else
+        return -ENODEV;
+}
+
+__attribute__((visibility("default")))
+void dpfs_hal_poll_mmio(struct dpfs_hal *hal, uint16_t device_id)
+{
+    // There is no management I/O on a loopback device
+}
+
+__attribute__((visibility("default")))
+void dpfs_hal_poll_mmio_timed(struct dpfs_hal *hal, uint16_t device_id)
+{
+}
+
+__attribute__((visibility("default")))
+int dpfs_hal_async_complete(void *completion_context, enum dpfs_hal_completion_status status)
+{
+    struct lb_slot *s = completion_context;
+    struct dpfs_hal *hal = s->dev->hal;
+    if (hal->ops.async_done)
+        hal->ops.async_done(hal->user_data, s);
+    lb_complete(s, status != DPFS_HAL_COMPLETION_SUCCES);
+    stats_shm_async_complete(1);
+    return 0;
+}
+
+__attribute__((visibility("default")))
+int dpfs_hal_async_complete_batch(void **completion_contexts,
+                                  enum dpfs_hal_completion_status *statuses, int n)
+{
+    for (int i = 0; i < n; i++) {
+        struct lb_slot *s = completion_contexts[i];
+        struct dpfs_hal *hal = s->dev->hal;
+        if (hal->ops.async_done)
+            hal->ops.async_done(hal->user_data, s);
+        lb_complete(s, statuses && statuses[i] != DPFS_HAL_COMPLETION_SUCCES);
+    }
+    stats_shm_async_complete(n);
+    return 0;
+}
+
+static const char *lb_opcode_name(uint32_t opcode)
+{
+    switch (opcode) {
+    case FUSE_INIT: return "INIT";
+    case FUSE_LOOKUP: return "LOOKUP";
+    case FUSE_GETATTR: return "GETATTR";
+    case FUSE_OPEN: return "OPEN";
+    case FUSE_READ: return "READ";
+    case FUSE_WRITE: return "WRITE";
+    case FUSE_STATFS: return "STATFS";
+    default: return "UNKNOWN";
+    }
+}
+
+// Fills in the request in slot s, based on the opcode
+static void lb_prep(struct dpfs_hal *hal, struct lb_generator *g, struct lb_slot *s, uint32_t opcode)
+{
+    struct lb_device *dev = s->dev;
+
+    memset(&s->in_hdr, 0, sizeof(s->in_hdr));
+    s->in_hdr.opcode = opcode;
+    s->in_hdr.unique = ++dev->unique;
+    s->in_hdr.nodeid = dev->nodeid;
+    s->in_iov[0].iov_base = &s->in_hdr;
+    s->in_iov[0].iov_len = sizeof(s->in_hdr);
+    s->in_iov[1].iov_base = &s->in_arg;
+    s->in_iovcnt = 2;
+    s->out_iov[0].iov_base = &s->out_hdr;
+    s->out_iov[0].iov_len = sizeof(s->out_hdr);
+    s->out_iov[1].iov_base = &s->out_arg;
+    s->out_iovcnt = 2;
+
+    uint64_t offset = 0;
+    if (opcode == FUSE_READ || opcode == FUSE_WRITE) {
+        uint64_t nblocks = hal->file_size / hal->block_size;
+        offset = (lb_rand(&g->rng) % nblocks) * hal->block_size;
+    }
+
+    switch (opcode) {
+    case FUSE_INIT:
+        memset(&s->in_arg.init, 0, sizeof(s->in_arg.init));
+        s->in_arg.init.major = FUSE_KERNEL_VERSION;
+        s->in_arg.init.minor = FUSE_KERNEL_MINOR_VERSION;
+        s->in_arg.init.max_readahead = hal->block_size;
+        s->in_iov[1].iov_len = sizeof(s->in_arg.init);
+        s->out_iov[1].iov_len = sizeof(s->out_arg.init);
+        break;
+    case FUSE_LOOKUP:
+        s->in_hdr.nodeid = FUSE_ROOT_ID;
+        strncpy(s->in_arg.name, hal->file, LB_MAX_NAME - 1);
+        s->in_iov[1].iov_len = strlen(s->in_arg.name) + 1;
+        s->out_iov[1].iov_len = sizeof(s->out_arg.entry);
+        break;
+    case FUSE_GETATTR:
+        memset(&s->in_arg.getattr, 0, sizeof(s->in_arg.getattr));
+        s->in_iov[1].iov_len = sizeof(s->in_arg.getattr);
+        s->out_iov[1].iov_len = sizeof(s->out_arg.attr);
+        break;
+    case FUSE_OPEN:
+        memset(&s->in_arg.open, 0, sizeof(s->in_arg.open));
+        s->in_arg.open.flags = hal->workload == LB_WORKLOAD_READ ? O_RDONLY : O_RDWR;
+        s->in_iov[1].iov_len = sizeof(s->in_arg.open);
+        s->out_iov[1].iov_len = sizeof(s->out_arg.open);
+        break;
+    case FUSE_STATFS:
+        s->in_iovcnt = 1;
+        s->out_iov[1].iov_len = sizeof(s->out_arg.statfs);
+        break;
+    case FUSE_READ:
+        memset(&s->in_arg.read, 0, sizeof(s->in_arg.read));
+        s->in_arg.read.fh = dev->fh;
+        s->in_arg.read.offset = offset;
+        s->in_arg.read.size = hal->block_size;
+        s->in_iov[1].iov_len = sizeof(s->in_arg.read);
+        s->out_iov[1].iov_base = s->data;
+        s->out_iov[1].iov_len = hal->block_size;
+        break;
+    case FUSE_WRITE:
+        memset(&s->in_arg.write, 0, sizeof(s->in_arg.write));
+        s->in_arg.write.fh = dev->fh;
+        s->in_arg.write.offset = offset;
+        s->in_arg.write.size = hal->block_size;
+        s->in_iov[1].iov_len = sizeof(s->in_arg.write);
+        s->in_iov[2].iov_base = s->data;
+        s->in_iov[2].iov_len = hal->block_size;
+        s->in_iovcnt = 3;
+        s->out_iov[1].iov_len = sizeof(s->out_arg.write);
+        break;
+    }
+
+    s->in_hdr.len = 0;
+    for (int i = 0; i < s->in_iovcnt; i++)
+        s->in_hdr.len += s->in_iov[i].iov_len;
+}
+
+// Hands the slot over to the poller of the device
+static void lb_post(struct lb_slot *s)
+{
+    struct lb_device *dev = s->dev;
+
+    s->posted = true;
+    s->done = false;
+    memset(&s->out_hdr, 0, sizeof(s->out_hdr));
+    clock_gettime(CLOCK_MONOTONIC, &s->start);
+
+    dev->avail[dev->avail_prod & (dev->qd - 1)] = s->idx;
+    __atomic_store_n(&dev->avail_prod, dev->avail_prod + 1, __ATOMIC_RELEASE);
+}
+
+static uint32_t lb_next_opcode(struct dpfs_hal *hal, struct lb_generator *g)
+{
+    switch (hal->workload) {
+    case LB_WORKLOAD_GETATTR: return FUSE_GETATTR;
+    case LB_WORKLOAD_STATFS: return FUSE_STATFS;
+    case LB_WORKLOAD_LOOKUP: return FUSE_LOOKUP;
+    case LB_WORKLOAD_READ: return FUSE_READ;
+    case LB_WORKLOAD_WRITE: return FUSE_WRITE;
+    case LB_WORKLOAD_RW: return lb_rand(&g->rng) & 1 ? FUSE_READ : FUSE_WRITE;
+    }
+    return FUSE_GETATTR;
+}
+
+// Sends a single request and waits for it, retries as long as the file system is not ready yet
+static int lb_submit_sync(struct dpfs_hal *hal, struct lb_generator *g, struct lb_device *dev, uint32_t opcode)
+{
+    struct lb_slot *s = &dev->slots[0];
+
+    while (keep_running) {
+        lb_prep(hal, g, s, opcode);
+        lb_post(s);
+        while (!__atomic_load_n(&s->done, __ATOMIC_ACQUIRE))
+            sched_yield();
+        s->posted = false;
+
+        if (s->error) {
+            fprintf(stderr, "DPFS-HAL loopback: device %u %s failed in the HAL request handler\n",
+                    dev->device_id, lb_opcode_name(opcode));
+            return -1;
+        }
+        // The file system can still be connecting to its backend after FUSE_INIT
+        if (s->out_hdr.error == -EBUSY) {
+            usleep(100000);
+            continue;
+        }
+        if (s->out_hdr.error != 0) {
+            fprintf(stderr, "DPFS-HAL loopback: device %u %s failed with %d (%s)\n",
+                    dev->device_id, lb_opcode_name(opcode), s->out_hdr.error, strerror(-s->out_hdr.error));
+            return -1;
+        }
+        return 0;
+    }
+    return -1;
+}
+
+// Performs the FUSE handshake, and for I/O workloads, looks up and opens the file
+static int lb_setup_device(struct dpfs_hal *hal, struct lb_generator *g, struct lb_device *dev)
+{
+    dev->nodeid = FUSE_ROOT_ID;
+    if (lb_submit_sync(hal, g, dev, FUSE_INIT))
+        return -1;
+
+    if (hal->workload == LB_WORKLOAD_GETATTR || hal->workload == LB_WORKLOAD_STATFS)
+        return 0;
+
+    if (lb_submit_sync(hal, g, dev, FUSE_LOOKUP))
+        return -1;
+    if (dev->slots[0].out_arg.entry.nodeid == 0) {
+        fprintf(stderr, "DPFS-HAL loopback: device %u could not find \"%s\" in the root of the file system\n",
+                dev->device_id, hal->file);
+        return -1;
+    }
+    dev->nodeid = dev->slots[0].out_arg.entry.nodeid;
+
+    if (hal->workload == LB_WORKLOAD_LOOKUP)
+        return 0;
+
+    if (lb_submit_sync(hal, g, dev, FUSE_OPEN))
+        return -1;
+    dev->fh = dev->slots[0].out_arg.open.fh;
+
+    return 0;
+}
+
+static void lb_record(struct lb_generator *g, struct lb_slot *s, struct timespec *now)
+{
+    uint32_t opcode = s->in_hdr.opcode;
+
+    if (!g->hist[opcode]) {
+        g->hist[opcode] = malloc(sizeof(struct lat_hist));
+        if (!g->hist[opcode])
+            err(1, "DPFS-HAL loopback: could not allocate a latency histogram");
+        lat_hist_init(g->hist[opcode]);
+    }
+    lat_hist_record(g->hist[opcode], lb_ts_diff_ns(&s->start, now));
+
+    if (s->error || s->out_hdr.error < 0) {
+        g->op_errors[opcode]++;
+        __atomic_store_n(&g->errors, g->errors + 1, __ATOMIC_RELAXED);
+    }
+    __atomic_store_n(&g->completions, g->completions + 1, __ATOMIC_RELAXED);
+}
+
+static void lb_report_interval(struct dpfs_hal *hal, uint64_t *last, double sec)
+{
+    uint64_t total = 0;
+    uint64_t errors = 0;
+    for (uint16_t i = 0; i < hal->nthreads; i++) {
+        total += __atomic_load_n(&hal->generators[i].completions, __ATOMIC_RELAXED);
+        errors += __atomic_load_n(&hal->generators[i].errors, __ATOMIC_RELAXED);
+    }
+    printf("DPFS-HAL loopback: %.0f IOPS (%lu errors in total)\n", (total - *last) / sec, errors);
+    *last = total;
+}
+
+static void *lb_generator_thread(void *arg)
+{
+    struct lb_generator *g = arg;
+    struct dpfs_hal *hal = g->hal;
+
+    if (g->cpu >= 0) {
+        int ret = placement_pin(g->cpu);
+        errno = -ret;
+        if (ret)
+            warn("Could not set the CPU affinity of load generator %u. It will continue not pinned.", g->id);
+    }
+
+    for (size_t i = g->devices_start; i < g->devices_end; i++) {
+        if (lb_setup_device(hal, g, &hal->devices[i])) {
+            g->failed = true;
+            keep_running = 0;
+            goto out;
+        }
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &g->begin);
+    struct timespec now = g->begin;
+    struct timespec last_report = g->begin;
+    uint64_t last_total = 0;
+
+    for (size_t i = g->devices_start; i < g->devices_end; i++) {
+        struct lb_device *dev = &hal->devices[i];
+        for (uint32_t j = 0; j < dev->qd; j++) {
+            lb_prep(hal, g, &dev->slots[j], lb_next_opcode(hal, g));
+            lb_post(&dev->slots[j]);
+        }
+    }
+
+    bool stopping = false;
+    size_t inflight = 1;
+    while (!stopping || inflight > 0) {
+        inflight = 0;
+        for (size_t i = g->devices_start; i < g->devices_end; i++) {
+            struct lb_device *dev = &hal->devices[i];
+            for (uint32_t j = 0; j < dev->qd; j++) {
+                struct lb_slot *s = &dev->slots[j];
+                if (!s->posted)
+                    continue;
+                if (!__atomic_load_n(&s->done, __ATOMIC_ACQUIRE)) {
+                    inflight++;
+                    continue;
+                }
+                clock_gettime(CLOCK_MONOTONIC, &now);
+                lb_record(g, s, &now);
+                s->posted = false;
+                if (!stopping) {
+                    lb_prep(hal, g, s, lb_next_opcode(hal, g));
+                    lb_post(s);
+                    inflight++;
+                }
+            }
+        }
+
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        if (!stopping && (!keep_running ||
+                (hal->duration_sec && lb_ts_diff_ns(&g->begin, &now) >= hal->duration_sec * 1000000000ULL)))
+            stopping = true;
+
+        if (g->id == 0 && hal->report_interval_sec &&
+                lb_ts_diff_ns(&last_report, &now) >= hal->report_interval_sec * 1000000000ULL) {
+            lb_report_interval(hal, &last_total, lb_ts_diff_ns(&last_report, &now) / 1e9);
+            last_report = now;
+        }
+    }
+    clock_gettime(CLOCK_MONOTONIC, &g->end);
+
+out:
+    for (size_t i = g->devices_start; i < g->devices_end; i++)
+        __atomic_store_n(&hal->devices[i].suspended, true, __ATOMIC_RELEASE);
+    return NULL;
+}
+
+static bool all_devices_suspended(struct dpfs_hal *hal)
+{
+    for (uint16_t i = 0; i < hal->ndevices; i++) {
+        if (!__atomic_load_n(&hal->devices[i].suspended, __ATOMIC_ACQUIRE))
+            return false;
+    }
+    return true;
+}
+
+static void lb_join_generators(struct dpfs_hal *hal)
+{
+    if (hal->generators_joined)
+        return;
+    for (uint16_t i = 0; i < hal->nthreads; i++) {
+        if (hal->generators[i].running)
+            pthread_join(hal->generators[i].thread, NULL);
+        hal->generators[i].running = false;
+    }
+    hal->generators_joined = true;
+}
+
+static void lb_print_row(const char *name, struct lat_hist *h, uint64_t errors, double sec)
+{
+    printf("%-10s %12lu %12.0f %8lu %10.2f %10.2f %10.2f %10.2f %10.2f\n", name, h->count,
+            sec > 0 ? h->count / sec : 0.0, errors,
+            lat_hist_mean(h) / 1e3,
+            lat_hist_percentile(h, 50.0) / 1e3,
+            lat_hist_percentile(h, 99.0) / 1e3,
+            lat_hist_percentile(h, 99.9) / 1e3,
+            h->max / 1e3);
+}
+
+static void lb_print_summary(struct dpfs_hal *hal)
+{
+    if (hal->summary_printed)
+        return;
+    hal->summary_printed = true;
+
+    double sec = 0;
+    for (uint16_t i = 0; i < hal->nthreads; i++) {
+        struct lb_generator *g = &hal->generators[i];
+        if (g->failed)
+            continue;
+        double gsec = lb_ts_diff_ns(&g->begin, &g->end) / 1e9;
+        if (gsec > sec)
+            sec = gsec;
+    }
+
+    struct lat_hist *total = malloc(sizeof(*total));
+    struct lat_hist *op = malloc(sizeof(*op));
+    if (!total || !op) {
+        free(total);
+        free(op);
+        return;
+    }
+    lat_hist_init(total);
+    uint64_t total_errors = 0;
+
+    printf("DPFS-HAL loopback: workload \"%s\" on %d devices, queue depth %u, %u threads, %.2f seconds\n",
+            hal->workload_name, hal->ndevices, hal->queue_depth, hal->nthreads, sec);
+    printf("%-10s %12s %12s %8s %10s %10s %10s %10s %10s\n", "opcode", "count", "IOPS", "errors",
+            "avg(us)", "p50(us)", "p99(us)", "p999(us)", "max(us)");
+    for (uint32_t o = 0; o <= LB_MAX_OPCODE; o++) {
+        lat_hist_init(op);
+        uint64_t errors = 0;
+        for (uint16_t i = 0; i < hal->nthreads; i++) {
+            if (hal->generators[i].hist[o])
+                lat_hist_merge(op, hal->generators[i].hist[o]);
+            errors += hal->generators[i].op_errors[o];
+        }
+        if (op->count == 0)
+            continue;
+        lb_print_row(lb_opcode_name(o), op, errors, sec);
+        lat_hist_merge(total, op);
+        total_errors += errors;
+    }
+    lb_print_row("total", total, total_errors, sec);
+
+    free(total);
+    free(op);
+}
+
+struct dpfs_hal_loop_thread {
+    pthread_t thread;
+    size_t thread_id;
+    struct dpfs_hal *hal;
+};
+
+static void *dpfs_hal_loop_static_thread(void *arg)
+{
+    struct dpfs_hal_loop_thread *ht = arg;
+    struct dpfs_hal *hal = ht->hal;
+
+    // Store the thread_id in thread local storage so that the FUSE implementation
+    // knows what thread number its in when called with a request
+    pthread_setspecific(dpfs_hal_thread_id_key, (void *) ht->thread_id);
+    stats_shm_thread_init(ht->thread_id);
+
+    int ret = placement_pin(hal->thread_cpus[ht->thread_id]);
+    if (ret) {
+        errno = -ret;
+        warn("Could not set the CPU affinity of polling thread %lu. DPFS thread %lu will continue not pinned.", ht->thread_id, ht->thread_id);
+    }
+
+    size_t devices_start, devices_end;
+    lb_device_window(hal, ht->thread_id, &devices_start, &devices_end);
+
+    while (!all_devices_suspended(hal)) {
+        // don't call usleep(0) because it adds a huge overhead to polling
+        if (hal->polling_interval_usec > 0)
+            usleep(hal->polling_interval_usec);
+        int n = 0;
+        for (size_t i = devices_start; i < devices_end; i++) {
+            n += lb_progress_device(&hal->devices[i]);
+        }
+        dpfs_stats_poll(stats_shm, ht->thread_id, n);
+
+        if (n == 0 && hal->idle_wait > 0) {
+            uint64_t start = cycles_now();
+            if (devices_end - devices_start == 1) {
+                struct lb_device *dev = &hal->devices[devices_start];
+                cycles_monitor_wait(&dev->avail_prod, dev->avail_cons, start + hal->idle_wait);
+            } else {
+                cycles_wait(start + hal->idle_wait);
+            }
+            dpfs_stats_idle(stats_shm, ht->thread_id, (cycles_now() - start) * 1000 / cycles_per_usec(), 0);
+        }
+    }
+
+    return NULL;
+}
+
+static void dpfs_hal_loop_static(struct dpfs_hal *hal)
+{
+    struct sigaction act;
+    memset(&act, 0, sizeof(act));
+    act.sa_handler = signal_handler;
+    sigaction(SIGINT, &act, 0);
+    sigaction(SIGPIPE, &act, 0);
+    sigaction(SIGTERM, &act, 0);
+
+    struct dpfs_hal_loop_thread tdatas[hal->nthreads];
+
+    for (int i = 0; i < hal->nthreads; i++) {
+        tdatas[i].thread_id = i;
+        tdatas[i].hal = hal;
+        if (pthread_create(&tdatas[i].thread, NULL, dpfs_hal_loop_static_thread, &tdatas[i])) {
+            warn("Failed to create thread for io %d", i);
+            keep_running = 0;
+            for (int j = 0; j < i; j++) {
+                pthread_cancel(tdatas[j].thread);
+            }
+            return;
+        }
+    }
+
+    printf("DPFS-HAL loopback: All device pollers are up and running.\n");
+
+    // Wait for all the polling threads to stop
+    for (int i = 0; i < hal->nthreads; i++) {
+        pthread_join(tdatas[i].thread, NULL);
+    }
+
+    lb_join_generators(hal);
+    lb_print_summary(hal);
+}
+
+__attribute__((visibility("default")))
+void dpfs_hal_loop(struct dpfs_hal *hal)
+{
+    start_low_latency();
+
+    dpfs_hal_loop_static(hal);
+
+    stop_low_latency();
+}
+
+static int lb_init_dev(struct dpfs_hal *hal, struct lb_device *dev, uint16_t device_id)
+{
+    dev->device_id = device_id;
+    dev->qd = hal->queue_depth;
+    dev->hal = hal;
+    dev->slots = calloc(dev->qd, sizeof(*dev->slots));
+    dev->avail = calloc(dev->qd, sizeof(*dev->avail));
+    if (!dev->slots || !dev->avail)
+        goto err;
+
+    for (uint32_t i = 0; i < dev->qd; i++) {
+        struct lb_slot *s = &dev->slots[i];
+        s->dev = dev;
+        s->idx = i;
+        if (posix_memalign(&s->data, LB_DATA_ALIGN, hal->block_size))
+            goto err;
+        memset(s->data, 0xA5, hal->block_size);
+    }
+
+    if (hal->dax_window_size) {
+        // Only reserved, the backend maps files into it
+        dev->dax_window = mmap(NULL, hal->dax_window_size, PROT_NONE,
+                MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+        if (dev->dax_window == MAP_FAILED) {
+            dev->dax_window = NULL;
+            goto err;
+        }
+    }
+
+    if (hal->ops.register_device)
+        hal->ops.register_device(hal->user_data, device_id);
+
+    return 0;
+err:
+    fprintf(stderr, "%s: couldn't allocate memory for loopback device %u\n", __func__, device_id);
+    if (dev->slots) {
+        for (uint32_t i = 0; i < dev->qd; i++)
+            free(dev->slots[i].data);
+    }
+    free(dev->slots);
+    free(dev->avail);
+    return -1;
+}
+
+static void lb_destroy_dev(struct lb_device *dev)
+{
+    struct dpfs_hal *hal = dev->hal;
+
+    if (hal->ops.unregister_device)
+        hal->ops.unregister_device(hal->user_data, dev->device_id);
+
+    for (uint32_t i = 0; i < dev->qd; i++)
+        free(dev->slots[i].data);
+    free(dev->slots);
+    free(dev->avail);
+    if (dev->dax_window)
+        munmap(dev->dax_window, hal->dax_window_size);
+}
+
+static int lb_parse_workload(const char *s, enum lb_workload *w)
+{
+    if (strcmp(s, "getattr") == 0)
+        *w = LB_WORKLOAD_GETATTR;
+    else if (strcmp(s, "statfs") == 0)
+        *w = LB_WORKLOAD_STATFS;
+    else if (strcmp(s, "lookup") == 0)
+        *w = LB_WORKLOAD_LOOKUP;
+    else if (strcmp(s, "read") == 0)
+        *w = LB_WORKLOAD_READ;
+    else if (strcmp(s, "write") == 0)
+        *w = LB_WORKLOAD_WRITE;
+    else if (strcmp(s, "rw") == 0)
+        *w = LB_WORKLOAD_RW;
+    else
+        return -1;
+    return 0;
+}
+
+// Same placement as the SNAP HAL, the hal_pollers of [placement] or by default thread 0 occupies the last core.
+// The load generators may not share a CPU with any DPFS thread either
+static int lb_resolve_thread_cpus(const struct placement *p, int nthreads, int *cpus, toml_array_t *generator_cpus)
+{
+    long num_cpus = sysconf(_SC_NPROCESSORS_CONF);
+
+    if (p->ncpus[PLACEMENT_HAL_POLLERS] > 0 && p->ncpus[PLACEMENT_HAL_POLLERS] != nthreads) {
+        fprintf(stderr, "%s: [placement] hal_pollers must contain a CPU for each of the nthreads polling threads!\n", __func__);
+        return -EINVAL;
+    }
+    for (int i = 0; i < nthreads; i++) {
+        int cpu = placement_cpu(p, PLACEMENT_HAL_POLLERS, i);
+        if (cpu == -1)
+            cpu = num_cpus - 1 - i;
+        if (cpu < 0 || placement_conflicts(p, PLACEMENT_HAL_POLLERS, cpu)) {
+            fprintf(stderr, "%s: polling thread %d would run on CPU %d, which is not available."
+                    " Hint: set hal_pollers in [placement]\n", __func__, i, cpu);
+            return -EINVAL;
+        }
+        cpus[i] = cpu;
+    }
+    for (int i = 0; i < toml_array_nelem(generator_cpus); i++) {
+        int cpu = toml_int_at(generator_cpus, i).u.i;
+        bool overlap = placement_conflicts(p, PLACEMENT_HAL_POLLERS, cpu);
+        for (int j = 0; j < nthreads; j++)
+            overlap |= cpus[j] == cpu;
+        if (overlap) {
+            fprintf(stderr, "%s: load generator %d cannot run on CPU %d, it is used by DPFS\n", __func__, i, cpu);
+            return -EINVAL;
+        }
+    }
+    return 0;
+}
+
+__attribute__((visibility("default")))
+struct dpfs_hal *dpfs_hal_new(struct dpfs_hal_params *params, bool start_mock_thread)
+{
+    FILE *fp;
+    char errbuf[200];
+
+    // 1. Read and parse toml file
+    fp = fopen(params->conf_path, "r");
+    if (!fp) {
+        fprintf(stderr, "%s: cannot open %s - %s", __func__,
+                params->conf_path, strerror(errno));
+        return NULL;
+    }
+
+    toml_table_t *conf = toml_parse_file(fp, errbuf, sizeof(errbuf));
+    fclose(fp);
+
+    if (!conf) {
+        fprintf(stderr, "%s: cannot parse - %s", __func__, errbuf);
+        return NULL;
+    }
+
+    // 2. The threading and queue parameters are shared with the SNAP HAL
+    toml_table_t *snap_conf = toml_table_in(conf, "snap_hal");
+    if (!snap_conf) {
+        fprintf(stderr, "%s: missing [snap_hal] in hal config", __func__);
+        goto out_conf;
+    }
+    toml_table_t *lb_conf = toml_table_in(conf, "loopback_hal");
+    if (!lb_conf) {
+        fprintf(stderr, "%s: missing [loopback_hal] in hal config", __func__);
+        goto out_conf;
+    }
+
+    toml_datum_t qd = toml_int_in(snap_conf, "queue_depth");
+    if (!qd.ok || qd.u.i < 1 || qd.u.i > UINT16_MAX || (qd.u.i & (qd.u.i - 1))) {
+        fprintf(stderr, "%s: queue_depth must be a power of 2 and >= 1\n!", __func__);
+        goto out_conf;
+    }
+    toml_datum_t nthreads = toml_int_in(snap_conf, "nthreads");
+    if (!nthreads.ok || nthreads.u.i < 1) {
+        fprintf(stderr, "%s: nthreads must be >= 1!", __func__);
+        goto out_conf;
+    }
+    toml_datum_t polling_interval = toml_int_in(snap_conf, "polling_interval_usec");
+    if (!polling_interval.ok || polling_interval.u.i < 0 ) {
+        fprintf(stderr, "%s: polling_interval_usec must be >= 0\n!", __func__);
+        goto out_conf;
+    }
+    toml_datum_t ndevices = toml_int_in(lb_conf, "ndevices");
+    if (!ndevices.ok || ndevices.u.i < 1 || ndevices.u.i > UINT16_MAX) {
+        fprintf(stderr, "%s: ndevices must be >= 1!\n", __func__);
+        goto out_conf;
+    }
+    if (nthreads.u.i > ndevices.u.i) {
+        fprintf(stderr, "%s: nthreads value invalid! there cannot be more threads than loopback devices\n", __func__);
+        goto out_conf;
+    }
+    toml_datum_t workload = toml_string_in(lb_conf, "workload");
+    enum lb_workload w;
+    if (!workload.ok || lb_parse_workload(workload.u.s, &w)) {
+        fprintf(stderr, "%s: workload must be one of getattr, statfs, lookup, read, write or rw!\n", __func__);
+        if (workload.ok)
+            free(workload.u.s);
+        goto out_conf;
+    }
+    toml_datum_t file = toml_string_in(lb_conf, "file");
+    if (w >= LB_WORKLOAD_LOOKUP && (!file.ok || strlen(file.u.s) == 0 || strlen(file.u.s) >= LB_MAX_NAME)) {
+        fprintf(stderr, "%s: the lookup and I/O workloads require `file`, a file in the root of the file system!\n", __func__);
+        goto out_workload;
+    }
+    toml_datum_t block_size = toml_int_in(lb_conf, "block_size");
+    if (!block_size.ok || block_size.u.i < 1 || block_size.u.i > (1 << 20)) {
+        fprintf(stderr, "%s: block_size must be between 1 and 1MiB!\n", __func__);
+        goto out_file;
+    }
+    toml_datum_t file_size = toml_int_in(lb_conf, "file_size");
+    if (w >= LB_WORKLOAD_READ && (!file_size.ok || file_size.u.i < block_size.u.i)) {
+        fprintf(stderr, "%s: file_size must be >= block_size for the I/O workloads!\n", __func__);
+        goto out_file;
+    }
+    toml_datum_t duration = toml_int_in(lb_conf, "duration_sec");
+    if (!duration.ok || duration.u.i < 0) {
+        fprintf(stderr, "%s: duration_sec must be >= 0\n", __func__);
+        goto out_file;
+    }
+    toml_datum_t report_interval = toml_int_in(lb_conf, "report_interval_sec");
+    if (!report_interval.ok || report_interval.u.i < 0) {
+        fprintf(stderr, "%s: report_interval_sec must be >= 0\n", __func__);
+        goto out_file;
+    }
+    toml_datum_t idle_wait = toml_int_in(lb_conf, "idle_wait_usec"); // optional
+    if (idle_wait.ok && idle_wait.u.i < 0) {
+        fprintf(stderr, "%s: idle_wait_usec must be >= 0\n", __func__);
+        goto out_file;
+    }
+    toml_datum_t dax_window_size = toml_int_in(lb_conf, "dax_window_size"); // optional
+    if (dax_window_size.ok && (dax_window_size.u.i < 0 || dax_window_size.u.i % getpagesize())) {
+        fprintf(stderr, "%s: dax_window_size must be a multiple of the page size!\n", __func__);
+        goto out_file;
+    }
+    toml_array_t *generator_cpus = toml_array_in(lb_conf, "generator_cpus"); // optional
+    if (generator_cpus && toml_array_nelem(generator_cpus) > 0 &&
+            (toml_array_kind(generator_cpus) != 'v' || toml_array_nelem(generator_cpus) != nthreads.u.i)) {
+        fprintf(stderr, "%s: the optional generator_cpus must be an array with a CPU id for each of the nthreads load generators!\n", __func__);
+        goto out_file;
+    }
+    struct placement placement;
+    if (placement_parse(conf, &placement)) {
+        goto out_file;
+    }
+
+    struct dpfs_hal *hal = calloc(1, sizeof(struct dpfs_hal));
+    hal->polling_interval_usec = polling_interval.u.i;
+    hal->idle_wait = idle_wait.ok ? idle_wait.u.i * cycles_per_usec() : 0;
+    hal->user_data = params->user_data;
+    hal->ops = params->ops;
+    hal->nthreads = nthreads.u.i;
+    hal->queue_depth = qd.u.i;
+    hal->workload = w;
+    hal->workload_name = workload.u.s;
+    hal->file = file.ok ? file.u.s : NULL;
+    hal->block_size = block_size.u.i;
+    hal->file_size = file_size.ok ? file_size.u.i : 0;
+    hal->duration_sec = duration.u.i;
+    hal->report_interval_sec = report_interval.u.i;
+    hal->dax_window_size = dax_window_size.ok ? dax_window_size.u.i : 0;
+    hal->ndevices = ndevices.u.i;
+    toml_datum_t stats_shm_name = toml_string_in(snap_conf, "stats_shm_name"); // optional
+    if (stats_shm_name.ok && stats_shm_name.u.s[0] != '\0')
+        hal->stats_shm_name = stats_shm_name.u.s;
+    else if (stats_shm_name.ok)
+        free(stats_shm_name.u.s);
+    hal->devices = calloc(hal->ndevices, sizeof(*hal->devices));
+    hal->generators = calloc(hal->nthreads, sizeof(*hal->generators));
+    hal->thread_cpus = calloc(hal->nthreads, sizeof(*hal->thread_cpus));
+    if (!hal->devices || !hal->generators || !hal->thread_cpus) {
+        fprintf(stderr, "%s: couldn't allocate memory for the loopback devices\n", __func__);
+        goto out;
+    }
+    if (lb_resolve_thread_cpus(&placement, hal->nthreads, hal->thread_cpus, generator_cpus)) {
+        goto out;
+    }
+
+    // Initialize the thread-local key we use to tell each of the polling threads,
+    // which thread id it has
+    if (pthread_key_create(&dpfs_hal_thread_id_key, NULL)) {
+        fprintf(stderr, "Failed to create thread-local key for dpfs_hal threadid\n");
+        goto out;
+    }
+
+    if (hal->stats_shm_name && stats_shm_create(hal->stats_shm_name, "loopback", hal->nthreads, hal->ndevices)) {
+        goto out;
+    }
+
+    for (uint16_t i = 0; i < hal->ndevices; i++) {
+        if (lb_init_dev(hal, &hal->devices[i], i)) {
+            for (uint16_t j = 0; j < i; j++) {
+                lb_destroy_dev(&hal->devices[j]);
+            }
+            goto out_stats;
+        }
+    }
+
+    // The generators are started right away, their requests simply wait in the virtqueues
+    // until the backend starts polling. This way the HAL also works without `dpfs_hal_loop`
+    for (uint16_t i = 0; i < hal->nthreads; i++) {
+        struct lb_generator *g = &hal->generators[i];
+        g->id = i;
+        g->hal = hal;
+        g->cpu = generator_cpus && toml_array_nelem(generator_cpus) > 0 ?
+            toml_int_at(generator_cpus, i).u.i : -1;
+        g->rng = 0x9E3779B97F4A7C15ULL * (i + 1);
+        lb_device_window(hal, i, &g->devices_start, &g->devices_end);
+        if (pthread_create(&g->thread, NULL, lb_generator_thread, g)) {
+            warn("Failed to create load generator thread %u", i);
+            keep_running = 0;
+            lb_join_generators(hal);
+            for (uint16_t j = 0; j < hal->ndevices; j++) {
+                lb_destroy_dev(&hal->devices[j]);
+            }
+            goto out_stats;
+        }
+        g->running = true;
+    }
+
+    printf("DPFS HAL with software loopback frontend online!\n");
+    printf("Running workload \"%s\" on %d loopback devices with queue depth %u\n",
+            hal->workload_name, hal->ndevices, hal->queue_depth);
+    placement_print(&placement);
+    for (uint16_t i = 0; i < hal->nthreads; i++)
+        printf("DPFS-HAL loopback: polling thread %u runs on CPU %d\n", i, hal->thread_cpus[i]);
+
+    toml_free(conf);
+    return hal;
+
+out_stats:
+    if (hal->stats_shm_name)
+        stats_shm_destroy(hal->stats_shm_name);
+out:
+    free(hal->stats_shm_name);
+    free(hal->thread_cpus);
+    free(hal->devices);
+    free(hal->generators);
+    free(hal);
+out_file:
+    if (file.ok)
+        free(file.u.s);
+out_workload:
+    free(workload.u.s);
+out_conf:
+    toml_free(conf);
+    return NULL;
+}
+
+__attribute__((visibility("default")))
+void dpfs_hal_destroy(struct dpfs_hal *hal)
+{
+    printf("DPFS HAL destroying %d loopback devices\n", hal->ndevices);
+
+    keep_running = 0;
+    // The backend might not have polled since, so keep the devices going until they are drained
+    while (!all_devices_suspended(hal)) {
+        for (uint16_t i = 0; i < hal->ndevices; i++)
+            lb_progress_device(&hal->devices[i]);
+    }
+    lb_join_generators(hal);
+    lb_print_summary(hal);
+
+    for (uint16_t i = 0; i < hal->ndevices; i++) {
+        lb_destroy_dev(&hal->devices[i]);
+    }
+    for (uint16_t i = 0; i < hal->nthreads; i++) {
+        for (uint32_t o = 0; o <= LB_MAX_OPCODE; o++)
+            free(hal->generators[i].hist[o]);
+    }
+
+    if (hal->stats_shm_name)
+        stats_shm_destroy(hal->stats_shm_name);
+
+    free(hal->stats_shm_name);
+    free(hal->thread_cpus);
+    free(hal->devices);
+    free(hal->generators);
+    free(hal->workload_name);
+    free(hal->file);
+    free(hal);
+}
+
+#endif // DPFS_LOOPBACK
@@ -9,11 +9,20 @@
 #if defined(DPFS_RVFS)
 
 #include <vector>
+#include <string>
+#include <algorithm>
 #include <iostream>
 #include <memory>
+#include <mutex>
+#include <thread>
+#include <atomic>
 #include <linux/fuse.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include "hal.h"
 #include "rvfs.h"
+#include "rvfs_shm.h"
 #include "rpc.h"
 #include "util/tls_registry.h"
 #include "tomlcpp.hpp"
@@ -26,20 +35,21 @@ using namespace erpc;
 pthread_key_t dpfs_hal_thread_id_key;
 __attribute__((visibility("default")))
 uint16_t dpfs_hal_thread_id(void) {
-    return (uint16_t) pthread_getspecific(dpfs_hal_thread_id_key);
-}
-__attribute__((visibility("default")))
-uint16_t dpfs_hal_nthreads(struct dpfs_hal *hal)
-{
-    return 1;
+    return (uint16_t) (uintptr_t) pthread_getspecific(dpfs_hal_thread_id_key);
 }
 
+struct dpfs_hal_worker;
+
 struct rpc_msg {
-    // Back reference to dpfs_hal for the async_completion
-    dpfs_hal *hal;
+    // Back reference to the worker that received the request, for the async_completion
+    dpfs_hal_worker *worker;
 
     // Only filled if the msg is in use, if so it will point to req internally
     ReqHandle *reqh;
+    // The response buffer of reqh that the reply is in, see alloc_resp()
+    MsgBuffer *resp;
+    // With the shm transport instead of reqh, the slot the request and reply are in
+    int slot;
 
     // Based on the max block size of 1MiB (4k pages, so 256 descriptors) and 3 page overhead per request.
     // These will point into the req and resp buffers.
@@ -47,46 +57,134 @@ struct rpc_msg {
     int in_iovcnt;
     int out_iovcnt;
 
-    rpc_msg(dpfs_hal *hal) : hal(hal), reqh(nullptr),
-        iov{{0}}, in_iovcnt(0), out_iovcnt(0)
+    // A request of a DPFS_RVFS_REQTYPE_FUSE_BATCH message: the msg that holds the reqh of the batch,
+    // and where the length of the reply goes
+    rpc_msg *batch;
+    uint32_t *resp_len;
+    // Of the batch msg: the requests that haven't completed yet and the size of the reply
+    std::atomic<uint16_t> pending;
+    size_t resp_size;
+
+    rpc_msg(dpfs_hal_worker *w) : worker(w), reqh(nullptr), resp(nullptr), slot(-1),
+        iov{{0}}, in_iovcnt(0), out_iovcnt(0), batch(nullptr), resp_len(nullptr), pending(0), resp_size(0)
     {}
 };
 
+// A DPFS thread with its own eRPC endpoint, the Rpc id is the thread id.
+// The DPU opens a session to every worker and spreads its requests over them.
+// With the shm transport every worker has its own ring pair instead, the ring pair id is the thread id
+struct dpfs_hal_worker {
+    uint16_t id;
+    dpfs_hal *hal;
+    std::unique_ptr<Rpc<CTransport>> rpc;
+    // The completion ring has a single producer, but requests can complete on any thread
+    std::mutex cq_lock;
+    // Only touched by the worker itself
+    std::vector<rpc_msg *> avail;
+    // Messages that were completed on other threads (e.g. the io_uring cq threads),
+    // the worker takes them back once avail runs empty
+    std::mutex returned_lock;
+    std::vector<rpc_msg *> returned;
+    std::thread thread;
+
+    dpfs_hal_worker(uint16_t id, dpfs_hal *hal) : id(id), hal(hal) {}
+};
+
 struct dpfs_hal {
     dpfs_hal_ops ops;
     void *user_data;
 
-    // eRPC
-    std::vector<rpc_msg *> avail;
+    // eRPC, or the shared memory segment of rvfs_dpu if transport = "shm"
     std::unique_ptr<Nexus> nexus;
-    std::unique_ptr<Rpc<CTransport>> rpc;
+    dpfs_rvfs_shm_hdr *shm;
+    size_t shm_size;
+    // Worker 0 runs on the thread that created the HAL, the others are started by dpfs_hal_loop
+    std::vector<std::unique_ptr<dpfs_hal_worker>> workers;
 
     dpfs_hal(dpfs_hal_ops o, void *ud) :
-        ops(o), user_data(ud), avail() {}
+        ops(o), user_data(ud), shm(nullptr), shm_size(0) {}
 };
-    
-static void req_handler(ReqHandle *reqh, void *context)
+
+// The worker of the calling thread, nullptr on threads that aren't workers
+static thread_local dpfs_hal_worker *dpfs_hal_self = nullptr;
+
+__attribute__((visibility("default")))
+uint16_t dpfs_hal_nthreads(struct dpfs_hal *hal)
+{
+    return hal->workers.size();
+}
+
+// The DPU decides how many requests it sends
+__attribute__((visibility("default")))
+size_t dpfs_hal_max_inflight(struct dpfs_hal *)
+{
+    return 0;
+}
+
+// The window would have to be in the memory of the host that runs rvfs_dpu, RVFS only carries requests
+__attribute__((visibility("default")))
+int dpfs_hal_dax_window(struct dpfs_hal *, uint16_t, void **, uint64_t *)
+{
+    return -ENOTSUP;
+}
+
+// Messages are taken from the cache of the worker that received the request
+static rpc_msg *get_msg(dpfs_hal_worker *w)
 {
-    dpfs_hal *hal = static_cast<dpfs_hal *>(context);
     // Messages and their buffers are dynamically allocated
     // The queue_depth of the virtio-fs device is static, so this wont infinitely allocate memory
     // Just be sure to warm up the system before evaulating performance
+    if (w->avail.empty()) {
+        std::lock_guard<std::mutex> lock(w->returned_lock);
+        w->avail.swap(w->returned);
+    }
     rpc_msg *msg;
-    if (hal->avail.empty()) {
-        msg = new rpc_msg(hal);
+    if (w->avail.empty()) {
+        msg = new rpc_msg(w);
     } else {
-        msg = hal->avail.back();
-        hal->avail.pop_back();
+        msg = w->avail.back();
+        w->avail.pop_back();
     }
+    return msg;
+}
 
-#ifdef DEBUG_ENABLED
-    printf("DPFS_HAL_RVFS %s: received eRPC in msg %p\n", __func__, msg);
-#endif
+static void complete_msg(rpc_msg *msg);
 
-    msg->reqh = reqh;
+static void handle_msg(dpfs_hal *hal, rpc_msg *msg)
+{
+    int ret = hal->ops.request_handler(hal->user_data,
+            msg->iov, msg->in_iovcnt,
+            msg->iov+msg->in_iovcnt, msg->out_iovcnt,
+            static_cast<void *>(msg), 0);
+
+    // Do nothing on EWOULDBLOCK, the FS impl has to call async_completion themselves
+    if (ret != EWOULDBLOCK)
+        complete_msg(msg);
+}
+
+// Replies that fit go in the response buffer that eRPC preallocated (DPFS_RVFS_MSGBUF_MEDIUM),
+// larger ones in a buffer of the eRPC allocator, which eRPC frees once the reply is sent
+static uint8_t *alloc_resp(dpfs_hal_worker *w, rpc_msg *msg, size_t size)
+{
+    // rvfs_dpu sized the slot for the reply
+    if (msg->slot >= 0) {
+        dpfs_rvfs_shm_hdr *shm = w->hal->shm;
+        return dpfs_rvfs_shm_slot_resp(shm, dpfs_rvfs_shm_get_slot(shm, msg->slot));
+    }
+
+    ReqHandle *reqh = msg->reqh;
+    if (size <= DPFS_RVFS_MSGBUF_MEDIUM) {
+        msg->resp = &reqh->pre_resp_msgbuf_;
+    } else {
+        reqh->dyn_resp_msgbuf_ = w->rpc->alloc_msg_buffer_or_die(size);
+        msg->resp = &reqh->dyn_resp_msgbuf_;
+    }
+    return msg->resp->buf_;
+}
 
-    uint8_t *req_buf = reqh->get_req_msgbuf()->buf_;
-    uint8_t *resp_buf = reqh->pre_resp_msgbuf_.buf_;
+// Wire format 1
+static void handle_req(dpfs_hal_worker *w, rpc_msg *msg, uint8_t *req_buf)
+{
 
     // Load the input io vectors
     msg->in_iovcnt = *((int *) req_buf);
@@ -108,28 +206,216 @@ static void req_handler(ReqHandle *reqh, void *context)
     msg->out_iovcnt = *((int *) req_buf);
     req_buf += sizeof(msg->out_iovcnt);
     
+    size_t resp_size = 0;
     for (; i < msg->in_iovcnt + msg->out_iovcnt; i++) {
         size_t iov_len = *((size_t *) req_buf);
         req_buf += sizeof(iov_len);
 
+        msg->iov[i].iov_len = iov_len;
+        resp_size += iov_len;
+    }
+
+    // Directly map into the NIC buffer for zero copy
+    uint8_t *resp_buf = alloc_resp(w, msg, resp_size);
+    for (i = msg->in_iovcnt; i < msg->in_iovcnt + msg->out_iovcnt; i++) {
+        msg->iov[i].iov_base = resp_buf;
+        resp_buf += msg->iov[i].iov_len;
+    }
+
+    handle_msg(w->hal, msg);
+}
+
+// The sum of the output descriptor lengths of a format 2 request
+static size_t sg_resp_size(const uint8_t *req_buf)
+{
+    const dpfs_rvfs_sg_hdr *hdr = reinterpret_cast<const dpfs_rvfs_sg_hdr *>(req_buf);
+    size_t size = 0;
+    for (int i = hdr->in_iovcnt; i < hdr->in_iovcnt + hdr->out_iovcnt; i++)
+        size += hdr->len[i];
+    return size;
+}
+
+// Maps the iovecs of msg onto a format 2 request in req and its reply in resp,
+// returns the size of the reply buffer
+static size_t map_sg(rpc_msg *msg, uint8_t *req_buf, uint8_t *resp_buf)
+{
+    uint8_t *resp_start = resp_buf;
+    const dpfs_rvfs_sg_hdr *hdr = reinterpret_cast<const dpfs_rvfs_sg_hdr *>(req_buf);
+    msg->in_iovcnt = hdr->in_iovcnt;
+    msg->out_iovcnt = hdr->out_iovcnt;
+    int iovcnt = msg->in_iovcnt + msg->out_iovcnt;
+
+    uint8_t *seg = req_buf + dpfs_rvfs_sg_hdr_size(iovcnt);
+    for (int i = 0; i < msg->in_iovcnt; i++) {
         // Directly map into the NIC buffer for zero copy
+        msg->iov[i].iov_base = seg;
+        msg->iov[i].iov_len = hdr->len[i];
+        seg += dpfs_rvfs_seg_align(hdr->len[i]);
+    }
+    // The response is packed, the DPU copies it out in one pass
+    for (int i = msg->in_iovcnt; i < iovcnt; i++) {
         msg->iov[i].iov_base = resp_buf;
-        msg->iov[i].iov_len = iov_len;
+        msg->iov[i].iov_len = hdr->len[i];
+        resp_buf += hdr->len[i];
+    }
 
-        resp_buf += iov_len;
+    return resp_buf - resp_start;
+}
+
+// Wire format 2, the lengths come first so the segments are mapped without walking the message
+static void handle_req_sg(dpfs_hal_worker *w, rpc_msg *msg, uint8_t *req_buf)
+{
+    map_sg(msg, req_buf, alloc_resp(w, msg, sg_resp_size(req_buf)));
+
+    handle_msg(w->hal, msg);
+}
+
+// The requests are only handed to the backend once they are all mapped, so that the reply
+// isn't sent before the size of it is known
+static void handle_req_batch(dpfs_hal_worker *w, rpc_msg *batch, uint8_t *req_buf)
+{
+    const dpfs_rvfs_batch_hdr *hdr = reinterpret_cast<const dpfs_rvfs_batch_hdr *>(req_buf);
+    uint16_t nreqs = std::min<uint16_t>(hdr->nreqs, DPFS_RVFS_BATCH_MAX_REQS);
+
+    size_t resp_size = DPFS_RVFS_BATCH_RESP_HDR_SIZE;
+    uint8_t *req = req_buf + DPFS_RVFS_BATCH_HDR_SIZE;
+    for (uint16_t i = 0; i < nreqs; i++) {
+        resp_size += dpfs_rvfs_seg_align(sg_resp_size(req));
+        req += hdr->len[i];
     }
+    uint8_t *resp_buf = alloc_resp(w, batch, resp_size);
+    uint32_t *resp_lens = reinterpret_cast<uint32_t *>(resp_buf);
 
-    int ret = hal->ops.request_handler(hal->user_data,
-            msg->iov, msg->in_iovcnt,
-            msg->iov+msg->in_iovcnt, msg->out_iovcnt,
-            static_cast<void *>(msg), 0);
+#ifdef DEBUG_ENABLED
+    printf("DPFS_HAL_RVFS %s: received a batch of %u requests in msg %p\n", __func__, nreqs, batch);
+#endif
 
-    if (ret == 0) {
-        dpfs_hal_async_complete(msg, DPFS_HAL_COMPLETION_SUCCES);
-    } else if (ret == EWOULDBLOCK) {
-        // Do nothing, the FS impl has to call async_completion themselves
-    } else {
-        dpfs_hal_async_complete(msg, DPFS_HAL_COMPLETION_ERROR);
+    rpc_msg *msgs[DPFS_RVFS_BATCH_MAX_REQS];
+    req = req_buf + DPFS_RVFS_BATCH_HDR_SIZE;
+    uint8_t *resp = resp_buf + DPFS_RVFS_BATCH_RESP_HDR_SIZE;
+    for (uint16_t i = 0; i < nreqs; i++) {
+        rpc_msg *msg = get_msg(w);
+        msg->reqh = nullptr;
+        msg->slot = -1;
+        msg->batch = batch;
+        msg->resp_len = &resp_lens[i];
+        resp += dpfs_rvfs_seg_align(map_sg(msg, req, resp));
+        req += hdr->len[i];
+        msgs[i] = msg;
+    }
+    batch->resp_size = resp - resp_buf;
+    batch->pending.store(nreqs, std::memory_order_relaxed);
+
+    for (uint16_t i = 0; i < nreqs; i++)
+        handle_msg(w->hal, msgs[i]);
+}
+
+// Takes a msg for a request that eRPC delivered
+static rpc_msg *get_msg_erpc(dpfs_hal_worker *w, ReqHandle *reqh)
+{
+    rpc_msg *msg = get_msg(w);
+#ifdef DEBUG_ENABLED
+    printf("DPFS_HAL_RVFS %s: received eRPC in msg %p\n", __func__, msg);
+#endif
+    msg->reqh = reqh;
+    msg->slot = -1;
+    msg->batch = nullptr;
+    return msg;
+}
+
+static void req_handler(ReqHandle *reqh, void *context)
+{
+    dpfs_hal_worker *w = static_cast<dpfs_hal_worker *>(context);
+    handle_req(w, get_msg_erpc(w, reqh), reqh->get_req_msgbuf()->buf_);
+}
+
+static void req_handler_sg(ReqHandle *reqh, void *context)
+{
+    dpfs_hal_worker *w = static_cast<dpfs_hal_worker *>(context);
+    handle_req_sg(w, get_msg_erpc(w, reqh), reqh->get_req_msgbuf()->buf_);
+}
+
+static void req_handler_batch(ReqHandle *reqh, void *context)
+{
+    dpfs_hal_worker *w = static_cast<dpfs_hal_worker *>(context);
+    handle_req_batch(w, get_msg_erpc(w, reqh), reqh->get_req_msgbuf()->buf_);
+}
+
+// Handles the requests that rvfs_dpu put on the submission ring of the worker
+static void poll_shm(dpfs_hal_worker *w)
+{
+    dpfs_rvfs_shm_hdr *shm = w->hal->shm;
+    uint32_t idx[DPFS_RVFS_BATCH_MAX_REQS];
+    uint32_t n = dpfs_rvfs_shm_pop(shm, dpfs_rvfs_shm_get_ring(shm, w->id, 0), idx, DPFS_RVFS_BATCH_MAX_REQS);
+    for (uint32_t i = 0; i < n; i++) {
+        dpfs_rvfs_shm_slot *slot = dpfs_rvfs_shm_get_slot(shm, idx[i]);
+        rpc_msg *msg = get_msg(w);
+#ifdef DEBUG_ENABLED
+        printf("DPFS_HAL_RVFS %s: received slot %u in msg %p\n", __func__, idx[i], msg);
+#endif
+        msg->reqh = nullptr;
+        msg->slot = idx[i];
+        msg->batch = nullptr;
+        uint8_t *req_buf = dpfs_rvfs_shm_slot_req(slot);
+        switch (slot->req_type) {
+        case DPFS_RVFS_REQTYPE_FUSE:
+            handle_req(w, msg, req_buf);
+            break;
+        case DPFS_RVFS_REQTYPE_FUSE_SG:
+            handle_req_sg(w, msg, req_buf);
+            break;
+        case DPFS_RVFS_REQTYPE_FUSE_BATCH:
+            handle_req_batch(w, msg, req_buf);
+            break;
+        default:
+            std::cerr << "DPFS_HAL_RVFS: unknown request type " << (int) slot->req_type << " in slot "
+                << idx[i] << std::endl;
+            w->avail.push_back(msg);
+            break;
+        }
+    }
+}
+
+// rvfs_dpu creates the segment, so this waits until it is there
+static dpfs_rvfs_shm_hdr *map_shm(const std::string &name, uint16_t host_threads, size_t *size)
+{
+    bool waiting = false;
+    while (true) {
+        int fd = shm_open(name.c_str(), O_RDWR, 0);
+        if (fd == -1 && errno != ENOENT) {
+            std::cerr << "Cannot open shared memory segment " << name << " - " << strerror(errno) << std::endl;
+            return nullptr;
+        }
+        struct stat st;
+        if (fd != -1 && fstat(fd, &st) == 0 && (size_t) st.st_size >= sizeof(dpfs_rvfs_shm_hdr)) {
+            void *p = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+            close(fd);
+            if (p == MAP_FAILED) {
+                std::cerr << "Cannot map shared memory segment " << name << " - " << strerror(errno) << std::endl;
+                return nullptr;
+            }
+            dpfs_rvfs_shm_hdr *hdr = static_cast<dpfs_rvfs_shm_hdr *>(p);
+            if (__atomic_load_n(&hdr->magic, __ATOMIC_ACQUIRE) == DPFS_RVFS_SHM_MAGIC) {
+                if (hdr->version != DPFS_RVFS_SHM_VERSION || hdr->npairs != host_threads
+                        || dpfs_rvfs_shm_size(hdr->nslots, hdr->npairs, hdr->slot_size) > (size_t) st.st_size) {
+                    std::cerr << "The shared memory segment " << name << " doesn't match, is `host_threads` "
+                        << "the same on both sides?" << std::endl;
+                    munmap(p, st.st_size);
+                    return nullptr;
+                }
+                *size = st.st_size;
+                return hdr;
+            }
+            munmap(p, st.st_size);
+        } else if (fd != -1) {
+            close(fd);
+        }
+
+        if (!waiting) {
+            std::cout << "Waiting for rvfs_dpu to create the shared memory segment " << name << std::endl;
+            waiting = true;
+        }
+        usleep(100000);
     }
 }
 
@@ -138,6 +424,15 @@ static void sm_handler(int, SmEventType event, SmErrType err, void *) {
     std::cout << "Event: " << sm_event_type_str(event) << " Error: " << sm_err_type_str(err) << std::endl;
 }
 
+static void create_rpc(dpfs_hal_worker *w)
+{
+    if (w->hal->shm)
+        return;
+    w->rpc = std::unique_ptr<Rpc<CTransport>>(new Rpc<CTransport>(w->hal->nexus.get(), w, w->id, sm_handler));
+    // Most replies fit in the preallocated response buffer, see alloc_resp()
+    w->rpc->set_pre_resp_msgbuf_size(DPFS_RVFS_MSGBUF_MEDIUM);
+}
+
 __attribute__((visibility("default")))
 struct dpfs_hal *dpfs_hal_new(struct dpfs_hal_params *params, bool start_mock_thread) {
     dpfs_hal *hal = new dpfs_hal(params->ops, params->user_data);
@@ -153,38 +448,87 @@ struct dpfs_hal *dpfs_hal_new(struct dpfs_hal_params *params, bool start_mock_th
         delete hal;
         return nullptr;
     }
+    // optional
+    auto [oktr, transport] = conf->getString("transport");
+    if (!oktr)
+        transport = "erpc";
+    if (transport != "erpc" && transport != "shm") {
+        std::cerr << "`transport` must be \"erpc\" or \"shm\"" << std::endl;
+        delete hal;
+        return nullptr;
+    }
     auto [ok, remote_uri] = conf->getString("remote_uri");
-    if (!ok) {
+    if (!ok && transport == "erpc") {
         std::cerr << "The config must contain a `remote_uri` [hostname/ip:UDP_PORT]" << std::endl;
         delete hal;
         return nullptr;
     }
+    // optional
+    auto [oks, shm_name] = conf->getString("shm_name");
+    if (!oks)
+        shm_name = "/dpfs-rvfs";
+    // optional
+    auto [okt, host_threads] = conf->getInt("host_threads");
+    if (!okt)
+        host_threads = 1;
+    if (host_threads < 1 || host_threads > UINT16_MAX) {
+        std::cerr << "`host_threads` must be at least 1" << std::endl;
+        delete hal;
+        return nullptr;
+    }
     if (pthread_key_create(&dpfs_hal_thread_id_key, NULL)) {
         std::cerr << "Failed to create thread-local key for dpfs_hal threadid" << std::endl;
         delete hal;
         return nullptr;
     }
-    // Only one thread, thread_id=0
-    pthread_setspecific(dpfs_hal_thread_id_key, (void *) 0);
 
-    // NUMA node 0
-    // 1 background thread, which is unused but created to enable multithreading in eRPC
-    hal->nexus = std::unique_ptr<Nexus>(new Nexus(remote_uri, 0, 1));
-    hal->nexus->register_req_func(DPFS_RVFS_REQTYPE_FUSE, req_handler);
-    
-    hal->rpc = std::unique_ptr<Rpc<CTransport>>(new Rpc<CTransport>(hal->nexus.get(), hal, 0, sm_handler));
-    // Same as in rvfs_dpu
-    hal->rpc->set_pre_resp_msgbuf_size(DPFS_RVFS_MAX_REQRESP_SIZE);
+    if (transport == "shm") {
+        hal->shm = map_shm(shm_name, host_threads, &hal->shm_size);
+        if (!hal->shm) {
+            delete hal;
+            return nullptr;
+        }
+    } else {
+        // NUMA node 0
+        // 1 background thread, which is unused but created to enable multithreading in eRPC
+        hal->nexus = std::unique_ptr<Nexus>(new Nexus(remote_uri, 0, 1));
+        hal->nexus->register_req_func(DPFS_RVFS_REQTYPE_FUSE, req_handler);
+        hal->nexus->register_req_func(DPFS_RVFS_REQTYPE_FUSE_SG, req_handler_sg);
+        hal->nexus->register_req_func(DPFS_RVFS_REQTYPE_FUSE_BATCH, req_handler_batch);
+    }
+
+    for (uint16_t i = 0; i < host_threads; i++)
+        hal->workers.emplace_back(new dpfs_hal_worker(i, hal));
+    // The calling thread is worker 0, an Rpc has to be created on the thread that polls it
+    dpfs_hal_worker *w = hal->workers[0].get();
+    pthread_setspecific(dpfs_hal_thread_id_key, (void *) 0);
+    dpfs_hal_self = w;
+    create_rpc(w);
 
     hal->ops.register_device(hal->user_data, 0);
 
-    std::cout << "DPFS HAL with RVFS frontend online at " << remote_uri << "!" << std::endl;
+    std::cout << "DPFS HAL with RVFS frontend online at " << (hal->shm ? shm_name : remote_uri) << " with "
+        << host_threads << " threads!" << std::endl;
 
     return hal;
 }
 
 static volatile int keep_running;
 
+// All the requests that eRPC delivers in a single event loop iteration form a batch
+static void run_event_loop_batch(dpfs_hal_worker *w)
+{
+    dpfs_hal *hal = w->hal;
+    if (hal->ops.poll_batch_begin)
+        hal->ops.poll_batch_begin(hal->user_data, 0);
+    if (hal->shm)
+        poll_shm(w);
+    else
+        w->rpc->run_event_loop_once();
+    if (hal->ops.poll_batch_end)
+        hal->ops.poll_batch_end(hal->user_data, 0);
+}
+
 static void signal_handler(int dummy)
 {
     keep_running = 0;
@@ -200,14 +544,33 @@ void dpfs_hal_loop(struct dpfs_hal *hal) {
     sigaction(SIGPIPE, &act, 0);
     sigaction(SIGTERM, &act, 0);
 
+    // The DPU retries the sessions to these workers until their Rpc exists
+    for (size_t i = 1; i < hal->workers.size(); i++) {
+        dpfs_hal_worker *w = hal->workers[i].get();
+        w->thread = std::thread([w]() {
+            pthread_setspecific(dpfs_hal_thread_id_key, (void *) (uintptr_t) w->id);
+            dpfs_hal_self = w;
+            create_rpc(w);
+            while (keep_running) {
+                run_event_loop_batch(w);
+            }
+            // Also destroyed on the thread that created it
+            w->rpc.reset();
+        });
+    }
+
     while(keep_running) {
-        hal->rpc->run_event_loop_once();
+        run_event_loop_batch(hal->workers[0].get());
     }
+
+    for (size_t i = 1; i < hal->workers.size(); i++)
+        hal->workers[i]->thread.join();
 }
 
+// Only polls worker 0, must be called from the thread that created the HAL
 __attribute__((visibility("default")))
 int dpfs_hal_poll_io(struct dpfs_hal *hal, uint16_t) {
-    hal->rpc->run_event_loop_once();
+    run_event_loop_batch(hal->workers[0].get());
     return 0;
 }
 
@@ -215,37 +578,92 @@ int dpfs_hal_poll_io(struct dpfs_hal *hal, uint16_t) {
 __attribute__((visibility("default")))
 void dpfs_hal_poll_mmio(struct dpfs_hal *, uint16_t) {}
 
+__attribute__((visibility("default")))
+void dpfs_hal_poll_mmio_timed(struct dpfs_hal *, uint16_t) {}
+
 __attribute__((visibility("default")))
 void dpfs_hal_destroy(struct dpfs_hal *hal) {
-    while (hal->avail.size()) {
-        rpc_msg *msg = hal->avail.back();
-        hal->avail.pop_back();
-        delete msg;
+    for (auto &w : hal->workers) {
+        for (rpc_msg *msg : w->avail)
+            delete msg;
+        for (rpc_msg *msg : w->returned)
+            delete msg;
     }
 
     hal->ops.unregister_device(hal->user_data, 0);
+    if (hal->shm)
+        munmap(hal->shm, hal->shm_size);
     delete hal;
 }
 
-__attribute__((visibility("default")))
-int dpfs_hal_async_complete(void *completion_context, enum dpfs_hal_completion_status)
+static void put_msg(rpc_msg *msg)
 {
-    rpc_msg *msg = (rpc_msg *) completion_context;
-    dpfs_hal *hal = msg->hal;
+    dpfs_hal_worker *w = msg->worker;
+    if (dpfs_hal_self == w) {
+        w->avail.push_back(msg);
+    } else {
+        std::lock_guard<std::mutex> lock(w->returned_lock);
+        w->returned.push_back(msg);
+    }
+}
+
+// Sends the reply of msg, or of its batch once all the requests in it are complete
+static void complete_msg(rpc_msg *msg)
+{
+    dpfs_hal_worker *w = msg->worker;
+    dpfs_hal *hal = w->hal;
 
 #ifdef DEBUG_ENABLED
     printf("DPFS_HAL_RVFS %s: replying to msg %p\n", __func__, msg);
 #endif
 
-    if (!hal->nexus->tls_registry_.is_init()) {
-        hal->nexus->tls_registry_.init();
+    struct fuse_out_header *fuse_out_header = static_cast<struct fuse_out_header *>(msg->iov[msg->in_iovcnt].iov_base);
+    size_t resp_size = fuse_out_header->len;
+    if (msg->batch) {
+        // The batch is replied to once its last request completes
+        rpc_msg *batch = msg->batch;
+        *msg->resp_len = fuse_out_header->len;
+        put_msg(msg);
+        if (batch->pending.fetch_sub(1, std::memory_order_acq_rel) != 1)
+            return;
+        msg = batch;
+        resp_size = msg->resp_size;
     }
 
-    struct fuse_out_header *fuse_out_header = static_cast<struct fuse_out_header *>(msg->iov[msg->in_iovcnt].iov_base);
-    Rpc<CTransport>::resize_msg_buffer(&msg->reqh->pre_resp_msgbuf_, fuse_out_header->len);
+    if (msg->slot >= 0) {
+        dpfs_rvfs_shm_get_slot(hal->shm, msg->slot)->resp_len = resp_size;
+        std::lock_guard<std::mutex> lock(w->cq_lock);
+        dpfs_rvfs_shm_push(hal->shm, dpfs_rvfs_shm_get_ring(hal->shm, w->id, 1), msg->slot);
+    } else {
+        Rpc<CTransport>::resize_msg_buffer(msg->resp, resp_size);
+        if (!hal->nexus->tls_registry_.is_init()) {
+            hal->nexus->tls_registry_.init();
+        }
+        w->rpc->enqueue_response(msg->reqh, msg->resp);
+    }
+    put_msg(msg);
+}
 
-    hal->rpc->enqueue_response(msg->reqh, &msg->reqh->pre_resp_msgbuf_);
-    hal->avail.push_back(msg);
+__attribute__((visibility("default")))
+int dpfs_hal_async_complete(void *completion_context, enum dpfs_hal_completion_status)
+{
+    rpc_msg *msg = (rpc_msg *) completion_context;
+    dpfs_hal *hal = msg->worker->hal;
+    if (hal->ops.async_done)
+        hal->ops.async_done(hal->user_data, msg);
+    complete_msg(msg);
+    return 0;
+}
+
+// eRPC already batches the transmission of the enqueued responses in its event loop
+__attribute__((visibility("default")))
+int dpfs_hal_async_complete_batch(void **completion_contexts,
+                                  enum dpfs_hal_completion_status *statuses, int n)
+{
+    for (int i = 0; i < n; i++) {
+        dpfs_hal_async_complete(completion_contexts[i],
+                statuses ? statuses[i] : DPFS_HAL_COMPLETION_SUCCES);
+    }
     return 0;
 }
 
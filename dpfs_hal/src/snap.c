@@ -30,7 +30,7 @@
  */
 
 #include "config.h"
-#if defined(HAVE_SNAP) && !defined(DPFS_RVFS)
+#if defined(HAVE_SNAP) && !defined(DPFS_RVFS) && !defined(DPFS_LOOPBACK)
 
 #define _GNU_SOURCE
 #include <stdio.h>
@@ -41,9 +41,11 @@
 #include <stdbool.h>
 #include <err.h>
 #include <string.h>
+#include <time.h>
 #include <sys/errno.h>
 #include <sys/stat.h>
 #include <sys/queue.h>
+#include <linux/fuse.h>
 
 #include "virtio_fs_controller.h"
 #include "nvme_emu_log.h"
@@ -51,23 +53,184 @@
 #include "mlnx_snap_pci_manager.h"
 #include "hal.h"
 #include "cpu_latency.h"
+#include "stats_shm.h"
+#include "placement.h"
+#include "cycles.h"
 #include "toml.h"
 
+// The SNAP poll group of the HiPrio virtqueue, request queue i is in poll group 1 + i
+#define DPFS_HAL_HIPRIO_PG 0
+
+struct dpfs_hal_queue;
+struct dpfs_hal_md_thread;
+
 struct dpfs_hal_device {
     struct virtio_fs_ctrl *snap_ctrl;
     uint16_t device_id;
     uint16_t pf_id;
+    // -1 for a PF
+    int vf_id;
     char *tag;
-
-    uint16_t poll_counter;
+    // PF devices always stay, VF devices come and go when the host enables and disables VFs.
+    // Protected by devices_lock of the HAL
+    bool present;
+    // PFs only, the number of VFs the host has enabled as reported by SNAP
+    int requested_vfs;
+
+    // cycles_now() after which the mmio of the device is due
+    uint64_t mmio_deadline;
+    uint64_t mmio_period;
+    // Until the host driver sends the first request, it is still negotiating with the device
+    bool initialising;
     bool suspending;
+    // The request queues, the thread that polls queues[0] also polls the mmio of the device
+    uint16_t nqueues;
+    struct dpfs_hal_queue *queues;
 
     struct dpfs_hal *hal;
 };
 
+enum dpfs_hal_queue_state {
+    // The slot of a VF device that doesn't exist (right now)
+    DPFS_HAL_QUEUE_ABSENT,
+    DPFS_HAL_QUEUE_ACTIVE,
+    // The device is being removed, its owner must drop the queue
+    DPFS_HAL_QUEUE_REMOVING,
+};
+
+// A request queue of a device. SNAP spreads the virtqueues of a device over one poll group
+// per request queue, which lets multiple threads handle the requests of a single device.
+// The HiPrio virtqueue gets a poll group of its own, that is polled together with queue 0
+struct dpfs_hal_queue {
+    struct dpfs_hal_device *dev;
+    // The SNAP poll group
+    uint16_t queue_id;
+    // The thread that owns this queue
+    uint16_t thread_id;
+    // Set while a thread is polling this queue, with the dynamic scheduler
+    // a queue can be polled by any thread, but only by one at a time
+    bool polling;
+    // Number of polls and the number of polls that found requests
+    uint64_t polls;
+    uint64_t hits;
+
+    enum dpfs_hal_queue_state state;
+    // Set by the owner once it has dropped a REMOVING queue
+    bool released;
+    // Activity polling: whether the queue is in the active set of its owner,
+    // and when the queue last had requests
+    bool active;
+    uint64_t last_hit_ns;
+    // For handing the queues of a hot-added device to their owner
+    struct dpfs_hal_queue *next;
+    // Completion handoff, see dpfs_hal_cpl. cpl_free is only touched by the thread polling the queue,
+    // the other threads push their completions onto handoff
+    struct dpfs_hal_cpl *cpl_free;
+    struct dpfs_hal_cpl *handoff;
+};
+
+// With completion handoff the backend gets a dpfs_hal_cpl of the queue as completion context,
+// instead of the SNAP context. A completion on a thread that is not polling the queue (uring CQ,
+// libnfs service, aio threads etc.) is pushed onto a lock-free MPSC list of the queue,
+// and the thread polling the queue writes it to the virtqueue on its next poll. That way only one
+// thread at a time touches a virtqueue and SNAP needs no concurrency-safe completion path.
+// The contexts are tagged with DPFS_HAL_CPL_TAG, untagged ones are SNAP contexts
+struct dpfs_hal_cpl {
+    struct snap_fs_dev_io_done_ctx *done_ctx;
+    struct dpfs_hal_queue *q;
+    enum dpfs_hal_completion_status status;
+    struct dpfs_hal_cpl *next;
+};
+
+#define DPFS_HAL_CPL_TAG 1UL
+
+enum dpfs_hal_scheduler {
+    // Every thread owns a fixed set of queues
+    DPFS_HAL_SCHED_STATIC,
+    // Every thread owns a fixed set of queues, but polls the queues of other threads
+    // when its own queues are idle
+    DPFS_HAL_SCHED_DYNAMIC,
+};
+
+// The states of the adaptive polling back-off, from lowest latency to lowest CPU usage
+enum dpfs_hal_poll_state {
+    DPFS_HAL_POLL_SPIN,
+    DPFS_HAL_POLL_WAIT,
+    DPFS_HAL_POLL_YIELD,
+    DPFS_HAL_POLL_SLEEP_SHORT,
+    DPFS_HAL_POLL_SLEEP_LONG,
+    DPFS_HAL_POLL_NSTATES
+};
+
+static const char *dpfs_hal_poll_state_names[DPFS_HAL_POLL_NSTATES] = {
+    "spin", "wait", "yield", "short sleep", "long sleep"
+};
+
+struct dpfs_hal_adaptive_conf {
+    bool enabled;
+    // The spin window after the last request is 4x the average request interarrival time,
+    // bounded by these two
+    uint64_t spin_min_usec;
+    uint64_t spin_max_usec;
+    // After the spin window, pause and yield the CPU for this long
+    uint64_t yield_usec;
+    // If not 0, wait in a low-power state (WFE/TPAUSE) for up to wait_usec between the polls
+    // of the yield window instead of yielding, the CPU stays ours but draws less power
+    uint64_t wait_usec;
+    // Then sleep, starting at sleep_min_usec and doubling up to sleep_max_usec, which is
+    // the worst-case latency added to a request that arrives on an idle thread
+    useconds_t sleep_min_usec;
+    useconds_t sleep_max_usec;
+};
+
+// Per polling thread state of the adaptive polling
+struct dpfs_hal_backoff {
+    uint16_t thread_id;
+    // Whether the thread counts in the QoS nawake
+    bool awake;
+    enum dpfs_hal_poll_state state;
+    uint64_t last_ns;
+    uint64_t last_hit_ns;
+    // Exponentially weighted moving average of the time between polls that found requests
+    uint64_t avg_gap_ns;
+    useconds_t sleep_usec;
+
+    uint64_t polls;
+    uint64_t hits;
+    uint64_t state_ns[DPFS_HAL_POLL_NSTATES];
+};
+
+// The low-latency CPU QoS request (see cpu_latency.h) is only held while a poller is awake
+struct dpfs_hal_qos {
+    pthread_mutex_t lock;
+    uint16_t nawake;
+};
+
+struct dpfs_hal_loop_thread;
+
 struct dpfs_hal {
+    // The device slots, first the PFs in pf_ids and then max_vfs VF slots per PF
     int ndevices;
     struct dpfs_hal_device *devices;
+    uint16_t npfs;
+    uint16_t max_vfs;
+    // The request queues of all the device slots, device after device
+    int nqueues;
+    struct dpfs_hal_queue *queues;
+    // Serializes the creation and destruction of devices with the pollers looking at all of them
+    pthread_mutex_t devices_lock;
+    // Incremented on every change of the queue ownership, the pollers sync their queues when it changes
+    uint64_t queues_gen;
+    // Hot-adds and removes VF devices and parks and unparks the elastic pollers
+    pthread_t manager_thread;
+    bool manager_thread_running;
+    // The polling threads, while dpfs_hal_loop runs
+    struct dpfs_hal_loop_thread *threads;
+    // For creating the VF devices at runtime
+    char *emu_manager;
+    char *tag;
+    int queue_depth;
+    uint16_t dev_nqueues;
     int nmock_devices;
     struct dpfs_hal_device *mock_devices;
     pthread_t mock_thread;
@@ -76,10 +239,52 @@ struct dpfs_hal {
     struct dpfs_hal_ops ops;
     void *user_data;
     useconds_t polling_interval_usec;
+    // The default and the fast (initialising or suspending devices) mmio period, in cycles
+    uint64_t mmio_period;
+    uint64_t mmio_fast_period;
     uint16_t nthreads;
+    // Elastic pollers: the pollers [nrunning, nthreads) are parked, nrunning is in [min_threads, nthreads]
+    uint16_t min_threads;
+    uint16_t nrunning;
+    // The manager wakes a poller when the running pollers found requests in more than
+    // elastic_grow_pct of their passes, and parks one when the others could take over its load
+    // while staying below elastic_shrink_pct
+    uint16_t elastic_grow_pct;
+    uint16_t elastic_shrink_pct;
+    pthread_mutex_t park_lock;
+    pthread_cond_t park_cond;
+    struct dpfs_hal_qos qos;
+    enum dpfs_hal_scheduler scheduler;
+    struct dpfs_hal_adaptive_conf adaptive;
+    // Activity polling: only the queues that had requests in the last activity_idle_ns
+    // are polled on every pass, the idle queues are swept one per pass
+    bool activity_polling;
+    uint64_t activity_idle_ns;
+    // The metadata lane: the polling threads hand the metadata requests to these threads,
+    // so that stats and opens don't queue up behind bulk READ/WRITE on the same poller.
+    // They have the thread ids [nthreads, nthreads + nmd_threads)
+    uint16_t nmd_threads;
+    struct dpfs_hal_md_thread *md_threads;
+    // The thread id of the mock thread, after the configured metadata threads. It has its own,
+    // because the backends keep per-thread state (pools, rings, batches) indexed by the thread id
+    uint16_t mock_thread_id;
+    // Set while the metadata threads run, only then requests are routed to them
+    bool md_running;
+    int *md_thread_cpus;
+    // NULL if the statistics are disabled
+    char *stats_shm_name;
+    // The CPU of every polling thread
+    int *thread_cpus;
+    // The completion contexts of all the queues, NULL without completion handoff
+    struct dpfs_hal_cpl *cpl_slots;
 };
 
 static volatile int keep_running = 1;
+// dpfs_hal_async_complete has no HAL to find the async_done op in
+static dpfs_hal_async_done_t async_done = NULL;
+static void *async_done_user_data = NULL;
+// The queue that the calling thread is polling, if any
+static __thread struct dpfs_hal_queue *dpfs_hal_polled_queue = NULL;
 
 pthread_key_t dpfs_hal_thread_id_key;
 __attribute__((visibility("default")))
@@ -89,7 +294,22 @@ uint16_t dpfs_hal_thread_id(void) {
 __attribute__((visibility("default")))
 uint16_t dpfs_hal_nthreads(struct dpfs_hal *hal)
 {
-    return hal->nthreads;
+    if (hal->nmock_devices > 0)
+        return hal->mock_thread_id + 1;
+    return hal->nthreads + hal->nmd_threads;
+}
+__attribute__((visibility("default")))
+size_t dpfs_hal_max_inflight(struct dpfs_hal *hal)
+{
+    // Every virtqueue of every device can have queue_depth requests in flight
+    return (size_t) (hal->ndevices + hal->nmock_devices) * (1 + hal->dev_nqueues) * hal->queue_depth;
+}
+
+// SNAP's virtio-fs emulation doesn't expose a shared memory region on the PCI function
+__attribute__((visibility("default")))
+int dpfs_hal_dax_window(struct dpfs_hal *hal, uint16_t device_id, void **addr, uint64_t *len)
+{
+    return -ENOTSUP;
 }
 
 static void signal_handler(int dummy)
@@ -98,11 +318,48 @@ static void signal_handler(int dummy)
     printf("DPFS-HAL SNAP: the HAL will exit when the host has suspended all the virtio-fs devices");
 }
 
+// Pulls all the available requests of a queue, or of all the queues of the device if queue_id < 0,
+// and hands them to the request handler as a batch
+static int dpfs_hal_progress_io(struct dpfs_hal_device *dev, int queue_id)
+{
+    struct dpfs_hal *hal = dev->hal;
+    int n;
+
+    if (hal->ops.poll_batch_begin)
+        hal->ops.poll_batch_begin(hal->user_data, dev->device_id);
+    if (queue_id < 0) {
+        n = virtio_fs_ctrl_progress_all_io(dev->snap_ctrl);
+    } else {
+        // The HiPrio queue (FORGET, INTERRUPT) is serviced first on every poll of queue 0,
+        // so that these cheap messages never wait behind a burst of requests
+        int hiprio = queue_id == 0 ? virtio_fs_ctrl_progress_io(dev->snap_ctrl, DPFS_HAL_HIPRIO_PG) : 0;
+        n = virtio_fs_ctrl_progress_io(dev->snap_ctrl, 1 + queue_id);
+        if (hiprio > 0)
+            n = (n > 0 ? n : 0) + hiprio;
+    }
+    if (hal->ops.poll_batch_end)
+        hal->ops.poll_batch_end(hal->user_data, dev->device_id);
+
+    return n;
+}
+
+// The device that the backend polls itself, the mock devices come after the PFs and the VFs
+static struct dpfs_hal_device *dpfs_hal_backend_device(struct dpfs_hal *hal, uint16_t device_id)
+{
+    if (device_id < hal->ndevices)
+        return hal->devices[device_id].present ? &hal->devices[device_id] : NULL;
+    // The mock thread polls them otherwise
+    if (hal->mock_thread_running || device_id - hal->ndevices >= hal->nmock_devices)
+        return NULL;
+    return &hal->mock_devices[device_id - hal->ndevices];
+}
+
 __attribute__((visibility("default")))
 int dpfs_hal_poll_io(struct dpfs_hal *hal, uint16_t device_id)
 {
-    if (device_id < hal->ndevices)
-        return virtio_fs_ctrl_progress_all_io(hal->devices[device_id].snap_ctrl);
+    struct dpfs_hal_device *dev = dpfs_hal_backend_device(hal, device_id);
+    if (dev)
+        return dpfs_hal_progress_io(dev, -1);
     else
         return -ENODEV;
 }
@@ -110,14 +367,133 @@ int dpfs_hal_poll_io(struct dpfs_hal *hal, uint16_t device_id)
 __attribute__((visibility("default")))
 void dpfs_hal_poll_mmio(struct dpfs_hal *hal, uint16_t device_id)
 {
-    if (device_id < hal->ndevices)
-        virtio_fs_ctrl_progress(hal->devices[device_id].snap_ctrl);
+    struct dpfs_hal_device *dev = dpfs_hal_backend_device(hal, device_id);
+    if (dev)
+        virtio_fs_ctrl_progress(dev->snap_ctrl);
 }
 
-static void dpfs_hal_poll_device(struct dpfs_hal_device *dev)
+// Polls the mmio (management io) of the device once its period has elapsed. A fixed number of
+// polls between mmio polls would waste cycles on an idle device and starve resets and suspends on
+// a busy one. A device that is initialising or suspending uses the fast period
+static inline void dpfs_hal_poll_device_mmio(struct dpfs_hal_device *dev)
 {
-    struct dpfs_hal *hal = dev->hal;
+    uint64_t now = cycles_now();
+    if (likely(now < dev->mmio_deadline))
+        return;
+
+    virtio_fs_ctrl_progress(dev->snap_ctrl);
+    bool fast = __atomic_load_n(&dev->initialising, __ATOMIC_RELAXED) || dev->suspending || !keep_running;
+    dev->mmio_deadline = now + (fast ? dev->hal->mmio_fast_period : dev->mmio_period);
+}
 
+__attribute__((visibility("default")))
+void dpfs_hal_poll_mmio_timed(struct dpfs_hal *hal, uint16_t device_id)
+{
+    struct dpfs_hal_device *dev = dpfs_hal_backend_device(hal, device_id);
+    if (dev)
+        dpfs_hal_poll_device_mmio(dev);
+}
+
+static void dpfs_hal_snap_complete(struct snap_fs_dev_io_done_ctx *cb, enum dpfs_hal_completion_status status)
+{
+    enum snap_fs_dev_op_status snap_status = SNAP_FS_DEV_OP_IO_ERROR;
+    switch (status) {
+        case DPFS_HAL_COMPLETION_SUCCES:
+            snap_status = SNAP_FS_DEV_OP_SUCCESS;
+            break;
+        case DPFS_HAL_COMPLETION_ERROR:
+            snap_status = SNAP_FS_DEV_OP_IO_ERROR;
+            break;
+    }
+    cb->cb(snap_status, cb->user_arg);
+}
+
+// Only called by the thread polling q. Returns the SNAP context itself if handoff is disabled
+// or if all the contexts are taken, which can't happen because the queue has room for
+// every request that SNAP can have in flight on it
+static inline void *dpfs_hal_cpl_get(struct dpfs_hal_queue *q, struct snap_fs_dev_io_done_ctx *done_ctx)
+{
+    struct dpfs_hal_cpl *c = q ? q->cpl_free : NULL;
+    if (!c)
+        return done_ctx;
+    q->cpl_free = c->next;
+    c->done_ctx = done_ctx;
+    return (void *) ((uintptr_t) c | DPFS_HAL_CPL_TAG);
+}
+
+// Only called by the thread polling the queue of the context
+static inline void dpfs_hal_cpl_put(void *completion_context)
+{
+    if (!((uintptr_t) completion_context & DPFS_HAL_CPL_TAG))
+        return;
+    struct dpfs_hal_cpl *c = (void *) ((uintptr_t) completion_context & ~DPFS_HAL_CPL_TAG);
+    c->next = c->q->cpl_free;
+    c->q->cpl_free = c;
+}
+
+static void dpfs_hal_complete(void *completion_context, enum dpfs_hal_completion_status status)
+{
+    if (!((uintptr_t) completion_context & DPFS_HAL_CPL_TAG)) {
+        dpfs_hal_snap_complete(completion_context, status);
+        return;
+    }
+
+    struct dpfs_hal_cpl *c = (void *) ((uintptr_t) completion_context & ~DPFS_HAL_CPL_TAG);
+    struct dpfs_hal_queue *q = c->q;
+    if (q == dpfs_hal_polled_queue) {
+        dpfs_hal_snap_complete(c->done_ctx, status);
+        dpfs_hal_cpl_put(completion_context);
+        return;
+    }
+
+    c->status = status;
+    struct dpfs_hal_cpl *head = __atomic_load_n(&q->handoff, __ATOMIC_RELAXED);
+    do {
+        c->next = head;
+    } while (!__atomic_compare_exchange_n(&q->handoff, &head, c, true, __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+}
+
+// Writes the completions that other threads handed off to the virtqueue, in the order they arrived.
+// Only called by the thread polling q
+static int dpfs_hal_drain_handoff(struct dpfs_hal_queue *q)
+{
+    // Don't take the cacheline exclusive on every poll
+    if (likely(!__atomic_load_n(&q->handoff, __ATOMIC_RELAXED)))
+        return 0;
+
+    struct dpfs_hal_cpl *c = __atomic_exchange_n(&q->handoff, NULL, __ATOMIC_ACQUIRE);
+    struct dpfs_hal_cpl *fifo = NULL;
+    while (c) {
+        struct dpfs_hal_cpl *next = c->next;
+        c->next = fifo;
+        fifo = c;
+        c = next;
+    }
+
+    int n = 0;
+    while (fifo) {
+        struct dpfs_hal_cpl *next = fifo->next;
+        dpfs_hal_snap_complete(fifo->done_ctx, fifo->status);
+        fifo->next = q->cpl_free;
+        q->cpl_free = fifo;
+        fifo = next;
+        n++;
+    }
+    return n;
+}
+
+static int dpfs_hal_poll_queue(struct dpfs_hal_queue *q)
+{
+    struct dpfs_hal_device *dev = q->dev;
+    struct dpfs_hal *hal = dev->hal;
+    // Only one queue of a device takes care of the mmio
+    bool mmio = q == &dev->queues[0];
+    int n;
+
+    dpfs_hal_polled_queue = q;
+    // Completions of other threads are work too, otherwise the backoff and the activity tracking
+    // put a queue to sleep whose backend is still completing requests
+    int handed_off = dpfs_hal_drain_handoff(q);
     /*
      * don't call usleep(0) because it adds a huge overhead
      * to polling.
@@ -125,47 +501,76 @@ static void dpfs_hal_poll_device(struct dpfs_hal_device *dev)
     if (hal->polling_interval_usec > 0) {
         usleep(hal->polling_interval_usec);
         // actual io
-        virtio_fs_ctrl_progress_all_io(dev->snap_ctrl);
+        n = dpfs_hal_progress_io(dev, q->queue_id);
         // This is for mmio (management io)
-        virtio_fs_ctrl_progress(dev->snap_ctrl);
+        if (mmio)
+            virtio_fs_ctrl_progress(dev->snap_ctrl);
     } else {
         /*
          * poll submission queues as fast as we can
          * but don't spend resources on polling mmio
          */
-        virtio_fs_ctrl_progress_all_io(dev->snap_ctrl);
-        if (dev->poll_counter++ == 10000) {
-            virtio_fs_ctrl_progress(dev->snap_ctrl);
-            dev->poll_counter = 0;
-        }
+        n = dpfs_hal_progress_io(dev, q->queue_id);
+        if (mmio)
+            dpfs_hal_poll_device_mmio(dev);
     }
+    dpfs_hal_polled_queue = NULL;
+    if (unlikely(n > 0 && __atomic_load_n(&dev->initialising, __ATOMIC_RELAXED)))
+        __atomic_store_n(&dev->initialising, false, __ATOMIC_RELAXED);
 
-    if (unlikely(!keep_running && !dev->suspending)) {
+    if (unlikely(mmio && !keep_running && !dev->suspending)) {
         virtio_fs_ctrl_suspend(dev->snap_ctrl);
         dev->suspending = true;
     }
+
+    if (handed_off > 0)
+        n = (n > 0 ? n : 0) + handed_off;
+
+    q->polls++;
+    if (n > 0)
+        q->hits++;
+
+    return n;
+}
+
+// Returns -EBUSY if another thread is currently polling the queue
+static int dpfs_hal_try_poll_queue(struct dpfs_hal_queue *q)
+{
+    if (__atomic_test_and_set(&q->polling, __ATOMIC_ACQUIRE))
+        return -EBUSY;
+    if (__atomic_load_n(&q->state, __ATOMIC_ACQUIRE) != DPFS_HAL_QUEUE_ACTIVE) {
+        __atomic_clear(&q->polling, __ATOMIC_RELEASE);
+        return -ENODEV;
+    }
+    int n = dpfs_hal_poll_queue(q);
+    __atomic_clear(&q->polling, __ATOMIC_RELEASE);
+    return n;
 }
 
 static bool all_devices_suspended(struct dpfs_hal *hal)
 {
-    uint16_t n = 0;
-    for (uint16_t i = 0; i < hal->ndevices; i++) {
-        if (virtio_fs_ctrl_is_suspended(hal->devices[i].snap_ctrl))
-            n++;
+    bool suspended = true;
+    pthread_mutex_lock(&hal->devices_lock);
+    for (uint16_t i = 0; i < hal->ndevices && suspended; i++) {
+        if (hal->devices[i].present && !virtio_fs_ctrl_is_suspended(hal->devices[i].snap_ctrl))
+            suspended = false;
     }
-    return n == hal->ndevices;
+    pthread_mutex_unlock(&hal->devices_lock);
+    return suspended;
 }
 
 // Checks for (management) I/O every second on all mock devices
 static void *dpfs_hal_mock_thread(void *arg)
 {
     struct dpfs_hal *hal = arg;
+    pthread_setspecific(dpfs_hal_thread_id_key, (void *) (size_t) hal->mock_thread_id);
+    stats_shm_thread_init(hal->mock_thread_id);
 
     while (keep_running || !all_devices_suspended(hal)) {
         for (size_t i = 0; i < hal->nmock_devices; i++) {
             struct dpfs_hal_device *dev = &hal->mock_devices[i];
             // actual io
-            virtio_fs_ctrl_progress_all_io(dev->snap_ctrl);
+            dpfs_hal_progress_io(dev, -1);
             // This is for mmio (management io)
             virtio_fs_ctrl_progress(dev->snap_ctrl);
 
@@ -180,58 +585,651 @@ static void *dpfs_hal_mock_thread(void *arg)
     return NULL;
 }
 
+static inline void dpfs_hal_cpu_relax(void)
+{
+#if defined(__aarch64__)
+    asm volatile("yield" ::: "memory");
+#elif defined(__x86_64__)
+    __builtin_ia32_pause();
+#endif
+}
+
+static inline uint64_t dpfs_hal_now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+// Counts the pollers that are not sleeping or parked. Holds the low-latency QoS request while there
+// is at least one, and relaxes it when they all went to sleep, so that the idle CPUs can enter the
+// deeper C-states. Only takes the lock when the poller changes state
+static void dpfs_hal_qos_awake(struct dpfs_hal *hal, bool *awake, bool now_awake)
+{
+    if (likely(*awake == now_awake))
+        return;
+    *awake = now_awake;
+
+    pthread_mutex_lock(&hal->qos.lock);
+    if (now_awake) {
+        if (hal->qos.nawake++ == 0)
+            set_low_latency(true);
+    } else {
+        if (--hal->qos.nawake == 0)
+            set_low_latency(false);
+    }
+    pthread_mutex_unlock(&hal->qos.lock);
+}
+
+// Starts out not awake, the thread calls dpfs_hal_qos_awake once it polls
+static void dpfs_hal_backoff_init(struct dpfs_hal *hal, struct dpfs_hal_backoff *b, uint16_t thread_id)
+{
+    memset(b, 0, sizeof(*b));
+    b->thread_id = thread_id;
+    b->state = DPFS_HAL_POLL_SPIN;
+    b->last_ns = b->last_hit_ns = dpfs_hal_now_ns();
+    b->avg_gap_ns = hal->adaptive.spin_max_usec * 1000;
+    b->sleep_usec = hal->adaptive.sleep_min_usec;
+}
+
+// Called after every pass over the devices of a thread, n is the number of requests that the pass found.
+// Spins while requests are arriving and gradually backs off when the thread is idle
+static void dpfs_hal_backoff(struct dpfs_hal *hal, struct dpfs_hal_backoff *b, int n)
+{
+    struct dpfs_hal_adaptive_conf *conf = &hal->adaptive;
+    uint64_t now = dpfs_hal_now_ns();
+
+    // Account the time since the previous pass (including the waiting) to the state we were in
+    b->state_ns[b->state] += now - b->last_ns;
+    b->last_ns = now;
+    b->polls++;
+
+    if (n > 0) {
+        b->hits++;
+        b->avg_gap_ns = (b->avg_gap_ns * 7 + (now - b->last_hit_ns)) / 8;
+        b->last_hit_ns = now;
+        b->sleep_usec = conf->sleep_min_usec;
+        b->state = DPFS_HAL_POLL_SPIN;
+        dpfs_hal_qos_awake(hal, &b->awake, true);
+        return;
+    }
+
+    uint64_t spin_usec = b->avg_gap_ns * 4 / 1000;
+    if (spin_usec < conf->spin_min_usec)
+        spin_usec = conf->spin_min_usec;
+    else if (spin_usec > conf->spin_max_usec)
+        spin_usec = conf->spin_max_usec;
+
+    uint64_t idle_usec = (now - b->last_hit_ns) / 1000;
+    if (idle_usec < spin_usec) {
+        b->state = DPFS_HAL_POLL_SPIN;
+    } else if (idle_usec < spin_usec + conf->yield_usec) {
+        if (conf->wait_usec > 0) {
+            b->state = DPFS_HAL_POLL_WAIT;
+            cycles_wait(cycles_now() + conf->wait_usec * cycles_per_usec());
+        } else {
+            b->state = DPFS_HAL_POLL_YIELD;
+            for (int i = 0; i < 32; i++)
+                dpfs_hal_cpu_relax();
+            sched_yield();
+        }
+        dpfs_stats_idle(stats_shm, b->thread_id, dpfs_hal_now_ns() - now, 0);
+    } else {
+        b->state = b->sleep_usec < conf->sleep_max_usec ?
+            DPFS_HAL_POLL_SLEEP_SHORT : DPFS_HAL_POLL_SLEEP_LONG;
+        dpfs_hal_qos_awake(hal, &b->awake, false);
+        usleep(b->sleep_usec);
+        dpfs_stats_idle(stats_shm, b->thread_id, 0, dpfs_hal_now_ns() - now);
+        b->sleep_usec *= 2;
+        if (b->sleep_usec > conf->sleep_max_usec)
+            b->sleep_usec = conf->sleep_max_usec;
+    }
+}
+
 struct dpfs_hal_loop_thread {
     pthread_t thread;
     size_t thread_id;
     struct dpfs_hal *hal;
-};
+    // The queues this thread owns, queues[0, nactive) are the active set and the rest are idle.
+    // Without activity polling all the queues are always active
+    size_t nqueues;
+    size_t nactive;
+    struct dpfs_hal_queue **queues;
+    // The next idle queue to sweep, relative to nactive
+    size_t idle_cursor;
+    // The queues of hot-added devices that this thread should take over
+    struct dpfs_hal_queue *inbox;
+    uint64_t queues_gen;
+    // The number of queues assigned to this thread and the requests it handled,
+    // for giving hot-added devices to the least-loaded thread
+    size_t nowned;
+    uint64_t requests;
+    // The passes over the queues and the ones that found requests, for the elastic pollers
+    uint64_t passes;
+    uint64_t busy_passes;
+    // Number of requests this thread handled on queues of other threads
+    uint64_t stolen;
+    struct dpfs_hal_backoff backoff;
+} __attribute__((aligned(64)));
+
+// The thread that owns a queue of a PF when the queues aren't explicitly assigned in the config.
+// With a single queue per device every thread owns a contiguous window of devices,
+// otherwise the queues are dealt out over the threads round-robin.
+// With VFs there can be more threads than PF queues, the threads without one get the hot-added VFs
+static uint16_t dpfs_hal_default_queue_thread(struct dpfs_hal *hal, uint16_t device_id, uint16_t queue_id,
+        uint16_t nqueues)
+{
+    if (nqueues > 1)
+        return (device_id * nqueues + queue_id) % hal->nthreads;
+    if (hal->npfs < hal->nthreads)
+        return device_id;
+
+    size_t ndevices = hal->npfs / hal->nthreads;
+    size_t remainder = hal->npfs % hal->nthreads;
+    // Thread 0 owns its own window plus the remainder devices
+    if (device_id < ndevices + remainder)
+        return 0;
+    return (device_id - remainder) / ndevices;
+}
 
-static void *dpfs_hal_loop_static_thread(void *arg)
+static void dpfs_hal_loop_thread_init(struct dpfs_hal_loop_thread *ht)
 {
-    struct dpfs_hal_loop_thread *ht = arg;
     struct dpfs_hal *hal = ht->hal;
 
     // Store the thread_id in thread local storage so that the FUSE implementation
     // knows what thread number its in when called with a request
     pthread_setspecific(dpfs_hal_thread_id_key, (void *) ht->thread_id);
+    stats_shm_thread_init(ht->thread_id);
 
-    long num_cpus = sysconf(_SC_NPROCESSORS_CONF);
-    cpu_set_t loop_cpu;
-    CPU_ZERO(&loop_cpu);
-    // Calculate our polling CPU
-    // with two threads and 8 total cores:
-    // thread 0 will occupy core 7
-    // thread 1 will occupy core 6
-    CPU_SET(num_cpus - 1 - ht->thread_id, &loop_cpu);
-    int ret = sched_setaffinity(gettid(), sizeof(loop_cpu), &loop_cpu);
-    if (ret == -1) {
+    int ret = placement_pin(hal->thread_cpus[ht->thread_id]);
+    if (ret) {
+        errno = -ret;
         warn("Could not set the CPU affinity of polling thread %lu. DPFS thread %lu will continue not pinned.", ht->thread_id, ht->thread_id);
     }
+}
+
+static inline void dpfs_hal_swap_queues(struct dpfs_hal_loop_thread *ht, size_t a, size_t b)
+{
+    struct dpfs_hal_queue *q = ht->queues[a];
+    ht->queues[a] = ht->queues[b];
+    ht->queues[b] = q;
+}
+
+// Moves the idle queue at index i into the active set
+static void dpfs_hal_activate_queue(struct dpfs_hal_loop_thread *ht, size_t i, uint64_t now)
+{
+    struct dpfs_hal_queue *q = ht->queues[i];
+    q->last_hit_ns = now;
+    __atomic_store_n(&q->active, true, __ATOMIC_RELAXED);
+    dpfs_hal_swap_queues(ht, i, ht->nactive++);
+}
+
+// Moves the active queue at index i into the idle set
+static void dpfs_hal_deactivate_queue(struct dpfs_hal_loop_thread *ht, size_t i)
+{
+    __atomic_store_n(&ht->queues[i]->active, false, __ATOMIC_RELAXED);
+    dpfs_hal_swap_queues(ht, i, --ht->nactive);
+}
+
+// Hands q to the thread, which takes it over on its next sync. The caller bumps queues_gen
+static void dpfs_hal_push_queue(struct dpfs_hal_loop_thread *ht, struct dpfs_hal_queue *q)
+{
+    q->next = __atomic_load_n(&ht->inbox, __ATOMIC_RELAXED);
+    while (!__atomic_compare_exchange_n(&ht->inbox, &q->next, q, true, __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+        ;
+}
+
+// Removes the queue at index i from the queues of the thread
+static void dpfs_hal_drop_queue(struct dpfs_hal_loop_thread *ht, size_t i)
+{
+    size_t j = i;
+    if (i < ht->nactive) {
+        // Moves the queue to the start of the idle set
+        dpfs_hal_deactivate_queue(ht, i);
+        j = ht->nactive;
+    }
+    ht->queues[j] = ht->queues[--ht->nqueues];
+}
+
+// Takes over the queues of hot-added devices, drops the queues of devices that are being removed
+// and forwards the queues that the manager moved to another thread
+static void dpfs_hal_sync_queues(struct dpfs_hal_loop_thread *ht)
+{
+    struct dpfs_hal *hal = ht->hal;
+    uint64_t gen = __atomic_load_n(&hal->queues_gen, __ATOMIC_ACQUIRE);
+    if (likely(gen == ht->queues_gen))
+        return;
+    ht->queues_gen = gen;
+
+    // A new device is likely to be used soon, so it starts out active
+    uint64_t now = dpfs_hal_now_ns();
+    for (struct dpfs_hal_queue *q = __atomic_exchange_n(&ht->inbox, NULL, __ATOMIC_ACQUIRE); q; q = q->next) {
+        ht->queues[ht->nqueues++] = q;
+        dpfs_hal_activate_queue(ht, ht->nqueues - 1, now);
+    }
+    bool forwarded = false;
+    for (size_t i = 0; i < ht->nqueues;) {
+        struct dpfs_hal_queue *q = ht->queues[i];
+        uint16_t owner = __atomic_load_n(&q->thread_id, __ATOMIC_RELAXED);
+        if (__atomic_load_n(&q->state, __ATOMIC_ACQUIRE) == DPFS_HAL_QUEUE_REMOVING) {
+            dpfs_hal_drop_queue(ht, i);
+            __atomic_store_n(&q->released, true, __ATOMIC_RELEASE);
+        } else if (unlikely(owner != ht->thread_id)) {
+            dpfs_hal_drop_queue(ht, i);
+            dpfs_hal_push_queue(&hal->threads[owner], q);
+            forwarded = true;
+        } else {
+            i++;
+        }
+    }
+    // So that the new owners sync again
+    if (forwarded)
+        __atomic_add_fetch(&hal->queues_gen, 1, __ATOMIC_RELEASE);
+}
 
-    size_t ndevices = hal->ndevices / hal->nthreads;
-    size_t remainder = hal->ndevices % hal->nthreads;
-    size_t devices_start = ndevices * ht->thread_id;
-    size_t devices_end = devices_start + ndevices;
-    if (ht->thread_id == 0 && remainder != 0) {
-        // Extend our window to the right with the remainder devices
-        devices_end += remainder;
-        ndevices += remainder;
-    } else if (remainder != 0) {
-        // Move our window to the right by the number of devices T0 has
-        devices_start += remainder;
-        devices_end += remainder;
+// Called when the manager parked this thread. Blocks until the manager needs the thread again,
+// or until the HAL exits. Returns without parking while the thread still holds queues,
+// they are forwarded to their new owners by the sync
+static void dpfs_hal_park(struct dpfs_hal_loop_thread *ht)
+{
+    struct dpfs_hal *hal = ht->hal;
+
+    dpfs_hal_sync_queues(ht);
+    if (ht->nqueues > 0)
+        return;
+
+    if (hal->ops.thread_park)
+        hal->ops.thread_park(hal->user_data, ht->thread_id);
+    dpfs_hal_qos_awake(hal, &ht->backoff.awake, false);
+    uint64_t start = dpfs_hal_now_ns();
+    while (__atomic_load_n(&hal->nrunning, __ATOMIC_ACQUIRE) <= ht->thread_id) {
+        if (!keep_running && all_devices_suspended(hal))
+            return;
+        // Timed, because a signal handler can't wake us up on exit
+        struct timespec ts;
+        clock_gettime(CLOCK_REALTIME, &ts);
+        ts.tv_nsec += 100000000;
+        if (ts.tv_nsec >= 1000000000) {
+            ts.tv_sec++;
+            ts.tv_nsec -= 1000000000;
+        }
+        pthread_mutex_lock(&hal->park_lock);
+        if (hal->nrunning <= ht->thread_id)
+            pthread_cond_timedwait(&hal->park_cond, &hal->park_lock, &ts);
+        pthread_mutex_unlock(&hal->park_lock);
     }
+    if (hal->ops.thread_unpark)
+        hal->ops.thread_unpark(hal->user_data, ht->thread_id);
+    dpfs_stats_idle(stats_shm, ht->thread_id, 0, dpfs_hal_now_ns() - start);
+    dpfs_hal_backoff_init(hal, &ht->backoff, ht->thread_id);
+    dpfs_hal_qos_awake(hal, &ht->backoff.awake, true);
+}
+
+// Polls the queues of the thread, exclusive: use try_poll because other threads may poll them too.
+// With activity polling only the active queues and the next idle queue are polled, so that the cost
+// of a pass doesn't grow with the number of idle devices. Idle queues join the active set as soon
+// as they have requests
+static int dpfs_hal_poll_thread_queues(struct dpfs_hal_loop_thread *ht, bool exclusive)
+{
+    struct dpfs_hal *hal = ht->hal;
+    int n = 0;
+
+    if (!hal->activity_polling) {
+        for (size_t i = 0; i < ht->nqueues; i++) {
+            int ret = exclusive ? dpfs_hal_try_poll_queue(ht->queues[i]) :
+                dpfs_hal_poll_queue(ht->queues[i]);
+            // If another thread is polling our queue, then it is being progressed
+            if (ret > 0)
+                n += ret;
+        }
+        return n;
+    }
+
+    uint64_t now = dpfs_hal_now_ns();
+    for (size_t i = 0; i < ht->nactive;) {
+        struct dpfs_hal_queue *q = ht->queues[i];
+        int ret = exclusive ? dpfs_hal_try_poll_queue(q) : dpfs_hal_poll_queue(q);
+        if (ret > 0) {
+            n += ret;
+            q->last_hit_ns = now;
+        } else if (ret == 0 && now - q->last_hit_ns > hal->activity_idle_ns) {
+            // The last active queue is swapped into i, poll that one next
+            dpfs_hal_deactivate_queue(ht, i);
+            continue;
+        }
+        i++;
+    }
+
+    size_t nidle = ht->nqueues - ht->nactive;
+    if (nidle > 0) {
+        if (ht->idle_cursor >= nidle)
+            ht->idle_cursor = 0;
+        size_t i = ht->nactive + ht->idle_cursor++;
+        struct dpfs_hal_queue *q = ht->queues[i];
+        int ret = exclusive ? dpfs_hal_try_poll_queue(q) : dpfs_hal_poll_queue(q);
+        if (ret > 0) {
+            n += ret;
+            dpfs_hal_activate_queue(ht, i, now);
+        }
+    }
+
+    return n;
+}
+
+static inline void dpfs_hal_account_requests(struct dpfs_hal_loop_thread *ht, int n)
+{
+    __atomic_store_n(&ht->passes, ht->passes + 1, __ATOMIC_RELAXED);
+    if (n > 0) {
+        __atomic_store_n(&ht->requests, ht->requests + n, __ATOMIC_RELAXED);
+        __atomic_store_n(&ht->busy_passes, ht->busy_passes + 1, __ATOMIC_RELAXED);
+    }
+}
+
+static void *dpfs_hal_loop_static_thread(void *arg)
+{
+    struct dpfs_hal_loop_thread *ht = arg;
+    struct dpfs_hal *hal = ht->hal;
+
+    dpfs_hal_loop_thread_init(ht);
+
+    while (keep_running || !all_devices_suspended(hal)) {
+        dpfs_hal_sync_queues(ht);
+        if (unlikely(__atomic_load_n(&hal->nrunning, __ATOMIC_RELAXED) <= ht->thread_id))
+            dpfs_hal_park(ht);
+        int n = dpfs_hal_poll_thread_queues(ht, false);
+        dpfs_hal_account_requests(ht, n);
+        dpfs_stats_poll(stats_shm, ht->thread_id, n);
+        if (hal->adaptive.enabled)
+            dpfs_hal_backoff(hal, &ht->backoff, n);
+    }
+
+    return NULL;
+}
+
+static void *dpfs_hal_loop_dynamic_thread(void *arg)
+{
+    struct dpfs_hal_loop_thread *ht = arg;
+    struct dpfs_hal *hal = ht->hal;
+
+    dpfs_hal_loop_thread_init(ht);
+    // Where the previous search for work on the queues of other threads left off
+    size_t victim = ht->thread_id % hal->nqueues;
 
     while (keep_running || !all_devices_suspended(hal)) {
-        for (size_t i = devices_start; i < devices_end; i++) {
-            dpfs_hal_poll_device(&hal->devices[i]);
+        dpfs_hal_sync_queues(ht);
+        if (unlikely(__atomic_load_n(&hal->nrunning, __ATOMIC_RELAXED) <= ht->thread_id))
+            dpfs_hal_park(ht);
+        int n = dpfs_hal_poll_thread_queues(ht, true);
+        if (n > 0 || hal->nthreads == 1) {
+            dpfs_hal_account_requests(ht, n);
+            dpfs_stats_poll(stats_shm, ht->thread_id, n);
+            if (hal->adaptive.enabled)
+                dpfs_hal_backoff(hal, &ht->backoff, n);
+            continue;
+        }
+
+        // Our own queues are idle, help out the other threads by polling their queues.
+        // Stop at the first queue that had work, so that we check our own queues again soon
+        for (size_t j = 0; j < hal->nqueues; j++) {
+            struct dpfs_hal_queue *q = &hal->queues[victim];
+            victim = (victim + 1) % hal->nqueues;
+            if (q->thread_id == ht->thread_id)
+                continue;
+            // The owner sweeps its idle queues, don't spend our passes on them
+            if (hal->activity_polling && !__atomic_load_n(&q->active, __ATOMIC_RELAXED))
+                continue;
+
+            int ret = dpfs_hal_try_poll_queue(q);
+            if (ret > 0) {
+                ht->stolen += ret;
+                n += ret;
+                break;
+            }
+        }
+        dpfs_hal_account_requests(ht, n);
+        dpfs_stats_poll(stats_shm, ht->thread_id, n);
+        if (hal->adaptive.enabled)
+            dpfs_hal_backoff(hal, &ht->backoff, n);
+    }
+
+    return NULL;
+}
+
+static int dpfs_hal_init_dev(struct dpfs_hal *hal, struct dpfs_hal_device *dev, uint16_t device_id,
+        char *emu_manager, int pf_id, int vf_id, char *tag, int qd, uint16_t nqueues, struct dpfs_hal_queue *queues);
+static void dpfs_hal_destroy_dev(struct dpfs_hal_device *dev);
+static int dpfs_hal_md_start(struct dpfs_hal *hal);
+static void dpfs_hal_md_stop(struct dpfs_hal *hal);
+
+// How often the manager thread checks for enabled and disabled VFs and samples the load of the pollers
+#define DPFS_HAL_MANAGER_INTERVAL_USEC 100000
+
+// SNAP calls this from the mmio polling of a PF when the host changes the number of enabled VFs.
+// This is on a polling thread, so the VF devices are created and destroyed by the manager thread
+static void dpfs_hal_vf_change(void *arg, int pf_id, int num_vfs)
+{
+    struct dpfs_hal_device *pf = arg;
+    __atomic_store_n(&pf->requested_vfs, num_vfs, __ATOMIC_RELAXED);
+}
+
+// The running thread that handled the fewest requests in the last interval, or with equal load
+// the one that owns the fewest queues
+static uint16_t dpfs_hal_least_loaded_thread(struct dpfs_hal *hal, const uint64_t *load)
+{
+    uint16_t best = 0;
+    for (uint16_t i = 1; i < hal->nrunning; i++) {
+        if (load[i] < load[best] ||
+                (load[i] == load[best] && hal->threads[i].nowned < hal->threads[best].nowned))
+            best = i;
+    }
+    return best;
+}
+
+static void dpfs_hal_hotplug_add(struct dpfs_hal *hal, uint16_t device_id, uint16_t pf_id, int vf_id, uint64_t *load)
+{
+    struct dpfs_hal_device *dev = &hal->devices[device_id];
+    struct dpfs_hal_queue *queues = &hal->queues[device_id * hal->dev_nqueues];
+
+    if (dpfs_hal_init_dev(hal, dev, device_id, hal->emu_manager, pf_id, vf_id, hal->tag, hal->queue_depth,
+                hal->dev_nqueues, queues)) {
+        fprintf(stderr, "DPFS-HAL SNAP: failed to hot-add VF%d of PF%u, will retry\n", vf_id, pf_id);
+        return;
+    }
+
+    // The device is registered with the backend, now hand its queues to the pollers
+    for (uint16_t i = 0; i < hal->dev_nqueues; i++) {
+        struct dpfs_hal_queue *q = &queues[i];
+        struct dpfs_hal_loop_thread *ht = &hal->threads[dpfs_hal_least_loaded_thread(hal, load)];
+
+        q->thread_id = ht->thread_id;
+        // Expect the new queue to be as busy as the average queue of the thread,
+        // so that the queues of a device are spread over the threads
+        load[ht->thread_id] += ht->nowned ? load[ht->thread_id] / ht->nowned + 1 : 1;
+        ht->nowned++;
+        dpfs_hal_push_queue(ht, q);
+    }
+    __atomic_add_fetch(&hal->queues_gen, 1, __ATOMIC_RELEASE);
+
+    printf("DPFS-HAL SNAP: hot-added VF%d of PF%u as device %u, queue 0 is polled by thread %u\n",
+            vf_id, pf_id, device_id, queues[0].thread_id);
+}
+
+static void dpfs_hal_hotplug_remove(struct dpfs_hal *hal, struct dpfs_hal_device *dev)
+{
+    for (uint16_t i = 0; i < dev->nqueues; i++)
+        __atomic_store_n(&dev->queues[i].state, DPFS_HAL_QUEUE_REMOVING, __ATOMIC_RELEASE);
+    __atomic_add_fetch(&hal->queues_gen, 1, __ATOMIC_RELEASE);
+
+    // Wait until the owners have dropped the queues and no other thread is polling them
+    for (uint16_t i = 0; i < dev->nqueues; i++) {
+        struct dpfs_hal_queue *q = &dev->queues[i];
+        while (!__atomic_load_n(&q->released, __ATOMIC_ACQUIRE))
+            usleep(10);
+        while (__atomic_test_and_set(&q->polling, __ATOMIC_ACQUIRE))
+            usleep(10);
+        hal->threads[q->thread_id].nowned--;
+    }
+
+    // The backend and the metadata lane may still hold requests of the device, their completions are
+    // handed off to the queues, which nobody polls anymore. SNAP only reports the controller as
+    // suspended once all of them are written back
+    virtio_fs_ctrl_suspend(dev->snap_ctrl);
+    dev->suspending = true;
+    while (true) {
+        for (uint16_t i = 0; i < dev->nqueues; i++)
+            dpfs_hal_drain_handoff(&dev->queues[i]);
+        virtio_fs_ctrl_progress(dev->snap_ctrl);
+        if (virtio_fs_ctrl_is_suspended(dev->snap_ctrl))
+            break;
+        usleep(10);
+    }
+
+    printf("DPFS-HAL SNAP: removing VF%d of PF%u (device %u)\n", dev->vf_id, dev->pf_id, dev->device_id);
+    dpfs_hal_destroy_dev(dev);
+    for (uint16_t i = 0; i < dev->nqueues; i++)
+        __atomic_clear(&dev->queues[i].polling, __ATOMIC_RELEASE);
+}
+
+// Moves queue q to thread t, its current owner forwards it on its next sync. The caller bumps queues_gen
+static void dpfs_hal_move_queue(struct dpfs_hal *hal, struct dpfs_hal_queue *q, uint16_t t)
+{
+    hal->threads[q->thread_id].nowned--;
+    hal->threads[t].nowned++;
+    __atomic_store_n(&q->thread_id, t, __ATOMIC_RELAXED);
+}
+
+// Parks the last running poller, its queues go to the least-loaded running pollers
+static void dpfs_hal_elastic_shrink(struct dpfs_hal *hal, uint64_t *load)
+{
+    uint16_t t = hal->nrunning - 1;
+    __atomic_store_n(&hal->nrunning, t, __ATOMIC_RELEASE);
+
+    for (int i = 0; i < hal->nqueues; i++) {
+        struct dpfs_hal_queue *q = &hal->queues[i];
+        if (q->state != DPFS_HAL_QUEUE_ACTIVE || q->thread_id != t)
+            continue;
+        uint16_t target = dpfs_hal_least_loaded_thread(hal, load);
+        struct dpfs_hal_loop_thread *ht = &hal->threads[target];
+        load[target] += ht->nowned ? load[target] / ht->nowned + 1 : 1;
+        dpfs_hal_move_queue(hal, q, target);
+    }
+    __atomic_add_fetch(&hal->queues_gen, 1, __ATOMIC_RELEASE);
+    printf("DPFS-HAL SNAP: parked polling thread %u, %u threads are running\n", t, t);
+}
+
+// Wakes the first parked poller and gives it its share of the queues, taken from the pollers
+// that own the most
+static void dpfs_hal_elastic_grow(struct dpfs_hal *hal)
+{
+    uint16_t t = hal->nrunning;
+    pthread_mutex_lock(&hal->park_lock);
+    __atomic_store_n(&hal->nrunning, t + 1, __ATOMIC_RELEASE);
+    pthread_cond_broadcast(&hal->park_cond);
+    pthread_mutex_unlock(&hal->park_lock);
+
+    while (true) {
+        uint16_t busiest = 0;
+        for (uint16_t i = 1; i < t; i++) {
+            if (hal->threads[i].nowned > hal->threads[busiest].nowned)
+                busiest = i;
+        }
+        if (hal->threads[busiest].nowned <= hal->threads[t].nowned + 1)
+            break;
+        bool moved = false;
+        for (int i = 0; i < hal->nqueues && !moved; i++) {
+            struct dpfs_hal_queue *q = &hal->queues[i];
+            if (q->state == DPFS_HAL_QUEUE_ACTIVE && q->thread_id == busiest) {
+                dpfs_hal_move_queue(hal, q, t);
+                moved = true;
+            }
+        }
+        if (!moved)
+            break;
+    }
+    __atomic_add_fetch(&hal->queues_gen, 1, __ATOMIC_RELEASE);
+    printf("DPFS-HAL SNAP: woke up polling thread %u, it took over %lu queues\n", t, hal->threads[t].nowned);
+}
+
+// The number of intervals that the load must stay low before a poller is parked,
+// so that a short lull doesn't make the pollers flap
+#define DPFS_HAL_ELASTIC_SHRINK_INTERVALS 10
+
+// Decides whether to wake or park a poller, from the share of the passes of every running
+// poller that found requests in the last interval
+static void dpfs_hal_elastic(struct dpfs_hal *hal, const uint64_t *passes, const uint64_t *busy_passes,
+        uint64_t *load, int *low_intervals)
+{
+    uint16_t n = hal->nrunning;
+    // The sum of the utilization of the running pollers, in percent
+    uint64_t util = 0;
+    for (uint16_t i = 0; i < n; i++)
+        util += passes[i] ? 100 * busy_passes[i] / passes[i] : 0;
+
+    if (n < hal->nthreads && util > (uint64_t) hal->elastic_grow_pct * n) {
+        *low_intervals = 0;
+        dpfs_hal_elastic_grow(hal);
+    } else if (n > hal->min_threads && util < (uint64_t) hal->elastic_shrink_pct * (n - 1)) {
+        if (++*low_intervals >= DPFS_HAL_ELASTIC_SHRINK_INTERVALS) {
+            *low_intervals = 0;
+            dpfs_hal_elastic_shrink(hal, load);
+        }
+    } else {
+        *low_intervals = 0;
+    }
+}
+
+// Creates and destroys the VF devices when the host enables and disables VFs, without stopping the I/O
+// of the other devices. A new device is handed to the least-loaded polling thread.
+// With elastic pollers (min_threads < nthreads) it also parks and wakes up pollers
+static void *dpfs_hal_manager_thread(void *arg)
+{
+    struct dpfs_hal *hal = arg;
+    uint64_t prev[hal->nthreads], prev_passes[hal->nthreads], prev_busy[hal->nthreads];
+    uint64_t load[hal->nthreads], passes[hal->nthreads], busy_passes[hal->nthreads];
+    int low_intervals = 0;
+    memset(prev, 0, sizeof(prev));
+    memset(prev_passes, 0, sizeof(prev_passes));
+    memset(prev_busy, 0, sizeof(prev_busy));
+
+    while (keep_running) {
+        usleep(DPFS_HAL_MANAGER_INTERVAL_USEC);
+
+        for (uint16_t i = 0; i < hal->nthreads; i++) {
+            struct dpfs_hal_loop_thread *ht = &hal->threads[i];
+            uint64_t requests = __atomic_load_n(&ht->requests, __ATOMIC_RELAXED);
+            uint64_t p = __atomic_load_n(&ht->passes, __ATOMIC_RELAXED);
+            uint64_t b = __atomic_load_n(&ht->busy_passes, __ATOMIC_RELAXED);
+            load[i] = requests - prev[i];
+            passes[i] = p - prev_passes[i];
+            busy_passes[i] = b - prev_busy[i];
+            prev[i] = requests;
+            prev_passes[i] = p;
+            prev_busy[i] = b;
+        }
+        if (hal->min_threads < hal->nthreads)
+            dpfs_hal_elastic(hal, passes, busy_passes, load, &low_intervals);
+
+        for (uint16_t p = 0; p < hal->npfs; p++) {
+            struct dpfs_hal_device *pf = &hal->devices[p];
+            int nvfs = __atomic_load_n(&pf->requested_vfs, __ATOMIC_RELAXED);
+            if (nvfs > hal->max_vfs)
+                nvfs = hal->max_vfs;
+
+            for (int v = 0; v < hal->max_vfs && keep_running; v++) {
+                uint16_t device_id = hal->npfs + p * hal->max_vfs + v;
+                struct dpfs_hal_device *dev = &hal->devices[device_id];
+                if (v < nvfs && !dev->present)
+                    dpfs_hal_hotplug_add(hal, device_id, pf->pf_id, v, load);
+                else if (v >= nvfs && dev->present)
+                    dpfs_hal_hotplug_remove(hal, dev);
+            }
         }
     }
 
     return NULL;
 }
 
-static void dpfs_hal_loop_static(struct dpfs_hal *hal)
+static void dpfs_hal_loop_threads(struct dpfs_hal *hal, void *(*thread_fn)(void *))
 {
     struct sigaction act;
     memset(&act, 0, sizeof(act));
@@ -242,15 +1240,55 @@ static void dpfs_hal_loop_static(struct dpfs_hal *hal)
 
     struct dpfs_hal_loop_thread tdatas[hal->nthreads];
 
+    struct dpfs_hal_queue **queues = calloc(hal->nthreads * hal->nqueues, sizeof(*queues));
+    if (!queues) {
+        warn("Failed to allocate the queue lists of the threads");
+        return;
+    }
+
+    // The queues are handed out here, before the manager thread can add or move any
+    uint64_t now = dpfs_hal_now_ns();
     for (int i = 0; i < hal->nthreads; i++) {
         tdatas[i].thread_id = i;
         tdatas[i].hal = hal;
-        // Only the first thread does mmio polling (sometimes)
-        if (pthread_create(&tdatas[i].thread, NULL, dpfs_hal_loop_static_thread, &tdatas[i])) {
+        tdatas[i].queues = &queues[i * hal->nqueues];
+        tdatas[i].nqueues = 0;
+        tdatas[i].inbox = NULL;
+        tdatas[i].queues_gen = hal->queues_gen;
+        tdatas[i].requests = 0;
+        tdatas[i].passes = 0;
+        tdatas[i].busy_passes = 0;
+        tdatas[i].stolen = 0;
+        for (int j = 0; j < hal->nqueues; j++) {
+            if (hal->queues[j].state == DPFS_HAL_QUEUE_ACTIVE && hal->queues[j].thread_id == i)
+                tdatas[i].queues[tdatas[i].nqueues++] = &hal->queues[j];
+        }
+        tdatas[i].nowned = tdatas[i].nqueues;
+        // Every queue starts out active, the idle ones drop out after activity_idle_usec
+        tdatas[i].nactive = tdatas[i].nqueues;
+        tdatas[i].idle_cursor = 0;
+        for (size_t j = 0; j < tdatas[i].nqueues; j++) {
+            tdatas[i].queues[j]->active = true;
+            tdatas[i].queues[j]->last_hit_ns = now;
+        }
+    }
+    hal->threads = tdatas;
+    hal->nrunning = hal->nthreads;
+
+    if (hal->nmd_threads > 0 && dpfs_hal_md_start(hal))
+        fprintf(stderr, "DPFS-HAL SNAP: the metadata requests will be handled by the polling threads\n");
+
+    for (int i = 0; i < hal->nthreads; i++) {
+        dpfs_hal_backoff_init(hal, &tdatas[i].backoff, i);
+        dpfs_hal_qos_awake(hal, &tdatas[i].backoff.awake, true);
+        if (pthread_create(&tdatas[i].thread, NULL, thread_fn, &tdatas[i])) {
             warn("Failed to create thread for io %d", i);
-            for (int j = 0; j < i; i++) {
+            for (int j = 0; j < i; j++) {
                 pthread_cancel(tdatas[j].thread);
             }
+            if (hal->md_threads)
+                dpfs_hal_md_stop(hal);
+            free(queues);
             return;
         }
     }
@@ -262,17 +1300,63 @@ static void dpfs_hal_loop_static(struct dpfs_hal *hal)
             for (int i = 0; i < hal->nthreads; i++) {
                 pthread_cancel(tdatas[i].thread);
             }
+            if (hal->md_threads)
+                dpfs_hal_md_stop(hal);
+            free(queues);
             return;
         }
         hal->mock_thread_running = true;
     }
 
+    if (hal->max_vfs > 0 || hal->min_threads < hal->nthreads) {
+        if (pthread_create(&hal->manager_thread, NULL, dpfs_hal_manager_thread, hal))
+            warn("Failed to create the manager thread, VFs will not be emulated and the pollers are not elastic");
+        else
+            hal->manager_thread_running = true;
+    }
+
     printf("DPFS-HAL SNAP: All device pollers are up and running.\n");
 
     // Wait for all the polling threads to stop
     for (int i = 0; i < hal->nthreads; i++) {
         pthread_join(tdatas[i].thread, NULL);
     }
+    if (hal->manager_thread_running) {
+        pthread_join(hal->manager_thread, NULL);
+        hal->manager_thread_running = false;
+    }
+    if (hal->md_threads)
+        dpfs_hal_md_stop(hal);
+    hal->threads = NULL;
+    free(queues);
+    if (hal->scheduler == DPFS_HAL_SCHED_DYNAMIC) {
+        for (int i = 0; i < hal->nthreads; i++) {
+            printf("DPFS-HAL SNAP: thread %d handled %lu requests of queues owned by other threads\n",
+                    i, tdatas[i].stolen);
+        }
+    }
+    if (hal->adaptive.enabled) {
+        for (int i = 0; i < hal->nthreads; i++) {
+            struct dpfs_hal_backoff *b = &tdatas[i].backoff;
+            uint64_t total_ns = 0;
+            for (int s = 0; s < DPFS_HAL_POLL_NSTATES; s++)
+                total_ns += b->state_ns[s];
+            printf("DPFS-HAL SNAP: thread %d found requests in %.2f%% of %lu polls, time spent:", i,
+                    b->polls ? 100.0 * b->hits / b->polls : 0.0, b->polls);
+            for (int s = 0; s < DPFS_HAL_POLL_NSTATES; s++)
+                printf(" %s %.2f%%", dpfs_hal_poll_state_names[s],
+                        total_ns ? 100.0 * b->state_ns[s] / total_ns : 0.0);
+            printf("\n");
+        }
+        for (int i = 0; i < hal->nqueues; i++) {
+            struct dpfs_hal_queue *q = &hal->queues[i];
+            if (!q->dev)
+                continue;
+            printf("DPFS-HAL SNAP: device %u (PF%u) queue %u found requests in %.2f%% of %lu polls\n",
+                    q->dev->device_id, q->dev->pf_id, q->queue_id,
+                    q->polls ? 100.0 * q->hits / q->polls : 0.0, q->polls);
+        }
+    }
     if (hal->nmock_devices > 0) {
         pthread_join(hal->mock_thread, NULL);
         hal->mock_thread_running = false;
@@ -284,8 +1368,15 @@ void dpfs_hal_loop(struct dpfs_hal *hal)
 {
     start_low_latency();
 
-    // Currently only static scheduling is supported
-    dpfs_hal_loop_static(hal);
+    switch (hal->scheduler) {
+    case DPFS_HAL_SCHED_DYNAMIC:
+        dpfs_hal_loop_threads(hal, dpfs_hal_loop_dynamic_thread);
+        break;
+    case DPFS_HAL_SCHED_STATIC:
+    default:
+        dpfs_hal_loop_threads(hal, dpfs_hal_loop_static_thread);
+        break;
+    }
 
     stop_low_latency();
 }
@@ -300,22 +1391,220 @@ struct dpfs_hal_completion_ctx {
 __attribute__((visibility("default")))
 int dpfs_hal_async_complete(void *completion_context, enum dpfs_hal_completion_status status)
 {
-    // Increment IO counter
-    // If timer is > 1 sec, calc the IOPS and reset the counter
-    struct snap_fs_dev_io_done_ctx *cb = completion_context;
-    enum snap_fs_dev_op_status snap_status = SNAP_FS_DEV_OP_IO_ERROR;
-    switch (status) {
-        case DPFS_HAL_COMPLETION_SUCCES:
-            snap_status = SNAP_FS_DEV_OP_SUCCESS;
+    if (async_done)
+        async_done(async_done_user_data, completion_context);
+    dpfs_hal_complete(completion_context, status);
+    stats_shm_async_complete(1);
+    return 0;
+}
+
+// SNAP has no bulk completion, so this is only a convenience for the backends
+__attribute__((visibility("default")))
+int dpfs_hal_async_complete_batch(void **completion_contexts,
+                                  enum dpfs_hal_completion_status *statuses, int n)
+{
+    for (int i = 0; i < n; i++) {
+        dpfs_hal_async_complete(completion_contexts[i],
+                statuses ? statuses[i] : DPFS_HAL_COMPLETION_SUCCES);
+    }
+    return 0;
+}
+
+// A request that a polling thread handed to a metadata thread. SNAP keeps the iovecs valid
+// until the request is completed, like with any asynchronous request
+struct dpfs_hal_md_req {
+    struct dpfs_hal_device *dev;
+    struct iovec *in_iov;
+    int in_iovcnt;
+    struct iovec *out_iov;
+    int out_iovcnt;
+    // A SNAP context or a dpfs_hal_cpl
+    void *completion_context;
+};
+
+struct dpfs_hal_md_thread {
+    pthread_t thread;
+    uint16_t thread_id;
+    struct dpfs_hal *hal;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    // Set while the thread waits for requests
+    bool waiting;
+    bool stop;
+    // The pollers add requests at tail and the thread takes them from head. The ring has room for
+    // every request that can be in flight on all the devices, so it never overflows
+    struct dpfs_hal_md_req *ring;
+    size_t mask;
+    size_t head;
+    size_t tail;
+};
+
+// The metadata thread takes at most this many requests from its ring at once
+#define DPFS_HAL_MD_BATCH 32
+
+// The requests that are routed to the metadata lane. Everything else (READ, WRITE, FSYNC, INIT,
+// and FORGET and INTERRUPT from the HiPrio queue) stays on the polling thread
+static inline bool dpfs_hal_is_metadata(const struct iovec *in_iov, int in_iovcnt)
+{
+    if (in_iovcnt < 1 || in_iov[0].iov_len < sizeof(struct fuse_in_header))
+        return false;
+
+    switch (((const struct fuse_in_header *) in_iov[0].iov_base)->opcode) {
+        case FUSE_LOOKUP:
+        case FUSE_GETATTR:
+        case FUSE_SETATTR:
+        case FUSE_READLINK:
+        case FUSE_SYMLINK:
+        case FUSE_MKNOD:
+        case FUSE_MKDIR:
+        case FUSE_UNLINK:
+        case FUSE_RMDIR:
+        case FUSE_RENAME:
+        case FUSE_RENAME2:
+        case FUSE_LINK:
+        case FUSE_OPEN:
+        case FUSE_OPENDIR:
+        case FUSE_CREATE:
+        case FUSE_RELEASE:
+        case FUSE_RELEASEDIR:
+        case FUSE_READDIR:
+        case FUSE_READDIRPLUS:
+        case FUSE_STATFS:
+        case FUSE_ACCESS:
+        case FUSE_FLUSH:
+        case FUSE_SETXATTR:
+        case FUSE_GETXATTR:
+        case FUSE_LISTXATTR:
+        case FUSE_REMOVEXATTR:
+            return true;
+        default:
+            return false;
+    }
+}
+
+static void dpfs_hal_md_submit(struct dpfs_hal *hal, const struct dpfs_hal_md_req *req)
+{
+    // All the metadata of a device is handled by the same thread
+    struct dpfs_hal_md_thread *mt = &hal->md_threads[req->dev->device_id % hal->nmd_threads];
+
+    pthread_mutex_lock(&mt->lock);
+    mt->ring[mt->tail++ & mt->mask] = *req;
+    bool wake = mt->waiting;
+    pthread_mutex_unlock(&mt->lock);
+    if (wake)
+        pthread_cond_signal(&mt->cond);
+}
+
+static void *dpfs_hal_md_thread(void *arg)
+{
+    struct dpfs_hal_md_thread *mt = arg;
+    struct dpfs_hal *hal = mt->hal;
+    struct dpfs_hal_md_req batch[DPFS_HAL_MD_BATCH];
+
+    pthread_setspecific(dpfs_hal_thread_id_key, (void *) (size_t) mt->thread_id);
+    stats_shm_thread_init(mt->thread_id);
+    int cpu = hal->md_thread_cpus[mt->thread_id - hal->nthreads];
+    if (cpu >= 0) {
+        int ret = placement_pin(cpu);
+        if (ret) {
+            errno = -ret;
+            warn("Could not set the CPU affinity of metadata thread %u, it will continue not pinned", mt->thread_id);
+        }
+    }
+
+    while (true) {
+        pthread_mutex_lock(&mt->lock);
+        while (mt->head == mt->tail && !mt->stop) {
+            mt->waiting = true;
+            pthread_cond_wait(&mt->cond, &mt->lock);
+            mt->waiting = false;
+        }
+        size_t n = 0;
+        while (mt->head != mt->tail && n < DPFS_HAL_MD_BATCH)
+            batch[n++] = mt->ring[mt->head++ & mt->mask];
+        bool stop = mt->stop && n == 0;
+        pthread_mutex_unlock(&mt->lock);
+        if (stop)
             break;
-        case DPFS_HAL_COMPLETION_ERROR:
-            snap_status = SNAP_FS_DEV_OP_IO_ERROR;
+
+        for (size_t i = 0; i < n; i++) {
+            struct dpfs_hal_md_req *req = &batch[i];
+            uint16_t device_id = req->dev->device_id;
+
+            if (hal->ops.poll_batch_begin)
+                hal->ops.poll_batch_begin(hal->user_data, device_id);
+            int ret = hal->ops.request_handler(hal->user_data, req->in_iov, req->in_iovcnt,
+                    req->out_iov, req->out_iovcnt, req->completion_context, device_id);
+            if (hal->ops.poll_batch_end)
+                hal->ops.poll_batch_end(hal->user_data, device_id);
+            dpfs_stats_request(stats_shm, mt->thread_id, device_id, ret);
+            // SNAP got EWOULDBLOCK from the polling thread, so complete it like an asynchronous request
+            if (ret != EWOULDBLOCK)
+                dpfs_hal_complete(req->completion_context, ret == 0 ? DPFS_HAL_COMPLETION_SUCCES : DPFS_HAL_COMPLETION_ERROR);
+        }
+    }
+
+    return NULL;
+}
+
+static int dpfs_hal_md_start(struct dpfs_hal *hal)
+{
+    size_t inflight = dpfs_hal_max_inflight(hal);
+    size_t size = 1;
+    while (size < inflight)
+        size <<= 1;
+
+    hal->md_threads = calloc(hal->nmd_threads, sizeof(*hal->md_threads));
+    if (!hal->md_threads) {
+        warn("Failed to allocate the metadata threads");
+        return -1;
+    }
+    for (uint16_t i = 0; i < hal->nmd_threads; i++) {
+        struct dpfs_hal_md_thread *mt = &hal->md_threads[i];
+        mt->thread_id = hal->nthreads + i;
+        mt->hal = hal;
+        mt->mask = size - 1;
+        mt->ring = calloc(size, sizeof(*mt->ring));
+        pthread_mutex_init(&mt->lock, NULL);
+        pthread_cond_init(&mt->cond, NULL);
+        if (!mt->ring || pthread_create(&mt->thread, NULL, dpfs_hal_md_thread, mt)) {
+            warn("Failed to create metadata thread %u", mt->thread_id);
+            free(mt->ring);
+            hal->nmd_threads = i;
             break;
+        }
     }
-    cb->cb(snap_status, cb->user_arg);
+    if (hal->nmd_threads == 0) {
+        free(hal->md_threads);
+        hal->md_threads = NULL;
+        return -1;
+    }
+    __atomic_store_n(&hal->md_running, true, __ATOMIC_RELEASE);
     return 0;
 }
 
+// The devices are suspended, so no requests are in flight anymore
+static void dpfs_hal_md_stop(struct dpfs_hal *hal)
+{
+    __atomic_store_n(&hal->md_running, false, __ATOMIC_RELEASE);
+    for (uint16_t i = 0; i < hal->nmd_threads; i++) {
+        struct dpfs_hal_md_thread *mt = &hal->md_threads[i];
+        pthread_mutex_lock(&mt->lock);
+        mt->stop = true;
+        pthread_mutex_unlock(&mt->lock);
+        pthread_cond_signal(&mt->cond);
+    }
+    for (uint16_t i = 0; i < hal->nmd_threads; i++) {
+        struct dpfs_hal_md_thread *mt = &hal->md_threads[i];
+        pthread_join(mt->thread, NULL);
+        pthread_mutex_destroy(&mt->lock);
+        pthread_cond_destroy(&mt->cond);
+        free(mt->ring);
+    }
+    free(hal->md_threads);
+    hal->md_threads = NULL;
+}
+
 static int dpfs_hal_handle_req(struct virtio_fs_ctrl *ctrl,
                             struct iovec *in_iov, int in_iovcnt,
                             struct iovec *out_iov, int out_iovcnt,
@@ -323,12 +1612,32 @@ static int dpfs_hal_handle_req(struct virtio_fs_ctrl *ctrl,
 {
     struct dpfs_hal_device *dev = ctrl->virtiofs_emu;
     struct dpfs_hal *hal = dev->hal;
+    void *completion_context = dpfs_hal_cpl_get(dpfs_hal_polled_queue, done_ctx);
+
+    if (__atomic_load_n(&hal->md_running, __ATOMIC_ACQUIRE) && dpfs_hal_is_metadata(in_iov, in_iovcnt)) {
+        struct dpfs_hal_md_req req = {
+            .dev = dev,
+            .in_iov = in_iov,
+            .in_iovcnt = in_iovcnt,
+            .out_iov = out_iov,
+            .out_iovcnt = out_iovcnt,
+            .completion_context = completion_context,
+        };
+        dpfs_hal_md_submit(hal, &req);
+        return EWOULDBLOCK;
+    }
 
-    return hal->ops.request_handler(hal->user_data, in_iov, in_iovcnt, out_iov, out_iovcnt, done_ctx, dev->device_id);
+    int ret = hal->ops.request_handler(hal->user_data, in_iov, in_iovcnt, out_iov, out_iovcnt,
+            completion_context, dev->device_id);
+    dpfs_stats_request(stats_shm, dpfs_hal_thread_id(), dev->device_id, ret);
+    // SNAP completes the synchronous requests itself
+    if (ret != EWOULDBLOCK)
+        dpfs_hal_cpl_put(completion_context);
+    return ret;
 }
 
 static int dpfs_hal_init_dev(struct dpfs_hal *hal, struct dpfs_hal_device *dev, uint16_t device_id,
-        char *emu_manager, int pf_id, char *tag, int qd)
+        char *emu_manager, int pf_id, int vf_id, char *tag, int qd, uint16_t nqueues, struct dpfs_hal_queue *queues)
 {
     char *full_tag;
     int ret = asprintf(&full_tag, "%s-%u", tag, device_id);
@@ -339,16 +1648,17 @@ static int dpfs_hal_init_dev(struct dpfs_hal *hal, struct dpfs_hal_device *dev,
 
     struct virtio_fs_ctrl_init_attr param;
     param.emu_manager_name = emu_manager;
-    // A single device could be shared amongst multiple polling threads, but because of locking
-    // in SNAP, there is no point in doing this. So a device is owned by a single thread
-    param.nthreads = 1;
+    // SNAP creates a poll group per "thread" and spreads the virtqueues evenly over them.
+    // With a poll group per virtqueue, the HiPrio virtqueue (the first) ends up alone in poll group 0.
+    // Every other poll group is a queue for us, that is polled by a single DPFS thread
+    param.nthreads = 1 + nqueues;
     param.tag = full_tag;
     param.pf_id = pf_id;
-    param.vf_id = -1;
+    param.vf_id = vf_id;
 
     param.dev_type = "virtiofs_emu";
-    // one for HiPrio and one for Requests
-    param.num_queues = 2;
+    // one for HiPrio and the rest for Requests
+    param.num_queues = 1 + nqueues;
     // Must be an order of 2 or you will get err 121
     // queue slots that are left unused significantly decrease performance because of the SNAP poller
     param.queue_depth = qd;
@@ -358,13 +1668,19 @@ static int dpfs_hal_init_dev(struct dpfs_hal *hal, struct dpfs_hal_device *dev,
     param.recover = false;
     param.suspended = false;
     param.virtiofs_emu_handle_req = dpfs_hal_handle_req;
-    param.vf_change_cb = NULL;
-    param.vf_change_cb_arg = NULL;
+    // SR-IOV, the VFs of a PF are created at runtime when the host enables them
+    param.vf_change_cb = vf_id < 0 && hal->max_vfs > 0 ? dpfs_hal_vf_change : NULL;
+    param.vf_change_cb_arg = dev;
     param.virtiofs_emu = dev;
 
+    // Before SNAP can call the vf_change_cb
+    dev->requested_vfs = 0;
     struct virtio_fs_ctrl *snap_ctrl = virtio_fs_ctrl_init(&param);
     if (!snap_ctrl) {
-        fprintf(stderr, "failed to initialize virtio-fs device using SNAP on PF %u\n", param.pf_id);
+        if (vf_id < 0)
+            fprintf(stderr, "failed to initialize virtio-fs device using SNAP on PF %u\n", param.pf_id);
+        else
+            fprintf(stderr, "failed to initialize virtio-fs device using SNAP on PF %u VF %d\n", param.pf_id, vf_id);
         free(full_tag);
         return -1;
     }
@@ -372,12 +1688,33 @@ static int dpfs_hal_init_dev(struct dpfs_hal *hal, struct dpfs_hal_device *dev,
     dev->snap_ctrl = snap_ctrl;
     dev->device_id = device_id;
     dev->pf_id = pf_id;
+    dev->vf_id = vf_id;
     dev->hal = hal;
     dev->tag = full_tag;
+    dev->nqueues = nqueues;
+    dev->queues = queues;
+    dev->suspending = false;
+    dev->initialising = true;
+    dev->mmio_period = hal->mmio_period;
+    dev->mmio_deadline = 0;
+    for (uint16_t i = 0; queues && i < nqueues; i++) {
+        queues[i].dev = dev;
+        queues[i].queue_id = i;
+        queues[i].polls = 0;
+        queues[i].hits = 0;
+        queues[i].released = false;
+    }
 
     if (hal->ops.register_device)
         hal->ops.register_device(hal->user_data, device_id);
 
+    pthread_mutex_lock(&hal->devices_lock);
+    dev->present = true;
+    pthread_mutex_unlock(&hal->devices_lock);
+    // Only now the queues can be polled, with the dynamic scheduler by any thread
+    for (uint16_t i = 0; queues && i < nqueues; i++)
+        __atomic_store_n(&queues[i].state, DPFS_HAL_QUEUE_ACTIVE, __ATOMIC_RELEASE);
+
     return 0;
 }
 
@@ -385,6 +1722,12 @@ static void dpfs_hal_destroy_dev(struct dpfs_hal_device *dev)
 {
     struct dpfs_hal *hal = dev->hal;
 
+    pthread_mutex_lock(&hal->devices_lock);
+    dev->present = false;
+    pthread_mutex_unlock(&hal->devices_lock);
+    for (uint16_t i = 0; dev->queues && i < dev->nqueues; i++)
+        dev->queues[i].state = DPFS_HAL_QUEUE_ABSENT;
+
     if (hal->ops.unregister_device)
         hal->ops.unregister_device(hal->user_data, dev->device_id);
 
@@ -392,6 +1735,32 @@ static void dpfs_hal_destroy_dev(struct dpfs_hal_device *dev)
     free(dev->tag);
 }
 
+// The polling threads run on the hal_pollers of [placement], or by default on the last CPUs
+// with two threads and 8 total cores:
+// thread 0 will occupy core 7
+// thread 1 will occupy core 6
+static int dpfs_hal_resolve_thread_cpus(const struct placement *p, int nthreads, int *cpus)
+{
+    long num_cpus = sysconf(_SC_NPROCESSORS_CONF);
+
+    if (p->ncpus[PLACEMENT_HAL_POLLERS] > 0 && p->ncpus[PLACEMENT_HAL_POLLERS] != nthreads) {
+        fprintf(stderr, "%s: [placement] hal_pollers must contain a CPU for each of the nthreads polling threads!\n", __func__);
+        return -EINVAL;
+    }
+    for (int i = 0; i < nthreads; i++) {
+        int cpu = placement_cpu(p, PLACEMENT_HAL_POLLERS, i);
+        if (cpu == -1)
+            cpu = num_cpus - 1 - i;
+        if (cpu < 0 || placement_conflicts(p, PLACEMENT_HAL_POLLERS, cpu)) {
+            fprintf(stderr, "%s: polling thread %d would run on CPU %d, which is not available."
+                    " Hint: set hal_pollers in [placement]\n", __func__, i, cpu);
+            return -EINVAL;
+        }
+        cpus[i] = cpu;
+    }
+    return 0;
+}
+
 __attribute__((visibility("default")))
 struct dpfs_hal *dpfs_hal_new(struct dpfs_hal_params *params, bool start_mock_thread)
 {
@@ -453,15 +1822,133 @@ struct dpfs_hal *dpfs_hal_new(struct dpfs_hal_params *params, bool start_mock_th
         fprintf(stderr, "%s: nthreads must be >= 1!", __func__);
         return NULL;
     }
-    if (nthreads.u.i > toml_array_nelem(pf_ids)) {
-        fprintf(stderr, "%s: nthreads value invalid! there cannot be more threads than virtio-fs devices\n", __func__);
+    toml_datum_t min_threads = toml_int_in(snap_conf, "min_threads"); // optional
+    if (min_threads.ok && (min_threads.u.i < 1 || min_threads.u.i > nthreads.u.i)) {
+        fprintf(stderr, "%s: min_threads must be in the range [1, nthreads]\n", __func__);
+        return NULL;
+    }
+    toml_datum_t grow_pct = toml_int_in(snap_conf, "elastic_grow_pct"); // optional
+    toml_datum_t shrink_pct = toml_int_in(snap_conf, "elastic_shrink_pct"); // optional
+    int64_t elastic_grow_pct = grow_pct.ok ? grow_pct.u.i : 50;
+    int64_t elastic_shrink_pct = shrink_pct.ok ? shrink_pct.u.i : 20;
+    if (elastic_shrink_pct < 0 || elastic_shrink_pct >= elastic_grow_pct || elastic_grow_pct > 100) {
+        fprintf(stderr, "%s: elastic polling requires 0 <= elastic_shrink_pct < elastic_grow_pct <= 100\n", __func__);
         return NULL;
     }
+    int64_t nqueues = 1;
+    toml_datum_t request_queues = toml_int_in(snap_conf, "virtio_request_queues"); // optional
+    if (request_queues.ok) {
+        if (request_queues.u.i < 1 || request_queues.u.i > DPFS_HAL_NUM_QUEUES - 1) {
+            fprintf(stderr, "%s: virtio_request_queues must be >= 1 and <= %d!\n", __func__, DPFS_HAL_NUM_QUEUES - 1);
+            return NULL;
+        }
+        nqueues = request_queues.u.i;
+    }
+    int64_t max_vfs = 0;
+    toml_datum_t max_vfs_conf = toml_int_in(snap_conf, "max_vfs"); // optional
+    if (max_vfs_conf.ok) {
+        if (max_vfs_conf.u.i < 0 || toml_array_nelem(pf_ids) * (1 + max_vfs_conf.u.i) > UINT16_MAX / 2) {
+            fprintf(stderr, "%s: max_vfs must be >= 0 and all the PFs and VFs together must be less than %d!\n",
+                    __func__, UINT16_MAX / 2);
+            return NULL;
+        }
+        max_vfs = max_vfs_conf.u.i;
+    }
+    // The VF slots count, the threads that don't own a queue of a PF start out without any
+    if (nthreads.u.i > toml_array_nelem(pf_ids) * (1 + max_vfs) * nqueues) {
+        fprintf(stderr, "%s: nthreads value invalid! there cannot be more threads than virtio-fs request queues"
+                " of the PFs and VFs\n", __func__);
+        return NULL;
+    }
+    toml_array_t *queue_threads = toml_array_in(snap_conf, "queue_threads"); // optional
+    if (queue_threads && toml_array_nelem(queue_threads) == 0)
+        queue_threads = NULL;
+    if (queue_threads) {
+        if (toml_array_kind(queue_threads) != 'v' ||
+                toml_array_nelem(queue_threads) != toml_array_nelem(pf_ids) * nqueues) {
+            fprintf(stderr, "%s: the optional queue_threads must be an array with a thread id for"
+                    " each request queue of each device in pf_ids!\n", __func__);
+            return NULL;
+        }
+        bool owns_queue[nthreads.u.i];
+        memset(owns_queue, 0, sizeof(owns_queue));
+        for (int i = 0; i < toml_array_nelem(queue_threads); i++) {
+            toml_datum_t t = toml_int_at(queue_threads, i);
+            if (!t.ok || t.u.i < 0 || t.u.i >= nthreads.u.i) {
+                fprintf(stderr, "%s: All queue_threads must be thread ids in the range [0, nthreads)!\n", __func__);
+                return NULL;
+            }
+            owns_queue[t.u.i] = true;
+        }
+        // Without VFs a thread without a queue would never poll anything
+        for (int i = 0; i < nthreads.u.i && max_vfs == 0; i++) {
+            if (!owns_queue[i]) {
+                fprintf(stderr, "%s: queue_threads must assign at least one queue to every thread!\n", __func__);
+                return NULL;
+            }
+        }
+    }
     toml_datum_t polling_interval = toml_int_in(snap_conf, "polling_interval_usec");
     if (!polling_interval.ok || polling_interval.u.i < 0 ) {
         fprintf(stderr, "%s: polling_interval_usec must be >= 0\n!", __func__);
         return NULL;
     }
+    toml_datum_t mmio_period = toml_int_in(snap_conf, "mmio_period_usec"); // optional
+    toml_datum_t mmio_fast_period = toml_int_in(snap_conf, "mmio_fast_period_usec"); // optional
+    if ((mmio_period.ok && mmio_period.u.i < 1) || (mmio_fast_period.ok && mmio_fast_period.u.i < 1)) {
+        fprintf(stderr, "%s: mmio_period_usec and mmio_fast_period_usec must be at least 1\n", __func__);
+        return NULL;
+    }
+    struct dpfs_hal_adaptive_conf adaptive = {
+        .enabled = false,
+        .spin_min_usec = 20,
+        .spin_max_usec = 200,
+        .yield_usec = 100,
+        .wait_usec = 0,
+        .sleep_min_usec = 50,
+        .sleep_max_usec = 1000,
+    };
+    toml_datum_t adaptive_polling = toml_bool_in(snap_conf, "adaptive_polling"); // optional
+    if (adaptive_polling.ok && adaptive_polling.u.b) {
+        adaptive.enabled = true;
+        const char *keys[] = { "adaptive_spin_min_usec", "adaptive_spin_max_usec", "adaptive_yield_usec",
+            "adaptive_sleep_min_usec", "adaptive_sleep_max_usec", "adaptive_wait_usec" };
+        uint64_t vals[] = { adaptive.spin_min_usec, adaptive.spin_max_usec, adaptive.yield_usec,
+            adaptive.sleep_min_usec, adaptive.sleep_max_usec, adaptive.wait_usec };
+        for (int i = 0; i < sizeof(keys) / sizeof(keys[0]); i++) {
+            toml_datum_t d = toml_int_in(snap_conf, keys[i]); // optional
+            if (!d.ok)
+                continue;
+            if (d.u.i < 0 || d.u.i > UINT32_MAX) {
+                fprintf(stderr, "%s: %s must be >= 0\n", __func__, keys[i]);
+                return NULL;
+            }
+            vals[i] = d.u.i;
+        }
+        adaptive.spin_min_usec = vals[0];
+        adaptive.spin_max_usec = vals[1];
+        adaptive.yield_usec = vals[2];
+        adaptive.sleep_min_usec = vals[3];
+        adaptive.sleep_max_usec = vals[4];
+        adaptive.wait_usec = vals[5];
+        if (adaptive.spin_min_usec > adaptive.spin_max_usec || adaptive.sleep_min_usec < 1 ||
+                adaptive.sleep_min_usec > adaptive.sleep_max_usec) {
+            fprintf(stderr, "%s: adaptive polling requires spin_min_usec <= spin_max_usec and"
+                    " 1 <= sleep_min_usec <= sleep_max_usec\n", __func__);
+            return NULL;
+        }
+        if (polling_interval.u.i > 0) {
+            printf("%s: polling_interval_usec is ignored because adaptive_polling is enabled\n", __func__);
+            polling_interval.u.i = 0;
+        }
+    }
+    toml_datum_t completion_handoff = toml_bool_in(snap_conf, "completion_handoff"); // optional
+    toml_datum_t activity_polling = toml_bool_in(snap_conf, "activity_polling"); // optional
+    toml_datum_t activity_idle = toml_int_in(snap_conf, "activity_idle_usec"); // optional
+    if (activity_idle.ok && activity_idle.u.i < 1) {
+        fprintf(stderr, "%s: activity_idle_usec must be at least 1\n", __func__);
+        return NULL;
+    }
     toml_datum_t tag = toml_string_in(snap_conf, "tag");
     if (!tag.ok) {
         fprintf(stderr, "%s: a virtio-fs file system tag in the form of a string must be supplied!"
@@ -495,18 +1982,113 @@ struct dpfs_hal *dpfs_hal_new(struct dpfs_hal_params *params, bool start_mock_th
     }
     if (toml_array_nelem(mock_pf_ids) == 0)
         mock_pf_ids = NULL;
+    toml_datum_t md_threads = toml_int_in(snap_conf, "metadata_threads"); // optional
+    if (md_threads.ok && (md_threads.u.i < 0 || nthreads.u.i + md_threads.u.i > DPFS_STATS_MAX_THREADS)) {
+        fprintf(stderr, "%s: metadata_threads must be >= 0 and nthreads + metadata_threads <= %d\n",
+                __func__, DPFS_STATS_MAX_THREADS);
+        return NULL;
+    }
+    toml_datum_t stats_shm_name = toml_string_in(snap_conf, "stats_shm_name"); // optional
+    if (stats_shm_name.ok && stats_shm_name.u.s[0] == '\0') {
+        free(stats_shm_name.u.s);
+        stats_shm_name.ok = false;
+    }
+    enum dpfs_hal_scheduler scheduler = DPFS_HAL_SCHED_STATIC;
+    toml_datum_t sched = toml_string_in(snap_conf, "scheduler"); // optional
+    if (sched.ok) {
+        if (strcmp(sched.u.s, "static") == 0) {
+            scheduler = DPFS_HAL_SCHED_STATIC;
+        } else if (strcmp(sched.u.s, "dynamic") == 0) {
+            scheduler = DPFS_HAL_SCHED_DYNAMIC;
+        } else {
+            fprintf(stderr, "%s: the optional scheduler must be either \"static\" or \"dynamic\"!\n", __func__);
+            free(sched.u.s);
+            if (stats_shm_name.ok)
+                free(stats_shm_name.u.s);
+            return NULL;
+        }
+        free(sched.u.s);
+    }
+    struct placement placement;
+    if (placement_parse(conf, &placement)) {
+        if (stats_shm_name.ok)
+            free(stats_shm_name.u.s);
+        return NULL;
+    }
 
     struct dpfs_hal *hal = calloc(1, sizeof(struct dpfs_hal));
     hal->polling_interval_usec = polling_interval.u.i;
+    hal->mmio_period = (mmio_period.ok ? mmio_period.u.i : 1000) * cycles_per_usec();
+    hal->mmio_fast_period = (mmio_fast_period.ok ? mmio_fast_period.u.i : 50) * cycles_per_usec();
     hal->user_data = params->user_data;
     hal->ops = params->ops;
+    async_done = params->ops.async_done;
+    async_done_user_data = params->user_data;
     hal->nthreads = nthreads.u.i;
-    hal->ndevices = toml_array_nelem(pf_ids);
+    hal->min_threads = min_threads.ok ? min_threads.u.i : nthreads.u.i;
+    hal->nrunning = hal->nthreads;
+    hal->elastic_grow_pct = elastic_grow_pct;
+    hal->elastic_shrink_pct = elastic_shrink_pct;
+    hal->scheduler = scheduler;
+    hal->adaptive = adaptive;
+    hal->activity_polling = activity_polling.ok && activity_polling.u.b;
+    hal->activity_idle_ns = (activity_idle.ok ? activity_idle.u.i : 1000) * 1000;
+    hal->stats_shm_name = stats_shm_name.ok ? stats_shm_name.u.s : NULL;
+    hal->thread_cpus = calloc(hal->nthreads, sizeof(*hal->thread_cpus));
+    hal->nmd_threads = md_threads.ok ? md_threads.u.i : 0;
+    hal->mock_thread_id = hal->nthreads + hal->nmd_threads;
+    hal->md_thread_cpus = calloc(hal->nmd_threads + 1, sizeof(*hal->md_thread_cpus));
+    hal->npfs = toml_array_nelem(pf_ids);
+    hal->max_vfs = max_vfs;
+    hal->ndevices = hal->npfs * (1 + max_vfs);
     hal->devices = calloc(hal->ndevices, sizeof(*hal->devices));
+    hal->dev_nqueues = nqueues;
+    hal->nqueues = hal->ndevices * nqueues;
+    hal->queues = calloc(hal->nqueues, sizeof(*hal->queues));
+    hal->emu_manager = emu_manager.u.s;
+    hal->tag = tag.u.s;
+    hal->queue_depth = qd.u.i;
+    pthread_mutex_init(&hal->devices_lock, NULL);
+    pthread_mutex_init(&hal->park_lock, NULL);
+    pthread_cond_init(&hal->park_cond, NULL);
+    pthread_mutex_init(&hal->qos.lock, NULL);
+    if (completion_handoff.ok && completion_handoff.u.b) {
+        // Queue 0 also carries the HiPrio virtqueue
+        size_t per_queue = 2 * (size_t) qd.u.i;
+        hal->cpl_slots = calloc(hal->nqueues * per_queue, sizeof(*hal->cpl_slots));
+        for (size_t i = 0; hal->cpl_slots && i < hal->nqueues * per_queue; i++) {
+            struct dpfs_hal_queue *q = &hal->queues[i / per_queue];
+            hal->cpl_slots[i].q = q;
+            hal->cpl_slots[i].next = q->cpl_free;
+            q->cpl_free = &hal->cpl_slots[i];
+        }
+        if (!hal->cpl_slots) {
+            fprintf(stderr, "%s: couldn't allocate memory for the completion handoff\n", __func__);
+            goto out;
+        }
+    }
+    // The VF slots get their owners when the VFs are hot-added
+    for (int i = 0; i < hal->npfs * nqueues; i++) {
+        if (queue_threads)
+            hal->queues[i].thread_id = toml_int_at(queue_threads, i).u.i;
+        else
+            hal->queues[i].thread_id = dpfs_hal_default_queue_thread(hal, i / nqueues, i % nqueues, nqueues);
+    }
     if (mock_pf_ids) {
         hal->nmock_devices = toml_array_nelem(mock_pf_ids);
         hal->mock_devices = calloc(hal->nmock_devices, sizeof(*hal->mock_devices));
     }
+    if (dpfs_hal_resolve_thread_cpus(&placement, hal->nthreads, hal->thread_cpus)) {
+        goto out;
+    }
+    if (placement.ncpus[PLACEMENT_METADATA_THREADS] > 0 &&
+            placement.ncpus[PLACEMENT_METADATA_THREADS] != hal->nmd_threads) {
+        fprintf(stderr, "%s: [placement] metadata_threads must contain a CPU for each of the metadata_threads\n", __func__);
+        goto out;
+    }
+    // Not pinned by default
+    for (uint16_t i = 0; i < hal->nmd_threads; i++)
+        hal->md_thread_cpus[i] = placement_cpu(&placement, PLACEMENT_METADATA_THREADS, i);
 
     // Initialize the thread-local key we use to tell each of the Virtio
     // polling threads, which thread id it has
@@ -526,12 +2108,18 @@ struct dpfs_hal *dpfs_hal_new(struct dpfs_hal_params *params, bool start_mock_th
         goto out;
     };
 
+    // Before the devices, so that no request goes uncounted
+    if (hal->stats_shm_name && stats_shm_create(hal->stats_shm_name, "snap", dpfs_hal_nthreads(hal), hal->ndevices)) {
+        goto clear_pci_list;
+    }
+
     uint16_t device_id = 0;
-    for (uint16_t i = 0; i < hal->ndevices; i++) {
+    for (uint16_t i = 0; i < hal->npfs; i++) {
         toml_datum_t pf = toml_int_at(pf_ids, i);
 
         struct dpfs_hal_device *dev = &hal->devices[i];
-        int ret = dpfs_hal_init_dev(hal, dev, device_id, emu_manager.u.s, pf.u.i, tag.u.s, qd.u.i);
+        int ret = dpfs_hal_init_dev(hal, dev, device_id, emu_manager.u.s, pf.u.i, -1, tag.u.s, qd.u.i,
+                nqueues, &hal->queues[i * nqueues]);
         if (ret) {
             for (uint16_t j = 0; j < i; j++) {
                 dpfs_hal_destroy_dev(&hal->devices[j]);
@@ -540,17 +2128,20 @@ struct dpfs_hal *dpfs_hal_new(struct dpfs_hal_params *params, bool start_mock_th
         }
         device_id++;
     }
+    // The device ids in between are for the VFs
+    device_id = hal->ndevices;
 
     for (uint16_t i = 0; i < hal->nmock_devices; i++) {
         toml_datum_t pf = toml_int_at(mock_pf_ids, i);
 
         struct dpfs_hal_device *dev = &hal->mock_devices[i];
-        int ret = dpfs_hal_init_dev(hal, dev, device_id, emu_manager.u.s, pf.u.i, tag.u.s, qd.u.i);
+        // Mock devices are only polled once a second by the mock thread
+        int ret = dpfs_hal_init_dev(hal, dev, device_id, emu_manager.u.s, pf.u.i, -1, tag.u.s, qd.u.i, 1, NULL);
         if (ret) {
             for (uint16_t j = 0; j < i; j++) {
                 dpfs_hal_destroy_dev(&hal->mock_devices[j]);
             }
-            for (uint16_t j = 0; j < hal->ndevices; j++) {
+            for (uint16_t j = 0; j < hal->npfs; j++) {
                 dpfs_hal_destroy_dev(&hal->devices[j]);
             }
             goto clear_pci_list;
@@ -564,7 +2155,7 @@ struct dpfs_hal *dpfs_hal_new(struct dpfs_hal_params *params, bool start_mock_th
             for (uint16_t i = 0; i < hal->nmock_devices; i++) {
                 dpfs_hal_destroy_dev(&hal->mock_devices[i]);
             }
-            for (uint16_t i = 0; i < hal->ndevices; i++) {
+            for (uint16_t i = 0; i < hal->npfs; i++) {
                 dpfs_hal_destroy_dev(&hal->devices[i]);
             }
             goto clear_pci_list;
@@ -576,18 +2167,40 @@ struct dpfs_hal *dpfs_hal_new(struct dpfs_hal_params *params, bool start_mock_th
     printf("The virtio-fs device with tag \"%s\" is running on emulation manager \"%s\" (",
         tag.u.s, emu_manager.u.s);
     printf("PF%u", hal->devices[0].pf_id);
-    for (uint16_t i = 1; i < hal->ndevices; i++)
+    for (uint16_t i = 1; i < hal->npfs; i++)
             printf(", PF%u", hal->devices[i].pf_id);
     printf(") and ready to be consumed by the host\n");
+    if (hal->max_vfs > 0)
+        printf("Up to %u VFs per PF will be emulated when the host enables them\n", hal->max_vfs);
+    if (nqueues > 1) {
+        for (int i = 0; i < hal->npfs * nqueues; i++) {
+            printf("DPFS-HAL SNAP: device %d queue %d is polled by thread %u\n",
+                    i / (int) nqueues, i % (int) nqueues, hal->queues[i].thread_id);
+        }
+    }
+    placement_print(&placement);
+    for (uint16_t i = 0; i < hal->nthreads; i++)
+        printf("DPFS-HAL SNAP: polling thread %u runs on CPU %d\n", i, hal->thread_cpus[i]);
 
     return hal;
 
 clear_pci_list:
+    if (hal->stats_shm_name)
+        stats_shm_destroy(hal->stats_shm_name);
     mlnx_snap_pci_manager_clear();
 out:
+    pthread_mutex_destroy(&hal->devices_lock);
+    pthread_mutex_destroy(&hal->park_lock);
+    pthread_cond_destroy(&hal->park_cond);
+    pthread_mutex_destroy(&hal->qos.lock);
+    free(hal->stats_shm_name);
+    free(hal->thread_cpus);
+    free(hal->md_thread_cpus);
     free(tag.u.s);
     free(emu_manager.u.s);
     free(hal->devices);
+    free(hal->queues);
+    free(hal->cpl_slots);
     if (hal->mock_devices)
         free(hal->mock_devices);
     free(hal);
@@ -598,7 +2211,10 @@ out:
 __attribute__((visibility("default")))
 void dpfs_hal_destroy(struct dpfs_hal *hal)
 {
-    printf("DPFS HAL destroying %d virtio-fs devices on SNAP RDMA device %s\n", hal->ndevices + hal->nmock_devices,
+    int ndevices = hal->nmock_devices;
+    for (uint16_t i = 0; i < hal->ndevices; i++)
+        ndevices += hal->devices[i].present;
+    printf("DPFS HAL destroying %d virtio-fs devices on SNAP RDMA device %s\n", ndevices,
             hal->devices[0].snap_ctrl->sctx->context->device->name);
 
     if (hal->mock_thread_running) {
@@ -607,14 +2223,28 @@ void dpfs_hal_destroy(struct dpfs_hal *hal)
     }
 
     for (uint16_t i = 0; i < hal->ndevices; i++) {
-        dpfs_hal_destroy_dev(&hal->devices[i]);
+        if (hal->devices[i].present)
+            dpfs_hal_destroy_dev(&hal->devices[i]);
     }
     for (uint16_t i = 0; i < hal->nmock_devices; i++) {
         dpfs_hal_destroy_dev(&hal->mock_devices[i]);
     }
     mlnx_snap_pci_manager_clear();
-
+    if (hal->stats_shm_name)
+        stats_shm_destroy(hal->stats_shm_name);
+
+    pthread_mutex_destroy(&hal->devices_lock);
+    pthread_mutex_destroy(&hal->park_lock);
+    pthread_cond_destroy(&hal->park_cond);
+    pthread_mutex_destroy(&hal->qos.lock);
+    free(hal->stats_shm_name);
+    free(hal->thread_cpus);
+    free(hal->md_thread_cpus);
+    free(hal->emu_manager);
+    free(hal->tag);
     free(hal->devices);
+    free(hal->queues);
+    free(hal->cpl_slots);
     if (hal->mock_devices)
         free(hal->mock_devices);
     free(hal);
@@ -0,0 +1,98 @@
+/*
+#
+# Copyright 2023- IBM Inc. All rights reserved
+# SPDX-License-Identifier: LGPL-2.1-or-later
+#
+*/
+
+#include <stdint.h>
+#include <stdio.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#include "stats_shm.h"
+
+struct dpfs_stats *stats_shm = NULL;
+// The counters of the DPFS thread that runs this, NULL on all the other threads
+static __thread struct dpfs_stats_thread *stats_shm_self = NULL;
+
+__attribute__((visibility("default")))
+struct dpfs_stats *dpfs_hal_stats(void)
+{
+    return stats_shm;
+}
+
+int stats_shm_create(const char *name, const char *hal, uint16_t nthreads, uint16_t ndevices)
+{
+    if (nthreads > DPFS_STATS_MAX_THREADS || ndevices > DPFS_STATS_MAX_DEVICES) {
+        fprintf(stderr, "%s: only the first %d threads and %d devices will have statistics\n",
+                __func__, DPFS_STATS_MAX_THREADS, DPFS_STATS_MAX_DEVICES);
+    }
+
+    int fd = shm_open(name, O_CREAT | O_TRUNC | O_RDWR, 0644);
+    if (fd == -1) {
+        fprintf(stderr, "%s: cannot create shared memory segment %s - %s\n", __func__,
+                name, strerror(errno));
+        return -errno;
+    }
+    if (ftruncate(fd, sizeof(struct dpfs_stats)) == -1) {
+        int ret = -errno;
+        fprintf(stderr, "%s: cannot size shared memory segment %s - %s\n", __func__,
+                name, strerror(errno));
+        close(fd);
+        shm_unlink(name);
+        return ret;
+    }
+    struct dpfs_stats *s = mmap(NULL, sizeof(*s), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (s == MAP_FAILED) {
+        int ret = -errno;
+        fprintf(stderr, "%s: cannot map shared memory segment %s - %s\n", __func__,
+                name, strerror(errno));
+        shm_unlink(name);
+        return ret;
+    }
+
+    // The segment is zeroed by ftruncate
+    s->version = DPFS_STATS_VERSION;
+    s->pid = getpid();
+    s->start_time = time(NULL);
+    s->nthreads = nthreads < DPFS_STATS_MAX_THREADS ? nthreads : DPFS_STATS_MAX_THREADS;
+    s->ndevices = ndevices < DPFS_STATS_MAX_DEVICES ? ndevices : DPFS_STATS_MAX_DEVICES;
+    strncpy(s->hal, hal, sizeof(s->hal) - 1);
+    __atomic_store_n(&s->magic, DPFS_STATS_MAGIC, __ATOMIC_RELEASE);
+
+    stats_shm = s;
+    printf("DPFS-HAL: publishing runtime statistics in shared memory segment %s\n", name);
+    return 0;
+}
+
+void stats_shm_destroy(const char *name)
+{
+    if (!stats_shm)
+        return;
+
+    struct dpfs_stats *s = stats_shm;
+    stats_shm = NULL;
+    // Readers that still have it mapped see that the process is gone
+    __atomic_store_n(&s->magic, 0, __ATOMIC_RELEASE);
+    munmap(s, sizeof(*s));
+    shm_unlink(name);
+}
+
+void stats_shm_thread_init(uint16_t thread_id)
+{
+    stats_shm_self = dpfs_stats_thread(stats_shm, thread_id);
+}
+
+void stats_shm_async_complete(int n)
+{
+    if (stats_shm_self)
+        dpfs_stats_add(&stats_shm_self->async_completions, n);
+    else if (stats_shm)
+        dpfs_stats_add_shared(&stats_shm->external_async_completions, n);
+}
@@ -0,0 +1,25 @@
+/*
+#
+# Copyright 2023- IBM Inc. All rights reserved
+# SPDX-License-Identifier: LGPL-2.1-or-later
+#
+*/
+
+#ifndef STATS_SHM_H
+#define STATS_SHM_H
+
+#include <stdint.h>
+#include "stats.h"
+
+// The statistics segment of this process, NULL if none has been created
+extern struct dpfs_stats *stats_shm;
+
+// Creates (or replaces) the shared memory segment /dev/shm/<name> and sets stats_shm
+int stats_shm_create(const char *name, const char *hal, uint16_t nthreads, uint16_t ndevices);
+void stats_shm_destroy(const char *name);
+// Must be called by every DPFS thread before it handles requests
+void stats_shm_thread_init(uint16_t thread_id);
+// Accounts n dpfs_hal_async_complete calls on the calling thread
+void stats_shm_async_complete(int n);
+
+#endif // STATS_SHM_H
@@ -21,6 +21,7 @@
 
 #include "dpfs_fuse.h"
 #include "dpfs/hal.h"
+#include "placement.h"
 
 struct RamCloudUserData {
     RAMCloud::RamCloud *ramcloud;
@@ -717,6 +718,10 @@ int main(int argc, char **argv)
         return -1;
     }
 
+    struct placement placement;
+    if (placement_load(conf_path, &placement))
+        return -1;
+
     printf("dpfs_kv starting up!\n");
     printf("Connecting to RAMCloud coordinator %s\n", coordinator);
 
@@ -730,8 +735,21 @@ int main(int argc, char **argv)
 
     printf("Start poll thread for RAMCloud %s\n", coordinator);
     // poll ramcloud here
+    // The poll thread runs on the first service_threads CPU of [placement], and is not pinned by default
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    int cpu = placement_cpu(&placement, PLACEMENT_SERVICE_THREADS, 0);
+    if (cpu >= 0) {
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        CPU_SET(cpu, &set);
+        pthread_attr_setaffinity_np(&attr, sizeof(set), &set);
+        printf("The RAMCloud poll thread runs on CPU %d\n", cpu);
+    }
     pthread_t ramcloud_poll_thread;
-    if (pthread_create(&ramcloud_poll_thread, NULL, ramcloud_poll, &user_data)) {
+    int ret = pthread_create(&ramcloud_poll_thread, &attr, ramcloud_poll, &user_data);
+    pthread_attr_destroy(&attr);
+    if (ret) {
         fprintf(stderr, "Failed to create RAMCloud poll thread, exiting...\n");
         return -1;
     }
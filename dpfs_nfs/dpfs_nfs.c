@@ -21,6 +21,7 @@
 
 #include "config.h"
 #include "dpfs_fuse.h"
+#include "dpfs/stats.h"
 #include "dpfs_nfs.h"
 #include "vnfs_connect.h"
 #include "mpool.h"
@@ -90,6 +91,24 @@ static uint32_t statfs_attributes[2] = {
 #define LATENCY_MEASURING_STOP(op) do {} while(0)
 #endif
 
+// The rpc_pdu holds the data of the request, a cancel can complete it from now on
+#define VNFS_CANCEL_SENT 1
+// An interrupt came in before the request was sent, the sender cancels it
+#define VNFS_CANCEL_PENDING 2
+// The sender doesn't touch the cb_data anymore, the RPC callback waits for this before freeing it
+#define VNFS_CANCEL_SENDER_DONE 4
+
+// The part of the READ and WRITE cb_data that vcancel needs. Whoever sets claimed first completes the request,
+// the RPC callback or vcancel. The session slot is only released when the reply comes in
+struct vnfs_cancelable {
+    atomic_bool claimed;
+    atomic_uint flags;
+    struct fuse_session *se;
+    uint64_t unique;
+    void *completion_context;
+    struct fuse_out_header *out_hdr;
+};
+
 // All the cb_data structs, nice and cozy together
 struct getattr_cb_data {
     uint16_t thread_id;
@@ -189,6 +208,8 @@ struct read_cb_data {
     struct fuse_out_header *out_hdr;
     struct iovec *out_iov;
     int out_iovcnt;
+
+    struct vnfs_cancelable cancel;
 };
 struct write_cb_data {
     uint16_t thread_id;
@@ -207,6 +228,27 @@ struct write_cb_data {
 
     struct fuse_out_header *out_hdr;
     struct fuse_write_out *out_write;
+
+    struct vnfs_cancelable cancel;
+};
+struct copy_cb_data {
+    uint16_t thread_id;
+    void *completion_context;
+    struct virtionfs *vnfs;
+    struct vnfs_conn *conn;
+    // Held for both the READ and the WRITE compound
+    uint32_t slotid;
+    slotid4 highest_slotid;
+
+#ifdef LATENCY_MEASURING_ENABLED
+    struct ftimer ft;
+#endif
+
+    struct inode *i_out;
+    struct fuse_copy_file_range_in *in_copy;
+
+    struct fuse_out_header *out_hdr;
+    struct fuse_write_out *out_write;
 };
 struct fsync_cb_data {
     uint16_t thread_id;
@@ -269,6 +311,7 @@ struct cb_data {
         struct open_cb_data open;
         struct read_cb_data read;
         struct write_cb_data write;
+        struct copy_cb_data copy;
         struct fsync_cb_data fsync;
         struct release_cb_data release;
         struct create_cb_data create;
@@ -394,6 +437,7 @@ int create(struct fuse_session *se, void *user_data,
     uint16_t thread_id = dpfs_hal_thread_id();
     struct create_cb_data *cb_data = mpool_alloc(vnfs->p[thread_id]);
     if (!cb_data) {
+        dpfs_stats_mpool_exhausted(dpfs_hal_stats(), thread_id);
         out_hdr->error = -ENOMEM;
         return 0;
     }
@@ -529,6 +573,7 @@ int release(struct fuse_session *se, void *user_data,
     uint16_t thread_id = dpfs_hal_thread_id();
     struct release_cb_data *cb_data = mpool_alloc(vnfs->p[thread_id]);
     if (!cb_data) {
+        dpfs_stats_mpool_exhausted(dpfs_hal_stats(), thread_id);
         out_hdr->error = -ENOMEM;
         return 0;
     }
@@ -613,6 +658,7 @@ int vfsync(struct fuse_session *se, void *user_data,
     uint16_t thread_id = dpfs_hal_thread_id();
     struct fsync_cb_data *cb_data = mpool_alloc(vnfs->p[thread_id]);
     if (!cb_data) {
+        dpfs_stats_mpool_exhausted(dpfs_hal_stats(), thread_id);
         out_hdr->error = -ENOMEM;
         return 0;
     }
@@ -657,6 +703,57 @@ int vfsync(struct fuse_session *se, void *user_data,
     return EWOULDBLOCK;
 }
 
+static void vnfs_cancelable_init(struct vnfs_cancelable *c, struct fuse_session *se, struct fuse_in_header *in_hdr,
+                                 void *completion_context, struct fuse_out_header *out_hdr)
+{
+    atomic_init(&c->claimed, false);
+    atomic_init(&c->flags, 0);
+    c->se = se;
+    c->unique = in_hdr->unique;
+    c->completion_context = completion_context;
+    c->out_hdr = out_hdr;
+}
+
+// Returns false if vcancel already completed the request, the reply must then be dropped
+static bool vnfs_cancelable_claim(struct vnfs_cancelable *c)
+{
+    // The callback runs on the libnfs service thread and can come in before the sender is done.
+    // That is only a few instructions, and the sender can't free the cb_data because mpool is single-producer
+    while (!(atomic_load(&c->flags) & VNFS_CANCEL_SENDER_DONE));
+    // Waits for a vcancel that is running, the guest can reuse the unique once we complete
+    fuse_ll_inflight_remove(c->se, c->unique);
+    return !atomic_exchange(&c->claimed, true);
+}
+
+static void vnfs_cancel_complete(struct vnfs_cancelable *c)
+{
+    if (atomic_exchange(&c->claimed, true))
+        return;
+    c->out_hdr->error = -EINTR;
+    c->out_hdr->len = sizeof(*c->out_hdr);
+    dpfs_hal_async_complete(c->completion_context, DPFS_HAL_COMPLETION_SUCCES);
+}
+
+// Called by the sender once the rpc_pdu holds the data, the request and cb_data belong to the callback afterwards
+static void vnfs_cancelable_sent(struct vnfs_cancelable *c)
+{
+    if (atomic_fetch_or(&c->flags, VNFS_CANCEL_SENT) & VNFS_CANCEL_PENDING)
+        vnfs_cancel_complete(c);
+    atomic_fetch_or(&c->flags, VNFS_CANCEL_SENDER_DONE);
+}
+
+// There is no way to take back an RPC, so the request is completed right away with -EINTR and the reply
+// is dropped when it comes in. This frees the Virtio descriptors, but not the session slot or the cb_data.
+// Before the request is sent, libnfs may still be encoding the Virtio buffers, so the sender cancels it then
+void vcancel(struct fuse_session *se, void *user_data, uint64_t unique, void *token, uint16_t device_id)
+{
+    struct vnfs_cancelable *c = token;
+
+    if (!(atomic_fetch_or(&c->flags, VNFS_CANCEL_PENDING) & VNFS_CANCEL_SENT))
+        return;
+    vnfs_cancel_complete(c);
+}
+
 void vwrite_cb(struct rpc_context *rpc, int status, void *data,
            void *private_data)
 {
@@ -666,6 +763,10 @@ void vwrite_cb(struct rpc_context *rpc, int status, void *data,
     LATENCY_MEASURING_STOP(WRITE);
 
     cb_data->conn->session.slots[cb_data->slotid].in_use = false;
+    if (!vnfs_cancelable_claim(&cb_data->cancel)) {
+        mpool_free(vnfs->p[cb_data->thread_id], cb_data);
+        return;
+    }
     if (status != RPC_STATUS_SUCCESS) {
         vnfs_error("FUSE_WRITE:%lu - RPC error=%d, %s\n", cb_data->out_hdr->unique, status, (char *) data);
         cb_data->out_hdr->error = -EREMOTEIO;
@@ -718,6 +819,7 @@ int vwrite(struct fuse_session *se, void *user_data,
     uint16_t thread_id = dpfs_hal_thread_id();
     struct write_cb_data *cb_data = mpool_alloc(vnfs->p[thread_id]);
     if (!cb_data) {
+        dpfs_stats_mpool_exhausted(dpfs_hal_stats(), thread_id);
         out_hdr->error = -ENOMEM;
         return 0;
     }
@@ -778,13 +880,25 @@ int vwrite(struct fuse_session *se, void *user_data,
     // This allocates way too much, but atleast it is safe
     uint64_t alloc_hint = offset; 
 
+    // Registered before sending, so that the callback always finds the entry to remove.
+    // The data is in the rpc_pdu once it is sent, so the Virtio descriptors can go when it's interrupted
+    vnfs_cancelable_init(&cb_data->cancel, se, in_hdr, completion_context, out_hdr);
+    fuse_ll_inflight_add(se, in_hdr->unique, &cb_data->cancel);
+
     LATENCY_MEASURING_START(WRITE);
     if (rpc_nfs4_compound_async2(conn->rpc, vwrite_cb, &args, cb_data, alloc_hint) != 0) {
     	vnfs_error("Failed to send NFS:write request\n");
+        fuse_ll_inflight_remove(se, in_hdr->unique);
+        if (atomic_exchange(&cb_data->cancel.claimed, true)) {
+            // Already completed by a cancel
+            mpool_free(vnfs->p[thread_id], cb_data);
+            return EWOULDBLOCK;
+        }
         mpool_free(vnfs->p[thread_id], cb_data);
         out_hdr->error = -EREMOTEIO;
         return 0;
     }
+    vnfs_cancelable_sent(&cb_data->cancel);
 
     return EWOULDBLOCK;
 #endif
@@ -822,6 +936,10 @@ void vread_cb(struct rpc_context *rpc, int status, void *data,
     LATENCY_MEASURING_STOP(READ);
 
     cb_data->conn->session.slots[cb_data->slotid].in_use = false;
+    if (!vnfs_cancelable_claim(&cb_data->cancel)) {
+        mpool_free(vnfs->p[cb_data->thread_id], cb_data);
+        return;
+    }
     if (status != RPC_STATUS_SUCCESS) {
         vnfs_error("FUSE_READ:%lu - RPC error=%d, %s\n", cb_data->out_hdr->unique, status, (char *) data);
         cb_data->out_hdr->error = -EREMOTEIO;
@@ -869,6 +987,7 @@ int vread(struct fuse_session *se, void *user_data,
     uint16_t thread_id = dpfs_hal_thread_id();
     struct read_cb_data *cb_data = mpool_alloc(vnfs->p[thread_id]);
     if (!cb_data) {
+        dpfs_stats_mpool_exhausted(dpfs_hal_stats(), thread_id);
         out_hdr->error = -ENOMEM;
         return 0;
     }
@@ -903,9 +1022,204 @@ int vread(struct fuse_session *se, void *user_data,
     op[2].nfs_argop4_u.opread.count = in_read->size;
     op[2].nfs_argop4_u.opread.offset = in_read->offset;
 
+    // The callback writes to the Virtio buffers, so they can only go once it is sent and the callback
+    // checks claimed
+    vnfs_cancelable_init(&cb_data->cancel, se, in_hdr, completion_context, out_hdr);
+    fuse_ll_inflight_add(se, in_hdr->unique, &cb_data->cancel);
+
     LATENCY_MEASURING_START(READ);
     if (rpc_nfs4_compound_async(conn->rpc, vread_cb, &args, cb_data) != 0) {
     	vnfs_error("Failed to send NFS:READ request\n");
+        fuse_ll_inflight_remove(se, in_hdr->unique);
+        if (atomic_exchange(&cb_data->cancel.claimed, true)) {
+            // Already completed by a cancel
+            mpool_free(vnfs->p[thread_id], cb_data);
+            return EWOULDBLOCK;
+        }
+        mpool_free(vnfs->p[thread_id], cb_data);
+        out_hdr->error = -EREMOTEIO;
+        return 0;
+    }
+    vnfs_cancelable_sent(&cb_data->cancel);
+
+    return EWOULDBLOCK;
+#endif
+}
+
+static void vcopy_complete(struct copy_cb_data *cb_data)
+{
+    struct virtionfs *vnfs = cb_data->vnfs;
+
+    LATENCY_MEASURING_STOP(COPY_FILE_RANGE);
+
+    cb_data->conn->session.slots[cb_data->slotid].in_use = false;
+    void *completion_context = cb_data->completion_context;
+    mpool_free(vnfs->p[cb_data->thread_id], cb_data);
+    dpfs_hal_async_complete(completion_context, DPFS_HAL_COMPLETION_SUCCES);
+}
+
+void vcopy_write_cb(struct rpc_context *rpc, int status, void *data,
+           void *private_data)
+{
+    struct copy_cb_data *cb_data = (struct copy_cb_data *) private_data;
+
+    if (status != RPC_STATUS_SUCCESS) {
+        vnfs_error("FUSE_COPY_FILE_RANGE:%lu - RPC error=%d, %s\n", cb_data->out_hdr->unique, status, (char *) data);
+        cb_data->out_hdr->error = -EREMOTEIO;
+        goto ret;
+    }
+    COMPOUND4res *res = data;
+    if (res->status != NFS4_OK) {
+        cb_data->out_hdr->error = -nfs_error_to_fuse_error(res->status);
+        goto ret;
+    }
+
+    cb_data->out_write->size = res->resarray.resarray_val[2].nfs_resop4_u.opwrite.WRITE4res_u.resok4.count;
+    cb_data->out_hdr->len += sizeof(*cb_data->out_write);
+
+ret:
+    vcopy_complete(cb_data);
+}
+
+// Sends the data that was just read to the destination. The connection still holds the slot of the READ,
+// so this reuses it instead of claiming a slot outside of the Virtio poller thread
+void vcopy_read_cb(struct rpc_context *rpc, int status, void *data,
+              void *private_data)
+{
+    struct copy_cb_data *cb_data = (struct copy_cb_data *) private_data;
+    struct vnfs_conn *conn = cb_data->conn;
+
+    if (status != RPC_STATUS_SUCCESS) {
+        vnfs_error("FUSE_COPY_FILE_RANGE:%lu - RPC error=%d, %s\n", cb_data->out_hdr->unique, status, (char *) data);
+        cb_data->out_hdr->error = -EREMOTEIO;
+        goto ret;
+    }
+    COMPOUND4res *res = data;
+    if (res->status != NFS4_OK) {
+        cb_data->out_hdr->error = -nfs_error_to_fuse_error(res->status);
+        goto ret;
+    }
+
+    READ4resok *resok = &res->resarray.resarray_val[2].nfs_resop4_u.opread.READ4res_u.resok4;
+    if (resok->data.data_len == 0) {
+        // The source ends at off_in
+        cb_data->out_write->size = 0;
+        cb_data->out_hdr->len += sizeof(*cb_data->out_write);
+        goto ret;
+    }
+
+    COMPOUND4args args;
+    nfs_argop4 op[3];
+    memset(&args.tag, 0, sizeof(args.tag));
+    args.minorversion = NFS4DOT1_MINOR;
+    args.argarray.argarray_len = sizeof(op) / sizeof(nfs_argop4);
+    args.argarray.argarray_val = op;
+
+    // SEQUENCE
+    op[0].argop = OP_SEQUENCE;
+    struct SEQUENCE4args *seq = &op[0].nfs_argop4_u.opsequence;
+    memcpy(seq->sa_sessionid, conn->session.sessionid, sizeof(sessionid4));
+    seq->sa_cachethis = false;
+    seq->sa_slotid = cb_data->slotid;
+    seq->sa_highest_slotid = cb_data->highest_slotid;
+    seq->sa_sequenceid = ++conn->session.slots[cb_data->slotid].seqid;
+    // PUTFH
+    op[1].argop = OP_PUTFH;
+    op[1].nfs_argop4_u.opputfh.object.nfs_fh4_val = cb_data->i_out->fh_open.val;
+    op[1].nfs_argop4_u.opputfh.object.nfs_fh4_len = cb_data->i_out->fh_open.len;
+    // WRITE
+    op[2].argop = OP_WRITE;
+    op[2].nfs_argop4_u.opwrite.stateid = cb_data->i_out->open_stateid;
+    op[2].nfs_argop4_u.opwrite.offset = cb_data->in_copy->off_out;
+    op[2].nfs_argop4_u.opwrite.stable = UNSTABLE4;
+    op[2].nfs_argop4_u.opwrite.data.data_val = resok->data.data_val;
+    op[2].nfs_argop4_u.opwrite.data.data_len = resok->data.data_len;
+
+    // The data is encoded into the rpc_pdu right away, so it can be freed with res after this callback.
+    // See vwrite for the alloc_hint
+    if (rpc_nfs4_compound_async2(conn->rpc, vcopy_write_cb, &args, cb_data, resok->data.data_len) != 0) {
+    	vnfs_error("Failed to send NFS:write request of FUSE_COPY_FILE_RANGE\n");
+        cb_data->out_hdr->error = -EREMOTEIO;
+        goto ret;
+    }
+    return;
+
+ret:
+    vcopy_complete(cb_data);
+}
+
+// NFSv4.2 COPY and CLONE are not in the XDR of libnfs, so the DPU reads the range from the source
+// and writes it to the destination. The data still makes two trips over the network, but none over PCIe.
+// A single READ of at most the session's max size per request, the guest continues after a short copy
+int vcopy_file_range(struct fuse_session *se, void *user_data,
+                     struct fuse_in_header *in_hdr, struct fuse_copy_file_range_in *in_copy,
+                     struct fuse_out_header *out_hdr, struct fuse_write_out *out_write,
+                     void *completion_context, uint16_t device_id)
+{
+#ifdef VNFS_NULLDEV
+    out_write->size = in_copy->len;
+    out_hdr->len += sizeof(*out_write);
+    return 0;
+#else
+
+    struct virtionfs *vnfs = user_data;
+    struct vnfs_conn *conn = vnfs_get_conn(vnfs);
+    uint16_t thread_id = dpfs_hal_thread_id();
+
+    struct inode *i_out = inode_table_get(vnfs->inodes, in_copy->nodeid_out);
+    if (!i_out) {
+    	vnfs_error("Invalid nodeid_out supplied\n");
+        out_hdr->error = -ENOENT;
+        return 0;
+    }
+
+    struct copy_cb_data *cb_data = mpool_alloc(vnfs->p[thread_id]);
+    if (!cb_data) {
+        dpfs_stats_mpool_exhausted(dpfs_hal_stats(), thread_id);
+        out_hdr->error = -ENOMEM;
+        return 0;
+    }
+
+    cb_data->thread_id = thread_id;
+    cb_data->completion_context = completion_context;
+    cb_data->vnfs = vnfs;
+    cb_data->conn = conn;
+    cb_data->i_out = i_out;
+    cb_data->in_copy = in_copy;
+    cb_data->out_hdr = out_hdr;
+    cb_data->out_write = out_write;
+
+    COMPOUND4args args;
+    nfs_argop4 op[3];
+    memset(&args.tag, 0, sizeof(args.tag));
+    args.minorversion = NFS4DOT1_MINOR;
+    args.argarray.argarray_len = sizeof(op) / sizeof(nfs_argop4);
+    args.argarray.argarray_val = op;
+
+    // PUTFH
+    struct inode *i = vnfs4_op_putfh_open(vnfs, &op[1], in_hdr->nodeid);
+    if (!i) {
+    	vnfs_error("Invalid nodeid supplied\n");
+        mpool_free(vnfs->p[thread_id], cb_data);
+        out_hdr->error = -ENOENT;
+        return 0;
+    }
+    cb_data->slotid = vnfs4_op_sequence(&op[0], conn, false);
+    cb_data->highest_slotid = op[0].nfs_argop4_u.opsequence.sa_highest_slotid;
+    // READ
+    // We play it safe and assume that the other stuff in the request and response is 4k in size
+    count4 maxsize = conn->session.attrs.ca_maxresponsesize - 4096;
+    if (conn->session.attrs.ca_maxrequestsize - 4096 < maxsize)
+        maxsize = conn->session.attrs.ca_maxrequestsize - 4096;
+    op[2].argop = OP_READ;
+    op[2].nfs_argop4_u.opread.stateid = i->open_stateid;
+    op[2].nfs_argop4_u.opread.offset = in_copy->off_in;
+    op[2].nfs_argop4_u.opread.count = in_copy->len < maxsize ? in_copy->len : maxsize;
+
+    LATENCY_MEASURING_START(COPY_FILE_RANGE);
+    if (rpc_nfs4_compound_async(conn->rpc, vcopy_read_cb, &args, cb_data) != 0) {
+    	vnfs_error("Failed to send NFS:read request of FUSE_COPY_FILE_RANGE\n");
+        conn->session.slots[cb_data->slotid].in_use = false;
         mpool_free(vnfs->p[thread_id], cb_data);
         out_hdr->error = -EREMOTEIO;
         return 0;
@@ -995,6 +1309,7 @@ int vopen(struct fuse_session *se, void *user_data,
     uint16_t thread_id = dpfs_hal_thread_id();
     struct open_cb_data *cb_data = mpool_alloc(vnfs->p[thread_id]);
     if (!cb_data) {
+        dpfs_stats_mpool_exhausted(dpfs_hal_stats(), thread_id);
         out_hdr->error = -ENOMEM;
         return 0;
     }
@@ -1110,6 +1425,7 @@ int setattr(struct fuse_session *se, void *user_data,
     uint16_t thread_id = dpfs_hal_thread_id();
     struct setattr_cb_data *cb_data = mpool_alloc(vnfs->p[thread_id]);
     if (!cb_data) {
+        dpfs_stats_mpool_exhausted(dpfs_hal_stats(), thread_id);
         out_hdr->error = -ENOMEM;
         return 0;
     }
@@ -1246,6 +1562,7 @@ int statfs(struct fuse_session *se, void *user_data,
     uint16_t thread_id = dpfs_hal_thread_id();
     struct statfs_cb_data *cb_data = mpool_alloc(vnfs->p[thread_id]);
     if (!cb_data) {
+        dpfs_stats_mpool_exhausted(dpfs_hal_stats(), thread_id);
         out_hdr->error = -ENOMEM;
         return 0;
     }
@@ -1364,6 +1681,7 @@ int lookup(struct fuse_session *se, void *user_data,
     uint16_t thread_id = dpfs_hal_thread_id();
     struct lookup_cb_data *cb_data = mpool_alloc(vnfs->p[thread_id]);
     if (!cb_data) {
+        dpfs_stats_mpool_exhausted(dpfs_hal_stats(), thread_id);
         out_hdr->error = -ENOMEM;
         return 0;
     }
@@ -1487,6 +1805,7 @@ int getattr(struct fuse_session *se, void *user_data,
     uint16_t thread_id = dpfs_hal_thread_id();
     struct getattr_cb_data *cb_data = mpool_alloc(vnfs->p[thread_id]);
     if (!cb_data) {
+        dpfs_stats_mpool_exhausted(dpfs_hal_stats(), thread_id);
         out_hdr->error = -ENOMEM;
         return 0;
     }
@@ -1594,6 +1913,7 @@ void dpfs_nfs_assign_ops(struct fuse_ll_operations *ops) {
     ops->open = vopen;
     ops->read = vread;
     ops->write = vwrite;
+    ops->copy_file_range = vcopy_file_range;
     ops->fsync = vfsync;
     ops->release = release;
     // NFS only does fsync(aka COMMIT) on files
@@ -1603,6 +1923,7 @@ void dpfs_nfs_assign_ops(struct fuse_ll_operations *ops) {
     //ops->setattr = (typeof(ops->setattr)) setattr;
     ops->statfs = statfs;
     ops->destroy = destroy;
+    ops->cancel = vcancel;
 }
 
 void dpfs_nfs_main(char *server, char *export,
@@ -1623,6 +1944,8 @@ void dpfs_nfs_main(char *server, char *export,
     vnfs->timeout_sec = calc_timeout_sec(timeout);
     vnfs->timeout_nsec = calc_timeout_nsec(timeout);
     vnfs->cq_polling = cq_polling;
+    if (placement_load(conf_path, &vnfs->placement))
+        goto ret_a;
 
     int ret = inode_table_init(&vnfs->inodes);
     if (ret < 0) {
@@ -17,6 +17,7 @@
 #include "config.h"
 #include "dpfs_fuse.h"
 #include "mpool.h"
+#include "placement.h"
 #ifdef LATENCY_MEASURING_ENABLED
 #include "ftimer.h"
 #endif
@@ -70,6 +71,8 @@ struct virtionfs {
     // each thread gets its own connection
     struct vnfs_conn *conns;
     uint32_t conn_cntr;
+    // The libnfs service thread of connection i runs on service_threads CPU i
+    struct placement placement;
 
     struct inode_table *inodes;
     struct mpool **p;
@@ -5,7 +5,10 @@
 #
 */
 
+#define _GNU_SOURCE
 #include <sys/time.h>
+#include <pthread.h>
+#include <sched.h>
 #include <nfsc/libnfs.h>
 #include <err.h>
 #include <stdlib.h>
@@ -302,6 +305,28 @@ void vnfs_destroy_connection(struct vnfs_conn *conn, enum vnfs_conn_state state)
     // RPC is paired with the NFS context, so NFS_destroy destroys RPC
 }
 
+// libnfs doesn't let us set the attributes of its service thread, but the thread
+// inherits the CPU affinity of its creator. So we temporarily move ourselves to its CPU
+static int vnfs_service_thread_start(struct virtionfs *vnfs, struct vnfs_conn *conn)
+{
+    int cpu = placement_cpu(&vnfs->placement, PLACEMENT_SERVICE_THREADS, conn->vnfs_conn_id);
+    if (cpu < 0)
+        return nfs_mt_service_thread_start(conn->nfs);
+
+    cpu_set_t old, set;
+    pthread_getaffinity_np(pthread_self(), sizeof(old), &old);
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    if (pthread_setaffinity_np(pthread_self(), sizeof(set), &set))
+        warn("Could not pin the libnfs service thread of connection %u to CPU %d\n", conn->vnfs_conn_id, cpu);
+    else
+        printf("VNFS connection %u: the libnfs service thread runs on CPU %d\n", conn->vnfs_conn_id, cpu);
+
+    int ret = nfs_mt_service_thread_start(conn->nfs);
+    pthread_setaffinity_np(pthread_self(), sizeof(old), &old);
+    return ret;
+}
+
 int vnfs_init_connections(struct virtionfs *vnfs)
 {
     struct vnfs_conn *conn = &vnfs->conns[vnfs->conn_cntr];
@@ -344,7 +369,7 @@ int vnfs_init_connections(struct virtionfs *vnfs)
     else
         nfs_set_poll_timeout(nfs, 100);
 
-    if (nfs_mt_service_thread_start(nfs)) {
+    if (vnfs_service_thread_start(vnfs, conn)) {
         warn("Failed to start libnfs service thread for connection %u\n", conn->vnfs_conn_id);
         conn->state = VNFS_CONN_STATE_SHOULD_CLOSE;
         conn->rpc = NULL;
@@ -10,46 +10,272 @@
 #include <stdlib.h>
 #include <string.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <sys/mman.h>
 #include <linux/fuse.h>
 #include <string>
 #include <vector>
+#include <algorithm>
 #include <memory>
 #include <iostream>
 #include <thread>
 #include <boost/lockfree/spsc_queue.hpp>
 #include "config.h"
 #include "rvfs.h"
+#include "rvfs_shm.h"
 #include "dpfs/hal.h"
 #include "rpc.h"
 #include "tomlcpp.hpp"
 
 // Each virtio-fs uses at least 3 descriptors (aka queue entries) for each request
 #define VIRTIO_FS_MIN_DESCS 3
+// The most messages that are taken from a ring at once
+#define RING_BATCH 32
 
 using namespace erpc;
 
+// A request in a DPFS_RVFS_REQTYPE_FUSE_BATCH message
+struct batch_entry {
+    struct iovec *out_iov;
+    int out_iovcnt;
+    void *completion_context;
+    // The sum of the output descriptor lengths
+    size_t out_len;
+};
+
 struct rpc_msg {
+    // eRPC: taken from the msgbuf pools for every request, see get_msgbuf().
+    // req_class is -1 if the pools were empty, the dispatch thread then allocates and fills the buffers
     MsgBuffer req;
     MsgBuffer resp;
-    // Virtio-fs req output stuff
+    int req_class;
+    int resp_class;
+    // shm: the slot that holds the request and reply
+    int slot;
+    // Where the request and reply go, in req and resp or in the slot
+    uint8_t *req_buf;
+    size_t req_cap;
+    uint8_t *resp_buf;
+    size_t resp_cap;
+    // The length of the reply that came back
+    size_t reply_len;
+    // Virtio-fs req stuff, the input only for a msg whose buffers the dispatch thread fills
+    struct iovec *in_iov;
+    int in_iovcnt;
     struct iovec *out_iov;
     int out_iovcnt;
     void *completion_context;
+    // Batch messages only, the requests and the bytes of the request and reply that are used
+    std::vector<batch_entry> entries;
+    size_t req_len;
+    size_t resp_len;
+
+    rpc_msg() : req_class(0), resp_class(0), slot(-1), req_buf(nullptr), req_cap(0), resp_buf(nullptr), resp_cap(0),
+        reply_len(0), in_iov(nullptr), in_iovcnt(0), out_iov(nullptr), out_iovcnt(0),
+        completion_context(nullptr), req_len(0), resp_len(0)
+    {}
+};
 
-    rpc_msg(Rpc<CTransport> &rpc) : out_iov(nullptr), out_iovcnt(0), completion_context(nullptr)
-    {
-        this->req = rpc.alloc_msg_buffer_or_die(DPFS_RVFS_MAX_REQRESP_SIZE);
-        this->resp = rpc.alloc_msg_buffer_or_die(DPFS_RVFS_MAX_REQRESP_SIZE);
-    }
+static const size_t msgbuf_sizes[DPFS_RVFS_MSGBUF_NCLASSES] = {
+    DPFS_RVFS_MSGBUF_SMALL, DPFS_RVFS_MSGBUF_MEDIUM, DPFS_RVFS_MAX_REQRESP_SIZE
 };
 
+typedef boost::lockfree::spsc_queue<rpc_msg *> msg_ring;
+
+// With two_threads the HAL thread handles the virtio-fs requests and only the dispatch thread touches
+// the transport (eRPC or the shared memory rings), they hand the messages to each other over two rings.
+// Without it both sides are the same thread
 struct rpc_state {
-    boost::lockfree::spsc_queue<struct rpc_msg *, boost::lockfree::capacity<1024>> avail;
+    // Only touched by the HAL thread: the free messages, the free message buffers of every size class
+    // and with the shm transport the free slots
+    std::vector<rpc_msg *> avail;
+    std::vector<MsgBuffer> msgbufs[DPFS_RVFS_MSGBUF_NCLASSES];
+    std::vector<uint32_t> free_slots;
+    // The messages to send and the messages that got their reply
+    std::unique_ptr<msg_ring> to_dispatch;
+    std::unique_ptr<msg_ring> from_dispatch;
+    std::vector<void *> completions;
+    // transport = "shm", the msg of every slot that is in flight
+    dpfs_rvfs_shm_hdr *shm;
+    size_t shm_size;
+    std::vector<rpc_msg *> slot_msgs;
     std::unique_ptr<Nexus> nexus;
     std::unique_ptr<Rpc<CTransport>> rpc;
-    int session_num;
+    // A session (or shm ring pair) to every worker thread of the host, the requests are spread
+    // round-robin over them
+    std::vector<int> sessions;
+    size_t next_session;
+    // The sessions whose connect failed, because the host hasn't created the Rpc of that worker yet
+    std::vector<int> failed_sessions;
+    // DPFS_RVFS_REQTYPE_FUSE or DPFS_RVFS_REQTYPE_FUSE_SG
+    uint8_t req_type;
+    // Request coalescing, the batch that is being filled by the current poll of the HAL
+    bool coalesce;
+    size_t coalesce_max_reqs;
+    size_t coalesce_max_bytes;
+    rpc_msg *batch;
 };
 
+// Takes a buffer of the smallest size class that fits size bytes from its pool, the pools are
+// preallocated by init_msgbufs(). Returns false if the pool is empty
+static void get_msgbuf_class(size_t size, int *cls)
+{
+    int c = 0;
+    while (c < DPFS_RVFS_MSGBUF_NCLASSES - 1 && msgbuf_sizes[c] < size)
+        c++;
+    *cls = c;
+}
+
+static bool get_msgbuf(rpc_state *state, size_t size, MsgBuffer *buf, int *cls)
+{
+    get_msgbuf_class(size, cls);
+    int c = *cls;
+    if (state->msgbufs[c].empty())
+        return false;
+    *buf = state->msgbufs[c].back();
+    state->msgbufs[c].pop_back();
+    return true;
+}
+
+static void put_msgbuf(rpc_state *state, MsgBuffer &buf, int cls)
+{
+    // eRPC shrinks the buffer to what it holds
+    Rpc<CTransport>::resize_msg_buffer(&buf, msgbuf_sizes[cls]);
+    state->msgbufs[cls].push_back(buf);
+}
+
+static void set_msgbufs(rpc_msg *msg)
+{
+    msg->req_buf = msg->req.buf_;
+    msg->req_cap = msgbuf_sizes[msg->req_class];
+    msg->resp_buf = msg->resp.buf_;
+    msg->resp_cap = msgbuf_sizes[msg->resp_class];
+}
+
+// If the pools are empty, the msg has req_class -1 and the dispatch thread allocates its buffers,
+// which then join the pools when the msg is done. So the pools only grow if more bulk I/O
+// is in flight than they were sized for
+static rpc_msg *get_msg(rpc_state *state, size_t req_size, size_t resp_size)
+{
+    // The queue_depth of the virtio-fs device is static, so this wont infinitely allocate memory
+    rpc_msg *msg;
+    if (state->avail.empty()) {
+        msg = new rpc_msg();
+    } else {
+        msg = state->avail.back();
+        state->avail.pop_back();
+    }
+    if (state->shm) {
+        // There is a slot for every request that can be in flight
+        msg->slot = state->free_slots.back();
+        state->free_slots.pop_back();
+        dpfs_rvfs_shm_slot *slot = dpfs_rvfs_shm_get_slot(state->shm, msg->slot);
+        msg->req_buf = dpfs_rvfs_shm_slot_req(slot);
+        msg->resp_buf = dpfs_rvfs_shm_slot_resp(state->shm, slot);
+        msg->req_cap = msg->resp_cap = state->shm->slot_size;
+    } else if (!get_msgbuf(state, req_size, &msg->req, &msg->req_class)) {
+        msg->req_class = -1;
+    } else if (!get_msgbuf(state, resp_size, &msg->resp, &msg->resp_class)) {
+        put_msgbuf(state, msg->req, msg->req_class);
+        msg->req_class = -1;
+    } else {
+        set_msgbufs(msg);
+    }
+    return msg;
+}
+
+static void put_msg(rpc_state *state, rpc_msg *msg)
+{
+    if (state->shm) {
+        state->free_slots.push_back(msg->slot);
+    } else {
+        put_msgbuf(state, msg->req, msg->req_class);
+        put_msgbuf(state, msg->resp, msg->resp_class);
+    }
+    state->avail.push_back(msg);
+}
+
+// Sizes the pools for max_inflight requests: every request fits in a small request and reply buffer,
+// a part of them is bulk I/O
+static void init_msgbufs(rpc_state *state, size_t max_inflight)
+{
+    const size_t prealloc[DPFS_RVFS_MSGBUF_NCLASSES] = {
+        2 * max_inflight, max_inflight / 2, max_inflight / 8
+    };
+    for (int c = 0; c < DPFS_RVFS_MSGBUF_NCLASSES; c++) {
+        for (size_t i = 0; i < std::max<size_t>(prealloc[c], 1); i++)
+            state->msgbufs[c].push_back(state->rpc->alloc_msg_buffer_or_die(msgbuf_sizes[c]));
+    }
+}
+
+// Creates the segment of the shm transport with a slot for every request that can be in flight,
+// the RVFS HAL waits for it to appear
+static int create_shm(rpc_state *state, const std::string &name, size_t max_inflight, uint16_t host_threads)
+{
+    uint32_t nslots = 1;
+    while (nslots < max_inflight)
+        nslots <<= 1;
+    uint64_t slot_size = dpfs_rvfs_seg_align(DPFS_RVFS_MAX_REQRESP_SIZE);
+    size_t size = dpfs_rvfs_shm_size(nslots, host_threads, slot_size);
+
+    // Don't let the host map a segment of a previous run
+    shm_unlink(name.c_str());
+    int fd = shm_open(name.c_str(), O_CREAT | O_EXCL | O_RDWR, 0600);
+    if (fd == -1) {
+        fprintf(stderr, "%s: cannot create shared memory segment %s - %s\n", __func__,
+                name.c_str(), strerror(errno));
+        return -errno;
+    }
+    // The segment is zeroed and only the touched pages of the slots take memory
+    if (ftruncate(fd, size) == -1) {
+        int ret = -errno;
+        fprintf(stderr, "%s: cannot size shared memory segment %s - %s\n", __func__,
+                name.c_str(), strerror(errno));
+        close(fd);
+        shm_unlink(name.c_str());
+        return ret;
+    }
+    void *p = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (p == MAP_FAILED) {
+        int ret = -errno;
+        fprintf(stderr, "%s: cannot map shared memory segment %s - %s\n", __func__,
+                name.c_str(), strerror(errno));
+        shm_unlink(name.c_str());
+        return ret;
+    }
+
+    dpfs_rvfs_shm_hdr *hdr = (dpfs_rvfs_shm_hdr *) p;
+    hdr->version = DPFS_RVFS_SHM_VERSION;
+    hdr->nslots = nslots;
+    hdr->npairs = host_threads;
+    hdr->slot_size = slot_size;
+    __atomic_store_n(&hdr->magic, DPFS_RVFS_SHM_MAGIC, __ATOMIC_RELEASE);
+
+    state->shm = hdr;
+    state->shm_size = size;
+    state->slot_msgs.resize(nslots);
+    for (uint32_t i = 0; i < nslots; i++)
+        state->free_slots.push_back(nslots - 1 - i);
+    // One "session" per ring pair
+    for (uint16_t i = 0; i < host_threads; i++)
+        state->sessions.push_back(i);
+    return 0;
+}
+
+// The host only sends the bytes of the reply (fuse_out_header.len), e.g. a short READ
+// or an error, don't copy the rest of the output descriptors
+static void copy_reply(struct iovec *out_iov, int out_iovcnt, uint8_t *resp_buf, size_t resp_len)
+{
+    for (size_t i = 0; i < out_iovcnt && resp_len > 0; i++) {
+        size_t len = std::min(out_iov[i].iov_len, resp_len);
+        memcpy(out_iov[i].iov_base, (void *) resp_buf, len);
+        resp_buf += len;
+        resp_len -= len;
+    }
+}
+
+// Runs on the dispatch thread, the HAL thread copies the reply and completes the requests
 void response_func(void *context, void *tag)
 {
 #ifdef DEBUG_ENABLED
@@ -58,44 +284,112 @@ void response_func(void *context, void *tag)
 #endif
     rpc_state *state = (rpc_state *) context;
     rpc_msg *msg = (rpc_msg *) tag;
-    uint8_t *resp_buf = msg->resp.buf_;
+    msg->reply_len = msg->resp.get_data_size();
+    // Can't be full, the ring holds every msg that can be in flight
+    while (!state->from_dispatch->push(msg));
+}
 
-    for (size_t i = 0; i < msg->out_iovcnt; i++) {
-        memcpy(msg->out_iov[i].iov_base, (void *) resp_buf, msg->out_iov[i].iov_len);
-        resp_buf += msg->out_iov[i].iov_len;
+// Runs on the dispatch thread, takes the replies from the completion ring of every host thread
+static void poll_shm(rpc_state *state)
+{
+    dpfs_rvfs_shm_hdr *shm = state->shm;
+    uint32_t idx[RING_BATCH];
+    for (uint32_t pair = 0; pair < shm->npairs; pair++) {
+        uint32_t n = dpfs_rvfs_shm_pop(shm, dpfs_rvfs_shm_get_ring(shm, pair, 1), idx, RING_BATCH);
+        for (uint32_t i = 0; i < n; i++) {
+            rpc_msg *msg = state->slot_msgs[idx[i]];
+            msg->reply_len = dpfs_rvfs_shm_get_slot(shm, idx[i])->resp_len;
+            while (!state->from_dispatch->push(msg));
+        }
     }
+}
 
-    dpfs_hal_async_complete(msg->completion_context, DPFS_HAL_COMPLETION_SUCCES);
+static void complete_msg(rpc_state *state, rpc_msg *msg)
+{
+    if (msg->entries.empty()) {
+        copy_reply(msg->out_iov, msg->out_iovcnt, msg->resp_buf, msg->reply_len);
+        state->completions.push_back(msg->completion_context);
+    } else {
+        const uint32_t *resp_lens = (const uint32_t *) msg->resp_buf;
+        uint8_t *resp_buf = msg->resp_buf + DPFS_RVFS_BATCH_RESP_HDR_SIZE;
+        for (size_t i = 0; i < msg->entries.size(); i++) {
+            batch_entry &e = msg->entries[i];
+            copy_reply(e.out_iov, e.out_iovcnt, resp_buf, std::min<size_t>(resp_lens[i], e.out_len));
+            resp_buf += dpfs_rvfs_seg_align(e.out_len);
+            state->completions.push_back(e.completion_context);
+        }
+        msg->entries.clear();
+    }
+    put_msg(state, msg);
+}
 
-    state->avail.push(msg);
+// Runs on the HAL thread
+static void complete_responses(rpc_state *state)
+{
+    rpc_msg *msgs[RING_BATCH];
+    size_t n = state->from_dispatch->pop(msgs, RING_BATCH);
+    if (n == 0)
+        return;
+    for (size_t i = 0; i < n; i++)
+        complete_msg(state, msgs[i]);
+    // Complete them all at once, the HAL publishes the completions to virtio in one go
+    dpfs_hal_async_complete_batch(state->completions.data(), NULL, state->completions.size());
+    state->completions.clear();
 }
 
 // The session management callback that is invoked when sessions are successfully created or destroyed.
-static void sm_handler(int, SmEventType event, SmErrType err, void *) {
+static void sm_handler(int session_num, SmEventType event, SmErrType err, void *context) {
     std::cout << "Event: " << sm_event_type_str(event) << " Error: " << sm_err_type_str(err) << std::endl;
+    if (event == SmEventType::kConnectFailed)
+        static_cast<rpc_state *>(context)->failed_sessions.push_back(session_num);
 }
 
-// Sends the virtio-fs request via eRPC to the remote server
-static int fuse_handler(void *user_data,
-                        struct iovec *in_iov, int in_iovcnt,
-                        struct iovec *out_iov, int out_iovcnt,
-                        void *completion_context, uint16_t device_id)
+static bool all_connected(rpc_state &state)
 {
-    rpc_state *state = (rpc_state *) user_data;
-    // Messages and their buffers are dynamically allocated
-    // The queue_depth of the virtio-fs device is static, so this wont infinitely allocate memory
-    // Just be sure to warm up the system before evaulating performance
-    rpc_msg *msg;
-    if (!state->avail.pop(msg)) {
-        msg = new rpc_msg(*state->rpc.get());
+    if (state.shm)
+        return true;
+    for (int session_num : state.sessions) {
+        if (!state.rpc->is_connected(session_num))
+            return false;
     }
-    uint8_t *req_buf = msg->req.buf_;
+    return true;
+}
 
-#ifdef DEBUG_ENABLED
-    printf("DPFS_RVFS_dpu %s: FUSE request with %d input iovecs and %d output iovecs. Sending in msg %p\n",
-            __func__, in_iovcnt, out_iovcnt, msg);
-#endif
+// Connects to the host_threads workers of the host, the host only creates the Rpc of workers 1..
+// once it runs its loop, so the sessions that fail to connect are retried
+static void connect_sessions(rpc_state &state, const std::string &remote_uri, uint16_t host_threads)
+{
+    for (uint16_t i = 0; i < host_threads; i++) {
+        state.sessions.push_back(state.rpc->create_session(remote_uri, i));
+        if (state.sessions[i] < 0)
+            state.failed_sessions.push_back(state.sessions[i]);
+    }
 
+    while (!all_connected(state)) {
+        state.rpc->run_event_loop_once();
+        if (state.failed_sessions.empty())
+            continue;
+
+        // Give the host some time
+        state.rpc->run_event_loop(100);
+        for (int failed : state.failed_sessions) {
+            for (uint16_t i = 0; i < host_threads; i++) {
+                if (state.sessions[i] == failed)
+                    state.sessions[i] = state.rpc->create_session(remote_uri, i);
+            }
+        }
+        state.failed_sessions.clear();
+        for (int session_num : state.sessions) {
+            if (session_num < 0)
+                state.failed_sessions.push_back(session_num);
+        }
+    }
+}
+
+// Wire format 1, returns the end of the request
+static uint8_t *serialize_v1(uint8_t *req_buf, struct iovec *in_iov, int in_iovcnt,
+                             struct iovec *out_iov, int out_iovcnt)
+{
     *((int *) req_buf) = in_iovcnt;
     req_buf += sizeof(in_iovcnt);
 
@@ -118,12 +412,208 @@ static int fuse_handler(void *user_data,
         req_buf += sizeof(out_iov[i].iov_len);
     }
 
-    state->rpc->resize_msg_buffer(&msg->req, req_buf - msg->req.buf_);
-    state->rpc->enqueue_request(state->session_num, DPFS_RVFS_REQTYPE_FUSE, &msg->req, &msg->resp, response_func, (void *) msg, kInvalidBgETid);
+    return req_buf;
+}
+
+// Wire format 2, returns the end of the request
+static uint8_t *serialize_sg(uint8_t *req_buf, struct iovec *in_iov, int in_iovcnt,
+                             struct iovec *out_iov, int out_iovcnt)
+{
+    dpfs_rvfs_sg_hdr *hdr = (dpfs_rvfs_sg_hdr *) req_buf;
+    hdr->in_iovcnt = in_iovcnt;
+    hdr->out_iovcnt = out_iovcnt;
+    req_buf += dpfs_rvfs_sg_hdr_size(in_iovcnt + out_iovcnt);
+    for (int i = 0; i < in_iovcnt; i++) {
+        hdr->len[i] = in_iov[i].iov_len;
+        memcpy(req_buf, in_iov[i].iov_base, in_iov[i].iov_len);
+        req_buf += dpfs_rvfs_seg_align(in_iov[i].iov_len);
+    }
+    for (int i = 0; i < out_iovcnt; i++)
+        hdr->len[in_iovcnt + i] = out_iov[i].iov_len;
+
+    return req_buf;
+}
+
+// Fills the request buffer of a msg that isn't a batch
+static void serialize_msg(rpc_state *state, rpc_msg *msg, struct iovec *in_iov, int in_iovcnt,
+                          struct iovec *out_iov, int out_iovcnt)
+{
+    uint8_t *req_buf = msg->req_buf;
+    if (state->req_type == DPFS_RVFS_REQTYPE_FUSE_SG)
+        req_buf = serialize_sg(req_buf, in_iov, in_iovcnt, out_iov, out_iovcnt);
+    else
+        req_buf = serialize_v1(req_buf, in_iov, in_iovcnt, out_iov, out_iovcnt);
+    msg->req_len = req_buf - msg->req_buf;
+}
+
+static int next_session(rpc_state *state)
+{
+    int session_num = state->sessions[state->next_session];
+    state->next_session = (state->next_session + 1) % state->sessions.size();
+    return session_num;
+}
+
+// Runs on the dispatch thread
+static void send_requests(rpc_state *state)
+{
+    rpc_msg *msgs[RING_BATCH];
+    size_t n = state->to_dispatch->pop(msgs, RING_BATCH);
+    for (size_t i = 0; i < n; i++) {
+        rpc_msg *msg = msgs[i];
+        uint8_t req_type = msg->entries.empty() ? state->req_type : DPFS_RVFS_REQTYPE_FUSE_BATCH;
+        if (state->shm) {
+            dpfs_rvfs_shm_slot *slot = dpfs_rvfs_shm_get_slot(state->shm, msg->slot);
+            slot->req_type = req_type;
+            slot->req_len = msg->req_len;
+            state->slot_msgs[msg->slot] = msg;
+            dpfs_rvfs_shm_push(state->shm, dpfs_rvfs_shm_get_ring(state->shm, next_session(state), 0), msg->slot);
+            continue;
+        }
+
+        if (msg->req_class < 0) {
+            get_msgbuf_class(msg->req_len, &msg->req_class);
+            get_msgbuf_class(msg->resp_len, &msg->resp_class);
+            msg->req = state->rpc->alloc_msg_buffer_or_die(msgbuf_sizes[msg->req_class]);
+            msg->resp = state->rpc->alloc_msg_buffer_or_die(msgbuf_sizes[msg->resp_class]);
+            set_msgbufs(msg);
+            serialize_msg(state, msg, msg->in_iov, msg->in_iovcnt, msg->out_iov, msg->out_iovcnt);
+        }
+        Rpc<CTransport>::resize_msg_buffer(&msg->req, msg->req_len);
+        state->rpc->enqueue_request(next_session(state), req_type, &msg->req, &msg->resp,
+                response_func, (void *) msg, kInvalidBgETid);
+    }
+}
+
+// Runs on the dispatch thread
+static void run_transport(rpc_state *state)
+{
+    if (state->shm)
+        poll_shm(state);
+    else
+        state->rpc->run_event_loop_once();
+}
+
+// Runs on the HAL thread, can't be full as the ring holds every msg that can be in flight
+static void send_msg(rpc_state *state, rpc_msg *msg)
+{
+    while (!state->to_dispatch->push(msg));
+}
+
+static void flush_batch(rpc_state *state)
+{
+    rpc_msg *msg = state->batch;
+    if (!msg)
+        return;
+    state->batch = nullptr;
+
+#ifdef DEBUG_ENABLED
+    printf("DPFS_RVFS_dpu %s: sending a batch of %zu requests in msg %p\n",
+            __func__, msg->entries.size(), msg);
+#endif
+
+    dpfs_rvfs_batch_hdr *hdr = (dpfs_rvfs_batch_hdr *) msg->req_buf;
+    hdr->nreqs = msg->entries.size();
+    send_msg(state, msg);
+}
+
+// The size of the request in the wire format of the DPU
+static size_t request_size(rpc_state *state, struct iovec *in_iov, int in_iovcnt, int out_iovcnt)
+{
+    size_t size;
+    if (state->req_type == DPFS_RVFS_REQTYPE_FUSE_SG) {
+        size = dpfs_rvfs_sg_hdr_size(in_iovcnt + out_iovcnt);
+        for (int i = 0; i < in_iovcnt; i++)
+            size += dpfs_rvfs_seg_align(in_iov[i].iov_len);
+    } else {
+        size = 2 * sizeof(int) + (in_iovcnt + out_iovcnt) * sizeof(size_t);
+        for (int i = 0; i < in_iovcnt; i++)
+            size += in_iov[i].iov_len;
+    }
+    return size;
+}
+
+// Adds the request to the batch of the current poll if it is small enough, returns false if it isn't
+static bool coalesce_request(rpc_state *state,
+                             struct iovec *in_iov, int in_iovcnt,
+                             struct iovec *out_iov, int out_iovcnt,
+                             void *completion_context, size_t req_len, size_t out_len)
+{
+    if (req_len > state->coalesce_max_bytes || out_len > state->coalesce_max_bytes)
+        return false;
+
+    rpc_msg *msg = state->batch;
+    if (msg && (msg->req_len + req_len > msg->req_cap ||
+                msg->resp_len + dpfs_rvfs_seg_align(out_len) > msg->resp_cap)) {
+        flush_batch(state);
+        msg = nullptr;
+    }
+    if (!msg) {
+        // Sized for a full batch
+        size_t max_len = state->coalesce_max_reqs * dpfs_rvfs_seg_align(state->coalesce_max_bytes);
+        msg = get_msg(state, DPFS_RVFS_BATCH_HDR_SIZE + max_len, DPFS_RVFS_BATCH_RESP_HDR_SIZE + max_len);
+        if (msg->req_class < 0) {
+            // Sent on its own
+            state->avail.push_back(msg);
+            return false;
+        }
+        msg->req_len = DPFS_RVFS_BATCH_HDR_SIZE;
+        msg->resp_len = DPFS_RVFS_BATCH_RESP_HDR_SIZE;
+        state->batch = msg;
+    }
+
+    dpfs_rvfs_batch_hdr *hdr = (dpfs_rvfs_batch_hdr *) msg->req_buf;
+    hdr->len[msg->entries.size()] = req_len;
+    serialize_sg(msg->req_buf + msg->req_len, in_iov, in_iovcnt, out_iov, out_iovcnt);
+    msg->req_len += req_len;
+    msg->resp_len += dpfs_rvfs_seg_align(out_len);
+    msg->entries.push_back({out_iov, out_iovcnt, completion_context, out_len});
+
+    if (msg->entries.size() >= state->coalesce_max_reqs)
+        flush_batch(state);
+    return true;
+}
+
+// The batch is sent at the latest when the HAL is done with the requests of a poll
+static void fuse_poll_batch_end(void *user_data, uint16_t device_id)
+{
+    flush_batch((rpc_state *) user_data);
+}
+
+// Sends the virtio-fs request via eRPC to the remote server
+static int fuse_handler(void *user_data,
+                        struct iovec *in_iov, int in_iovcnt,
+                        struct iovec *out_iov, int out_iovcnt,
+                        void *completion_context, uint16_t device_id)
+{
+    rpc_state *state = (rpc_state *) user_data;
+    size_t req_len = request_size(state, in_iov, in_iovcnt, out_iovcnt);
+    size_t out_len = 0;
+    for (int i = 0; i < out_iovcnt; i++)
+        out_len += out_iov[i].iov_len;
+
+    if (state->coalesce && coalesce_request(state, in_iov, in_iovcnt, out_iov, out_iovcnt,
+                                            completion_context, req_len, out_len))
+        return EWOULDBLOCK;
+
+    rpc_msg *msg = get_msg(state, req_len, out_len);
+
+#ifdef DEBUG_ENABLED
+    printf("DPFS_RVFS_dpu %s: FUSE request with %d input iovecs and %d output iovecs. Sending in msg %p\n",
+            __func__, in_iovcnt, out_iovcnt, msg);
+#endif
 
     msg->completion_context = completion_context;
     msg->out_iov = out_iov;
     msg->out_iovcnt = out_iovcnt;
+    if (msg->req_class < 0) {
+        msg->in_iov = in_iov;
+        msg->in_iovcnt = in_iovcnt;
+        msg->req_len = req_len;
+        msg->resp_len = out_len;
+    } else {
+        serialize_msg(state, msg, in_iov, in_iovcnt, out_iov, out_iovcnt);
+    }
+    send_msg(state, msg);
 
     return EWOULDBLOCK;
 }
@@ -140,30 +630,25 @@ void usage()
     printf("dpfs_rvfs_dpu [-c config_path]\n");
 }
 
+// One past the highest device id, the ids of the VFs and the mock devices don't follow the PFs directly.
+// dpfs_hal_poll_io skips the ids without a device
 static volatile uint16_t ndevices;
 
-void hal_polling(struct dpfs_hal *hal, Nexus *nexus) {
-    // We need to register ourself in eRPC so that we can send requests in the fuse_handler
-    nexus->tls_registry_.init();
-
-    uint32_t count = 0;
+void hal_polling(struct dpfs_hal *hal, rpc_state *state) {
     while(keep_running) {
         for (uint16_t i = 0; i < ndevices; i++) {
-            if (count++ == 10000) {
-                dpfs_hal_poll_mmio(hal, i);
-                count = 0;
-            }
-
+            dpfs_hal_poll_mmio_timed(hal, i);
             dpfs_hal_poll_io(hal, i);
         }
+        complete_responses(state);
     }
 }
 
 void register_dpfs_device(void *user_data, uint16_t device_id) {
-    ndevices++;
+    if (device_id >= ndevices)
+        ndevices = device_id + 1;
 }
 void unregister_dpfs_device(void *user_data, uint16_t device_id) {
-    ndevices--;
 }
 
 int main(int argc, char **argv)
@@ -199,13 +684,26 @@ int main(int argc, char **argv)
         return -1;
     }
     
+    // optional
+    auto [oktr, transport] = conf->getString("transport");
+    if (!oktr)
+        transport = "erpc";
+    if (transport != "erpc" && transport != "shm") {
+        std::cerr << "`transport` must be \"erpc\" or \"shm\"" << std::endl;
+        return -1;
+    }
+    bool shm = transport == "shm";
+    // optional
+    auto [oks, shm_name] = conf->getString("shm_name");
+    if (!oks)
+        shm_name = "/dpfs-rvfs";
     auto [ok, remote_uri] = conf->getString("remote_uri");
-    if (!ok) {
+    if (!ok && !shm) {
         std::cerr << "The config must contain a `remote_uri` [hostname/ip:UDP_PORT]" << std::endl;
         return -1;
     }
     auto [okc, dpu_uri] = conf->getString("dpu_uri");
-    if (!okc) {
+    if (!okc && !shm) {
         std::cerr << "The config must contain a `dpu_uri` [hostname/ip:UDP_PORT]" << std::endl;
         return -1;
     }
@@ -214,20 +712,73 @@ int main(int argc, char **argv)
         std::cerr << "The config must contain a boolean `two_threads`" << std::endl;
         return -1;
     }
+    // optional
+    auto [okw, wire_format] = conf->getInt("wire_format");
+    if (!okw)
+        wire_format = 2;
+    if (wire_format != 1 && wire_format != 2) {
+        std::cerr << "`wire_format` must be 1 or 2" << std::endl;
+        return -1;
+    }
+    // optional
+    auto [okco, coalesce] = conf->getBool("coalesce");
+    if (!okco)
+        coalesce = false;
+    // optional
+    auto [okcr, coalesce_max_reqs] = conf->getInt("coalesce_max_reqs");
+    if (!okcr)
+        coalesce_max_reqs = 32;
+    // optional
+    auto [okcb, coalesce_max_bytes] = conf->getInt("coalesce_max_bytes");
+    if (!okcb)
+        coalesce_max_bytes = 8192;
+    if (coalesce && wire_format != 2) {
+        std::cerr << "`coalesce` requires `wire_format` 2" << std::endl;
+        return -1;
+    }
+    if (coalesce_max_reqs < 1 || coalesce_max_reqs > DPFS_RVFS_BATCH_MAX_REQS) {
+        std::cerr << "`coalesce_max_reqs` must be between 1 and " << DPFS_RVFS_BATCH_MAX_REQS << std::endl;
+        return -1;
+    }
+    if (coalesce_max_bytes < 1) {
+        std::cerr << "`coalesce_max_bytes` must be at least 1" << std::endl;
+        return -1;
+    }
+    // optional
+    auto [okt, host_threads] = conf->getInt("host_threads");
+    if (!okt)
+        host_threads = 1;
+    if (host_threads < 1 || host_threads > UINT16_MAX) {
+        std::cerr << "`host_threads` must be at least 1" << std::endl;
+        return -1;
+    }
+    // optional
+    auto [okr, ring_size] = conf->getInt("ring_size");
+    if (!okr)
+        ring_size = 0;
+    if (ring_size < 0) {
+        std::cerr << "`ring_size` must be 0 or positive" << std::endl;
+        return -1;
+    }
 
     std::cout << "dpfs_rvfs_dpu starting up!" << std::endl;
-    std::cout << "Connecting to " << remote_uri << ". The virtio-fs device will only be up after the connection is established!" << std::endl;
+    if (!shm)
+        std::cout << "Connecting to " << remote_uri << ". The virtio-fs device will only be up after the connection is established!" << std::endl;
 
     rpc_state state {};
-    size_t numa_node = 0;
-    // 1 background thread, which is unused but created to enable multithreading in eRPC
-    size_t erpc_bg_threads = two_threads;
-    state.nexus = std::unique_ptr<Nexus>(new Nexus(dpu_uri, numa_node, erpc_bg_threads));
-    state.rpc = std::unique_ptr<Rpc<CTransport>>(new Rpc<CTransport>(state.nexus.get(), &state, 0, sm_handler));
-    state.session_num = state.rpc->create_session(remote_uri, 0);
-
-    // Run till we are connected
-    while (!state.rpc->is_connected(state.session_num)) state.rpc->run_event_loop_once();
+    state.req_type = wire_format == 2 ? DPFS_RVFS_REQTYPE_FUSE_SG : DPFS_RVFS_REQTYPE_FUSE;
+    state.coalesce = coalesce;
+    state.coalesce_max_reqs = coalesce_max_reqs;
+    state.coalesce_max_bytes = coalesce_max_bytes;
+    if (!shm) {
+        size_t numa_node = 0;
+        // Only the current thread touches eRPC, also with two_threads
+        size_t erpc_bg_threads = 0;
+        state.nexus = std::unique_ptr<Nexus>(new Nexus(dpu_uri, numa_node, erpc_bg_threads));
+        state.rpc = std::unique_ptr<Rpc<CTransport>>(new Rpc<CTransport>(state.nexus.get(), &state, 0, sm_handler));
+        // Run till we are connected
+        connect_sessions(state, remote_uri, host_threads);
+    }
 
     struct dpfs_hal_params hal_params;
     // just for safety if a new option gets added
@@ -236,13 +787,38 @@ int main(int argc, char **argv)
     hal_params.ops.request_handler = fuse_handler;
     hal_params.ops.register_device = register_dpfs_device;
     hal_params.ops.unregister_device = unregister_dpfs_device;
+    if (coalesce)
+        hal_params.ops.poll_batch_end = fuse_poll_batch_end;
     hal_params.user_data = &state;
 
-    struct dpfs_hal *hal = dpfs_hal_new(&hal_params, true);
+    // The mock devices are polled by the HAL thread like the others, the request handler, the pools and
+    // the rings are single-threaded. The rings and the pools are only sized after this, nothing is
+    // polled before that
+    struct dpfs_hal *hal = dpfs_hal_new(&hal_params, false);
     if (hal == NULL) {
         fprintf(stderr, "Failed to initialize dpfs_hal, exiting...\n");
         return -1;
     }
+    size_t max_inflight = dpfs_hal_max_inflight(hal);
+    if (shm) {
+        if (create_shm(&state, shm_name, max_inflight, host_threads)) {
+            dpfs_hal_destroy(hal);
+            return -1;
+        }
+    } else {
+        init_msgbufs(&state, max_inflight);
+    }
+    // Every msg that is in flight has to fit in a ring, so that the threads never wait on each other
+    if (ring_size == 0)
+        ring_size = std::max<size_t>(max_inflight, 64);
+    if (ring_size < max_inflight) {
+        std::cerr << "`ring_size` must be at least the number of requests that can be in flight ("
+            << max_inflight << ")" << std::endl;
+        dpfs_hal_destroy(hal);
+        return -1;
+    }
+    state.to_dispatch = std::unique_ptr<msg_ring>(new msg_ring(ring_size));
+    state.from_dispatch = std::unique_ptr<msg_ring>(new msg_ring(ring_size));
 
     keep_running = 1;
     struct sigaction act;
@@ -252,35 +828,39 @@ int main(int argc, char **argv)
     sigaction(SIGPIPE, &act, 0);
     sigaction(SIGTERM, &act, 0);
 
-    std::cout << "Connected to the remote and virtio-fs device is online" << std::endl;
+    if (shm)
+        std::cout << "Serving the host over shared memory segment " << shm_name << " and virtio-fs device is online" << std::endl;
+    else
+        std::cout << "Connected to the remote and virtio-fs device is online" << std::endl;
 
     if (two_threads) {
         // The eRPC connection was created on the current threads.
         // eRPC doesn't allow us to switch which thread is the "dispatch" thread.
         // So for simplicity we use the current thread as the eRPC polling thread.
-        std::thread hal_thread(hal_polling, hal, state.nexus.get());
-        uint32_t count = 0;
-        while(keep_running && state.rpc->is_connected(state.session_num)) {
-            state.rpc->run_event_loop_once();
+        std::thread hal_thread(hal_polling, hal, &state);
+        while(keep_running && all_connected(state)) {
+            send_requests(&state);
+            run_transport(&state);
         }
         keep_running = 0;
         hal_thread.join();
     } else {
-        uint32_t count = 0;
-        while(keep_running && state.rpc->is_connected(state.session_num)) {
+        while(keep_running && all_connected(state)) {
             for (uint16_t i = 0; i < ndevices; i++) {
-                if (count++ == 10000) {
-                    dpfs_hal_poll_mmio(hal, i);
-                    count = 0;
-                }
-
+                dpfs_hal_poll_mmio_timed(hal, i);
                 dpfs_hal_poll_io(hal, i);
-                state.rpc->run_event_loop_once();
+                send_requests(&state);
+                run_transport(&state);
+                complete_responses(&state);
             }
         }
     }
 
     dpfs_hal_destroy(hal);
+    if (state.shm) {
+        munmap(state.shm, state.shm_size);
+        shm_unlink(shm_name.c_str());
+    }
 
     return 0;
 }
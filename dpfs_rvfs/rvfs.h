@@ -1,8 +1,59 @@
 #ifndef DPFS_RVFS_H
 #define DPFS_RVFS_H
 
+#include <stdint.h>
+#include <stddef.h>
+
 #define DPFS_RVFS_MAX_REQRESP_SIZE ((2 << 20) + 4096)
+// The message buffer size classes, only bulk I/O needs a DPFS_RVFS_MAX_REQRESP_SIZE buffer.
+// The host replies in the response buffer that eRPC preallocates (DPFS_RVFS_MSGBUF_MEDIUM)
+// and only allocates one for larger replies
+#define DPFS_RVFS_MSGBUF_SMALL 4096
+#define DPFS_RVFS_MSGBUF_MEDIUM (64 << 10)
+#define DPFS_RVFS_MSGBUF_NCLASSES 3
 
+// Wire format 1: every descriptor is an int count or size_t length followed by its data, see README.md
 #define DPFS_RVFS_REQTYPE_FUSE 0
+// Wire format 2 (scatter-gather): a dpfs_rvfs_sg_hdr with all the descriptor lengths,
+// followed by the data of the input descriptors, every segment starting at a DPFS_RVFS_SEG_ALIGN
+// boundary. The host maps the segments in place. The host serves both formats,
+// the DPU picks one with `wire_format` in [rvfs]
+#define DPFS_RVFS_REQTYPE_FUSE_SG 1
+#define DPFS_RVFS_SEG_ALIGN 64
+// Multiple small FUSE requests in one eRPC request (see `coalesce` in [rvfs]): a dpfs_rvfs_batch_hdr
+// followed by the format 2 message of every request, each starting at a DPFS_RVFS_SEG_ALIGN boundary.
+// The reply starts with the reply length of every request (DPFS_RVFS_BATCH_RESP_HDR_SIZE bytes),
+// followed by the replies. The reply of a request starts at the sum of the aligned output
+// lengths of the requests before it, so the host can complete the requests in any order
+#define DPFS_RVFS_REQTYPE_FUSE_BATCH 2
+#define DPFS_RVFS_BATCH_MAX_REQS 64
+
+struct dpfs_rvfs_sg_hdr {
+    uint16_t in_iovcnt;
+    uint16_t out_iovcnt;
+    // in_iovcnt input lengths followed by out_iovcnt output lengths
+    uint32_t len[];
+};
+
+static inline size_t dpfs_rvfs_seg_align(size_t len)
+{
+    return (len + DPFS_RVFS_SEG_ALIGN - 1) & ~((size_t) DPFS_RVFS_SEG_ALIGN - 1);
+}
+
+// The offset of the first input segment
+static inline size_t dpfs_rvfs_sg_hdr_size(int iovcnt)
+{
+    return dpfs_rvfs_seg_align(sizeof(struct dpfs_rvfs_sg_hdr) + iovcnt * sizeof(uint32_t));
+}
+
+struct dpfs_rvfs_batch_hdr {
+    uint16_t nreqs;
+    uint16_t reserved;
+    // The aligned length of the message of every request
+    uint32_t len[DPFS_RVFS_BATCH_MAX_REQS];
+};
+
+#define DPFS_RVFS_BATCH_HDR_SIZE dpfs_rvfs_seg_align(sizeof(struct dpfs_rvfs_batch_hdr))
+#define DPFS_RVFS_BATCH_RESP_HDR_SIZE dpfs_rvfs_seg_align(DPFS_RVFS_BATCH_MAX_REQS * sizeof(uint32_t))
 
 #endif // DPFS_RVFS_H
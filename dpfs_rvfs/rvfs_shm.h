@@ -0,0 +1,119 @@
+#ifndef DPFS_RVFS_SHM_H
+#define DPFS_RVFS_SHM_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include "rvfs.h"
+
+/*
+    The shared memory transport of RVFS (transport = "shm" in [rvfs]), for a host and DPU process on the
+    same machine. rvfs_dpu creates the POSIX shared memory segment `shm_name`, the RVFS HAL maps it.
+    The segment holds a ring pair for every host thread and nslots message slots. A slot has room for
+    a request and its reply of slot_size bytes each, in the same wire formats as over eRPC.
+    rvfs_dpu owns the free slots: it fills the request of a slot and pushes the slot index on the
+    submission ring of a host thread, which pushes it on its completion ring once the reply is in the slot.
+    Both rings hold nslots entries, so a push never fails. Both sides poll.
+*/
+
+#define DPFS_RVFS_SHM_MAGIC 0x4d48535346565244ULL // "DRVFSSHM" in little-endian
+#define DPFS_RVFS_SHM_VERSION 1
+#define DPFS_RVFS_SHM_ALIGN 4096
+
+struct dpfs_rvfs_shm_hdr {
+    // Written last by rvfs_dpu, the segment is only valid when this is DPFS_RVFS_SHM_MAGIC
+    uint64_t magic;
+    uint32_t version;
+    // A power of 2
+    uint32_t nslots;
+    uint32_t npairs;
+    uint32_t reserved;
+    uint64_t slot_size;
+};
+
+// A single producer, single consumer ring of slot indices
+struct dpfs_rvfs_shm_ring {
+    uint32_t head __attribute__((aligned(64))); // consumer
+    uint32_t tail __attribute__((aligned(64))); // producer
+    uint32_t entries[] __attribute__((aligned(64)));
+};
+
+struct dpfs_rvfs_shm_slot {
+    // DPFS_RVFS_REQTYPE_*
+    uint8_t req_type;
+    uint32_t req_len;
+    uint32_t resp_len;
+} __attribute__((aligned(64)));
+
+static inline size_t dpfs_rvfs_shm_align(size_t len)
+{
+    return (len + DPFS_RVFS_SHM_ALIGN - 1) & ~((size_t) DPFS_RVFS_SHM_ALIGN - 1);
+}
+
+static inline size_t dpfs_rvfs_shm_ring_size(uint32_t nslots)
+{
+    return dpfs_rvfs_seg_align(sizeof(struct dpfs_rvfs_shm_ring) + nslots * sizeof(uint32_t));
+}
+
+static inline size_t dpfs_rvfs_shm_slot_size(uint64_t slot_size)
+{
+    return dpfs_rvfs_shm_align(sizeof(struct dpfs_rvfs_shm_slot) + 2 * slot_size);
+}
+
+// The rings follow the header, the slots start at the first page after the rings
+static inline size_t dpfs_rvfs_shm_slots_offset(uint32_t nslots, uint32_t npairs)
+{
+    return dpfs_rvfs_shm_align(dpfs_rvfs_seg_align(sizeof(struct dpfs_rvfs_shm_hdr))
+            + 2 * npairs * dpfs_rvfs_shm_ring_size(nslots));
+}
+
+static inline size_t dpfs_rvfs_shm_size(uint32_t nslots, uint32_t npairs, uint64_t slot_size)
+{
+    return dpfs_rvfs_shm_slots_offset(nslots, npairs) + nslots * dpfs_rvfs_shm_slot_size(slot_size);
+}
+
+// The submission (cq == 0) or completion ring of a host thread
+static inline struct dpfs_rvfs_shm_ring *dpfs_rvfs_shm_get_ring(struct dpfs_rvfs_shm_hdr *hdr, uint32_t pair, int cq)
+{
+    return (struct dpfs_rvfs_shm_ring *) ((uint8_t *) hdr + dpfs_rvfs_seg_align(sizeof(*hdr))
+            + (2 * pair + (cq ? 1 : 0)) * dpfs_rvfs_shm_ring_size(hdr->nslots));
+}
+
+static inline struct dpfs_rvfs_shm_slot *dpfs_rvfs_shm_get_slot(struct dpfs_rvfs_shm_hdr *hdr, uint32_t idx)
+{
+    return (struct dpfs_rvfs_shm_slot *) ((uint8_t *) hdr + dpfs_rvfs_shm_slots_offset(hdr->nslots, hdr->npairs)
+            + idx * dpfs_rvfs_shm_slot_size(hdr->slot_size));
+}
+
+static inline uint8_t *dpfs_rvfs_shm_slot_req(struct dpfs_rvfs_shm_slot *slot)
+{
+    return (uint8_t *) slot + sizeof(*slot);
+}
+
+static inline uint8_t *dpfs_rvfs_shm_slot_resp(struct dpfs_rvfs_shm_hdr *hdr, struct dpfs_rvfs_shm_slot *slot)
+{
+    return (uint8_t *) slot + sizeof(*slot) + hdr->slot_size;
+}
+
+// The ring holds nslots entries and there are only nslots slots, so this never overflows
+static inline void dpfs_rvfs_shm_push(struct dpfs_rvfs_shm_hdr *hdr, struct dpfs_rvfs_shm_ring *r, uint32_t idx)
+{
+    uint32_t tail = r->tail;
+    r->entries[tail & (hdr->nslots - 1)] = idx;
+    __atomic_store_n(&r->tail, tail + 1, __ATOMIC_RELEASE);
+}
+
+// Returns the number of slot indices taken, at most n
+static inline uint32_t dpfs_rvfs_shm_pop(struct dpfs_rvfs_shm_hdr *hdr, struct dpfs_rvfs_shm_ring *r,
+                                         uint32_t *idx, uint32_t n)
+{
+    uint32_t head = r->head;
+    uint32_t avail = __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE) - head;
+    if (avail < n)
+        n = avail;
+    for (uint32_t i = 0; i < n; i++)
+        idx[i] = r->entries[(head + i) & (hdr->nslots - 1)];
+    __atomic_store_n(&r->head, head + n, __ATOMIC_RELEASE);
+    return n;
+}
+
+#endif // DPFS_RVFS_SHM_H
@@ -0,0 +1,275 @@
+/*
+#
+# Copyright 2023- IBM Inc. All rights reserved
+# SPDX-License-Identifier: LGPL-2.1-or-later
+#
+*/
+
+#include <getopt.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdbool.h>
+#include <errno.h>
+#include <err.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <glob.h>
+#include <sys/mman.h>
+#include <linux/fuse.h>
+
+#include "dpfs/stats.h"
+
+static const char *opcode_names[DPFS_STATS_NOPCODES] = {
+    [0] = "OTHER",
+    [FUSE_LOOKUP] = "LOOKUP", [FUSE_FORGET] = "FORGET", [FUSE_GETATTR] = "GETATTR",
+    [FUSE_SETATTR] = "SETATTR", [FUSE_READLINK] = "READLINK", [FUSE_SYMLINK] = "SYMLINK",
+    [FUSE_MKNOD] = "MKNOD", [FUSE_MKDIR] = "MKDIR", [FUSE_UNLINK] = "UNLINK",
+    [FUSE_RMDIR] = "RMDIR", [FUSE_RENAME] = "RENAME", [FUSE_LINK] = "LINK",
+    [FUSE_OPEN] = "OPEN", [FUSE_READ] = "READ", [FUSE_WRITE] = "WRITE",
+    [FUSE_STATFS] = "STATFS", [FUSE_RELEASE] = "RELEASE", [FUSE_FSYNC] = "FSYNC",
+    [FUSE_SETXATTR] = "SETXATTR", [FUSE_GETXATTR] = "GETXATTR", [FUSE_LISTXATTR] = "LISTXATTR",
+    [FUSE_REMOVEXATTR] = "REMOVEXATTR", [FUSE_FLUSH] = "FLUSH", [FUSE_INIT] = "INIT",
+    [FUSE_OPENDIR] = "OPENDIR", [FUSE_READDIR] = "READDIR", [FUSE_RELEASEDIR] = "RELEASEDIR",
+    [FUSE_FSYNCDIR] = "FSYNCDIR", [FUSE_GETLK] = "GETLK", [FUSE_SETLK] = "SETLK",
+    [FUSE_SETLKW] = "SETLKW", [FUSE_ACCESS] = "ACCESS", [FUSE_CREATE] = "CREATE",
+    [FUSE_INTERRUPT] = "INTERRUPT", [FUSE_BMAP] = "BMAP", [FUSE_DESTROY] = "DESTROY",
+    [FUSE_IOCTL] = "IOCTL", [FUSE_POLL] = "POLL", [FUSE_NOTIFY_REPLY] = "NOTIFY_REPLY",
+    [FUSE_BATCH_FORGET] = "BATCH_FORGET", [FUSE_FALLOCATE] = "FALLOCATE",
+    [FUSE_READDIRPLUS] = "READDIRPLUS", [FUSE_RENAME2] = "RENAME2", [FUSE_LSEEK] = "LSEEK",
+    [FUSE_COPY_FILE_RANGE] = "COPY_FILE_RANGE", [FUSE_SETUPMAPPING] = "SETUPMAPPING",
+    [FUSE_REMOVEMAPPING] = "REMOVEMAPPING",
+};
+
+void usage()
+{
+    printf("dpfs_stat [-n stats_shm_name] [-t] [-o] [interval [count]]\n"
+           "  -n  the stats_shm_name from the HAL config, default \"/dpfs_stats\"\n"
+           "  -t  also report every DPFS thread, including the share of its time it waited in a\n"
+           "      low-power state or yielded (wait%%) and slept or was parked (sleep%%)\n"
+           "  -o  also report the request rate of every FUSE opcode\n"
+           "The first report covers the time since the DPFS process started,\n"
+           "every next report covers the interval (in seconds) since the previous one.\n"
+           "The power of the machine is reported when it has RAPL or hwmon energy counters\n");
+}
+
+static double now_sec(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// Copies the segment without writing to it, the counters of a snapshot can be
+// a couple of requests apart because the pollers keep running
+static bool snapshot(const struct dpfs_stats *shm, struct dpfs_stats *s)
+{
+    memcpy(s, shm, sizeof(*s));
+    return __atomic_load_n(&shm->magic, __ATOMIC_ACQUIRE) == DPFS_STATS_MAGIC &&
+        s->version == DPFS_STATS_VERSION;
+}
+
+// The energy counters of the RAPL domains or the hwmon sensors that report energy, in microjoules
+static const char *energy_patterns[] = {
+    "/sys/class/powercap/intel-rapl:[0-9]*/energy_uj",
+    "/sys/class/hwmon/hwmon*/energy1_input",
+};
+
+// Returns the total of all the energy counters, false if the machine has none we can read
+static bool energy_uj(uint64_t *total)
+{
+    bool found = false;
+    *total = 0;
+    for (size_t i = 0; i < sizeof(energy_patterns) / sizeof(energy_patterns[0]) && !found; i++) {
+        glob_t g;
+        if (glob(energy_patterns[i], 0, NULL, &g))
+            continue;
+        for (size_t j = 0; j < g.gl_pathc; j++) {
+            FILE *f = fopen(g.gl_pathv[j], "r");
+            if (!f)
+                continue;
+            unsigned long long v;
+            if (fscanf(f, "%llu", &v) == 1) {
+                *total += v;
+                found = true;
+            }
+            fclose(f);
+        }
+        globfree(&g);
+    }
+    return found;
+}
+
+static inline double rate(uint64_t cur, uint64_t prev, double sec)
+{
+    return (cur - prev) / sec;
+}
+
+static inline double pct(uint64_t part_cur, uint64_t part_prev, uint64_t cur, uint64_t prev)
+{
+    return cur != prev ? 100.0 * (part_cur - part_prev) / (cur - prev) : 0.0;
+}
+
+// watts < 0 if the energy is unknown
+static void report(const struct dpfs_stats *cur, const struct dpfs_stats *prev, double sec,
+                   double watts, bool threads, bool opcodes)
+{
+    char tbuf[32];
+    time_t t = time(NULL);
+    strftime(tbuf, sizeof(tbuf), "%H:%M:%S", localtime(&t));
+
+    uint64_t async_requests = 0, async_completions = cur->external_async_completions;
+    for (uint16_t i = 0; i < cur->nthreads; i++) {
+        async_requests += cur->threads[i].async_requests;
+        async_completions += cur->threads[i].async_completions;
+    }
+    printf("%s  pid %d (%s HAL), %u threads, %u devices, %lu requests in flight", tbuf,
+            cur->pid, cur->hal, cur->nthreads, cur->ndevices,
+            async_requests > async_completions ? async_requests - async_completions : 0);
+    if (watts >= 0)
+        printf(", %.1f W", watts);
+    printf("\n");
+
+    printf("%-8s %12s %8s %10s %10s %10s\n", "device", "req/s", "async%", "err/s", "rMB/s", "wMB/s");
+    struct dpfs_stats_device dt = {0}, dpt = {0};
+    for (uint16_t i = 0; i < cur->ndevices; i++) {
+        const struct dpfs_stats_device *d = &cur->devices[i], *dp = &prev->devices[i];
+        printf("%-8u %12.1f %8.1f %10.1f %10.1f %10.1f\n", i,
+                rate(d->requests, dp->requests, sec),
+                pct(d->async_requests, dp->async_requests, d->requests, dp->requests),
+                rate(d->errors, dp->errors, sec),
+                rate(d->read_bytes, dp->read_bytes, sec) / 1e6,
+                rate(d->write_bytes, dp->write_bytes, sec) / 1e6);
+        dt.requests += d->requests; dpt.requests += dp->requests;
+        dt.async_requests += d->async_requests; dpt.async_requests += dp->async_requests;
+        dt.errors += d->errors; dpt.errors += dp->errors;
+        dt.read_bytes += d->read_bytes; dpt.read_bytes += dp->read_bytes;
+        dt.write_bytes += d->write_bytes; dpt.write_bytes += dp->write_bytes;
+    }
+    if (cur->ndevices > 1) {
+        printf("%-8s %12.1f %8.1f %10.1f %10.1f %10.1f\n", "total",
+                rate(dt.requests, dpt.requests, sec),
+                pct(dt.async_requests, dpt.async_requests, dt.requests, dpt.requests),
+                rate(dt.errors, dpt.errors, sec),
+                rate(dt.read_bytes, dpt.read_bytes, sec) / 1e6,
+                rate(dt.write_bytes, dpt.write_bytes, sec) / 1e6);
+    }
+
+    if (threads) {
+        printf("%-8s %12s %8s %12s %10s %10s %10s %8s %6s %6s\n", "thread", "polls/s", "useful%",
+                "req/s", "sync/s", "async/s", "cpl/s", "mpool/s", "wait%", "sleep%");
+        for (uint16_t i = 0; i < cur->nthreads; i++) {
+            const struct dpfs_stats_thread *c = &cur->threads[i], *p = &prev->threads[i];
+            printf("%-8u %12.1f %8.2f %12.1f %10.1f %10.1f %10.1f %8.1f %6.1f %6.1f\n", i,
+                    rate(c->polls, p->polls, sec),
+                    pct(c->useful_polls, p->useful_polls, c->polls, p->polls),
+                    rate(c->requests, p->requests, sec),
+                    rate(c->sync_completions, p->sync_completions, sec),
+                    rate(c->async_requests, p->async_requests, sec),
+                    rate(c->async_completions, p->async_completions, sec),
+                    rate(c->mpool_exhausted, p->mpool_exhausted, sec),
+                    rate(c->wait_ns, p->wait_ns, sec) / 1e7,
+                    rate(c->sleep_ns, p->sleep_ns, sec) / 1e7);
+        }
+        printf("%-8s %12s %8s %12s %10s %10s %10.1f %8s\n", "external", "", "", "", "", "",
+                rate(cur->external_async_completions, prev->external_async_completions, sec), "");
+    }
+
+    if (opcodes) {
+        printf("opcode req/s:");
+        for (int o = 0; o < DPFS_STATS_NOPCODES; o++) {
+            uint64_t c = 0, p = 0;
+            for (uint16_t i = 0; i < cur->nthreads; i++) {
+                c += cur->threads[i].opcodes[o];
+                p += prev->threads[i].opcodes[o];
+            }
+            if (c != p)
+                printf(" %s %.1f", opcode_names[o] ? opcode_names[o] : "?", rate(c, p, sec));
+        }
+        printf("\n");
+    }
+    printf("\n");
+}
+
+int main(int argc, char **argv)
+{
+    const char *name = "/dpfs_stats";
+    bool threads = false, opcodes = false;
+
+    int opt;
+    while ((opt = getopt(argc, argv, "n:toh")) != -1) {
+        switch (opt) {
+            case 'n':
+                name = optarg;
+                break;
+            case 't':
+                threads = true;
+                break;
+            case 'o':
+                opcodes = true;
+                break;
+            default: /* '?' */
+                usage();
+                exit(1);
+        }
+    }
+    double interval = optind < argc ? atof(argv[optind++]) : 1.0;
+    long count = optind < argc ? atol(argv[optind++]) : -1;
+    if (interval <= 0) {
+        usage();
+        exit(1);
+    }
+
+    // Read-only, so that sampling never touches the cachelines of the pollers
+    int fd = shm_open(name, O_RDONLY, 0);
+    if (fd == -1)
+        err(1, "Cannot open the statistics segment %s, is stats_shm_name set in the HAL config", name);
+    const struct dpfs_stats *shm = mmap(NULL, sizeof(*shm), PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (shm == MAP_FAILED)
+        err(1, "Cannot map the statistics segment %s", name);
+
+    struct dpfs_stats *cur = calloc(1, sizeof(*cur));
+    struct dpfs_stats *prev = calloc(1, sizeof(*prev));
+    if (!cur || !prev)
+        err(1, "Cannot allocate memory for the snapshots");
+
+    if (!snapshot(shm, cur))
+        errx(1, "%s is not a (compatible) DPFS statistics segment or the DPFS process has exited", name);
+    // The first report is since the start of the process
+    double last = cur->start_time;
+    memset(prev, 0, sizeof(*prev));
+    // The energy is only known from the second report on, we didn't see the start of the process
+    uint64_t last_uj = 0;
+    bool energy = energy_uj(&last_uj);
+
+    for (long i = 0; count < 0 || i < count; i++) {
+        if (i > 0) {
+            usleep(interval * 1000000);
+            struct dpfs_stats *tmp = prev;
+            prev = cur;
+            cur = tmp;
+            if (!snapshot(shm, cur))
+                errx(1, "The DPFS process has exited");
+        }
+        double now = now_sec();
+        double sec = now - last > 0 ? now - last : interval;
+        last = now;
+        double watts = -1;
+        uint64_t uj;
+        if (energy && i > 0 && energy_uj(&uj)) {
+            // The counters wrap around, skip those intervals
+            if (uj >= last_uj)
+                watts = (uj - last_uj) / 1e6 / sec;
+            last_uj = uj;
+        }
+
+        report(cur, prev, sec, watts, threads, opcodes);
+        fflush(stdout);
+    }
+
+    free(cur);
+    free(prev);
+    return 0;
+}
@@ -23,6 +23,7 @@
 
 #include "fuser.h"
 #include "mirror_impl.h"
+#include "placement.h"
 
 struct inode *inode_new(fuse_ino_t ino) {
     struct inode *i = calloc(1, sizeof(struct inode));
@@ -182,17 +183,144 @@ static void maximize_fd_limit() {
         warn("WARNING: setrlimit() failed with");
 }
 
+struct io_uring_sqe *fuser_get_sqe(struct fuser *f, uint16_t thread_id) {
+    struct io_uring_sqe *sqe = io_uring_get_sqe(&f->rings[thread_id]);
+    if (!sqe && f->batches[thread_id].pending > 0) {
+        fuser_flush(f, thread_id);
+        sqe = io_uring_get_sqe(&f->rings[thread_id]);
+    }
+    return sqe;
+}
+
+int fuser_submit(struct fuser *f, uint16_t thread_id) {
+    struct fuser_batch *b = &f->batches[thread_id];
+    if (b->active) {
+        b->pending++;
+        return 0;
+    }
+    return io_uring_submit(&f->rings[thread_id]);
+}
+
+void fuser_flush(struct fuser *f, uint16_t thread_id) {
+    struct fuser_batch *b = &f->batches[thread_id];
+    if (b->pending == 0)
+        return;
+
+    int res = io_uring_submit(&f->rings[thread_id]);
+    if (res < 0) {
+        // The sqes stay in the ring and will be submitted by the next io_uring_submit
+        fprintf(stderr, "ERROR: uring submit of %u deferred sqes failed: %s\n", b->pending, strerror(-res));
+        return;
+    }
+    b->pending = 0;
+}
+
+void fuser_queue_cancel(struct fuser *f, uint16_t thread_id, struct fuse_session *se, uint64_t unique,
+                        struct fuser_cb_data *cb_data) {
+    struct fuser_batch *b = &f->batches[thread_id];
+
+    pthread_mutex_lock(&b->cancel_lock);
+    if (b->ncancels < FUSER_MAX_CANCELS) {
+        struct fuser_cancel *c = &b->cancels[b->ncancels];
+        c->cb_data = cb_data;
+        c->se = se;
+        c->unique = unique;
+        __atomic_store_n(&b->ncancels, b->ncancels + 1, __ATOMIC_RELEASE);
+    }
+    pthread_mutex_unlock(&b->cancel_lock);
+}
+
+void fuser_flush_cancels(struct fuser *f, uint16_t thread_id) {
+    struct fuser_batch *b = &f->batches[thread_id];
+    if (__atomic_load_n(&b->ncancels, __ATOMIC_ACQUIRE) == 0)
+        return;
+
+    struct fuser_cancel cancels[FUSER_MAX_CANCELS];
+    pthread_mutex_lock(&b->cancel_lock);
+    uint32_t n = b->ncancels;
+    memcpy(cancels, b->cancels, n * sizeof(*cancels));
+    b->ncancels = 0;
+    pthread_mutex_unlock(&b->cancel_lock);
+
+    uint32_t prepared = 0;
+    for (uint32_t i = 0; i < n; i++) {
+        struct fuser_cancel *c = &cancels[i];
+        // The request completed since the cancel was queued and this thread reused its cb_data.
+        // Only this thread allocates from the pool of the ring, so it can't be reused before the submit below
+        if (c->cb_data->unique != c->unique || c->cb_data->se != c->se)
+            continue;
+
+        struct io_uring_sqe *sqe = fuser_get_sqe(f, thread_id);
+        if (!sqe) {
+            fprintf(stderr, "ERROR: Not enough uring sqe elements avail to cancel %u requests.\n", n - i);
+            break;
+        }
+        io_uring_prep_cancel(sqe, c->cb_data, 0);
+        // The reaper skips the cqe of the cancel itself
+        io_uring_sqe_set_data(sqe, NULL);
+        prepared++;
+    }
+    if (prepared == 0)
+        return;
+
+    int res = io_uring_submit(&f->rings[thread_id]);
+    if (res < 0)
+        fprintf(stderr, "ERROR: uring submit of %u cancels failed: %s\n", prepared, strerror(-res));
+    else
+        b->pending = 0;
+}
+
 struct tdata {
     pthread_t t;
     uint16_t thread_id;
     struct fuser *f;
+    // -1 if the thread is not pinned
+    int cpu;
 };
 
+#define FUSER_CQE_BATCH 64
+
+// Handles all the available cqes on the ring and completes them to the HAL in bulk
+static unsigned fuser_reap_cqes(struct fuser *f, struct io_uring *ring) {
+    struct io_uring_cqe *cqes[FUSER_CQE_BATCH];
+    void *completion_contexts[FUSER_CQE_BATCH];
+
+    unsigned n = io_uring_peek_batch_cqe(ring, cqes, FUSER_CQE_BATCH);
+    unsigned ncompleted = 0;
+    for (unsigned i = 0; i < n; i++) {
+        struct fuser_cb_data *cb_data = io_uring_cqe_get_data(cqes[i]);
+        // A cancel, see fuser_flush_cancels
+        if (!cb_data)
+            continue;
+
+        cb_data->cb(cb_data, cqes[i]);
+
+        completion_contexts[ncompleted++] = cb_data->completion_context;
+        // Not every op sets it, a queued cancel must not match the next use of the cb_data
+        cb_data->unique = 0;
+        mpool_free(f->cb_data_pools[cb_data->thread_id], cb_data);
+    }
+    if (n > 0) {
+        io_uring_cq_advance(ring, n);
+        if (ncompleted > 0)
+            dpfs_hal_async_complete_batch(completion_contexts, NULL, ncompleted);
+    }
+    return n;
+}
+
 // Blocks on a single ring
 static void *fuser_io_blocking_thread(void *arg) {
     struct tdata *td = arg;
     struct fuser *f = td->f;
 
+    if (td->cpu >= 0) {
+        int ret = placement_pin(td->cpu);
+        if (ret) {
+            errno = -ret;
+            warn("Could not set the CPU affinity of uring completion thread %u. It will continue not pinned.", td->thread_id);
+        }
+    }
+
     while(!f->io_poll_thread_stop){
             struct io_uring_cqe *cqe;
             int ret = io_uring_wait_cqe(&f->rings[td->thread_id], &cqe);
@@ -203,16 +331,59 @@ static void *fuser_io_blocking_thread(void *arg) {
                 fprintf(stderr, "ERROR: uring cqe wait ret = %d\n", ret);
                 fprintf(stderr, "ERROR: stopping uring cqe waiting\n");
                 return NULL;
-            } // else process the event
+            } // else process the event and all the others that are ready
+
+            fuser_reap_cqes(f, &f->rings[td->thread_id]);
+    }
+    return NULL;
+}
 
-            struct fuser_cb_data *cb_data = io_uring_cqe_get_data(cqe);
+void fuser_queue_copy(struct fuser *f, struct fuser_copy *c)
+{
+    c->next = NULL;
+    pthread_mutex_lock(&f->copy_lock);
+    if (f->copy_tail)
+        f->copy_tail->next = c;
+    else
+        f->copy_head = c;
+    f->copy_tail = c;
+    pthread_cond_signal(&f->copy_cond);
+    pthread_mutex_unlock(&f->copy_lock);
+}
 
-            cb_data->cb(cb_data, cqe);
+// Does the copies one by one, the source file system can do them as a reflink or in the kernel
+static void *fuser_copy_thread(void *arg) {
+    struct fuser *f = arg;
+
+    while (true) {
+        pthread_mutex_lock(&f->copy_lock);
+        while (!f->copy_head && !f->copy_stop)
+            pthread_cond_wait(&f->copy_cond, &f->copy_lock);
+        struct fuser_copy *c = f->copy_head;
+        if (c) {
+            f->copy_head = c->next;
+            if (!f->copy_head)
+                f->copy_tail = NULL;
+        }
+        pthread_mutex_unlock(&f->copy_lock);
+        // Only stop once all the queued copies are done
+        if (!c)
+            return NULL;
+
+        loff_t off_in = c->in.off_in;
+        loff_t off_out = c->in.off_out;
+        ssize_t res = copy_file_range(c->in.fh_in, &off_in, c->in.fh_out, &off_out, c->in.len, c->in.flags);
+        if (res == -1) {
+            c->out_hdr->error = -errno;
+        } else {
+            c->out_write->size = res;
+            c->out_hdr->len += sizeof(*c->out_write);
+        }
 
-            io_uring_cqe_seen(&f->rings[td->thread_id], cqe);
-            mpool_free(f->cb_data_pools[cb_data->thread_id], cb_data);
+        void *completion_context = c->completion_context;
+        free(c);
+        dpfs_hal_async_complete(completion_context, DPFS_HAL_COMPLETION_SUCCES);
     }
-    return NULL;
 }
 
 // Polls on a range of rings depending on the number of polling threads and rings
@@ -220,19 +391,10 @@ static void *fuser_io_poll_thread(void *arg) {
     struct tdata *td = arg;
     struct fuser *f = td->f;
 
-    long num_cpus = sysconf(_SC_NPROCESSORS_CONF);
-    if (dpfs_fuse_nthreads(f->fuse) + f->cq_polling_nthreads <= num_cpus) {
-        cpu_set_t loop_cpu;
-        CPU_ZERO(&loop_cpu);
-        // Calculate our polling CPU
-        // with two DPFS threads, two CQ threads and 8 total cores:
-        // DPFS thread 0 will occupy core 7
-        // DPFS thread 1 will occupy core 6
-        // cq polling thread 0 will occupy core 5
-        // cq polling thread 1 will occupy core 4
-        CPU_SET(num_cpus-1 - dpfs_fuse_nthreads(f->fuse) - td->thread_id, &loop_cpu);
-        int ret = sched_setaffinity(gettid(), sizeof(loop_cpu), &loop_cpu);
-        if (ret == -1) {
+    if (td->cpu >= 0) {
+        int ret = placement_pin(td->cpu);
+        if (ret) {
+            errno = -ret;
             warn("Could not set the CPU affinity of polling thread %u. uring polling thread %u will continue not pinned.", td->thread_id, td->thread_id);
         }
     }
@@ -253,26 +415,51 @@ static void *fuser_io_poll_thread(void *arg) {
 
     while(!td->f->io_poll_thread_stop){
         for (uint16_t i = start; i < end; i++) {
-            struct io_uring_cqe *cqe;
-            int ret = io_uring_peek_cqe(&td->f->rings[i], &cqe);
-
-            if(ret == -EAGAIN || ret == -EINTR){
-                continue; // No event to process
-            } else if(ret != 0) {
-                fprintf(stderr, "ERROR: uring cqe peek ret = %d\n", ret);
-                fprintf(stderr, "ERROR: stopping uring cqe polling\n");
-                return NULL;
-            } // else process the event
+            fuser_reap_cqes(f, &f->rings[i]);
+        }
+    }
+    return NULL;
+}
 
-            struct fuser_cb_data *cb_data = io_uring_cqe_get_data(cqe);
+// The completion threads run on the completion_threads of [placement]. Without it the cq polling threads
+// occupy the cores right below the DPFS threads, with two DPFS threads, two CQ threads and 8 total cores:
+// DPFS thread 0 will occupy core 7
+// DPFS thread 1 will occupy core 6
+// cq polling thread 0 will occupy core 5
+// cq polling thread 1 will occupy core 4
+// and the blocking completion threads are not pinned
+static int fuser_resolve_completion_cpus(struct fuser *f, const char *conf_path, uint16_t nthreads, struct tdata *td)
+{
+    struct placement p;
+    if (placement_load(conf_path, &p))
+        return -1;
 
-            cb_data->cb(cb_data, cqe);
+    int ncpus = p.ncpus[PLACEMENT_COMPLETION_THREADS];
+    if (f->cq_polling && ncpus > 0 && ncpus != nthreads) {
+        fprintf(stderr, "ERROR: [placement] completion_threads must contain a CPU for each of the uring_cq_polling_nthreads threads!\n");
+        return -1;
+    }
 
-            io_uring_cqe_seen(&td->f->rings[i], cqe);
-            mpool_free(td->f->cb_data_pools[cb_data->thread_id], cb_data);
+    long num_cpus = sysconf(_SC_NPROCESSORS_CONF);
+    bool pin_default = f->cq_polling && dpfs_fuse_nthreads(f->fuse) + nthreads <= num_cpus;
+    if (f->cq_polling && ncpus == 0 && !pin_default) {
+        warn("DPFS is configured with as many or more threads than there are cores on the DPU!"
+                "Core pinning is therefore disabled in dpfs_uring!\n");
+    }
+    for (uint16_t i = 0; i < nthreads; i++) {
+        td[i].cpu = placement_cpu(&p, PLACEMENT_COMPLETION_THREADS, i);
+        if (td[i].cpu == -1 && pin_default) {
+            td[i].cpu = num_cpus-1 - dpfs_fuse_nthreads(f->fuse) - i;
+            if (placement_conflicts(&p, PLACEMENT_COMPLETION_THREADS, td[i].cpu)) {
+                fprintf(stderr, "ERROR: uring cq polling thread %u would run on CPU %d, which is not available."
+                        " Hint: set completion_threads in [placement]\n", i, td[i].cpu);
+                return -1;
+            }
         }
+        if (td[i].cpu >= 0)
+            printf("dpfs_uring: %s thread %u runs on CPU %d\n", f->cq_polling ? "cq polling" : "completion", i, td[i].cpu);
     }
-    return NULL;
+    return 0;
 }
 
 // TODO proper error handling
@@ -346,11 +533,22 @@ int fuser_main(bool debug, char *source, double metadata_timeout, const char *co
         }
     }
 
+    f->batches = calloc(f->nrings, sizeof(*f->batches));
+    for (uint16_t i = 0; i < f->nrings; i++) {
+        pthread_mutex_init(&f->batches[i].cancel_lock, NULL);
+    }
     f->cb_data_pools = calloc(f->nrings, sizeof(*f->cb_data_pools));
     for (uint16_t i = 0; i < f->nrings; i++) {
         mpool_init(&f->cb_data_pools[i], sizeof(struct fuser_cb_data), 256);
     }
 
+    pthread_mutex_init(&f->copy_lock, NULL);
+    pthread_cond_init(&f->copy_cond, NULL);
+    if (pthread_create(&f->copy_thread, NULL, fuser_copy_thread, f)) {
+        fprintf(stderr, "ERROR: Unable to start the copy_file_range thread\n");
+        return -1;
+    }
+
     uint16_t nthreads;
     if (f->cq_polling) {
         nthreads = cq_polling_nthreads; // user-defined
@@ -359,16 +557,12 @@ int fuser_main(bool debug, char *source, double metadata_timeout, const char *co
             fprintf(stderr, "ERROR: There cannot be more cq polling threads than DPFS threads for request handling!\n");
             return -1;
         }
-
-        long num_cpus = sysconf(_SC_NPROCESSORS_CONF);
-        if (dpfs_fuse_nthreads(fuse) + nthreads >= num_cpus) {
-            warn("DPFS is configured with as many or more threads than there are cores on the DPU!"
-                    "Core pinning is therefore disabled in dpfs_uring!\n");
-        }
     } else {
         nthreads = f->nrings; // a blocking thread per ring
     }
     struct tdata td[nthreads];
+    if (fuser_resolve_completion_cpus(f, conf_path, nthreads, td))
+        return -1;
 
     for (uint16_t i = 0; i < nthreads; i++) {
         td[i].thread_id = i;
@@ -380,6 +574,16 @@ int fuser_main(bool debug, char *source, double metadata_timeout, const char *co
     }
 
     dpfs_fuse_loop(fuse);
+
+    // The queued copies are completed before the HAL goes away
+    pthread_mutex_lock(&f->copy_lock);
+    f->copy_stop = true;
+    pthread_cond_signal(&f->copy_cond);
+    pthread_mutex_unlock(&f->copy_lock);
+    pthread_join(f->copy_thread, NULL);
+    pthread_mutex_destroy(&f->copy_lock);
+    pthread_cond_destroy(&f->copy_cond);
+
     dpfs_fuse_destroy(fuse);
 
     f->io_poll_thread_stop = true;
@@ -400,6 +604,7 @@ int fuser_main(bool debug, char *source, double metadata_timeout, const char *co
     for (uint16_t i = 0; i < f->nrings; i++) {
         mpool_destroy(f->cb_data_pools[i]);
     }
+    free(f->batches);
     // destroy inode table
     free(f);
 
@@ -63,6 +63,39 @@ struct directory {
 
 void directory_destroy(struct directory *);
 
+struct fuser_cb_data;
+
+// The most cancels that can be queued for a ring, more are dropped
+#define FUSER_MAX_CANCELS 64
+
+struct fuser_cancel {
+    struct fuser_cb_data *cb_data;
+    struct fuse_session *se;
+    uint64_t unique;
+};
+
+// A FUSE_COPY_FILE_RANGE for the copy thread
+struct fuser_copy {
+    struct fuse_copy_file_range_in in;
+    struct fuse_out_header *out_hdr;
+    struct fuse_write_out *out_write;
+    void *completion_context;
+    struct fuser_copy *next;
+};
+
+// Per DPFS thread state of a poll batch, see fuser_mirror_poll_batch_begin
+struct fuser_batch {
+    bool active;
+    // The number of sqes that have been prepared but not submitted yet
+    uint32_t pending;
+
+    // Only the DPFS thread of a ring may submit to it, so the cancels that other threads ask for
+    // are queued here and submitted at the end of the next poll batch
+    pthread_mutex_t cancel_lock;
+    uint32_t ncancels;
+    struct fuser_cancel cancels[FUSER_MAX_CANCELS];
+};
+
 struct fuser {
     pthread_mutex_t m;
     struct inode_table *inodes; // protected by m
@@ -85,11 +118,36 @@ struct fuser {
     // if cq_polling == false, then nthreads = nrings
 
     struct mpool **cb_data_pools;
+    // One for every ring
+    struct fuser_batch *batches;
+
+    // copy_file_range blocks for as long as the copy takes, so the copies run on their own thread
+    // instead of stalling the queues of a DPFS thread. FIFO, protected by copy_lock
+    pthread_t copy_thread;
+    pthread_mutex_t copy_lock;
+    pthread_cond_t copy_cond;
+    struct fuser_copy *copy_head;
+    struct fuser_copy *copy_tail;
+    bool copy_stop;
 };
 
 struct inode *ino_to_inodeptr(struct fuser *, fuse_ino_t);
 int ino_to_fd(struct fuser *, fuse_ino_t);
 
+// Get an sqe from the ring of the DPFS thread, flushes the deferred sqes if the ring is full
+struct io_uring_sqe *fuser_get_sqe(struct fuser *, uint16_t thread_id);
+// Submits the prepared sqe, or defers the submission to the end of the poll batch
+int fuser_submit(struct fuser *, uint16_t thread_id);
+// Submits all the deferred sqes of the DPFS thread
+void fuser_flush(struct fuser *, uint16_t thread_id);
+// Queues the cancel of a request that was submitted to the ring of thread_id, can be called by any thread
+void fuser_queue_cancel(struct fuser *, uint16_t thread_id, struct fuse_session *, uint64_t unique,
+                        struct fuser_cb_data *);
+// Submits the queued cancels of the DPFS thread
+void fuser_flush_cancels(struct fuser *, uint16_t thread_id);
+// Hands a copy to the copy thread, which completes the request
+void fuser_queue_copy(struct fuser *, struct fuser_copy *);
+
 int fuser_main(bool debug, char *source, double metadata_timeout,
                const char *conf_path, bool cq_polling,
                uint16_t cq_polling_nthreads, bool sq_polling);
@@ -20,8 +20,11 @@
 #include <unistd.h>
 #include <sys/statvfs.h>
 #include <sys/file.h>
+#include <sys/xattr.h>
+#include <sys/mman.h>
 #include <string.h>
 #include "dpfs_fuse.h"
+#include "dpfs/stats.h"
 
 #include "fuser.h"
 #include "mirror_impl.h"
@@ -29,13 +32,8 @@
 
 static void fuser_mirror_generic_cb(struct fuser_cb_data *cb_data, struct io_uring_cqe *cqe)
 {
-    if (cqe->res < 0) {
+    if (cqe->res < 0)
         cb_data->out_hdr->error = cqe->res;
-        dpfs_hal_async_complete(cb_data->completion_context, DPFS_HAL_COMPLETION_SUCCES);
-        return;
-    }
-
-    dpfs_hal_async_complete(cb_data->completion_context, DPFS_HAL_COMPLETION_SUCCES);
 }
 
 
@@ -135,8 +133,6 @@ static void fuser_mirror_getattr_cb(struct fuser_cb_data *cb_data, struct io_uri
         cb_data->out_hdr->error = cqe->res;
     }
     fuse_ll_reply_attrx(cb_data->se, cb_data->out_hdr, cb_data->getattr.out_attr, &cb_data->getattr.s, cb_data->f->timeout);
-
-    dpfs_hal_async_complete(cb_data->completion_context, DPFS_HAL_COMPLETION_SUCCES);
 }
 
 int fuser_mirror_getattr(struct fuse_session *se, void *user_data,
@@ -157,6 +153,11 @@ int fuser_mirror_getattr(struct fuse_session *se, void *user_data,
 
     uint16_t thread_id = dpfs_hal_thread_id();
     struct fuser_cb_data *cb_data = mpool_alloc(f->cb_data_pools[thread_id]);
+    if (!cb_data) {
+        dpfs_stats_mpool_exhausted(dpfs_hal_stats(), thread_id);
+        out_hdr->error = -ENOMEM;
+        return 0;
+    }
     cb_data->thread_id = thread_id;
     cb_data->cb = fuser_mirror_getattr_cb;
     cb_data->f = f;
@@ -165,7 +166,7 @@ int fuser_mirror_getattr(struct fuse_session *se, void *user_data,
     cb_data->getattr.out_attr = out_attr;
     cb_data->completion_context = completion_context;
 
-    struct io_uring_sqe *sqe = io_uring_get_sqe(&f->rings[thread_id]);
+    struct io_uring_sqe *sqe = fuser_get_sqe(f, thread_id);
     if (!sqe) {
         fprintf(stderr, "ERROR: Not enough uring sqe elements avail.\n");
         out_hdr->error = -ENOMEM;
@@ -174,7 +175,7 @@ int fuser_mirror_getattr(struct fuse_session *se, void *user_data,
     io_uring_prep_statx(sqe, fd, "", AT_EMPTY_PATH | AT_SYMLINK_NOFOLLOW | AT_NO_AUTOMOUNT, STATX_BASIC_STATS, &cb_data->getattr.s);
     io_uring_sqe_set_data(sqe, cb_data);
 
-    int res = io_uring_submit(&f->rings[thread_id]);
+    int res = fuser_submit(f, thread_id);
     if (res < 0) {
         out_hdr->error = res;
         return 0;
@@ -641,13 +642,18 @@ static int do_fsync(struct fuse_session *se, void *user_data,
 
     uint16_t thread_id = dpfs_hal_thread_id();
     struct fuser_cb_data *cb_data = mpool_alloc(f->cb_data_pools[thread_id]);
+    if (!cb_data) {
+        dpfs_stats_mpool_exhausted(dpfs_hal_stats(), thread_id);
+        out_hdr->error = -ENOMEM;
+        return 0;
+    }
     cb_data->thread_id = thread_id;
     cb_data->cb = fuser_mirror_generic_cb;
     cb_data->completion_context = completion_context;
     cb_data->in_hdr = in_hdr;
     cb_data->out_hdr = out_hdr;
 
-    struct io_uring_sqe *sqe = io_uring_get_sqe(&f->rings[thread_id]);
+    struct io_uring_sqe *sqe = fuser_get_sqe(f, thread_id);
     if (!sqe) {
         fprintf(stderr, "ERROR: Not enough uring sqe elements avail.\n");
         out_hdr->error = -ENOMEM;
@@ -660,7 +666,7 @@ static int do_fsync(struct fuse_session *se, void *user_data,
     io_uring_prep_fsync(sqe, fd, flags);
     io_uring_sqe_set_data(sqe, cb_data);
 
-    int res = io_uring_submit(&f->rings[thread_id]);
+    int res = fuser_submit(f, thread_id);
     if (res < 0) {
         out_hdr->error = res;
         return 0;
@@ -802,14 +808,16 @@ int fuser_mirror_rename(struct fuse_session *se, void *user_data,
 
 void fuser_mirror_read_cb(struct fuser_cb_data *cb_data, struct io_uring_cqe *cqe)
 {
-    if (cqe->res < 0) {
+    fuse_ll_inflight_remove(cb_data->se, cb_data->unique);
+    if (cqe->res == -ECANCELED) {
+        cb_data->out_hdr->error = -EINTR;
+        return;
+    } else if (cqe->res < 0) {
         cb_data->out_hdr->error = cqe->res;
-        dpfs_hal_async_complete(cb_data->completion_context, DPFS_HAL_COMPLETION_SUCCES);
         return;
     }
 
     cb_data->out_hdr->len += cqe->res;
-    dpfs_hal_async_complete(cb_data->completion_context, DPFS_HAL_COMPLETION_SUCCES);
 }
 
 int fuser_mirror_read(struct fuse_session *se, void *user_data,
@@ -821,13 +829,18 @@ int fuser_mirror_read(struct fuse_session *se, void *user_data,
 
     size_t thread_id = dpfs_hal_thread_id();
     struct fuser_cb_data *cb_data = mpool_alloc(f->cb_data_pools[thread_id]);
+    if (!cb_data) {
+        dpfs_stats_mpool_exhausted(dpfs_hal_stats(), thread_id);
+        out_hdr->error = -ENOMEM;
+        return 0;
+    }
     cb_data->thread_id = thread_id;
     cb_data->cb = fuser_mirror_read_cb;
     cb_data->completion_context = completion_context;
     cb_data->in_hdr = in_hdr;
     cb_data->out_hdr = out_hdr;
 
-    struct io_uring_sqe *sqe = io_uring_get_sqe(&f->rings[thread_id]);
+    struct io_uring_sqe *sqe = fuser_get_sqe(f, thread_id);
     if (!sqe) {
         fprintf(stderr, "ERROR: Not enough uring sqe elements avail.\n");
         out_hdr->error = -ENOMEM;
@@ -837,8 +850,12 @@ int fuser_mirror_read(struct fuse_session *se, void *user_data,
     io_uring_sqe_set_data(sqe, cb_data);
     // IOSQE_ASYNC doesn't work on file systems
 
-    int res = io_uring_submit(&f->rings[thread_id]);
+    cb_data->se = se;
+    cb_data->unique = in_hdr->unique;
+    fuse_ll_inflight_add(se, in_hdr->unique, cb_data);
+    int res = fuser_submit(f, thread_id);
     if (res < 0) {
+        fuse_ll_inflight_remove(se, in_hdr->unique);
         out_hdr->error = res;
         return 0;
     }
@@ -848,15 +865,17 @@ int fuser_mirror_read(struct fuse_session *se, void *user_data,
 
 void fuser_mirror_write_cb(struct fuser_cb_data *cb_data, struct io_uring_cqe *cqe)
 {
-    if (cqe->res < 0) {
+    fuse_ll_inflight_remove(cb_data->se, cb_data->unique);
+    if (cqe->res == -ECANCELED) {
+        cb_data->out_hdr->error = -EINTR;
+        return;
+    } else if (cqe->res < 0) {
         cb_data->out_hdr->error = cqe->res;
-        dpfs_hal_async_complete(cb_data->completion_context, DPFS_HAL_COMPLETION_SUCCES);
         return;
     }
 
     cb_data->write.out_write->size = cqe->res;
     cb_data->out_hdr->len += sizeof(*cb_data->write.out_write);
-    dpfs_hal_async_complete(cb_data->completion_context, DPFS_HAL_COMPLETION_SUCCES);
 }
 
 int fuser_mirror_write(struct fuse_session *se, void *user_data,
@@ -869,6 +888,11 @@ int fuser_mirror_write(struct fuse_session *se, void *user_data,
 
     size_t thread_id = dpfs_hal_thread_id();
     struct fuser_cb_data *cb_data = mpool_alloc(f->cb_data_pools[thread_id]);
+    if (!cb_data) {
+        dpfs_stats_mpool_exhausted(dpfs_hal_stats(), thread_id);
+        out_hdr->error = -ENOMEM;
+        return 0;
+    }
     cb_data->thread_id = thread_id;
     cb_data->cb = fuser_mirror_write_cb;
     cb_data->completion_context = completion_context;
@@ -876,7 +900,7 @@ int fuser_mirror_write(struct fuse_session *se, void *user_data,
     cb_data->out_hdr = out_hdr;
     cb_data->write.out_write = out_write;
 
-    struct io_uring_sqe *sqe = io_uring_get_sqe(&f->rings[thread_id]);
+    struct io_uring_sqe *sqe = fuser_get_sqe(f, thread_id);
     if (!sqe) {
         fprintf(stderr, "ERROR: Not enough uring sqe elements avail.\n");
         out_hdr->error = -ENOMEM;
@@ -886,8 +910,12 @@ int fuser_mirror_write(struct fuse_session *se, void *user_data,
     io_uring_sqe_set_data(sqe, cb_data);
     // IOSQE_ASYNC doesn't work on file systems
 
-    int res = io_uring_submit(&f->rings[thread_id]);
+    cb_data->se = se;
+    cb_data->unique = in_hdr->unique;
+    fuse_ll_inflight_add(se, in_hdr->unique, cb_data);
+    int res = fuser_submit(f, thread_id);
     if (res < 0) {
+        fuse_ll_inflight_remove(se, in_hdr->unique);
         out_hdr->error = res;
         return 0;
     }
@@ -1084,6 +1112,195 @@ int fuser_mirror_fallocate(struct fuse_session *se, void *user_data,
     return 0;
 }
 
+// The fd of an inode is O_PATH, which the f*xattr calls don't take
+int fuser_mirror_setxattr(struct fuse_session *se, void *user_data,
+                          struct fuse_in_header *in_hdr, const char *const in_name,
+                          const void *in_value, uint32_t in_size, uint32_t in_flags,
+                          struct fuse_out_header *out_hdr,
+                          void *completion_context, uint16_t device_id)
+{
+    struct fuser *f = user_data;
+    struct inode *i = ino_to_inodeptr(f, in_hdr->nodeid);
+    if (!i) {
+        out_hdr->error = -ENOENT;
+        return 0;
+    }
+
+    char procname[64];
+    sprintf(procname, "/proc/self/fd/%i", i->fd);
+    int res = setxattr(procname, in_name, in_value, in_size, in_flags);
+
+    if (res == -1)
+        out_hdr->error = -errno;
+    return 0;
+}
+
+int fuser_mirror_getxattr(struct fuse_session *se, void *user_data,
+                          struct fuse_in_header *in_hdr, const char *const in_name, uint32_t in_size,
+                          struct fuse_out_header *out_hdr, struct fuse_getxattr_out *out_getxattr, void *out_value,
+                          void *completion_context, uint16_t device_id)
+{
+    struct fuser *f = user_data;
+    struct inode *i = ino_to_inodeptr(f, in_hdr->nodeid);
+    if (!i) {
+        out_hdr->error = -ENOENT;
+        return 0;
+    }
+
+    char procname[64];
+    sprintf(procname, "/proc/self/fd/%i", i->fd);
+    ssize_t res = getxattr(procname, in_name, in_size ? out_value : NULL, in_size);
+    if (res == -1) {
+        out_hdr->error = -errno;
+        return 0;
+    }
+
+    if (in_size == 0) {
+        out_getxattr->size = res;
+        out_getxattr->padding = 0;
+        out_hdr->len += sizeof(*out_getxattr);
+    } else {
+        out_hdr->len += res;
+    }
+    return 0;
+}
+
+int fuser_mirror_listxattr(struct fuse_session *se, void *user_data,
+                           struct fuse_in_header *in_hdr, uint32_t in_size,
+                           struct fuse_out_header *out_hdr, struct fuse_getxattr_out *out_getxattr, void *out_value,
+                           void *completion_context, uint16_t device_id)
+{
+    struct fuser *f = user_data;
+    struct inode *i = ino_to_inodeptr(f, in_hdr->nodeid);
+    if (!i) {
+        out_hdr->error = -ENOENT;
+        return 0;
+    }
+
+    char procname[64];
+    sprintf(procname, "/proc/self/fd/%i", i->fd);
+    ssize_t res = listxattr(procname, in_size ? out_value : NULL, in_size);
+    if (res == -1) {
+        out_hdr->error = -errno;
+        return 0;
+    }
+
+    if (in_size == 0) {
+        out_getxattr->size = res;
+        out_getxattr->padding = 0;
+        out_hdr->len += sizeof(*out_getxattr);
+    } else {
+        out_hdr->len += res;
+    }
+    return 0;
+}
+
+int fuser_mirror_removexattr(struct fuse_session *se, void *user_data,
+                             struct fuse_in_header *in_hdr, const char *const in_name,
+                             struct fuse_out_header *out_hdr,
+                             void *completion_context, uint16_t device_id)
+{
+    struct fuser *f = user_data;
+    struct inode *i = ino_to_inodeptr(f, in_hdr->nodeid);
+    if (!i) {
+        out_hdr->error = -ENOENT;
+        return 0;
+    }
+
+    char procname[64];
+    sprintf(procname, "/proc/self/fd/%i", i->fd);
+    int res = removexattr(procname, in_name);
+
+    if (res == -1)
+        out_hdr->error = -errno;
+    return 0;
+}
+
+// io_uring has no copy_file_range, and a splice through a pipe can neither reflink nor copy more than
+// the pipe holds. So the copy thread does a blocking copy_file_range. FUSER_COPY_MAX per request keeps
+// a large copy from holding up the copies behind it, the guest continues with another request after a short copy
+#define FUSER_COPY_MAX (16 << 20)
+
+int fuser_mirror_copy_file_range(struct fuse_session *se, void *user_data,
+                                 struct fuse_in_header *in_hdr, struct fuse_copy_file_range_in *in_copy,
+                                 struct fuse_out_header *out_hdr, struct fuse_write_out *out_write,
+                                 void *completion_context, uint16_t device_id)
+{
+    struct fuser *f = user_data;
+
+    struct fuser_copy *c = malloc(sizeof(*c));
+    if (!c) {
+        out_hdr->error = -ENOMEM;
+        return 0;
+    }
+    c->in = *in_copy;
+    if (c->in.len > FUSER_COPY_MAX)
+        c->in.len = FUSER_COPY_MAX;
+    c->out_hdr = out_hdr;
+    c->out_write = out_write;
+    c->completion_context = completion_context;
+    fuser_queue_copy(f, c);
+
+    return EWOULDBLOCK;
+}
+
+// The file is mapped straight into the DAX window, the guest then reads and writes the page cache of the
+// source file system. The mapping holds its own reference to the file, so it outlives the release of fh
+int fuser_mirror_setupmapping(struct fuse_session *se, void *user_data,
+                              struct fuse_in_header *in_hdr, struct fuse_setupmapping_in *in_setupmapping,
+                              void *addr, struct fuse_out_header *out_hdr, uint16_t device_id)
+{
+    int prot = 0;
+    if (in_setupmapping->flags & FUSE_SETUPMAPPING_FLAG_READ)
+        prot |= PROT_READ;
+    if (in_setupmapping->flags & FUSE_SETUPMAPPING_FLAG_WRITE)
+        prot |= PROT_WRITE;
+
+    void *p = mmap(addr, in_setupmapping->len, prot, MAP_SHARED | MAP_FIXED,
+            in_setupmapping->fh, in_setupmapping->foffset);
+    if (p == MAP_FAILED)
+        out_hdr->error = -errno;
+    return 0;
+}
+
+int fuser_mirror_removemapping(struct fuse_session *se, void *user_data,
+                               void *addr, uint64_t len, uint16_t device_id)
+{
+    // Keep the range of the window reserved
+    void *p = mmap(addr, len, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE | MAP_FIXED, -1, 0);
+    if (p == MAP_FAILED)
+        return -errno;
+    return 0;
+}
+
+void fuser_mirror_poll_batch_begin(struct fuse_session *se, void *user_data, uint16_t device_id)
+{
+    struct fuser *f = user_data;
+    f->batches[dpfs_hal_thread_id()].active = true;
+}
+
+// A single io_uring_submit for all the I/O that the poll yielded
+void fuser_mirror_poll_batch_end(struct fuse_session *se, void *user_data, uint16_t device_id)
+{
+    struct fuser *f = user_data;
+    uint16_t thread_id = dpfs_hal_thread_id();
+
+    f->batches[thread_id].active = false;
+    fuser_flush(f, thread_id);
+    fuser_flush_cancels(f, thread_id);
+}
+
+// The cancel is submitted by the DPFS thread that owns the ring of the request, at the end of its next poll.
+// A read or write that already reached the file system can't be cancelled and completes as usual,
+// otherwise it completes with -ECANCELED which is returned to the guest as -EINTR
+void fuser_mirror_cancel(struct fuse_session *se, void *user_data, uint64_t unique, void *token, uint16_t device_id)
+{
+    struct fuser *f = user_data;
+    struct fuser_cb_data *cb_data = token;
+
+    fuser_queue_cancel(f, cb_data->thread_id, se, unique, cb_data);
+}
+
 void fuser_mirror_assign_ops(struct fuse_ll_operations *ops) {
     memset(ops, 0, sizeof(*ops));
     ops->init = fuser_mirror_init;
@@ -1113,5 +1330,15 @@ void fuser_mirror_assign_ops(struct fuse_ll_operations *ops) {
     ops->flock = fuser_mirror_flock;
     ops->flush = fuser_mirror_flush;
     ops->fallocate = fuser_mirror_fallocate;
+    ops->setxattr = fuser_mirror_setxattr;
+    ops->getxattr = fuser_mirror_getxattr;
+    ops->listxattr = fuser_mirror_listxattr;
+    ops->removexattr = fuser_mirror_removexattr;
+    ops->copy_file_range = fuser_mirror_copy_file_range;
+    ops->setupmapping = fuser_mirror_setupmapping;
+    ops->removemapping = fuser_mirror_removemapping;
+    ops->poll_batch_begin = fuser_mirror_poll_batch_begin;
+    ops->poll_batch_end = fuser_mirror_poll_batch_end;
+    ops->cancel = fuser_mirror_cancel;
 }
 
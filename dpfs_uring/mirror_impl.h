@@ -22,6 +22,7 @@
 #include <linux/stat.h>
 
 struct fuser_cb_data;
+// Fills in the FUSE reply, the cq thread completes the request to the HAL afterwards
 typedef void (*fuser_uring_cb) (struct fuser_cb_data *, struct io_uring_cqe *);
 
 struct fuser_cb_data {
@@ -44,6 +45,8 @@ struct fuser_cb_data {
 #endif
     };
     void *completion_context;
+    // Only set for READ and WRITE, which can be cancelled by a FUSE_INTERRUPT (see fuser_mirror_cancel)
+    uint64_t unique;
 };
 
 
@@ -0,0 +1,70 @@
+/*
+#
+# Copyright 2023- IBM Inc. All rights reserved
+# SPDX-License-Identifier: LGPL-2.1-or-later
+#
+*/
+
+#include <string.h>
+
+#include "lat_hist.h"
+
+// The highest value that falls into bucket b
+static uint64_t lat_hist_bucket_max(uint32_t b)
+{
+    if (b < LAT_HIST_SUB_BUCKETS)
+        return b;
+    uint32_t shift = (b >> LAT_HIST_SUB_BITS) - 1;
+    uint64_t base = (uint64_t) (LAT_HIST_SUB_BUCKETS + (b & (LAT_HIST_SUB_BUCKETS - 1))) << shift;
+    return base + ((1ULL << shift) - 1);
+}
+
+void lat_hist_init(struct lat_hist *h)
+{
+    memset(h, 0, sizeof(*h));
+    h->min = UINT64_MAX;
+}
+
+void lat_hist_merge(struct lat_hist *dst, const struct lat_hist *src)
+{
+    if (src->count == 0)
+        return;
+
+    for (uint32_t i = 0; i < LAT_HIST_NBUCKETS; i++)
+        dst->buckets[i] += src->buckets[i];
+    dst->count += src->count;
+    dst->sum += src->sum;
+    if (src->min < dst->min)
+        dst->min = src->min;
+    if (src->max > dst->max)
+        dst->max = src->max;
+}
+
+uint64_t lat_hist_percentile(const struct lat_hist *h, double p)
+{
+    if (h->count == 0)
+        return 0;
+
+    // The rank of the sample we are looking for, rounded up
+    uint64_t rank = (uint64_t) ((p / 100.0) * h->count + 0.5);
+    if (rank == 0)
+        rank = 1;
+    if (rank >= h->count)
+        return h->max;
+
+    uint64_t seen = 0;
+    for (uint32_t i = 0; i < LAT_HIST_NBUCKETS; i++) {
+        seen += h->buckets[i];
+        if (seen >= rank) {
+            uint64_t v = lat_hist_bucket_max(i);
+            // Don't report more than what we have actually seen
+            return v < h->max ? v : h->max;
+        }
+    }
+    return h->max;
+}
+
+uint64_t lat_hist_mean(const struct lat_hist *h)
+{
+    return h->count ? h->sum / h->count : 0;
+}
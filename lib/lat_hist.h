@@ -0,0 +1,67 @@
+/*
+#
+# Copyright 2023- IBM Inc. All rights reserved
+# SPDX-License-Identifier: LGPL-2.1-or-later
+#
+*/
+
+#ifndef LAT_HIST_H
+#define LAT_HIST_H
+
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+    lat_hist is a log-linear latency histogram (in the spirit of HdrHistogram).
+    Every power of two is split into 2^LAT_HIST_SUB_BITS linear buckets, so the
+    relative error of a percentile is at most 1/2^LAT_HIST_SUB_BITS (~3%).
+    Recording is a couple of instructions and never allocates, but it is NOT thread-safe:
+    keep one histogram per thread and merge them when reporting.
+*/
+
+#define LAT_HIST_SUB_BITS 5
+#define LAT_HIST_SUB_BUCKETS (1 << LAT_HIST_SUB_BITS)
+#define LAT_HIST_NBUCKETS ((64 - LAT_HIST_SUB_BITS + 1) << LAT_HIST_SUB_BITS)
+
+struct lat_hist {
+    uint64_t count;
+    uint64_t sum;
+    uint64_t min;
+    uint64_t max;
+    uint64_t buckets[LAT_HIST_NBUCKETS];
+};
+
+static inline uint32_t lat_hist_bucket(uint64_t v)
+{
+    if (v < LAT_HIST_SUB_BUCKETS)
+        return (uint32_t) v;
+    uint32_t shift = 63 - __builtin_clzll(v) - LAT_HIST_SUB_BITS;
+    return ((shift + 1) << LAT_HIST_SUB_BITS) + ((v >> shift) & (LAT_HIST_SUB_BUCKETS - 1));
+}
+
+static inline void lat_hist_record(struct lat_hist *h, uint64_t v)
+{
+    h->buckets[lat_hist_bucket(v)]++;
+    h->count++;
+    h->sum += v;
+    if (v < h->min)
+        h->min = v;
+    if (v > h->max)
+        h->max = v;
+}
+
+void lat_hist_init(struct lat_hist *h);
+// Adds all the samples of src to dst
+void lat_hist_merge(struct lat_hist *dst, const struct lat_hist *src);
+// p in the range [0.0, 100.0], returns 0 if the histogram is empty
+uint64_t lat_hist_percentile(const struct lat_hist *h, double p);
+uint64_t lat_hist_mean(const struct lat_hist *h);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // LAT_HIST_H
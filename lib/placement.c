@@ -0,0 +1,131 @@
+/*
+#
+# Copyright 2023- IBM Inc. All rights reserved
+# SPDX-License-Identifier: LGPL-2.1-or-later
+#
+*/
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <errno.h>
+#include <string.h>
+#include <sched.h>
+#include <unistd.h>
+
+#include "placement.h"
+
+// The config keys of the classes
+static const char *placement_keys[PLACEMENT_NCLASSES] = {
+    "hal_pollers", "completion_threads", "service_threads", "metadata_threads", "reserved_cpus"
+};
+
+const char *placement_class_name(enum placement_class c)
+{
+    return placement_keys[c];
+}
+
+int placement_parse(toml_table_t *conf, struct placement *p)
+{
+    memset(p, 0, sizeof(*p));
+
+    toml_table_t *pconf = toml_table_in(conf, "placement"); // optional
+    if (!pconf)
+        return 0;
+
+    long num_cpus = sysconf(_SC_NPROCESSORS_CONF);
+    // Which class a CPU has been assigned to, to find the overlaps
+    int owner[PLACEMENT_MAX_CPUS];
+    for (int i = 0; i < PLACEMENT_MAX_CPUS; i++)
+        owner[i] = -1;
+
+    for (int c = 0; c < PLACEMENT_NCLASSES; c++) {
+        toml_array_t *cpus = toml_array_in(pconf, placement_keys[c]); // optional
+        if (!cpus || toml_array_nelem(cpus) == 0)
+            continue;
+        if (toml_array_kind(cpus) != 'v' || toml_array_nelem(cpus) > PLACEMENT_MAX_CPUS) {
+            fprintf(stderr, "%s: [placement] %s must be an array of at most %d CPU ids!\n", __func__,
+                    placement_keys[c], PLACEMENT_MAX_CPUS);
+            return -EINVAL;
+        }
+        for (int i = 0; i < toml_array_nelem(cpus); i++) {
+            toml_datum_t cpu = toml_int_at(cpus, i);
+            if (!cpu.ok || cpu.u.i < 0 || cpu.u.i >= num_cpus || cpu.u.i >= PLACEMENT_MAX_CPUS) {
+                fprintf(stderr, "%s: [placement] %s contains an invalid CPU id, this machine has CPUs 0-%ld\n",
+                        __func__, placement_keys[c], num_cpus - 1);
+                return -EINVAL;
+            }
+            if (owner[cpu.u.i] != -1) {
+                fprintf(stderr, "%s: [placement] CPU %ld is in both %s and %s, every CPU may only be used once!\n",
+                        __func__, cpu.u.i, placement_keys[owner[cpu.u.i]], placement_keys[c]);
+                return -EINVAL;
+            }
+            owner[cpu.u.i] = c;
+            p->cpus[c][p->ncpus[c]++] = cpu.u.i;
+        }
+    }
+
+    return 0;
+}
+
+int placement_load(const char *conf_path, struct placement *p)
+{
+    char errbuf[200];
+
+    FILE *fp = fopen(conf_path, "r");
+    if (!fp) {
+        fprintf(stderr, "%s: cannot open %s - %s\n", __func__, conf_path, strerror(errno));
+        return -EINVAL;
+    }
+    toml_table_t *conf = toml_parse_file(fp, errbuf, sizeof(errbuf));
+    fclose(fp);
+    if (!conf) {
+        fprintf(stderr, "%s: cannot parse - %s\n", __func__, errbuf);
+        return -EINVAL;
+    }
+
+    int ret = placement_parse(conf, p);
+    toml_free(conf);
+    return ret;
+}
+
+int placement_cpu(const struct placement *p, enum placement_class c, int i)
+{
+    if (p->ncpus[c] == 0)
+        return -1;
+    return p->cpus[c][i % p->ncpus[c]];
+}
+
+bool placement_conflicts(const struct placement *p, enum placement_class c, int cpu)
+{
+    for (int o = 0; o < PLACEMENT_NCLASSES; o++) {
+        if (o == c)
+            continue;
+        for (int i = 0; i < p->ncpus[o]; i++) {
+            if (p->cpus[o][i] == cpu)
+                return true;
+        }
+    }
+    return false;
+}
+
+int placement_pin(int cpu)
+{
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    if (sched_setaffinity(gettid(), sizeof(set), &set) == -1)
+        return -errno;
+    return 0;
+}
+
+void placement_print(const struct placement *p)
+{
+    for (int c = 0; c < PLACEMENT_NCLASSES; c++) {
+        if (p->ncpus[c] == 0)
+            continue;
+        printf("DPFS placement: %s on CPU", placement_keys[c]);
+        for (int i = 0; i < p->ncpus[c]; i++)
+            printf(" %d", p->cpus[c][i]);
+        printf("\n");
+    }
+}
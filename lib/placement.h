@@ -0,0 +1,63 @@
+/*
+#
+# Copyright 2023- IBM Inc. All rights reserved
+# SPDX-License-Identifier: LGPL-2.1-or-later
+#
+*/
+
+#ifndef PLACEMENT_H
+#define PLACEMENT_H
+
+#include <stdbool.h>
+#include "toml.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+    The optional [placement] table of the config assigns explicit CPU lists to the threads of DPFS,
+    so that it can be co-located with the other services on the DPU. Every CPU may only be used once
+    over all the lists, and never one of the reserved_cpus.
+    Threads of a class without a list keep their default placement.
+*/
+
+#define PLACEMENT_MAX_CPUS 256
+
+enum placement_class {
+    // The virtio-fs polling threads of the HAL, one CPU per thread
+    PLACEMENT_HAL_POLLERS,
+    // The completion threads of the backends (e.g. the io_uring cq polling threads)
+    PLACEMENT_COMPLETION_THREADS,
+    // The network service threads of the backends (libnfs, RAMCloud)
+    PLACEMENT_SERVICE_THREADS,
+    // The metadata lane threads of the HAL (metadata_threads)
+    PLACEMENT_METADATA_THREADS,
+    // CPUs of the other services on the DPU, DPFS never pins a thread to these
+    PLACEMENT_RESERVED,
+    PLACEMENT_NCLASSES
+};
+
+struct placement {
+    int ncpus[PLACEMENT_NCLASSES];
+    int cpus[PLACEMENT_NCLASSES][PLACEMENT_MAX_CPUS];
+};
+
+// Parses and validates the [placement] table, an absent table is valid and assigns nothing.
+// Returns 0 or -EINVAL
+int placement_parse(toml_table_t *conf, struct placement *p);
+int placement_load(const char *conf_path, struct placement *p);
+// The CPU of thread i of the class, or -1 if the class has no list
+int placement_cpu(const struct placement *p, enum placement_class c, int i);
+// Returns true if cpu is reserved or explicitly assigned to another class than c
+bool placement_conflicts(const struct placement *p, enum placement_class c, int cpu);
+// Pins the calling thread to cpu. Returns 0 or -errno
+int placement_pin(int cpu);
+void placement_print(const struct placement *p);
+const char *placement_class_name(enum placement_class c);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // PLACEMENT_H